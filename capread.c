@@ -0,0 +1,204 @@
+/* capread.c - Convert relay capture files to CSV or pcap
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include "capture.h"
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_LINKTYPE_RAW 101
+#define IP_TCP_HEADER_SIZE 40
+#define VIEWER_ADDR 0x7F000001		/* 127.0.0.1 */
+#define VIEWER_PORT_BASE 49152
+#define VIEWER_PORTS 16384
+
+typedef struct {
+	uint32_t seq[2];				/* Next sequence number per direction */
+} tcp_state_t;
+
+static const char *program_name = "capread";
+
+static void
+fatal (const char *fmt, ...)
+{
+	va_list argv;
+
+	fprintf(stderr, "%s: ", program_name);
+	va_start(argv, fmt);
+	vfprintf(stderr, fmt, argv);
+	va_end(argv);
+	exit(1);
+}
+
+static void
+put16 (unsigned char *p, uint16_t value)
+{
+	p[0] = value >> 8;
+	p[1] = value & 0xFF;
+}
+
+static void
+put32 (unsigned char *p, uint32_t value)
+{
+	put16(p, value >> 16);
+	put16(p + 2, value & 0xFFFF);
+}
+
+static void
+write_csv_record (FILE *out, const capture_header_t *header, const capture_record_t *record)
+{
+	fprintf(out, "%lld,%u,%s,%u,%u\n",
+		(long long) record->time, record->conn,
+		record->direction == CAPTURE_UP ? "up" : "down",
+		record->len, record->delay);
+}
+
+/* Write a record as an IPv4/TCP packet. The viewer side of connection N
+ * is shown as 127.0.0.1 port VIEWER_PORT_BASE+N, the server side as the
+ * relay target. Checksums are left as zero.
+ */
+static void
+write_pcap_record (FILE *out, const capture_header_t *header, const capture_record_t *record, tcp_state_t *tcp)
+{
+	unsigned char packet[IP_TCP_HEADER_SIZE];
+	uint32_t viewer_addr = VIEWER_ADDR;
+	uint32_t target_addr;
+	uint16_t viewer_port = VIEWER_PORT_BASE + record->conn % VIEWER_PORTS;
+	uint16_t target_port;
+	uint32_t pkthdr[4];
+	int64_t time = header->start_time + record->time;
+	const unsigned char *addr = (const unsigned char *) &header->target_addr;
+	const unsigned char *port = (const unsigned char *) &header->target_port;
+	int dir = record->direction == CAPTURE_UP ? 0 : 1;
+
+	target_addr = (uint32_t) addr[0] << 24 | addr[1] << 16 | addr[2] << 8 | addr[3];
+	target_port = port[0] << 8 | port[1];
+
+	pkthdr[0] = time / 1000000;
+	pkthdr[1] = time % 1000000;
+	pkthdr[2] = IP_TCP_HEADER_SIZE + record->caplen;
+	pkthdr[3] = IP_TCP_HEADER_SIZE + record->len;
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = 0x45;
+	put16(packet + 2, record->len + IP_TCP_HEADER_SIZE > 0xFFFF ? 0xFFFF : record->len + IP_TCP_HEADER_SIZE);
+	packet[8] = 64;
+	packet[9] = 6;
+	put32(packet + 12, dir == 0 ? viewer_addr : target_addr);
+	put32(packet + 16, dir == 0 ? target_addr : viewer_addr);
+	put16(packet + 20, dir == 0 ? viewer_port : target_port);
+	put16(packet + 22, dir == 0 ? target_port : viewer_port);
+	put32(packet + 24, tcp->seq[dir]);
+	put32(packet + 28, tcp->seq[!dir]);
+	packet[32] = 5 << 4;
+	packet[33] = 0x18;				/* PSH, ACK */
+	put16(packet + 34, 0xFFFF);
+	tcp->seq[dir] += record->len;
+
+	if (fwrite(pkthdr, sizeof(pkthdr), 1, out) != 1
+			|| fwrite(packet, sizeof(packet), 1, out) != 1
+			|| (record->caplen > 0 && fwrite(record + 1, record->caplen, 1, out) != 1))
+		fatal("Cannot write output: %s\n", strerror(errno));
+}
+
+int
+main (int argc, char **argv)
+{
+	capture_header_t *header;
+	/* Connections sharing a viewer port share sequence numbers, as
+	 * they share a flow in the pcap file.
+	 */
+	static tcp_state_t tcp[VIEWER_PORTS];
+	bool pcap = false;
+	const char *in_name;
+	const char *out_name;
+	FILE *in;
+	FILE *out;
+	char *data;
+	long size;
+	uint64_t first;
+
+	if (argc == 4 && strcmp(argv[1], "-p") == 0) {
+		pcap = true;
+		argv++;
+		argc--;
+	}
+	if (argc != 3) {
+		fprintf(stderr,
+			"Usage: %s [-p] CAPTURE-FILE OUTPUT-FILE\n"
+			"Convert a relay capture file to CSV, or to pcap with -p.\n",
+			program_name);
+		exit(1);
+	}
+	in_name = argv[1];
+	out_name = argv[2];
+
+	if ((in = fopen(in_name, "rb")) == NULL)
+		fatal("Cannot open file `%s' for reading: %s\n", in_name, strerror(errno));
+	if (fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0 || fseek(in, 0, SEEK_SET) != 0)
+		fatal("Cannot get size of file `%s': %s\n", in_name, strerror(errno));
+	if ((data = malloc(size)) == NULL)
+		fatal("Cannot allocate memory.\n");
+	if (fread(data, size, 1, in) != 1)
+		fatal("Cannot read from file `%s': %s\n", in_name, strerror(errno));
+	fclose(in);
+
+	header = (capture_header_t *) data;
+	if (size < sizeof(*header) || header->magic != CAPTURE_MAGIC)
+		fatal("File `%s' is not a capture file\n", in_name);
+	if (header->version != CAPTURE_VERSION)
+		fatal("Unsupported capture file version %u\n", header->version);
+	if (header->record_size < sizeof(capture_record_t) + header->payload || header->record_count == 0)
+		fatal("Capture file `%s' is corrupt\n", in_name);
+	if (sizeof(*header) + (uint64_t) header->record_size * header->record_count > size)
+		fatal("Capture file `%s' is truncated\n", in_name);
+
+	if ((out = fopen(out_name, pcap ? "wb" : "w")) == NULL)
+		fatal("Cannot open file `%s' for writing: %s\n", out_name, strerror(errno));
+	if (pcap) {
+		uint32_t file_header[6] = { PCAP_MAGIC, 2 | 4 << 16, 0, 0, 65535, PCAP_LINKTYPE_RAW };
+		if (fwrite(file_header, sizeof(file_header), 1, out) != 1)
+			fatal("Cannot write to file `%s': %s\n", out_name, strerror(errno));
+	} else {
+		fprintf(out, "time_us,conn,direction,size,delay_us\n");
+	}
+
+	/* Only the last record_count records are left in the ring. */
+	first = header->next > header->record_count ? header->next - header->record_count : 0;
+	for (uint64_t n = first; n < header->next; n++) {
+		capture_record_t *record = (capture_record_t *) (data + sizeof(*header) + n % header->record_count * header->record_size);
+
+		if (record->caplen > header->payload || record->caplen > record->len
+				|| (record->direction != CAPTURE_UP && record->direction != CAPTURE_DOWN))
+			fatal("Capture file `%s' is corrupt\n", in_name);
+		if (pcap) {
+			write_pcap_record(out, header, record, &tcp[record->conn % VIEWER_PORTS]);
+		} else {
+			write_csv_record(out, header, record);
+		}
+	}
+
+	if (fclose(out) != 0)
+		fatal("Cannot close file `%s': %s\n", out_name, strerror(errno));
+	free(data);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/* capture.c - Relay traffic capture to a memory-mapped ring file
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+#include <string.h>
+#include "rdpvnclaunch.h"
+#include "capture.h"
+
+/* Microseconds between 1601-01-01 (FILETIME epoch) and 1970-01-01. */
+#define FILETIME_UNIX_EPOCH_US 11644473600000000LL
+
+bool capture_enabled;
+static HANDLE capture_file = INVALID_HANDLE_VALUE;
+static HANDLE capture_mapping;
+static capture_header_t *capture_header;
+static char *capture_slots;
+static int64_t capture_start;
+
+/* capture_open:
+ * Create the capture file of the given size in bytes and map it into
+ * memory. The file is sized once here so that recording never needs
+ * to allocate or extend it.
+ */
+void
+capture_open (const wchar_t *path, uint32_t size, uint32_t payload, uint32_t target_addr, uint16_t target_port, int64_t now)
+{
+	uint32_t record_size;
+	LARGE_INTEGER file_size;
+	FILETIME ft;
+
+	record_size = (sizeof(capture_record_t) + payload + 7) & ~7;
+	if (size < sizeof(capture_header_t) + record_size)
+		die("Capture file size too small\n");
+
+	capture_file = CreateFileW(path, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (capture_file == INVALID_HANDLE_VALUE)
+		die("Cannot create capture file `%ls': %s\n", path, system_errstr());
+	file_size.QuadPart = size;
+	if (!SetFilePointerEx(capture_file, file_size, NULL, FILE_BEGIN) || !SetEndOfFile(capture_file))
+		die("Cannot set size of capture file `%ls': %s\n", path, system_errstr());
+	capture_mapping = CreateFileMappingW(capture_file, NULL, PAGE_READWRITE, 0, size, NULL);
+	if (capture_mapping == NULL)
+		die("Cannot map capture file `%ls': %s\n", path, system_errstr());
+	capture_header = MapViewOfFile(capture_mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (capture_header == NULL)
+		die("Cannot map capture file `%ls': %s\n", path, system_errstr());
+
+	GetSystemTimeAsFileTime(&ft);
+	capture_header->magic = CAPTURE_MAGIC;
+	capture_header->version = CAPTURE_VERSION;
+	capture_header->record_size = record_size;
+	capture_header->record_count = (size - sizeof(capture_header_t)) / record_size;
+	capture_header->next = 0;
+	capture_header->start_time = ((int64_t) ft.dwHighDateTime << 32 | ft.dwLowDateTime) / 10 - FILETIME_UNIX_EPOCH_US;
+	capture_header->target_addr = target_addr;
+	capture_header->target_port = target_port;
+	capture_header->payload = payload;
+	capture_slots = (char *) (capture_header + 1);
+	capture_start = now;
+	capture_enabled = true;
+}
+
+/* capture_record:
+ * Record one relayed chunk in the next slot of the ring, overwriting
+ * the oldest record when the ring is full.
+ */
+void
+capture_record (uint32_t conn, uint8_t direction, uint32_t len, int64_t delay, const char *data, int64_t now)
+{
+	capture_record_t *record;
+	uint32_t caplen;
+
+	record = (capture_record_t *) (capture_slots + capture_header->next % capture_header->record_count * capture_header->record_size);
+	caplen = capture_header->payload;
+	if (caplen > len)
+		caplen = len;
+	record->time = now - capture_start;
+	record->conn = conn;
+	record->len = len;
+	record->delay = delay > UINT32_MAX ? UINT32_MAX : delay;
+	record->caplen = caplen;
+	record->direction = direction;
+	record->reserved = 0;
+	memcpy(record + 1, data, caplen);
+	capture_header->next++;
+}
+
+void
+capture_close (void)
+{
+	if (!capture_enabled)
+		return;
+	capture_enabled = false;
+	UnmapViewOfFile(capture_header); /* Ignore errors */
+	CloseHandle(capture_mapping); /* Ignore errors */
+	CloseHandle(capture_file); /* Ignore errors */
+}
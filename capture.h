@@ -0,0 +1,67 @@
+/* capture.h - Relay traffic capture file format
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+/* A capture file is a header followed by record_count fixed-size slots
+ * used as a ring. Record number n is stored in slot n % record_count,
+ * and next is the number of records written so far. Each slot holds a
+ * capture_record_t followed by up to payload bytes of payload, padded
+ * to a multiple of 8 bytes.
+ */
+#define CAPTURE_MAGIC 0x50414352	/* "RCAP" */
+#define CAPTURE_VERSION 2
+#define CAPTURE_MAX_PAYLOAD (UINT16_MAX & ~7)	/* Still fits in caplen after padding */
+#define CAPTURE_UP 0				/* Viewer to server */
+#define CAPTURE_DOWN 1				/* Server to viewer */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t record_count;
+	uint64_t next;
+	int64_t start_time;			/* Microseconds since 1970-01-01 UTC */
+	uint32_t target_addr;		/* Network byte order */
+	uint16_t target_port;		/* Network byte order */
+	uint16_t payload;			/* Most payload bytes per record */
+} capture_header_t;
+
+typedef struct {
+	int64_t time;				/* Microseconds since start_time */
+	uint32_t conn;				/* Connection number */
+	uint32_t len;				/* Chunk size */
+	uint32_t delay;				/* Microseconds spent in the relay */
+	uint16_t caplen;			/* Bytes of payload that follow */
+	uint8_t direction;
+	uint8_t reserved;
+} capture_record_t;
+
+/* capture.c */
+extern bool capture_enabled;
+extern void capture_open (const wchar_t *path, uint32_t size, uint32_t payload, uint32_t target_addr, uint16_t target_port, int64_t now);
+extern void capture_record (uint32_t conn, uint8_t direction, uint32_t len, int64_t delay, const char *data, int64_t now);
+extern void capture_close (void);
+
+#endif
@@ -19,44 +19,854 @@
 
 #include <wchar.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include "rdpvnclaunch.h"
 
-void expand_line(wcsbuf_t *buf, wchar_t **search_replace)
-{
-	wchar_t *p0 = buf->data;
-	wchar_t *p1;
-
-	while ((p0 = wcschr(p0, '@')) != NULL && (p1 = wcschr(p0+1, '@')) != NULL) {
-		int c;
-
-		for (c = 0; search_replace[c] != NULL; c += 2) {
-			wchar_t *search = search_replace[c];
-			if (p1 - p0 - 1 == wcslen(search) && wcsncmp(p0+1, search, p1-p0-1) == 0) {
-				wchar_t *replacement = search_replace[c+1];
-				size_t newlen = wcslen(replacement);
-				size_t oldlen = p1 - p0 + 1;
-
-				if (buf->len + newlen - oldlen >= buf->size) {
-					wchar_t *newline;
-					buf->size = buf->len + newlen - oldlen + 1;
-					newline = xrealloc(buf->data, sizeof(wchar_t) * buf->size);
-					p0 = newline + (p0 - buf->data);
-					p1 = newline + (p1 - buf->data);
-					buf->data = newline;
-				}
-				memmove(p1 + newlen - oldlen + 1, p1 + 1, sizeof(wchar_t) * (buf->len - (p1 + 1 - buf->data) + 1));
-				memcpy(p0, replacement, sizeof(wchar_t) * newlen);
-				buf->len += newlen - oldlen;
-				p1 += newlen - oldlen;
-				break;
+#define OUTPUT_BUFSIZE 16384
+#define CACHE_MAGIC 0x43545652		/* "RVTC" */
+#define CACHE_VERSION 2
+#define NO_DIRECTIVE UINT32_MAX
+
+/* Variables are kept in insertion order, so that a variable's index
+ * (its slot) stays valid as the table grows, and found through an
+ * open addressing hash index over the slots. Each key is stored once
+ * with its hash.
+ */
+vartable_t *
+vartable_new(void)
+{
+	vartable_t *vars = xmalloc(sizeof(vartable_t));
+	vars->vars = NULL;
+	vars->count = 0;
+	vars->size = 0;
+	vars->index_size = 16;
+	vars->index = xmalloc(vars->index_size * sizeof(int));
+	for (size_t c = 0; c < vars->index_size; c++)
+		vars->index[c] = -1;
+	return vars;
+}
+
+void
+vartable_free(vartable_t *vars)
+{
+	for (size_t c = 0; c < vars->count; c++) {
+		free(vars->vars[c].key);
+		free(vars->vars[c].value);
+	}
+	free(vars->vars);
+	free(vars->index);
+	free(vars);
+}
+
+static uint32_t
+hash_name(const wchar_t *name, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	for (size_t c = 0; c < len; c++) {
+		hash ^= (uint16_t) name[c];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void
+vartable_rehash(vartable_t *vars)
+{
+	vars->index_size *= 2;
+	vars->index = xrealloc(vars->index, vars->index_size * sizeof(int));
+	for (size_t c = 0; c < vars->index_size; c++)
+		vars->index[c] = -1;
+	for (size_t c = 0; c < vars->count; c++) {
+		size_t pos = vars->vars[c].hash & (vars->index_size - 1);
+		while (vars->index[pos] >= 0)
+			pos = (pos + 1) & (vars->index_size - 1);
+		vars->index[pos] = c;
+	}
+}
+
+/* variable_slot:
+ * Return the slot of the variable named by the len characters at name,
+ * or -1 if there is no such variable.
+ */
+int
+variable_slot(const vartable_t *vars, const wchar_t *name, size_t len)
+{
+	uint32_t hash = hash_name(name, len);
+	size_t pos = hash & (vars->index_size - 1);
+	int slot;
+
+	while ((slot = vars->index[pos]) >= 0) {
+		const variable_t *var = &vars->vars[slot];
+		if (var->hash == hash && wcslen(var->key) == len && wmemcmp(var->key, name, len) == 0)
+			return slot;
+		pos = (pos + 1) & (vars->index_size - 1);
+	}
+	return -1;
+}
+
+/* Return the slot of variable key, adding it without a value if needed. */
+int
+define_variable(vartable_t *vars, const wchar_t *key)
+{
+	size_t len = wcslen(key);
+	int slot = variable_slot(vars, key, len);
+	size_t pos;
+
+	if (slot >= 0)
+		return slot;
+	if (vars->count >= vars->size) {
+		vars->size = vars->size == 0 ? 16 : vars->size * 2;
+		vars->vars = xrealloc(vars->vars, vars->size * sizeof(variable_t));
+	}
+	slot = vars->count++;
+	vars->vars[slot].key = xwcsdup(key);
+	vars->vars[slot].hash = hash_name(key, len);
+	vars->vars[slot].value = NULL;
+	vars->vars[slot].provider = NULL;
+	vars->vars[slot].provider_data = NULL;
+	/* Keep the index at most half full. */
+	if (vars->count * 2 > vars->index_size) {
+		vartable_rehash(vars);
+	} else {
+		pos = vars->vars[slot].hash & (vars->index_size - 1);
+		while (vars->index[pos] >= 0)
+			pos = (pos + 1) & (vars->index_size - 1);
+		vars->index[pos] = slot;
+	}
+	return slot;
+}
+
+/* Set variables from NAME=VALUE, as given with -D. Returns false if
+ * there is no `=' or the name is empty.
+ */
+bool
+set_variable_assignment(vartable_t *vars, const wchar_t *assignment)
+{
+	const wchar_t *equals = wcschr(assignment, '=');
+	wchar_t *key;
+
+	if (equals == NULL || equals == assignment)
+		return false;
+	key = xmalloc((equals - assignment + 1) * sizeof(wchar_t));
+	wmemcpy(key, assignment, equals - assignment);
+	key[equals - assignment] = '\0';
+	set_replacement(vars, key, xwcsdup(equals + 1));
+	free(key);
+	return true;
+}
+
+/* Add environment variables as template variables. Variables already
+ * defined, even if not yet given a value, are not replaced.
+ */
+void
+import_environment(vartable_t *vars)
+{
+	wchar_t *env = GetEnvironmentStringsW();
+
+	if (env == NULL)
+		return;
+	for (wchar_t *p = env; *p != '\0'; p += wcslen(p) + 1) {
+		const wchar_t *equals = wcschr(p + 1, '=');
+
+		/* Entries such as "=C:=C:\\" hold per-drive directories. */
+		if (*p == '=' || equals == NULL)
+			continue;
+		if (variable_slot(vars, p, equals - p) < 0) {
+			wchar_t *key = xmalloc((equals - p + 1) * sizeof(wchar_t));
+			wmemcpy(key, p, equals - p);
+			key[equals - p] = '\0';
+			set_replacement(vars, key, xwcsdup(equals + 1));
+			free(key);
+		}
+	}
+	FreeEnvironmentStringsW(env);
+}
+
+/* Templates are compiled once into a pool holding the template text
+ * and a list of tokens. A token is either a literal span of the pool or
+ * a placeholder, the span of a pair of `@' with the slot of the variable
+ * it names. A pair that does not name a variable is copied as literal
+ * text. Scanning always continues after the second `@', so where the
+ * pairs are does not depend on the variables, and a compiled template
+ * can be reused with other variables once its slots are resolved.
+ */
+template_t *
+template_new(void)
+{
+	template_t *tpl = xmalloc(sizeof(template_t));
+	tpl->pool = NULL;
+	tpl->pool_len = 0;
+	tpl->pool_size = 0;
+	tpl->tokens = NULL;
+	tpl->token_count = 0;
+	tpl->token_size = 0;
+	tpl->tmpfile_template = NULL;
+	tpl->command = NULL;
+	tpl->view = NULL;
+	tpl->encoding = ENCODING_UTF16LE;
+	return tpl;
+}
+
+void
+template_free(template_t *tpl)
+{
+	/* Mapped and embedded pools are not allocated. */
+	if (tpl->view != NULL)
+		UnmapViewOfFile(tpl->view); /* Ignore errors */
+	else if (tpl->pool_size != 0)
+		free(tpl->pool);
+	free(tpl->tokens);
+	free(tpl->tmpfile_template);
+	free(tpl->command);
+	free(tpl);
+}
+
+static void
+template_add_token(template_t *tpl, size_t offset, size_t len, int slot, bool placeholder)
+{
+	if (!placeholder) {
+		template_token_t *last = tpl->token_count > 0 ? &tpl->tokens[tpl->token_count-1] : NULL;
+
+		if (len == 0)
+			return;
+		/* Merge with the preceding literal if contiguous in the pool. */
+		if (last != NULL && !last->placeholder && last->offset + last->len == offset) {
+			last->len += len;
+			return;
+		}
+	}
+	if (tpl->token_count >= tpl->token_size) {
+		tpl->token_size = tpl->token_size == 0 ? 16 : tpl->token_size * 2;
+		tpl->tokens = xrealloc(tpl->tokens, tpl->token_size * sizeof(template_token_t));
+	}
+	tpl->tokens[tpl->token_count].offset = offset;
+	tpl->tokens[tpl->token_count].len = len;
+	tpl->tokens[tpl->token_count].slot = slot;
+	tpl->tokens[tpl->token_count].placeholder = placeholder;
+	tpl->token_count++;
+}
+
+/* template_scan:
+ * Add tokens for the text from start to end in the pool. The `@'
+ * characters are found SCAN_BATCH at a time with scan_chars.
+ */
+static void
+template_scan(template_t *tpl, size_t start, size_t end, vartable_t *vars)
+{
+	size_t at[SCAN_BATCH];
+	size_t count;
+
+	do {
+		size_t pos = start;
+
+		count = scan_chars(tpl->pool + pos, end - pos, '@', at, SCAN_BATCH);
+		for (size_t c = 0; c + 1 < count; c += 2) {
+			size_t p0 = pos + at[c];
+			size_t p1 = pos + at[c + 1];
+			int slot = variable_slot(vars, tpl->pool + p0 + 1, p1 - p0 - 1);
+
+			template_add_token(tpl, start, p0 - start, -1, false);
+			template_add_token(tpl, p0, p1 - p0 + 1, slot, true);
+			start = p1 + 1;
+		}
+		/* SCAN_BATCH is even, so a full batch ends with a complete pair. */
+	} while (count == SCAN_BATCH);
+	template_add_token(tpl, start, end - start, -1, false);
+}
+
+/* template_add:
+ * Append len characters of text to the template, resolving the
+ * placeholders in it to slots of vars.
+ */
+void
+template_add(template_t *tpl, const wchar_t *text, size_t len, vartable_t *vars)
+{
+	if (tpl->pool_len + len >= tpl->pool_size) {
+		tpl->pool_size = tpl->pool_size == 0 ? 1024 : tpl->pool_size;
+		while (tpl->pool_len + len >= tpl->pool_size)
+			tpl->pool_size *= 2;
+		tpl->pool = xrealloc(tpl->pool, tpl->pool_size * sizeof(wchar_t));
+	}
+	memcpy(tpl->pool + tpl->pool_len, text, len * sizeof(wchar_t));
+	tpl->pool_len += len;
+	tpl->pool[tpl->pool_len] = '\0';
+	template_scan(tpl, tpl->pool_len - len, tpl->pool_len, vars);
+}
+
+/* template_render:
+ * Append the expanded template to out. The output length is computed
+ * first so that out is grown at most once; this also runs the providers
+ * of the variables used.
+ */
+void
+template_render(const template_t *tpl, vartable_t *vars, wcsbuf_t *out)
+{
+	size_t len = out->len;
+	wchar_t *p;
+
+	for (size_t c = 0; c < tpl->token_count; c++) {
+		const template_token_t *token = &tpl->tokens[c];
+		const wchar_t *value;
+
+		if (token->slot < 0) {
+			len += token->len;
+		} else if ((value = variable_value(vars, token->slot)) != NULL) {
+			len += wcslen(value);
+		}
+	}
+	wcsbuf_assure(out, len);
+
+	p = out->data + out->len;
+	for (size_t c = 0; c < tpl->token_count; c++) {
+		const template_token_t *token = &tpl->tokens[c];
+		const wchar_t *value;
+
+		if (token->slot < 0) {
+			memcpy(p, tpl->pool + token->offset, token->len * sizeof(wchar_t));
+			p += token->len;
+		} else if ((value = vars->vars[token->slot].value) != NULL) {
+			size_t value_len = wcslen(value);
+			memcpy(p, value, value_len * sizeof(wchar_t));
+			p += value_len;
+		}
+	}
+	*p = '\0';
+	out->len = len;
+}
+
+/* Generated files are written through a fixed buffer with one
+ * WriteFile per flush, encoding as they go. "\n" is written as "\r\n"
+ * and the file starts with a byte order mark, as the C library does
+ * for files opened in text mode with a ccs encoding.
+ */
+typedef struct {
+	HANDLE file;
+	const wchar_t *path;
+	encoding_t encoding;
+	wchar_t high_surrogate;		/* Pending first half of a pair, or 0 */
+	size_t len;
+	char buf[OUTPUT_BUFSIZE];
+} output_t;
+
+static void
+output_flush(output_t *out)
+{
+	DWORD written;
+
+	if (out->len == 0)
+		return;
+	if (!WriteFile(out->file, out->buf, out->len, &written, NULL) || written != out->len)
+		die("Cannot write to file `%ls': %s", out->path, system_errstr());
+	out->len = 0;
+}
+
+static void
+output_bytes(output_t *out, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len > 0) {
+		size_t count = len < OUTPUT_BUFSIZE - out->len ? len : OUTPUT_BUFSIZE - out->len;
+
+		memcpy(out->buf + out->len, p, count);
+		out->len += count;
+		p += count;
+		len -= count;
+		if (out->len == OUTPUT_BUFSIZE)
+			output_flush(out);
+	}
+}
+
+static void
+output_utf8(output_t *out, const wchar_t *str, size_t len)
+{
+	while (len > 0) {
+		size_t count;
+
+		if (OUTPUT_BUFSIZE - out->len < ENCODE_UTF8_MAX(1))
+			output_flush(out);
+		count = (OUTPUT_BUFSIZE - out->len - ENCODE_UTF8_MAX(0)) / 3;
+		if (count > len)
+			count = len;
+		out->len += encode_utf8(str, count, out->buf + out->len, &out->high_surrogate);
+		str += count;
+		len -= count;
+	}
+}
+
+static void
+output_encoded(output_t *out, const wchar_t *str, size_t len)
+{
+	if (out->encoding == ENCODING_UTF8) {
+		output_utf8(out, str, len);
+	} else {
+		/* wchar_t is UTF-16LE already. */
+		output_bytes(out, str, len * sizeof(wchar_t));
+	}
+}
+
+static void
+output_text(output_t *out, const wchar_t *str, size_t len)
+{
+	while (len > 0) {
+		const wchar_t *newline = wmemchr(str, '\n', len);
+		size_t count = newline != NULL ? newline - str : len;
+
+		output_encoded(out, str, count);
+		if (newline == NULL)
+			break;
+		output_encoded(out, L"\r\n", 2);
+		str += count + 1;
+		len -= count + 1;
+	}
+}
+
+/* template_write:
+ * Expand the template into a new file at path. Memory use does not
+ * depend on the size of the output.
+ */
+void
+template_write(const template_t *tpl, vartable_t *vars, const wchar_t *path, encoding_t encoding)
+{
+	output_t out;
+
+	/* Run the providers first, so that one failing leaves no partial file. */
+	for (size_t c = 0; c < tpl->token_count; c++) {
+		if (tpl->tokens[c].slot >= 0)
+			variable_value(vars, tpl->tokens[c].slot);
+	}
+
+	out.file = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (out.file == INVALID_HANDLE_VALUE)
+		die("Cannot open file `%ls' for writing: %s", path, system_errstr());
+	out.path = path;
+	out.encoding = encoding;
+	out.high_surrogate = 0;
+	out.len = 0;
+
+	if (encoding == ENCODING_UTF8)
+		output_bytes(&out, "\xEF\xBB\xBF", 3);
+	else
+		output_bytes(&out, "\xFF\xFE", 2);
+	for (size_t c = 0; c < tpl->token_count; c++) {
+		const template_token_t *token = &tpl->tokens[c];
+		const wchar_t *value;
+
+		if (token->slot < 0)
+			output_text(&out, tpl->pool + token->offset, token->len);
+		else if ((value = vars->vars[token->slot].value) != NULL)
+			output_text(&out, value, wcslen(value));
+	}
+	if (out.high_surrogate != 0) {
+		if (OUTPUT_BUFSIZE - out.len < ENCODE_UTF8_MAX(0))
+			output_flush(&out);
+		out.len += encode_utf8(NULL, 0, out.buf + out.len, &out.high_surrogate);
+	}
+	output_flush(&out);
+	if (!CloseHandle(out.file))
+		die("Cannot close file `%ls': %s", path, system_errstr());
+}
+
+/* Resolve placeholder slots against vars. */
+static void
+template_resolve(template_t *tpl, const vartable_t *vars)
+{
+	for (size_t c = 0; c < tpl->token_count; c++) {
+		template_token_t *token = &tpl->tokens[c];
+
+		if (token->placeholder)
+			token->slot = variable_slot(vars, tpl->pool + token->offset + 1, token->len - 2);
+	}
+}
+
+static wchar_t *
+get_directive(const wchar_t *line, size_t len, const wchar_t *prefix)
+{
+	size_t prefix_len = wcslen(prefix);
+	wchar_t *value;
+
+	if (len < prefix_len || wmemcmp(line, prefix, prefix_len) != 0)
+		return NULL;
+	value = xmalloc((len - prefix_len + 1) * sizeof(wchar_t));
+	wmemcpy(value, line + prefix_len, len - prefix_len);
+	value[len - prefix_len] = '\0';
+	chomp_string(value);
+	return value;
+}
+
+/* Make the mapped template at data the pool of tpl. UTF-16LE templates
+ * are used in place, others are converted once.
+ */
+static void
+template_decode(template_t *tpl, const char *data, size_t size)
+{
+	encoding_t encoding;
+	size_t bom_len;
+
+	if (size == 0)
+		return;
+	encoding = detect_encoding(data, size, &bom_len);
+	if (encoding == ENCODING_UTF16LE) {
+		tpl->pool = (wchar_t *) (data + bom_len);
+		tpl->pool_len = (size - bom_len) / sizeof(wchar_t);
+		return;
+	}
+	tpl->pool = decode_text(data + bom_len, size - bom_len, encoding, &tpl->pool_len);
+	tpl->pool_size = tpl->pool_len + 1;
+}
+
+/* template_parse:
+ * Compile the template at path. Lines starting with one of the
+ * prefixes in syntax are directives, stored in the template and not
+ * part of its text. Lines starting with `#' and empty lines are
+ * discarded. The template may be in UTF-16, UTF-8 or the ANSI code
+ * page, with or without a byte order mark.
+ *
+ * The template is mapped into memory and its tokens refer to the
+ * mapped text. Line ends are "\n", as when read in text mode, so a
+ * "\r\n" line end is given a token for its "\n" alone.
+ */
+template_t *
+template_parse(const wchar_t *path, const template_syntax_t *syntax, vartable_t *vars)
+{
+	template_t *tpl = template_new();
+	LARGE_INTEGER size;
+	HANDLE file;
+	HANDLE mapping;
+	char *view = NULL;
+	size_t pos;
+
+	file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		die("Cannot open file `%ls' for reading: %s", path, system_errstr());
+	if (!GetFileSizeEx(file, &size))
+		die("Cannot read from file `%ls': %s", path, system_errstr());
+	if (size.QuadPart > SIZE_MAX / 2)
+		die("Cannot read from file `%ls': File too large", path);
+	/* Empty files cannot be mapped. */
+	if (size.QuadPart != 0) {
+		mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL)
+			die("Cannot map file `%ls': %s", path, system_errstr());
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (view == NULL)
+			die("Cannot map file `%ls': %s", path, system_errstr());
+		CloseHandle(mapping); /* Ignore errors */
+	}
+	CloseHandle(file); /* Ignore errors */
+
+	template_decode(tpl, view, size.QuadPart);
+	if (tpl->pool_size == 0)
+		tpl->view = view;
+	else if (view != NULL)
+		UnmapViewOfFile(view); /* Ignore errors */
+
+	for (pos = 0; pos < tpl->pool_len; ) {
+		const wchar_t *line = tpl->pool + pos;
+		const wchar_t *newline = wmemchr(line, '\n', tpl->pool_len - pos);
+		size_t len = newline != NULL ? newline - line + 1 : tpl->pool_len - pos;
+
+		if (line[0] != '#' && line[0] != '\n' && !(line[0] == '\r' && len >= 2 && line[1] == '\n')) {
+			wchar_t *value;
+
+			if ((value = get_directive(line, len, syntax->tmpfile)) != NULL) {
+				free(tpl->tmpfile_template);
+				tpl->tmpfile_template = value;
+			} else if ((value = get_directive(line, len, syntax->command)) != NULL) {
+				free(tpl->command);
+				tpl->command = value;
+			} else if ((value = get_directive(line, len, syntax->encoding)) != NULL) {
+				if (!parse_encoding(value, &tpl->encoding))
+					die("Unknown output encoding `%ls' in `%ls'", value, path);
+				free(value);
+			} else if (newline != NULL && len >= 2 && newline[-1] == '\r') {
+				template_scan(tpl, pos, pos + len - 2, vars);
+				template_add_token(tpl, pos + len - 1, 1, -1, false);
+			} else {
+				template_scan(tpl, pos, pos + len, vars);
 			}
 		}
-		p0 = p1 + 1;
+		pos += len;
+	}
+	return tpl;
+}
+
+/* Compiled templates are cached in the temporary directory, in a file
+ * named after the program and a hash of the template path. The cache
+ * is used only if the template still has the recorded size,
+ * modification time and content hash. It is laid out as:
+ *
+ *   cache_header_t
+ *   cache_token_t[token_count]
+ *   wchar_t pool[pool_len]
+ *   wchar_t tmpfile_template[tmpfile_len]	(NO_DIRECTIVE if not given)
+ *   wchar_t command[command_len]
+ *
+ * Any problem with the cache is ignored and the template parsed again.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t hash;
+	uint32_t pool_len;
+	uint32_t token_count;
+	uint32_t tmpfile_len;
+	uint32_t command_len;
+	uint32_t encoding;
+} cache_header_t;
+
+typedef struct {
+	uint32_t offset;
+	uint32_t len;
+	uint32_t placeholder;
+} cache_token_t;
+
+/* FNV-1a over the raw bytes of the template. */
+static bool
+hash_file(const wchar_t *path, uint64_t *hash)
+{
+	char buf[65536];
+	HANDLE file;
+	DWORD len;
+
+	file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	*hash = 14695981039346656037ULL;
+	while (ReadFile(file, buf, sizeof(buf), &len, NULL) && len > 0) {
+		for (DWORD c = 0; c < len; c++) {
+			*hash ^= (unsigned char) buf[c];
+			*hash *= 1099511628211ULL;
+		}
+	}
+	CloseHandle(file); /* Ignore errors */
+	return true;
+}
+
+static wchar_t *
+get_cache_path(const wchar_t *path, const template_syntax_t *syntax)
+{
+	wchar_t temp_dir[MAX_PATH + 1];
+	wchar_t full_path[MAX_PATH + 1];
+	uint32_t hash;
+	DWORD len;
+
+	len = GetTempPathW(MAX_PATH + 1, temp_dir);
+	if (len == 0 || len > MAX_PATH)
+		return NULL;
+	len = GetFullPathNameW(path, MAX_PATH + 1, full_path, NULL);
+	if (len == 0 || len > MAX_PATH)
+		return NULL;
+	/* The directive syntax differs between programs, so is part of the key. */
+	hash = hash_name(full_path, len) ^ hash_name(syntax->tmpfile, wcslen(syntax->tmpfile));
+	return xaswprintf(L"%ls%ls%ls-%08x.tpc", temp_dir, temp_dir[wcslen(temp_dir)-1] == '\\' ? L"" : L"\\", program_name_w, hash);
+}
+
+static wchar_t *
+cache_string(const wchar_t *data, uint32_t len)
+{
+	wchar_t *str;
+
+	if (len == NO_DIRECTIVE)
+		return NULL;
+	str = xmalloc((len + 1) * sizeof(wchar_t));
+	wmemcpy(str, data, len);
+	str[len] = '\0';
+	return str;
+}
+
+static template_t *
+load_cached_template(const wchar_t *cache_path, const cache_header_t *key)
+{
+	const cache_header_t *header;
+	const cache_token_t *tokens;
+	const wchar_t *strings;
+	LARGE_INTEGER file_size;
+	HANDLE file;
+	HANDLE mapping;
+	char *view;
+	template_t *tpl;
+	uint64_t expected;
+
+	file = CreateFileW(cache_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < (LONGLONG) sizeof(cache_header_t)) {
+		CloseHandle(file); /* Ignore errors */
+		return NULL;
+	}
+	mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file); /* Ignore errors */
+	if (mapping == NULL)
+		return NULL;
+	view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); /* Ignore errors */
+	if (view == NULL)
+		return NULL;
+
+	header = (const cache_header_t *) view;
+	expected = sizeof(cache_header_t) + (uint64_t) header->token_count * sizeof(cache_token_t)
+		+ ((uint64_t) header->pool_len
+		   + (header->tmpfile_len == NO_DIRECTIVE ? 0 : header->tmpfile_len)
+		   + (header->command_len == NO_DIRECTIVE ? 0 : header->command_len)) * sizeof(wchar_t);
+	if (header->magic != key->magic || header->version != key->version
+			|| header->size != key->size || header->mtime != key->mtime || header->hash != key->hash
+			|| expected != (uint64_t) file_size.QuadPart) {
+		UnmapViewOfFile(view); /* Ignore errors */
+		return NULL;
+	}
+	tokens = (const cache_token_t *) (header + 1);
+	for (uint32_t c = 0; c < header->token_count; c++) {
+		if (tokens[c].offset > header->pool_len || tokens[c].len > header->pool_len - tokens[c].offset
+				|| (tokens[c].placeholder && tokens[c].len < 2)) {
+			UnmapViewOfFile(view); /* Ignore errors */
+			return NULL;
+		}
+	}
+
+	tpl = template_new();
+	tpl->view = view;
+	/* The pool is used in place and must not be added to. */
+	tpl->pool = (wchar_t *) (tokens + header->token_count);
+	tpl->pool_len = header->pool_len;
+	tpl->token_count = tpl->token_size = header->token_count;
+	tpl->tokens = xmalloc((header->token_count + 1) * sizeof(template_token_t));
+	for (uint32_t c = 0; c < header->token_count; c++) {
+		tpl->tokens[c].offset = tokens[c].offset;
+		tpl->tokens[c].len = tokens[c].len;
+		tpl->tokens[c].slot = -1;
+		tpl->tokens[c].placeholder = tokens[c].placeholder != 0;
+	}
+	strings = tpl->pool + header->pool_len;
+	tpl->tmpfile_template = cache_string(strings, header->tmpfile_len);
+	if (header->tmpfile_len != NO_DIRECTIVE)
+		strings += header->tmpfile_len;
+	tpl->command = cache_string(strings, header->command_len);
+	tpl->encoding = header->encoding == ENCODING_UTF8 ? ENCODING_UTF8 : ENCODING_UTF16LE;
+	return tpl;
+}
+
+static bool
+write_all(HANDLE file, const void *data, size_t len)
+{
+	DWORD written;
+
+	return len == 0 || (WriteFile(file, data, len, &written, NULL) && written == len);
+}
+
+/* Write the cache to a new file, then move it in place, so that other
+ * launches never see a partial cache.
+ */
+static void
+store_cached_template(const wchar_t *cache_path, cache_header_t *header, const template_t *tpl)
+{
+	cache_token_t *tokens;
+	wchar_t *new_path;
+	HANDLE file;
+	bool ok;
+
+	header->pool_len = tpl->pool_len;
+	header->token_count = tpl->token_count;
+	header->tmpfile_len = tpl->tmpfile_template != NULL ? wcslen(tpl->tmpfile_template) : NO_DIRECTIVE;
+	header->command_len = tpl->command != NULL ? wcslen(tpl->command) : NO_DIRECTIVE;
+	header->encoding = tpl->encoding;
+	tokens = xmalloc((tpl->token_count + 1) * sizeof(cache_token_t));
+	for (size_t c = 0; c < tpl->token_count; c++) {
+		tokens[c].offset = tpl->tokens[c].offset;
+		tokens[c].len = tpl->tokens[c].len;
+		tokens[c].placeholder = tpl->tokens[c].placeholder;
+	}
+
+	new_path = xaswprintf(L"%ls.%lu", cache_path, GetCurrentProcessId());
+	file = CreateFileW(new_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file != INVALID_HANDLE_VALUE) {
+		ok = write_all(file, header, sizeof(*header))
+			&& write_all(file, tokens, tpl->token_count * sizeof(cache_token_t))
+			&& write_all(file, tpl->pool, tpl->pool_len * sizeof(wchar_t))
+			&& (tpl->tmpfile_template == NULL || write_all(file, tpl->tmpfile_template, header->tmpfile_len * sizeof(wchar_t)))
+			&& (tpl->command == NULL || write_all(file, tpl->command, header->command_len * sizeof(wchar_t)));
+		ok = CloseHandle(file) && ok;
+		if (!ok || !MoveFileExW(new_path, cache_path, MOVEFILE_REPLACE_EXISTING))
+			DeleteFileW(new_path); /* Ignore errors */
+	}
+	free(new_path);
+	free(tokens);
+}
+
+/* template_load:
+ * As template_parse, but use the cached compiled template if valid.
+ */
+template_t *
+template_load(const wchar_t *path, const template_syntax_t *syntax, vartable_t *vars)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	cache_header_t key;
+	wchar_t *cache_path = NULL;
+	template_t *tpl;
+
+	memset(&key, 0, sizeof(key));
+	key.magic = CACHE_MAGIC;
+	key.version = CACHE_VERSION;
+	if (GetFileAttributesExW(path, GetFileExInfoStandard, &attr) && hash_file(path, &key.hash)) {
+		key.size = (uint64_t) attr.nFileSizeHigh << 32 | attr.nFileSizeLow;
+		key.mtime = (uint64_t) attr.ftLastWriteTime.dwHighDateTime << 32 | attr.ftLastWriteTime.dwLowDateTime;
+		cache_path = get_cache_path(path, syntax);
+	}
+	if (cache_path != NULL && (tpl = load_cached_template(cache_path, &key)) != NULL) {
+		template_resolve(tpl, vars);
+	} else {
+		tpl = template_parse(path, syntax, vars);
+		if (cache_path != NULL)
+			store_cached_template(cache_path, &key, tpl);
+	}
+	free(cache_path);
+	return tpl;
+}
+
+/* template_embedded:
+ * Make a template of one compiled into the program by tplgen.
+ */
+template_t *
+template_embedded(const embedded_template_t *embedded, vartable_t *vars)
+{
+	template_t *tpl = template_new();
+
+	/* The pool is used in place and must not be added to. */
+	tpl->pool = (wchar_t *) embedded->pool;
+	tpl->pool_len = embedded->pool_len;
+	tpl->token_count = tpl->token_size = embedded->token_count;
+	tpl->tokens = xmalloc((embedded->token_count + 1) * sizeof(template_token_t));
+	for (size_t c = 0; c < embedded->token_count; c++) {
+		tpl->tokens[c].offset = embedded->tokens[c].offset;
+		tpl->tokens[c].len = embedded->tokens[c].len;
+		tpl->tokens[c].slot = -1;
+		tpl->tokens[c].placeholder = embedded->tokens[c].placeholder;
 	}
+	if (embedded->tmpfile_template != NULL)
+		tpl->tmpfile_template = xwcsdup(embedded->tmpfile_template);
+	if (embedded->command != NULL)
+		tpl->command = xwcsdup(embedded->command);
+	tpl->encoding = embedded->encoding;
+	template_resolve(tpl, vars);
+	return tpl;
+}
+
+void expand_line(wcsbuf_t *buf, vartable_t *vars)
+{
+	template_t *tpl = template_new();
+
+	template_add(tpl, buf->data, buf->len, vars);
+	buf->len = 0;
+	template_render(tpl, vars, buf);
+	template_free(tpl);
 }
 
 /* XXX race condition? need to create file instead of returning its name */
-wchar_t *get_temp_file_expanded(const wchar_t *template, wchar_t **search_replace)
+wchar_t *get_temp_file_expanded(const wchar_t *template, vartable_t *vars)
 {
 	wcsbuf_t *path;
 	wchar_t *unique;
@@ -88,7 +898,7 @@ wchar_t *get_temp_file_expanded(const wchar_t *template, wchar_t **search_replac
 			swprintf(tmp, L"%06d", rand() % 1000000);
 			memcpy(path->data + baselen + (unique-template), tmp, sizeof(wchar_t) * 6);
 			orig_path = wcsbuf_clone_buf(path);
-			expand_line(path, search_replace);
+			expand_line(path, vars);
 			for (int c = baselen; c < path->len; c++) {
 				if (path->data[c] <= 31 || wcschr(L"/\\:*?\"<>|", path->data[c]) != NULL)
 					path->data[c] = '_';
@@ -103,32 +913,61 @@ wchar_t *get_temp_file_expanded(const wchar_t *template, wchar_t **search_replac
 		die("No free temporary file name found.");
 	}
 
-	expand_line(path, search_replace);
+	expand_line(path, vars);
 	return wcsbuf_free_to_wcs(path);
 }
 
-wchar_t *get_replacement(wchar_t **search_replace, const wchar_t *key)
+wchar_t *get_replacement(vartable_t *vars, const wchar_t *key)
 {
-	for (int c = 0; search_replace[c] != NULL; c += 2) {
-		if (wcscmp(search_replace[c], key) == 0)
-			return search_replace[c+1];
-	}
+	int slot = variable_slot(vars, key, wcslen(key));
 
-	return NULL;
+	return slot >= 0 ? variable_value(vars, slot) : NULL;
 }
 
-wchar_t *set_replacement(wchar_t **search_replace, const wchar_t *key, wchar_t *value)
+/* Set variable key to value, which is then owned by vars. */
+wchar_t *set_replacement(vartable_t *vars, const wchar_t *key, wchar_t *value)
 {
-	for (int c = 0; search_replace[c] != NULL; c += 2) {
-		if (wcscmp(search_replace[c], key) == 0) {
-			if (search_replace[c+1] != NULL)
-				free(search_replace[c+1]);
-			search_replace[c+1] = value;
-			return value;
-		}
-	}
+	int slot = define_variable(vars, key);
+
+	free(vars->vars[slot].value);
+	vars->vars[slot].value = value;
+	vars->vars[slot].provider = NULL;
+	return value;
+}
 
-    return NULL;
+/* set_provider:
+ * Have provider compute the value of variable key when it is first
+ * used, replacing any value it has. data is passed to provider and
+ * stays owned by the caller. The value returned by provider, which may
+ * be NULL, is kept and owned by vars.
+ */
+void set_provider(vartable_t *vars, const wchar_t *key, provider_t provider, void *data)
+{
+	int slot = define_variable(vars, key);
+
+	free(vars->vars[slot].value);
+	vars->vars[slot].value = NULL;
+	vars->vars[slot].provider = provider;
+	vars->vars[slot].provider_data = data;
+}
+
+/* Return the value of the variable in slot, running its provider if
+ * this is the first use.
+ */
+wchar_t *variable_value(vartable_t *vars, int slot)
+{
+	provider_t provider = vars->vars[slot].provider;
+
+	if (provider != NULL) {
+		wchar_t *value;
+
+		/* Cleared first, so a provider using its own variable sees NULL. */
+		vars->vars[slot].provider = NULL;
+		value = provider(vars, vars->vars[slot].provider_data);
+		/* The provider may have defined variables, moving the table. */
+		vars->vars[slot].value = value;
+	}
+	return vars->vars[slot].value;
 }
 
 void chomp_string(wchar_t *str)
@@ -0,0 +1,96 @@
+/* conerror.c - Error reporting for console programs
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* The same functions as error.c, writing to stderr instead of showing
+ * a message box, for programs run from the build such as tplgen.
+ */
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include "rdpvnclaunch.h"
+
+void inform (char *fmt, ...)
+{
+	va_list argv;
+
+	va_start(argv, fmt);
+	vprintf(fmt, argv);
+	va_end(argv);
+	putchar('\n');
+}
+
+void vwarn (char *fmt, va_list argv)
+{
+	fprintf(stderr, "%s: ", program_name);
+	vfprintf(stderr, fmt, argv);
+	fputc('\n', stderr);
+}
+
+void warn (char *fmt, ...)
+{
+	va_list argv;
+
+	va_start(argv, fmt);
+	vwarn(fmt, argv);
+	va_end(argv);
+}
+
+void die (char *fmt, ...)
+{
+	va_list argv;
+
+	va_start(argv, fmt);
+	vwarn(fmt, argv);
+	va_end(argv);
+	exit(1);
+}
+
+void xalloc_die (void)
+{
+	die("Cannot allocate memory.");
+}
+
+char *errno_errstr (void)
+{
+	return strerror(errno);
+}
+
+char *system_errstr_error(DWORD error)
+{
+	char *sysmsg;
+	char *msg;
+
+	if (!FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM, NULL, error, 0, (LPTSTR) &sysmsg, 0, NULL))
+		return strdup("Unknown error");
+	msg = strdup(sysmsg);
+	if (msg == NULL)
+		xalloc_die();
+	LocalFree(sysmsg);
+	return msg;
+}
+
+char *system_errstr (void)
+{
+	return system_errstr_error(GetLastError());
+}
@@ -0,0 +1,382 @@
+/* encoding.c - Detection and conversion of text encodings
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <wchar.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include "rdpvnclaunch.h"
+#ifdef HAVE_X86_SIMD
+#include <emmintrin.h>
+#endif
+
+#define DETECT_SIZE 4096		/* Bytes examined when there is no BOM */
+#define REPLACEMENT_CHAR 0xFFFD
+
+static const struct {
+	const wchar_t *name;
+	encoding_t encoding;
+} encoding_names[] = {
+	{ L"UTF-16LE", ENCODING_UTF16LE },
+	{ L"UTF-16", ENCODING_UTF16LE },
+	{ L"UNICODE", ENCODING_UTF16LE },
+	{ L"UTF-8", ENCODING_UTF8 },
+};
+
+/* Return the output encoding named name, or false if there is none. */
+bool
+parse_encoding(const wchar_t *name, encoding_t *encoding)
+{
+	for (int c = 0; c < sizeof(encoding_names)/sizeof(*encoding_names); c++) {
+		if (_wcsicmp(name, encoding_names[c].name) == 0) {
+			*encoding = encoding_names[c].encoding;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool
+is_utf8(const unsigned char *data, size_t size)
+{
+	bool ascii = true;
+
+	for (size_t c = 0; c < size; ) {
+		size_t len;
+
+		if (data[c] < 0x80) {
+			c++;
+			continue;
+		}
+		ascii = false;
+		if (data[c] >= 0xC2 && data[c] <= 0xDF)
+			len = 2;
+		else if (data[c] >= 0xE0 && data[c] <= 0xEF)
+			len = 3;
+		else if (data[c] >= 0xF0 && data[c] <= 0xF4)
+			len = 4;
+		else
+			return false;
+		/* A sequence cut off by the end of the sample is accepted. */
+		for (size_t d = 1; d < len && c + d < size; d++) {
+			if ((data[c + d] & 0xC0) != 0x80)
+				return false;
+		}
+		c += len;
+	}
+	return !ascii;
+}
+
+/* detect_encoding:
+ * Guess the encoding of text from its byte order mark, or without one
+ * from the first DETECT_SIZE bytes: UTF-16 if most characters have a
+ * zero byte, UTF-8 if it is valid UTF-8 beyond ASCII, and the ANSI code
+ * page otherwise. The length of the byte order mark is stored in
+ * bom_len.
+ */
+encoding_t
+detect_encoding(const char *data, size_t size, size_t *bom_len)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	size_t sample = size < DETECT_SIZE ? size : DETECT_SIZE;
+	size_t zeros[2] = { 0, 0 };
+
+	*bom_len = 0;
+	if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+		*bom_len = 2;
+		return ENCODING_UTF16LE;
+	}
+	if (size >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
+		*bom_len = 2;
+		return ENCODING_UTF16BE;
+	}
+	if (size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+		*bom_len = 3;
+		return ENCODING_UTF8;
+	}
+
+	for (size_t c = 0; c < sample; c++) {
+		if (bytes[c] == 0)
+			zeros[c % 2]++;
+	}
+	if (size % 2 == 0 && sample >= 2) {
+		if (zeros[1] > sample / 4 && zeros[0] == 0)
+			return ENCODING_UTF16LE;
+		if (zeros[0] > sample / 4 && zeros[1] == 0)
+			return ENCODING_UTF16BE;
+	}
+	if (is_utf8(bytes, sample))
+		return ENCODING_UTF8;
+	return ENCODING_ANSI;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Widen ASCII bytes 16 at a time, stopping before a block that is not
+ * all ASCII. Returns the number of bytes converted.
+ */
+__attribute__((target("sse2")))
+static size_t
+widen_ascii_sse2(const unsigned char *data, size_t size, wchar_t *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t c;
+
+	for (c = 0; c + 16 <= size; c += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (data + c));
+
+		if (_mm_movemask_epi8(bytes) != 0)
+			break;
+		_mm_storeu_si128((__m128i *) (out + c), _mm_unpacklo_epi8(bytes, zero));
+		_mm_storeu_si128((__m128i *) (out + c + 8), _mm_unpackhi_epi8(bytes, zero));
+	}
+	return c;
+}
+
+/* Narrow UTF-16 units below 0x80 eight at a time, stopping before a
+ * block with any other unit. Returns the number of units converted.
+ */
+__attribute__((target("sse2")))
+static size_t
+narrow_ascii_sse2(const wchar_t *str, size_t len, char *out)
+{
+	const __m128i high_bits = _mm_set1_epi16((short) 0xFF80);
+	const __m128i zero = _mm_setzero_si128();
+	size_t c;
+
+	for (c = 0; c + 8 <= len; c += 8) {
+		__m128i units = _mm_loadu_si128((const __m128i *) (str + c));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, high_bits), zero)) != 0xFFFF)
+			break;
+		_mm_storel_epi64((__m128i *) (out + c), _mm_packus_epi16(units, units));
+	}
+	return c;
+}
+
+#endif
+
+/* Widen the leading ASCII bytes of data into out. Returns the number
+ * of bytes converted, stopping at the first non-ASCII byte.
+ */
+static size_t
+widen_ascii(const unsigned char *data, size_t size, wchar_t *out)
+{
+	size_t c = 0;
+
+#ifdef HAVE_X86_SIMD
+	if (cpu_has_sse2())
+		c = widen_ascii_sse2(data, size, out);
+#endif
+	for (; c < size && data[c] < 0x80; c++)
+		out[c] = data[c];
+	return c;
+}
+
+/* Decode UTF-8 into out, which must have room for size characters.
+ * Invalid sequences become U+FFFD. Returns the number of characters.
+ */
+static size_t
+decode_utf8(const unsigned char *data, size_t size, wchar_t *out)
+{
+	size_t in = 0;
+	size_t len = 0;
+
+	while (in < size) {
+		uint32_t ch;
+		uint32_t min;
+		size_t seq;
+		size_t ascii;
+
+		ascii = widen_ascii(data + in, size - in, out + len);
+		in += ascii;
+		len += ascii;
+		if (in >= size)
+			break;
+
+		ch = data[in];
+		if (ch >= 0xC2 && ch <= 0xDF) {
+			seq = 2;
+			ch &= 0x1F;
+			min = 0x80;
+		} else if (ch >= 0xE0 && ch <= 0xEF) {
+			seq = 3;
+			ch &= 0x0F;
+			min = 0x800;
+		} else if (ch >= 0xF0 && ch <= 0xF4) {
+			seq = 4;
+			ch &= 0x07;
+			min = 0x10000;
+		} else {
+			out[len++] = REPLACEMENT_CHAR;
+			in++;
+			continue;
+		}
+		if (in + seq > size) {
+			out[len++] = REPLACEMENT_CHAR;
+			in++;
+			continue;
+		}
+		for (size_t c = 1; c < seq; c++) {
+			if ((data[in + c] & 0xC0) != 0x80) {
+				ch = UINT32_MAX;
+				break;
+			}
+			ch = ch << 6 | (data[in + c] & 0x3F);
+		}
+		if (ch == UINT32_MAX || ch < min || ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF)) {
+			out[len++] = REPLACEMENT_CHAR;
+			in++;
+			continue;
+		}
+		in += seq;
+		if (ch >= 0x10000) {
+			ch -= 0x10000;
+			out[len++] = 0xD800 + (ch >> 10);
+			out[len++] = 0xDC00 + (ch & 0x3FF);
+		} else {
+			out[len++] = ch;
+		}
+	}
+	return len;
+}
+
+/* decode_text:
+ * Convert size bytes of text in encoding (not including a byte order
+ * mark) to a newly allocated wide string. The length is stored in len.
+ * UTF-16LE text can normally be used in place instead.
+ */
+wchar_t *
+decode_text(const char *data, size_t size, encoding_t encoding, size_t *len)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	wchar_t *text;
+
+	/* Every encoding takes at least one byte per UTF-16 unit. */
+	text = xmalloc((size + 1) * sizeof(wchar_t));
+	switch (encoding) {
+	case ENCODING_UTF16LE:
+		*len = size / 2;
+		memcpy(text, data, *len * sizeof(wchar_t));
+		break;
+	case ENCODING_UTF16BE:
+		*len = size / 2;
+		for (size_t c = 0; c < *len; c++)
+			text[c] = bytes[c*2] << 8 | bytes[c*2+1];
+		break;
+	case ENCODING_UTF8:
+		*len = decode_utf8(bytes, size, text);
+		break;
+	default:
+		/* ASCII is the same in every ANSI code page. */
+		*len = widen_ascii(bytes, size, text);
+		if (*len < size) {
+			int wide_len;
+
+			if (size > INT_MAX)
+				die("Cannot decode text: Too large");
+			wide_len = MultiByteToWideChar(CP_ACP, 0, data, size, text, size);
+			if (wide_len == 0)
+				die("Cannot decode text: %s", system_errstr());
+			*len = wide_len;
+		}
+		break;
+	}
+	text[*len] = '\0';
+	return text;
+}
+
+static size_t
+encode_utf8_char(uint32_t ch, char *out)
+{
+	if (ch < 0x80) {
+		out[0] = ch;
+		return 1;
+	}
+	if (ch < 0x800) {
+		out[0] = 0xC0 | ch >> 6;
+		out[1] = 0x80 | (ch & 0x3F);
+		return 2;
+	}
+	if (ch < 0x10000) {
+		out[0] = 0xE0 | ch >> 12;
+		out[1] = 0x80 | (ch >> 6 & 0x3F);
+		out[2] = 0x80 | (ch & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | ch >> 18;
+	out[1] = 0x80 | (ch >> 12 & 0x3F);
+	out[2] = 0x80 | (ch >> 6 & 0x3F);
+	out[3] = 0x80 | (ch & 0x3F);
+	return 4;
+}
+
+/* encode_utf8:
+ * Encode len UTF-16 units of str as UTF-8 into out, which must have
+ * room for ENCODE_UTF8_MAX(len) bytes. A surrogate pair may be split
+ * between calls: the first half is kept in *high_surrogate, which
+ * starts as 0. Call with len 0 at the end to flush an unpaired half.
+ * Returns the number of bytes written.
+ */
+size_t
+encode_utf8(const wchar_t *str, size_t len, char *out, wchar_t *high_surrogate)
+{
+	char *p = out;
+	size_t c = 0;
+#ifdef HAVE_X86_SIMD
+	bool sse2 = cpu_has_sse2();
+#endif
+
+	if (len == 0 && *high_surrogate != 0) {
+		*high_surrogate = 0;
+		return encode_utf8_char(REPLACEMENT_CHAR, out);
+	}
+	while (c < len) {
+		uint32_t ch;
+
+#ifdef HAVE_X86_SIMD
+		if (*high_surrogate == 0 && sse2) {
+			size_t ascii = narrow_ascii_sse2(str + c, len - c, p);
+
+			c += ascii;
+			p += ascii;
+			if (c >= len)
+				break;
+		}
+#endif
+		ch = (uint16_t) str[c++];
+		if (*high_surrogate != 0) {
+			if (ch >= 0xDC00 && ch <= 0xDFFF) {
+				p += encode_utf8_char(0x10000 + ((*high_surrogate - 0xD800) << 10) + (ch - 0xDC00), p);
+				*high_surrogate = 0;
+				continue;
+			}
+			p += encode_utf8_char(REPLACEMENT_CHAR, p);
+			*high_surrogate = 0;
+		}
+		if (ch >= 0xD800 && ch <= 0xDBFF)
+			*high_surrogate = ch;
+		else if (ch >= 0xDC00 && ch <= 0xDFFF)
+			p += encode_utf8_char(REPLACEMENT_CHAR, p);
+		else
+			p += encode_utf8_char(ch, p);
+	}
+	return p - out;
+}
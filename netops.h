@@ -0,0 +1,58 @@
+/* netops.h - Socket and clock operations used by the relay
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef NETOPS_H
+#define NETOPS_H
+
+#include <stdint.h>
+
+/* The relay reaches its sockets and clock only through these
+ * operations, so that the event loop can be driven by a simulated or
+ * fault-injecting network. Each operation behaves like the Winsock
+ * function of the same name; last_error is WSAGetLastError,
+ * set_last_error is WSASetLastError and now_us returns a monotonic time
+ * in microseconds. Only duplicating sockets for a handoff and sampling
+ * TCP_INFO call Winsock directly, as both need kernel sockets. Include
+ * after winsock2.h, with the same FD_SETSIZE as proxy.c.
+ */
+typedef struct {
+	SOCKET (*socket) (int af, int type, int protocol);
+	int (*bind) (SOCKET sock, const struct sockaddr *addr, int addr_len);
+	int (*listen) (SOCKET sock, int backlog);
+	SOCKET (*accept) (SOCKET sock, struct sockaddr *addr, int *addr_len);
+	int (*connect) (SOCKET sock, const struct sockaddr *addr, int addr_len);
+	int (*recv) (SOCKET sock, char *buf, int len, int flags);
+	int (*send) (SOCKET sock, const char *buf, int len, int flags);
+	int (*closesocket) (SOCKET sock);
+	int (*ioctlsocket) (SOCKET sock, long cmd, u_long *arg);
+	int (*getsockopt) (SOCKET sock, int level, int name, char *value, int *value_len);
+	int (*setsockopt) (SOCKET sock, int level, int name, const char *value, int value_len);
+	int (*getsockname) (SOCKET sock, struct sockaddr *addr, int *addr_len);
+	int (*getpeername) (SOCKET sock, struct sockaddr *addr, int *addr_len);
+	int (*select) (int nfds, fd_set *read_fds, fd_set *write_fds, fd_set *except_fds, const struct timeval *timeout);
+	int (*last_error) (void);
+	void (*set_last_error) (int error);
+	int64_t (*now_us) (void);
+} net_ops_t;
+
+/* proxy.c */
+extern const net_ops_t winsock_net_ops;
+extern void set_proxy_net_ops (const net_ops_t *ops);
+
+#endif
@@ -17,72 +17,367 @@
  * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+/* Two sockets per connection plus listen, control and statistics sockets.
+ * Both can be raised on the command line, as for the network simulator.
+ */
+#ifndef FD_SETSIZE
+#define FD_SETSIZE 128
+#endif
 #include <winsock2.h>
+#include <mstcpip.h>
+#include <iphlpapi.h>
 #include <time.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include "rdpvnclaunch.h"
+#include "capture.h"
+#include "stats.h"
+#include "netops.h"
 
-#define PROXY_BUFSIZE 1024
+#define PROXY_BUFSIZE 4096		/* Most bytes moved per stream and select round */
+#define STREAM_WINDOW 16384		/* Most bytes buffered per stream */
+#ifndef MAX_CONNECTIONS
+#define MAX_CONNECTIONS 32
+#endif
 #define LISTEN_PORT_LOW 20000
 #define LISTEN_PORT_HIGH 29999
 #define PROXY_LIFETIME_SECONDS 60
+#define SHARED_LIFETIME_SECONDS (8 * 3600)	/* Idle time before a shared relay exits */
+#define MAX_CHUNKS 64			/* Most delayed chunks queued per stream */
+#define DEFAULT_STALL_TIME 200
+#define DEFAULT_CAPTURE_SIZE 4096	/* Kilobytes */
+#define DEFAULT_STATS_INTERVAL 10	/* Seconds */
+#define MAX_HTTP_CLIENTS 4
+#define MAX_LISTENERS 16
+#define MAX_CONTROL_CLIENTS 4
+#define MAX_PENDING 32			/* Accepted connections waiting for admission */
+#define ACCEPT_BACKOFF 100		/* Milliseconds a listener rests after accept failed */
+#define ACCEPT_BATCH 64			/* Most connections accepted per listener and round */
+#define HANDOFF_MAGIC 0x33464F48	/* "HOF3" */
+#define HANDOFF_TIMEOUT 10000	/* Milliseconds to wait for a handoff to be confirmed */
+#define PATH_REGISTRY_KEY "Software\\rdpvnclaunch\\PathCache"
+#define DEFAULT_PROBE_TTL 24		/* Hours */
+#define ALIAS_REGISTRY_KEY "Software\\rdpvnclaunch\\RelayAliases"
+#define CONTROL_REGISTRY_KEY "Software\\rdpvnclaunch\\Relay"
+#define CONTROL_KEY_BYTES 16		/* Random bytes in the control key */
+#define MAX_TUNNELS 16
+#define TUNNEL_HEADER_SIZE 8		/* Type, flags, length and stream of a frame */
+#define TUNNEL_BUFSIZE 65536		/* Bytes of frames queued per tunnel before streams wait */
+#define TUNNEL_NONCE_BYTES 16
+#define TUNNEL_DIGEST_BYTES 32		/* SHA-256 */
+#define TUNNEL_MAX_KEY 256
+#define TUNNEL_AUTH_TIMEOUT 10000	/* Milliseconds for a tunnel to authenticate */
+
+/* Control, statistics and probe sockets, plus one for good measure.
+ * The peer endpoint adds its tunnel listener.
+ */
+#if FD_SETSIZE < 2 * MAX_CONNECTIONS + MAX_LISTENERS + MAX_CONTROL_CLIENTS + MAX_HTTP_CLIENTS + MAX_TUNNELS + 5
+#error FD_SETSIZE too small for MAX_CONNECTIONS
+#endif
 
-static struct sockaddr_in connect_addr;
-static struct sockaddr_in proxy_addr;
-static SOCKET listen_sock;
+typedef enum {
+	CONN_UNUSED,
+	CONN_CONNECTING,		/* Waiting for connection to proxy */
+	CONN_HANDSHAKE,			/* Sending SOCKS request, waiting for reply */
+	CONN_RELAYING,
+} conn_state_t;
 
-static char *wsa_errstr (void)
+/* Emulated link characteristics for one direction. */
+typedef struct {
+	int delay;				/* One-way delay in milliseconds */
+	int jitter;				/* Maximum extra random delay in milliseconds */
+	int rate;				/* Bandwidth in kbit/s, 0 for unlimited */
+	int stall;				/* Percentage of chunks held back as if retransmitted */
+	int stall_time;			/* Duration of a stall in milliseconds */
+} link_t;
+
+/* Relay settings that can be reloaded. A connection pins the
+ * configuration that was current when it was accepted, so a reload
+ * only applies to new connections. A replaced configuration is freed
+ * when the last connection using it closes.
+ */
+typedef struct {
+	int refs;				/* Connections using it, plus one while current */
+	bool link_emulation;
+	link_t links[2];		/* Client to proxy, proxy to client */
+} relay_config_t;
+
+typedef struct {
+	int size;				/* Bytes received */
+	int len;				/* Bytes not yet sent */
+	int64_t received;		/* Time when the chunk was received */
+	int64_t due;			/* Time when the chunk may be sent */
+} chunk_t;
+
+typedef struct {
+	char data[STREAM_WINDOW];
+	int start;
+	int len;
+	int ready;				/* Bytes at start that may be sent now */
+	bool eof;				/* Source has closed its side */
+	const link_t *link;		/* NULL unless link emulation is enabled */
+	int64_t link_free;		/* Time when the emulated link is idle */
+	chunk_t chunks[MAX_CHUNKS];
+	int chunk_head;
+	int chunk_count;
+	int chunk_released;		/* Chunks at head that are due */
+	uint32_t retired;		/* Bytes of all chunks sent in full */
+	uint32_t conn_id;
+	uint8_t direction;		/* CAPTURE_UP or CAPTURE_DOWN */
+	conn_stats_t *stats;
+} stream_t;
+
+typedef struct {
+	conn_state_t state;
+	SOCKET client_sock;
+	SOCKET proxy_sock;
+	char request[64];
+	int request_len;
+	int request_sent;
+	char reply[8];
+	int reply_len;
+	stream_t upstream;		/* Client to proxy */
+	stream_t downstream;	/* Proxy to client */
+	conn_stats_t stats;
+	struct listener *listener;
+	relay_config_t *config;
+	struct tunnel *tunnel;	/* Carries the connection in place of a socket, or NULL */
+	uint32_t stream_id;
+	int credit;				/* Bytes the stream may still send over the tunnel */
+	uint32_t granted;		/* Retired bytes of the received stream, as last granted */
+	bool remote_closed;		/* The other end of the tunnel is done with the stream */
+	char target_name[24];	/* At the peer endpoint, address and port of the target */
+} conn_t;
+
+/* A local port that relays connections to one target through one proxy. */
+typedef struct listener {
+	SOCKET sock;
+	struct in_addr addr;	/* Loopback address listened on */
+	uint16_t port;			/* Host byte order */
+	struct sockaddr_in proxy_addr;
+	struct sockaddr_in connect_addr;
+	char target_name[24];	/* Address and port of connect_addr */
+	int64_t paused_until;	/* Not polled before this time after accept failed */
+} listener_t;
+
+/* Frames on a tunnel. Each starts with a header of type, flags (0),
+ * payload length and stream, the last two in network byte order.
+ */
+typedef enum {
+	FRAME_HELLO = 1,		/* Peer endpoint to relay: nonce to authenticate with */
+	FRAME_AUTH,				/* Relay to peer endpoint: SHA-256 of the key and the nonce */
+	FRAME_OPEN,				/* Relay to peer endpoint: target address and port */
+	FRAME_DATA,
+	FRAME_WINDOW,			/* More bytes the receiver of the frame may send */
+	FRAME_CLOSE,			/* The sender of the frame has sent all it will */
+	FRAME_RESET,			/* Peer endpoint to relay: the target failed, with the error */
+} frame_type_t;
+
+typedef enum {
+	TUNNEL_UNUSED,
+	TUNNEL_CONNECTING,		/* Waiting for connection to proxy */
+	TUNNEL_HANDSHAKE,		/* Sending SOCKS request, waiting for reply */
+	TUNNEL_AUTH,			/* Waiting for HELLO, or at the peer endpoint, for AUTH */
+	TUNNEL_OPEN,
+} tunnel_state_t;
+
+/* One connection between the relay and a peer endpoint, carrying the
+ * connections through one proxy as streams.
+ */
+typedef struct tunnel {
+	tunnel_state_t state;
+	SOCKET sock;
+	bool peer;				/* This process is the peer endpoint */
+	struct sockaddr_in proxy_addr;
+	char request[64];
+	int request_len;
+	int request_sent;
+	char reply[8];
+	int reply_len;
+	int64_t started;
+	unsigned char nonce[TUNNEL_NONCE_BYTES];
+	char in[TUNNEL_BUFSIZE];	/* Frames received, the last one possibly in part */
+	int in_len;
+	char *out;				/* Frames not yet sent */
+	int out_start;
+	int out_len;
+	int out_size;
+	uint32_t next_stream;
+	int next_conn;			/* Connection to take data from first */
+} tunnel_t;
+
+/* An accepted connection waiting until it can be served within limits. */
+typedef struct {
+	SOCKET sock;
+	listener_t *listener;
+	int64_t accepted;
+} pending_t;
+
+typedef struct {
+	SOCKET sock;			/* INVALID_SOCKET if unused */
+	char line[128];
+	int len;
+	DWORD pid;				/* Process at the other end */
+} control_client_t;
+
+/* The user of a process, as returned by GetTokenInformation. */
+typedef union {
+	TOKEN_USER user;
+	char buf[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+} token_user_t;
+
+static listener_t listeners[MAX_LISTENERS];
+static int listener_count;
+static uint16_t shared_port;	/* Control port of shared relay, 0 if not shared */
+static bool relay_remote;		/* Connections are served by another process */
+static bool relay_handed_off;	/* Connections were handed off to another process */
+static bool takeover;			/* Take over a running shared relay */
+static bool relay_bypassed;		/* The viewer connects to the target directly */
+static uint32_t probe_timeout;	/* Milliseconds, 0 to not probe direct connects */
+static uint32_t probe_ttl = DEFAULT_PROBE_TTL;
+static char path_key[64];		/* Path cache entry, empty if not probing */
+static SOCKET probe_sock = INVALID_SOCKET;
+static int64_t probe_start;
+static SOCKET control_sock = INVALID_SOCKET;
+static control_client_t control_clients[MAX_CONTROL_CLIENTS];
+static char control_key[CONTROL_KEY_BYTES * 2 + 1];	/* Hex, starts every control request */
+static conn_t conns[MAX_CONNECTIONS];
+static pending_t pending[MAX_PENDING];
+static int pending_head;
+static int pending_count;
+static uint32_t max_conns = MAX_CONNECTIONS;
+static uint32_t max_handshakes = MAX_CONNECTIONS;
+static uint32_t max_buffered;	/* Kilobytes in all streams, 0 for no limit */
+static int64_t queue_time = -1;	/* Microseconds to wait for admission, -1 for no limit */
+static link_t links[2] = {		/* Client to proxy, proxy to client */
+	{ 0, 0, 0, 0, DEFAULT_STALL_TIME },
+	{ 0, 0, 0, 0, DEFAULT_STALL_TIME },
+};
+static bool link_emulation;
+static uint64_t link_random_state = 1;	/* Never 0 */
+static wchar_t *config_path;	/* Reloadable relay options, NULL if none */
+static relay_config_t *config;	/* Current configuration */
+static wchar_t *capture_path;
+static uint32_t capture_size = DEFAULT_CAPTURE_SIZE;
+static uint32_t capture_payload;
+static uint32_t next_conn_id;
+static wchar_t *stats_path;
+static wchar_t *events_path;
+static uint32_t stats_interval = DEFAULT_STATS_INTERVAL;
+static uint16_t stats_port;
+static SOCKET stats_sock = INVALID_SOCKET;
+static SOCKET http_socks[MAX_HTTP_CLIENTS];
+static int64_t clock_freq;
+static tunnel_t tunnels[MAX_TUNNELS];
+static struct sockaddr_in tunnel_addr;	/* Peer endpoint, sin_family 0 if none */
+static wchar_t *tunnel_key_path;
+static char tunnel_key[TUNNEL_MAX_KEY + 1];
+static SOCKET tunnel_listen_sock = INVALID_SOCKET;	/* Only at the peer endpoint */
+static HCRYPTPROV tunnel_prov;	/* For nonces at the peer endpoint */
+
+static int stream_head_pos (const stream_t *stream);
+
+static SOCKET sys_socket (int af, int type, int protocol) { return socket(af, type, protocol); }
+static int sys_bind (SOCKET sock, const struct sockaddr *addr, int addr_len) { return bind(sock, addr, addr_len); }
+static int sys_listen (SOCKET sock, int backlog) { return listen(sock, backlog); }
+static SOCKET sys_accept (SOCKET sock, struct sockaddr *addr, int *addr_len) { return accept(sock, addr, addr_len); }
+static int sys_connect (SOCKET sock, const struct sockaddr *addr, int addr_len) { return connect(sock, addr, addr_len); }
+static int sys_recv (SOCKET sock, char *buf, int len, int flags) { return recv(sock, buf, len, flags); }
+static int sys_send (SOCKET sock, const char *buf, int len, int flags) { return send(sock, buf, len, flags); }
+static int sys_closesocket (SOCKET sock) { return closesocket(sock); }
+static int sys_ioctlsocket (SOCKET sock, long cmd, u_long *arg) { return ioctlsocket(sock, cmd, arg); }
+static int sys_getsockopt (SOCKET sock, int level, int name, char *value, int *value_len) { return getsockopt(sock, level, name, value, value_len); }
+static int sys_setsockopt (SOCKET sock, int level, int name, const char *value, int value_len) { return setsockopt(sock, level, name, value, value_len); }
+static int sys_getsockname (SOCKET sock, struct sockaddr *addr, int *addr_len) { return getsockname(sock, addr, addr_len); }
+static int sys_getpeername (SOCKET sock, struct sockaddr *addr, int *addr_len) { return getpeername(sock, addr, addr_len); }
+static int sys_select (int nfds, fd_set *read_fds, fd_set *write_fds, fd_set *except_fds, const struct timeval *timeout) { return select(nfds, read_fds, write_fds, except_fds, timeout); }
+static int sys_last_error (void) { return WSAGetLastError(); }
+static void sys_set_last_error (int error) { WSASetLastError(error); }
+
+/* sys_now_us:
+ * Return a monotonic timestamp in microseconds.
+ */
+static int64_t
+sys_now_us (void)
 {
-    return system_errstr_error(WSAGetLastError());
+	LARGE_INTEGER count;
+
+	if (clock_freq == 0) {
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		clock_freq = freq.QuadPart;
+	}
+	QueryPerformanceCounter(&count);
+	return count.QuadPart / clock_freq * 1000000 + count.QuadPart % clock_freq * 1000000 / clock_freq;
 }
 
-static int
-full_recv (SOCKET fd, void *buf, int count)
+const net_ops_t winsock_net_ops = {
+	sys_socket, sys_bind, sys_listen, sys_accept, sys_connect, sys_recv, sys_send,
+	sys_closesocket, sys_ioctlsocket, sys_getsockopt, sys_setsockopt, sys_getsockname, sys_getpeername,
+	sys_select, sys_last_error, sys_set_last_error, sys_now_us,
+};
+
+static const net_ops_t *net = &winsock_net_ops;
+
+/* set_proxy_net_ops:
+ * Run the relay on other socket and clock operations, such as the
+ * fault-injecting ones of relaybench or the simulated network of
+ * relaysim. Must be called before prepare_proxy.
+ */
+void
+set_proxy_net_ops (const net_ops_t *ops)
 {
-  int total = 0;
-  char *ptr = (char *) buf;
-  
-  while (count > 0) {
-    int n_rw = recv(fd, ptr, count, 0);
-    if (n_rw == SOCKET_ERROR)
-      break;
-    if (n_rw == 0) {
-      WSASetLastError(0);
-      break;
-    }
-    total += n_rw;
-    ptr += n_rw;
-    count -= n_rw;
-  }
+	net = ops;
+}
 
-  return total;
+/* The select sets are built and searched without FD_SET and FD_ISSET,
+ * which scan the whole set on every call. Each socket is added at most
+ * once per set and round, and the sets returned by select are sorted
+ * and then searched, so that a round stays close to linear in the
+ * number of sockets when the relay is built for many connections.
+ */
+static void
+fd_add (SOCKET sock, fd_set *set)
+{
+	set->fd_array[set->fd_count++] = sock;
 }
 
 static int
-full_send (SOCKET fd, const void *buf, int count)
+compare_sockets (const void *a, const void *b)
 {
-  int total = 0;
-  const char *ptr = (const char *) buf;
-  
-  while (count > 0) {
-    int n_rw = send(fd, ptr, count, 0);
-    if (n_rw == SOCKET_ERROR)
-      break;
-    if (n_rw == 0) {
-      WSASetLastError(WSAENOBUFS);
-      break;
-    }
-    total += n_rw;
-    ptr += n_rw;
-    count -= n_rw;
-  }
+	SOCKET x = *(const SOCKET *) a;
+	SOCKET y = *(const SOCKET *) b;
 
-  return total;
+	return x < y ? -1 : x > y;
+}
+
+static void
+fd_sort (fd_set *set)
+{
+	qsort(set->fd_array, set->fd_count, sizeof(*set->fd_array), compare_sockets);
+}
+
+static bool
+fd_isset (SOCKET sock, fd_set *set)
+{
+	return bsearch(&sock, set->fd_array, set->fd_count, sizeof(*set->fd_array), compare_sockets) != NULL;
+}
+
+static char *wsa_errstr (void)
+{
+    return system_errstr_error(net->last_error());
+}
+
+static int64_t
+now_us (void)
+{
+	return net->now_us();
 }
 
 static bool
@@ -120,159 +415,3221 @@ parse_port (const wchar_t *str, uint16_t *port)
   return true;
 }
 
-uint16_t
-prepare_proxy (const wchar_t *proxy_host, const wchar_t *proxy_port, const wchar_t *connect_host, const wchar_t *connect_port)
+static bool
+parse_endpoint (const wchar_t *str, struct sockaddr_in *addr)
 {
-  struct sockaddr_in listen_addr;
-  WSADATA wsadata;
+	const wchar_t *colon = wcschr(str, ':');
+	wchar_t host[16];
 
-  if (WSAStartup(MAKEWORD(2,2), &wsadata) != 0)
-    die("Cannot initialize socket library: %s\n", wsa_errstr());
+	if (colon == NULL || colon - str >= sizeof(host)/sizeof(*host))
+		return false;
+	wmemcpy(host, str, colon - str);
+	host[colon - str] = '\0';
+	memset(addr, 0, sizeof(*addr));
+	if (!parse_addr(host, &addr->sin_addr) || !parse_port(colon + 1, &addr->sin_port))
+		return false;
+	addr->sin_family = AF_INET;
+	return true;
+}
 
-  if (!parse_addr(proxy_host, &proxy_addr.sin_addr))
-    die("Invalid IP address `%ls'\n", proxy_host);
-  if (!parse_port(proxy_port, &proxy_addr.sin_port))
-    die("Invalid port `%ls'\n", proxy_port);
-  proxy_addr.sin_family = AF_INET;
-  if (!parse_addr(connect_host, &connect_addr.sin_addr))
-    die("Invalid IP address `%ls'\n", connect_host);
-  if (!parse_port(connect_port, &connect_addr.sin_port))
-    die("Invalid port `%ls'\n", connect_port);
+static bool
+option_name_is (const wchar_t *option, size_t namelen, const wchar_t *name)
+{
+	return wcslen(name) == namelen && wcsncmp(option, name, namelen) == 0;
+}
 
-  /*warn("proxy=%ls:%ls connect=%ls:%ls\n", proxy_host, proxy_port, connect_host, connect_port);*/
+static bool
+parse_uint (const wchar_t *str, uint32_t min, uint32_t max, uint32_t *value)
+{
+	wchar_t *tail;
+	unsigned long result;
+
+	if (*str < '0' || *str > '9')
+		return false;
+	errno = 0;
+	result = wcstoul(str, &tail, 10);
+	if (*tail != '\0' || errno == ERANGE || result < min || result > max)
+		return false;
+	*value = result;
+	return true;
+}
+
+/* Times are limited so that they still fit in an int as microseconds. */
+static const struct {
+	const wchar_t *name;
+	size_t offset;
+	uint32_t max;
+} link_options[] = {
+	{ L"delay", offsetof(link_t, delay), 600000 },
+	{ L"jitter", offsetof(link_t, jitter), 600000 },
+	{ L"rate", offsetof(link_t, rate), INT32_MAX },
+	{ L"stall", offsetof(link_t, stall), 100 },
+	{ L"stall-time", offsetof(link_t, stall_time), 600000 },
+};
+
+/* Parse "UP[/DOWN]", each from 0 to max, into the given field of both
+ * link directions.
+ */
+static bool
+parse_link_value (link_t *link, const wchar_t *str, size_t offset, uint32_t max)
+{
+	const wchar_t *slash = wcschr(str, '/');
+	wchar_t upstr[16];
+	uint32_t up;
+	uint32_t down;
+
+	if (slash == NULL) {
+		if (!parse_uint(str, 0, max, &up))
+			return false;
+		down = up;
+	} else {
+		if (slash - str >= sizeof(upstr)/sizeof(*upstr))
+			return false;
+		wmemcpy(upstr, str, slash - str);
+		upstr[slash - str] = '\0';
+		if (!parse_uint(upstr, 0, max, &up) || !parse_uint(slash + 1, 0, max, &down))
+			return false;
+	}
+	*(int *) ((char *) &link[0] + offset) = up;
+	*(int *) ((char *) &link[1] + offset) = down;
+	return true;
+}
+
+/* set_proxy_option:
+ * Set a relay option specified as NAME=VALUE. Values that differ per
+ * direction are given as UP/DOWN, where up is from viewer to server.
+ */
+void
+set_proxy_option (const wchar_t *option)
+{
+	const wchar_t *value;
+	size_t namelen;
+
+	value = wcschr(option, '=');
+	if (value == NULL)
+		die("Invalid relay option `%ls', expected NAME=VALUE\n", option);
+	namelen = value - option;
+	value++;
+
+	for (int c = 0; c < sizeof(link_options)/sizeof(*link_options); c++) {
+		if (option_name_is(option, namelen, link_options[c].name)) {
+			if (!parse_link_value(links, value, link_options[c].offset, link_options[c].max))
+				die("Invalid value for relay option `%ls'\n", option);
+			link_emulation = true;
+			return;
+		}
+	}
+	if (option_name_is(option, namelen, L"capture")) {
+		free(capture_path);
+		capture_path = xwcsdup(value);
+	} else if (option_name_is(option, namelen, L"capture-size")) {
+		if (!parse_uint(value, 1, UINT32_MAX / 1024, &capture_size))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"capture-payload")) {
+		if (!parse_uint(value, 0, CAPTURE_MAX_PAYLOAD, &capture_payload))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"stats")) {
+		free(stats_path);
+		stats_path = xwcsdup(value);
+	} else if (option_name_is(option, namelen, L"shared")) {
+		if (!parse_port(value, &shared_port))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"config")) {
+		free(config_path);
+		config_path = xwcsdup(value);
+	} else if (option_name_is(option, namelen, L"takeover")) {
+		takeover = wcscmp(value, L"0") != 0;
+	} else if (option_name_is(option, namelen, L"events")) {
+		free(events_path);
+		events_path = xwcsdup(value);
+	} else if (option_name_is(option, namelen, L"stats-interval")) {
+		if (!parse_uint(value, 1, 86400, &stats_interval))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"direct-probe")) {
+		if (!parse_uint(value, 1, 60000, &probe_timeout))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"direct-probe-ttl")) {
+		if (!parse_uint(value, 1, 24 * 365, &probe_ttl))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"max-conns")) {
+		if (!parse_uint(value, 1, MAX_CONNECTIONS, &max_conns))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"max-handshakes")) {
+		if (!parse_uint(value, 1, MAX_CONNECTIONS, &max_handshakes))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"max-buffered")) {
+		if (!parse_uint(value, 0, UINT32_MAX / 1024, &max_buffered))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"queue-time")) {
+		uint32_t ms;
+		if (!parse_uint(value, 0, 3600000, &ms))
+			die("Invalid value for relay option `%ls'\n", option);
+		queue_time = ms * (int64_t) 1000;
+	} else if (option_name_is(option, namelen, L"lag-warn")) {
+		uint32_t ms;
+		if (!parse_uint(value, 1, 3600000, &ms))
+			die("Invalid value for relay option `%ls'\n", option);
+		stats_lag_warn = ms * 1000;
+	} else if (option_name_is(option, namelen, L"stats-port")) {
+		if (!parse_port(value, &stats_port))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"tunnel")) {
+		if (!parse_endpoint(value, &tunnel_addr))
+			die("Invalid value for relay option `%ls'\n", option);
+	} else if (option_name_is(option, namelen, L"tunnel-key")) {
+		free(tunnel_key_path);
+		tunnel_key_path = xwcsdup(value);
+	} else {
+		die("Unknown relay option `%ls'\n", option);
+	}
+}
+
+/* load_config:
+ * Return a new configuration made from the relay options on the command
+ * line and the link emulation options in config_path, one NAME=VALUE
+ * per line. Empty lines and lines starting with # are ignored. On error
+ * NULL is returned and *error is set to a message.
+ */
+static relay_config_t *
+load_config (char **error)
+{
+	relay_config_t *new_config;
+	wchar_t *line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+	FILE *fp;
+
+	new_config = xmalloc(sizeof(*new_config));
+	new_config->refs = 1;
+	new_config->link_emulation = link_emulation;
+	memcpy(new_config->links, links, sizeof(links));
+	if (config_path == NULL)
+		return new_config;
+
+	fp = _wfopen(config_path, L"r");
+	if (fp == NULL) {
+		*error = xasprintf("Cannot open `%ls': %s", config_path, errno_errstr());
+		free(new_config);
+		return NULL;
+	}
+	*error = NULL;
+	while (*error == NULL && wgetline(&line, &size, fp) >= 0) {
+		const wchar_t *value;
+		size_t namelen;
+		int c;
+
+		lineno++;
+		chomp_string(line);
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		value = wcschr(line, '=');
+		if (value == NULL) {
+			*error = xasprintf("%ls:%d: Expected NAME=VALUE", config_path, lineno);
+			break;
+		}
+		namelen = value - line;
+		value++;
+		for (c = 0; c < sizeof(link_options)/sizeof(*link_options); c++) {
+			if (option_name_is(line, namelen, link_options[c].name))
+				break;
+		}
+		if (c >= sizeof(link_options)/sizeof(*link_options))
+			*error = xasprintf("%ls:%d: Unknown or not reloadable relay option", config_path, lineno);
+		else if (!parse_link_value(new_config->links, value, link_options[c].offset, link_options[c].max))
+			*error = xasprintf("%ls:%d: Invalid value", config_path, lineno);
+		else
+			new_config->link_emulation = true;
+	}
+	if (*error == NULL && ferror(fp))
+		*error = xasprintf("Cannot read `%ls': %s", config_path, errno_errstr());
+	fclose(fp); /* Ignore errors */
+	free(line);
+
+	if (*error != NULL) {
+		free(new_config);
+		return NULL;
+	}
+	return new_config;
+}
+
+static relay_config_t *
+config_acquire (void)
+{
+	config->refs++;
+	return config;
+}
+
+static void
+config_release (relay_config_t *old_config)
+{
+	if (--old_config->refs == 0) {
+		free(old_config);
+		relay_stats.configs_pinned--;
+	}
+}
+
+/* reload_config:
+ * Read config_path again and make the result the current configuration.
+ * The previous one stays pinned until its connections have closed.
+ * Returns NULL on success, or an error message that the caller frees.
+ */
+static char *
+reload_config (void)
+{
+	int64_t start = now_us();
+	relay_config_t *old_config = config;
+	relay_config_t *new_config;
+	char *error;
+
+	new_config = load_config(&error);
+	if (new_config == NULL)
+		return error;
+	config = new_config;
+	if (--old_config->refs == 0)
+		free(old_config);
+	else
+		relay_stats.configs_pinned++;
+	relay_stats.reloads++;
+	relay_stats.reload_time = now_us() - start;
+	return NULL;
+}
+
+/* lookup_alias:
+ * Find the loopback address and port that connections to connect_addr
+ * are relayed on. Each target gets its own address in 127.0.0.0/8 and
+ * its own port, derived from a hash of the target and kept in the
+ * registry, so that the viewer's per-server settings and caches stay
+ * valid across launches. Returns false if the registry is unavailable.
+ */
+static bool
+lookup_alias (const struct sockaddr_in *connect_addr, struct sockaddr_in *alias)
+{
+	char target_name[24];
+	char alias_name[24];
+	unsigned a, b, c, d, port;
+	uint32_t hash = 2166136261u;
+	DWORD size;
+	HKEY key;
+
+	snprintf(target_name, sizeof(target_name), "%s:%u", inet_ntoa(connect_addr->sin_addr), ntohs(connect_addr->sin_port));
+	if (RegCreateKeyEx(HKEY_CURRENT_USER, ALIAS_REGISTRY_KEY, 0, NULL, REG_OPTION_NON_VOLATILE, KEY_ALL_ACCESS, NULL, &key, NULL) != ERROR_SUCCESS)
+		return false;
+
+	size = sizeof(alias_name) - 1;
+	if (RegQueryValueEx(key, target_name, NULL, NULL, (BYTE *) alias_name, &size) != ERROR_SUCCESS) {
+		for (const char *p = target_name; *p != '\0'; p++)
+			hash = (hash ^ (uint8_t) *p) * 16777619u;
+
+		/* Probe until the alias is not taken by another target. */
+		for (;;) {
+			char value_name[24];
+			char value[24];
+			bool taken = false;
+
+			a = (hash >> 16) & 0xFF;
+			b = (hash >> 8) & 0xFF;
+			c = 1 + hash % 254;
+			port = LISTEN_PORT_LOW + (hash >> 8) % (LISTEN_PORT_HIGH - LISTEN_PORT_LOW + 1);
+			snprintf(alias_name, sizeof(alias_name), "127.%u.%u.%u:%u", a, b, c, port);
+			for (DWORD index = 0; !taken; index++) {
+				DWORD name_size = sizeof(value_name);
+				DWORD value_size = sizeof(value) - 1;
+
+				if (RegEnumValue(key, index, value_name, &name_size, NULL, NULL, (BYTE *) value, &value_size) != ERROR_SUCCESS)
+					break;
+				value[value_size] = '\0';
+				taken = strcmp(value, alias_name) == 0;
+			}
+			if (!taken && !(a == 0 && b == 0 && c == 1))
+				break;
+			hash = hash * 16777619u + 1;
+		}
+		if (RegSetValueEx(key, target_name, 0, REG_SZ, (BYTE *) alias_name, strlen(alias_name) + 1) != ERROR_SUCCESS) {
+			RegCloseKey(key); /* Ignore errors */
+			return false;
+		}
+		size = strlen(alias_name) + 1;
+	}
+	RegCloseKey(key); /* Ignore errors */
+	alias_name[size] = '\0';
+
+	if (sscanf(alias_name, "%u.%u.%u.%u:%u", &a, &b, &c, &d, &port) != 5
+			|| a != 127 || b > 255 || c > 255 || d > 255 || port == 0 || port > UINT16_MAX)
+		return false;
+	memset(alias, 0, sizeof(*alias));
+	alias->sin_family = AF_INET;
+	alias->sin_addr.s_addr = htonl(a << 24 | b << 16 | c << 8 | d);
+	alias->sin_port = htons(port);
+	return true;
+}
+
+/* path_cache_key:
+ * Make the registry value name for the path to connect_addr from the
+ * current network location, identified by the local address that
+ * routes to the target.
+ */
+static bool
+path_cache_key (const struct sockaddr_in *connect_addr, char *key, size_t size)
+{
+	struct sockaddr_in local_addr;
+	int addr_len = sizeof(local_addr);
+	char target_name[24];
+	SOCKET sock;
+	bool ok;
+
+	/* Connecting a datagram socket selects a route without sending. */
+	sock = net->socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == INVALID_SOCKET)
+		return false;
+	ok = net->connect(sock, (const struct sockaddr *) connect_addr, sizeof(*connect_addr)) == 0
+		&& net->getsockname(sock, (struct sockaddr *) &local_addr, &addr_len) == 0;
+	net->closesocket(sock); /* Ignore errors */
+	if (!ok)
+		return false;
+	snprintf(target_name, sizeof(target_name), "%s:%u", inet_ntoa(connect_addr->sin_addr), ntohs(connect_addr->sin_port));
+	snprintf(key, size, "%s from %s", target_name, inet_ntoa(local_addr.sin_addr));
+	return true;
+}
+
+/* lookup_path:
+ * Return the path cached for path_key, or PATH_UNKNOWN if there is
+ * none or it has expired. Values are "PATH EXPIRES DIRECT-RTT PROXY-RTT"
+ * with the expiry time in seconds since 1970 and times in microseconds.
+ */
+static path_t
+lookup_path (void)
+{
+	char value[64];
+	char path[8];
+	long long expires, direct_rtt, proxy_rtt;
+	DWORD size = sizeof(value) - 1;
+	DWORD error;
+	HKEY key;
+
+	if (RegOpenKeyEx(HKEY_CURRENT_USER, PATH_REGISTRY_KEY, 0, KEY_QUERY_VALUE, &key) != ERROR_SUCCESS)
+		return PATH_UNKNOWN;
+	error = RegQueryValueEx(key, path_key, NULL, NULL, (BYTE *) value, &size);
+	RegCloseKey(key); /* Ignore errors */
+	if (error != ERROR_SUCCESS)
+		return PATH_UNKNOWN;
+	value[size] = '\0';
+	if (sscanf(value, "%7s %lld %lld %lld", path, &expires, &direct_rtt, &proxy_rtt) != 4 || expires <= time(NULL))
+		return PATH_UNKNOWN;
+	relay_stats.direct_rtt = direct_rtt;
+	relay_stats.proxy_rtt = proxy_rtt;
+	if (strcmp(path, "direct") == 0)
+		return PATH_DIRECT;
+	if (strcmp(path, "proxy") == 0)
+		return PATH_PROXY;
+	return PATH_UNKNOWN;
+}
+
+static void
+store_path (void)
+{
+	char *value;
+	HKEY key;
+
+	if (RegCreateKeyEx(HKEY_CURRENT_USER, PATH_REGISTRY_KEY, 0, NULL, REG_OPTION_NON_VOLATILE, KEY_ALL_ACCESS, NULL, &key, NULL) != ERROR_SUCCESS)
+		return;
+	value = xasprintf("%s %lld %lld %lld", relay_stats.path == PATH_DIRECT ? "direct" : "proxy",
+		(long long) time(NULL) + probe_ttl * 3600LL, (long long) relay_stats.direct_rtt, (long long) relay_stats.proxy_rtt);
+	RegSetValueEx(key, path_key, 0, REG_SZ, (BYTE *) value, strlen(value) + 1); /* Ignore errors */
+	RegCloseKey(key); /* Ignore errors */
+	free(value);
+}
+
+/* Bind sock to listen_addr, or to the first free port in the listen port
+ * range on the same address if that port is taken. Returns the port in
+ * host byte order, or 0 if the address cannot be used.
+ */
+static uint16_t
+bind_listener (SOCKET sock, struct sockaddr_in *listen_addr)
+{
+  uint16_t port;
+
+  if (listen_addr->sin_port != 0) {
+    if (net->bind(sock, (struct sockaddr *) listen_addr, sizeof(*listen_addr)) == 0)
+      return ntohs(listen_addr->sin_port);
+    if (net->last_error() != WSAEADDRINUSE)
+      return 0;
+  }
+  for (port = LISTEN_PORT_LOW; port <= LISTEN_PORT_HIGH; port++) {
+    listen_addr->sin_port = htons(port);
+    if (net->bind(sock, (struct sockaddr *) listen_addr, sizeof(*listen_addr)) == 0)
+      return port;
+    if (net->last_error() != WSAEADDRINUSE)
+      return 0;
+  }
+  die("No free port found\n");
+}
+
+static listener_t *
+add_listener (const struct sockaddr_in *proxy_addr, const struct sockaddr_in *connect_addr)
+{
+  struct sockaddr_in listen_addr;
+  listener_t *listener;
+  u_long nonblock = 1;
+  uint16_t port;
+
+  /* Reuse a warm listener for a repeated target. */
+  for (int c = 0; c < listener_count; c++) {
+    listener = &listeners[c];
+    if (listener->proxy_addr.sin_addr.s_addr == proxy_addr->sin_addr.s_addr
+        && listener->proxy_addr.sin_port == proxy_addr->sin_port
+        && listener->connect_addr.sin_addr.s_addr == connect_addr->sin_addr.s_addr
+        && listener->connect_addr.sin_port == connect_addr->sin_port)
+      return listener;
+  }
+  if (listener_count >= MAX_LISTENERS)
+    return NULL;
 
-  listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_sock == INVALID_SOCKET)
+  listener = &listeners[listener_count];
+  listener->proxy_addr = *proxy_addr;
+  listener->connect_addr = *connect_addr;
+  snprintf(listener->target_name, sizeof(listener->target_name), "%s:%u", inet_ntoa(connect_addr->sin_addr), ntohs(connect_addr->sin_port));
+
+  listener->sock = net->socket(AF_INET, SOCK_STREAM, 0);
+  if (listener->sock == INVALID_SOCKET)
     die("Cannot create socket: %s\n", wsa_errstr());
   /*BOOL sockopt = TRUE;
-  if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, (char *) &sockopt, sizeof(sockopt)) != 0)
+  if (net->setsockopt(listener->sock, SOL_SOCKET, SO_REUSEADDR, (char *) &sockopt, sizeof(sockopt)) != 0)
     die("Cannot enable socket reuse: %s\n", wsa_errstr());
   sockopt = TRUE;
-  if (setsockopt(listen_sock, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *) &sockopt, sizeof(sockopt)) != 0)
+  if (net->setsockopt(listener->sock, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *) &sockopt, sizeof(sockopt)) != 0)
     die("Cannot enable socket exclusiveness: %s\n", wsa_errstr());*/
-  listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  listen_addr.sin_family = AF_INET;
-
-  uint16_t port;
-  for (port = LISTEN_PORT_LOW; port <= LISTEN_PORT_HIGH; port++) {
-    listen_addr.sin_port = htons(port);
-    if (bind(listen_sock, (struct sockaddr *) &listen_addr, sizeof(listen_addr)) == 0)
-        break;
-    if (WSAGetLastError() != WSAEADDRINUSE)
-        die("Cannot bind to address %ls port %d: %s\n", L"127.0.0.1", port, wsa_errstr());
+  port = 0;
+  if (lookup_alias(connect_addr, &listen_addr))
+    port = bind_listener(listener->sock, &listen_addr);
+  if (port == 0) {
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_addr.sin_family = AF_INET;
+    port = bind_listener(listener->sock, &listen_addr);
+    if (port == 0)
+      die("Cannot bind to address %ls port %d: %s\n", L"127.0.0.1", ntohs(listen_addr.sin_port), wsa_errstr());
   }
-  if (port > LISTEN_PORT_HIGH)
-    die("No free port found\n");
-  if (listen(listen_sock, 1) != 0)
+  if (net->listen(listener->sock, SOMAXCONN) != 0)
     die("Cannot listen for connections: %s\n", wsa_errstr());
+  if (net->ioctlsocket(listener->sock, FIONBIO, &nonblock) != 0)
+    die("Cannot make socket non-blocking: %s\n", wsa_errstr());
 
-  return port;
+  listener->addr = listen_addr.sin_addr;
+  listener->port = port;
+  listener_count++;
+  return listener;
 }
 
-void
-handle_proxy (void)
+/* Load the key that every control request starts with, creating a
+ * random one the first time. It is kept in the registry under
+ * HKEY_CURRENT_USER, which other users cannot read.
+ */
+static void
+load_control_key (void)
 {
-    char data[PROXY_BUFSIZE];
-    int data_len;
-    int write_len;
-    SOCKET client_sock;
-    SOCKET proxy_sock;
-    fd_set read_fds;
-	int rc;
+	unsigned char random[CONTROL_KEY_BYTES];
+	DWORD size = sizeof(control_key);
+	HCRYPTPROV prov;
+	LONG error;
+	HKEY key;
 
-	/* XXX: handle multiple concurrent connections.
-	 * SOCKET client_socks[MAX_CONCURRENT_CONNECTION];
-	 * SOCKET proxy_socks[MAX_CONCURRENT_CONNECTION];
-	 * use INVALID_SOCKET for unused connections
-	 * shut down listen socket when there are no connections and
-	 * no new connections have been made in PROXY_LIFETIME_SECONDS seconds.
-	 */
-	for (;;) {
-		struct timeval timeout = { PROXY_LIFETIME_SECONDS, 0 };
+	if (control_key[0] != '\0')
+		return;
+	error = RegCreateKeyEx(HKEY_CURRENT_USER, CONTROL_REGISTRY_KEY, 0, NULL, REG_OPTION_NON_VOLATILE, KEY_ALL_ACCESS, NULL, &key, NULL);
+	if (error != ERROR_SUCCESS)
+		die("Cannot open registry key `%s': %s\n", CONTROL_REGISTRY_KEY, system_errstr_error(error));
+	error = RegQueryValueEx(key, "ControlKey", NULL, NULL, (BYTE *) control_key, &size);
+	if (error != ERROR_SUCCESS || size != sizeof(control_key) || control_key[sizeof(control_key) - 1] != '\0'
+			|| strspn(control_key, "0123456789abcdef") != sizeof(control_key) - 1) {
+		if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT)
+				|| !CryptGenRandom(prov, sizeof(random), random))
+			die("Cannot generate relay control key: %s\n", system_errstr());
+		CryptReleaseContext(prov, 0); /* Ignore errors */
+		for (int c = 0; c < CONTROL_KEY_BYTES; c++)
+			snprintf(control_key + c * 2, 3, "%02x", random[c]);
+		error = RegSetValueEx(key, "ControlKey", 0, REG_SZ, (BYTE *) control_key, sizeof(control_key));
+		if (error != ERROR_SUCCESS)
+			die("Cannot write registry key `%s': %s\n", CONTROL_REGISTRY_KEY, system_errstr_error(error));
+	}
+	RegCloseKey(key); /* Ignore errors */
+}
 
-		FD_ZERO(&read_fds);
-		FD_SET(listen_sock, &read_fds);
-		if ((rc = select(0, &read_fds, NULL, NULL, &timeout)) == SOCKET_ERROR)
-			die ("Cannot wait for input: %s\n", wsa_errstr());
-		if (rc == 0)
-			break;
+/* Return whether line starts with the control key and a space. All of
+ * the key is compared so that the time taken reveals nothing.
+ */
+static bool
+check_control_key (const char *line)
+{
+	unsigned char diff = 0;
 
-		client_sock = accept(listen_sock, NULL, NULL);
-		if (client_sock == INVALID_SOCKET)
-			die("Cannot accept connection: %s\n", wsa_errstr());
-
-		proxy_sock = socket(AF_INET, SOCK_STREAM, 0);
-		if (proxy_sock == INVALID_SOCKET)
-			die("Cannot create socket: %s\n", wsa_errstr());
-		if (connect(proxy_sock, (struct sockaddr *) &proxy_addr, sizeof(proxy_addr)) != 0)
-			die("Cannot connect to proxy: %s\n", wsa_errstr());
-
-		data[0] = 0x04;
-		data[1] = 0x01;
-		data[2] = connect_addr.sin_port & 0xFF;
-		data[3] = connect_addr.sin_port >> 8;
-		data[4] = connect_addr.sin_addr.s_addr & 0xFF;
-		data[5] = (connect_addr.sin_addr.s_addr >> 8) & 0xFF;
-		data[6] = (connect_addr.sin_addr.s_addr >> 16) & 0xFF;
-		data[7] = connect_addr.sin_addr.s_addr >> 24;
-		data_len = 8 + strlen(program_name) + 1;
-		memcpy(data + 8, program_name, data_len - 8);
-
-		write_len = full_send(proxy_sock, data, data_len);
-		if (write_len < 0)
-			die("Cannot write to proxy: %s\n", strerror(errno));
-		if (write_len < data_len)
-			die("Connection to proxy unexpectedly closed\n");
-
-		data_len = full_recv(proxy_sock, data, 8);
-		if (data_len < 0)
-			die("Cannot read from proxy: %s\n", strerror(errno));
-		if (data_len < 8)
-			die("Connection to proxy unexpectedly closed\n");
-		if (data[0] != 0)
-			die("Invalid response from proxy\n");
-		if (data[1] != 0x5A)
-			die("Proxy actively denied request\n");
+	for (int c = 0; c < sizeof(control_key) - 1; c++)
+		diff |= line[c] ^ control_key[c];
+	return diff == 0 && line[sizeof(control_key) - 1] == ' ';
+}
 
-		for (;;) {
-			FD_ZERO(&read_fds);
-			FD_SET(client_sock, &read_fds);
-			FD_SET(proxy_sock, &read_fds);
-
-			if (select(FD_SETSIZE, &read_fds, NULL, NULL, NULL) == SOCKET_ERROR)
-				die ("Cannot wait for input: %s\n", wsa_errstr());
-			if (FD_ISSET(client_sock, &read_fds)) {
-				data_len = recv(client_sock, data, sizeof(data), 0);
-				if (data_len == SOCKET_ERROR)
-					die("Cannot read from client: %s\n", wsa_errstr());
-				if (data_len == 0)
-					break;
-				write_len = full_send(proxy_sock, data, data_len);
-				if (write_len < 0)
-					die("Cannot write to proxy: %s\n", strerror(errno));
-				if (write_len < data_len)
-					die("Connection to proxy unexpectedly closed\n");
-			}
-			if (FD_ISSET(proxy_sock, &read_fds)) {
-				data_len = recv(proxy_sock, data, sizeof(data), 0);
-				if (data_len == SOCKET_ERROR)
-					die("Cannot read from proxy: %s\n", wsa_errstr());
-				if (data_len == 0)
-					break;
-				write_len = full_send(client_sock, data, data_len);
-				if (write_len < 0)
-					die("Cannot write to client: %s\n", strerror(errno));
-				if (write_len < data_len)
-					die("Connection to client unexpectedly closed\n");
+/* Load the key shared with the peer endpoint: the first line of
+ * tunnel_key_path, which should be readable by its user only.
+ */
+static void
+load_tunnel_key (void)
+{
+	wchar_t *line = NULL;
+	size_t size = 0;
+	size_t len;
+	FILE *fp;
+
+	if (tunnel_key_path == NULL)
+		die("Relay option `tunnel-key' is required for tunnels\n");
+	fp = _wfopen(tunnel_key_path, L"r");
+	if (fp == NULL)
+		die("Cannot open `%ls': %s\n", tunnel_key_path, errno_errstr());
+	if (wgetline(&line, &size, fp) < 0) {
+		if (ferror(fp))
+			die("Cannot read `%ls': %s\n", tunnel_key_path, errno_errstr());
+		die("No tunnel key in `%ls'\n", tunnel_key_path);
+	}
+	fclose(fp); /* Ignore errors */
+	chomp_string(line);
+	len = wcstombs(tunnel_key, line, sizeof(tunnel_key));
+	if (len == 0 || len == (size_t) -1 || len >= sizeof(tunnel_key))
+		die("Invalid tunnel key in `%ls'\n", tunnel_key_path);
+	free(line);
+}
+
+/* Store SHA-256 of the tunnel key and nonce in digest. A relay proves
+ * with it that it has the key, without revealing the key to whoever
+ * answers in place of the peer endpoint.
+ */
+static bool
+tunnel_digest (const unsigned char *nonce, unsigned char *digest)
+{
+	DWORD len = TUNNEL_DIGEST_BYTES;
+	HCRYPTPROV prov;
+	HCRYPTHASH hash;
+	bool ok;
+
+	if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT))
+		return false;
+	ok = CryptCreateHash(prov, CALG_SHA_256, 0, 0, &hash);
+	if (ok) {
+		ok = CryptHashData(hash, (BYTE *) tunnel_key, strlen(tunnel_key), 0)
+			&& CryptHashData(hash, nonce, TUNNEL_NONCE_BYTES, 0)
+			&& CryptGetHashParam(hash, HP_HASHVAL, digest, &len, 0);
+		CryptDestroyHash(hash); /* Ignore errors */
+	}
+	CryptReleaseContext(prov, 0); /* Ignore errors */
+	return ok;
+}
+
+static bool
+get_process_user (HANDLE process, token_user_t *user)
+{
+	HANDLE token;
+	DWORD len;
+	BOOL ok;
+
+	if (!OpenProcessToken(process, TOKEN_QUERY, &token))
+		return false;
+	ok = GetTokenInformation(token, TokenUser, user, sizeof(*user), &len);
+	CloseHandle(token); /* Ignore errors */
+	return ok;
+}
+
+/* Return whether process pid runs as the same user as this process. */
+static bool
+same_user_process (DWORD pid)
+{
+	token_user_t own;
+	token_user_t other;
+	HANDLE process;
+	bool same;
+
+	process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+	if (process == NULL)
+		return false;
+	same = get_process_user(GetCurrentProcess(), &own) && get_process_user(process, &other)
+		&& EqualSid(own.user.User.Sid, other.user.User.Sid);
+	CloseHandle(process); /* Ignore errors */
+	return same;
+}
+
+/* Return whether process pid runs a program that may take over the
+ * relay: a launcher, or the same program as this process.
+ */
+static bool
+launcher_process (DWORD pid)
+{
+	static const wchar_t *const launchers[] = { L"rdplaunch.exe", L"vnclaunch.exe" };
+	wchar_t own_path[MAX_PATH];
+	wchar_t path[MAX_PATH];
+	DWORD size = MAX_PATH;
+	const wchar_t *name;
+	const wchar_t *own_name;
+	HANDLE process;
+	BOOL ok;
+
+	process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+	if (process == NULL)
+		return false;
+	ok = QueryFullProcessImageNameW(process, 0, path, &size);
+	CloseHandle(process); /* Ignore errors */
+	if (!ok || GetModuleFileNameW(NULL, own_path, MAX_PATH) == 0)
+		return false;
+	name = wcsrchr(path, '\\') != NULL ? wcsrchr(path, '\\') + 1 : path;
+	own_name = wcsrchr(own_path, '\\') != NULL ? wcsrchr(own_path, '\\') + 1 : own_path;
+	if (_wcsicmp(name, own_name) == 0)
+		return true;
+	for (int c = 0; c < sizeof(launchers)/sizeof(*launchers); c++) {
+		if (_wcsicmp(name, launchers[c]) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Return the process at the other end of a connection accepted on the
+ * control port, or 0 if it cannot be found in the TCP connection table.
+ */
+static DWORD
+control_peer_pid (SOCKET sock)
+{
+	struct sockaddr_in peer;
+	struct sockaddr_in local;
+	int addr_len;
+	MIB_TCPTABLE_OWNER_PID *table = NULL;
+	DWORD size = 0;
+	DWORD pid = 0;
+	DWORD error;
+
+	addr_len = sizeof(peer);
+	if (net->getpeername(sock, (struct sockaddr *) &peer, &addr_len) != 0)
+		return 0;
+	addr_len = sizeof(local);
+	if (net->getsockname(sock, (struct sockaddr *) &local, &addr_len) != 0)
+		return 0;
+	/* The table may grow between calls. */
+	while ((error = GetExtendedTcpTable(table, &size, FALSE, AF_INET, TCP_TABLE_OWNER_PID_CONNECTIONS, 0)) == ERROR_INSUFFICIENT_BUFFER) {
+		free(table);
+		table = xmalloc(size);
+	}
+	if (error == NO_ERROR) {
+		for (DWORD c = 0; c < table->dwNumEntries; c++) {
+			MIB_TCPROW_OWNER_PID *row = &table->table[c];
+
+			if (row->dwLocalAddr == peer.sin_addr.s_addr && (uint16_t) row->dwLocalPort == peer.sin_port
+					&& row->dwRemoteAddr == local.sin_addr.s_addr && (uint16_t) row->dwRemotePort == local.sin_port) {
+				pid = row->dwOwningPid;
+				break;
 			}
 		}
-
-		if (closesocket(client_sock) != 0)
-			die("Cannot close client connection: %s\n", wsa_errstr());
-		if (closesocket(proxy_sock) != 0)
-			die("Cannot close proxy connection: %s\n", wsa_errstr());
 	}
+	free(table);
+	return pid;
+}
 
-	if (closesocket(listen_sock) != 0)
-		die("Cannot close client connection: %s\n", wsa_errstr());
+static uint32_t
+hash_bytes (uint32_t hash, const void *data, size_t len)
+{
+	for (size_t c = 0; c < len; c++)
+		hash = (hash ^ ((const uint8_t *) data)[c]) * 16777619u;
+	return hash;
+}
+
+static uint32_t
+hash_path (uint32_t hash, const wchar_t *path)
+{
+	if (path == NULL)
+		return hash_bytes(hash, "", 1);
+	return hash_bytes(hash, path, (wcslen(path) + 1) * sizeof(wchar_t));
+}
+
+/* Return a hash of the relay options that a shared relay applies to all
+ * launches it serves, so that a launch can tell whether the running
+ * relay was started with the same ones.
+ */
+static uint32_t
+options_hash (void)
+{
+	uint32_t hash = 2166136261u;
+
+	hash = hash_bytes(hash, links, sizeof(links));
+	hash = hash_bytes(hash, &link_emulation, sizeof(link_emulation));
+	hash = hash_path(hash, config_path);
+	hash = hash_path(hash, capture_path);
+	hash = hash_bytes(hash, &capture_size, sizeof(capture_size));
+	hash = hash_bytes(hash, &capture_payload, sizeof(capture_payload));
+	hash = hash_path(hash, stats_path);
+	hash = hash_path(hash, events_path);
+	hash = hash_bytes(hash, &stats_interval, sizeof(stats_interval));
+	hash = hash_bytes(hash, &stats_port, sizeof(stats_port));
+	hash = hash_bytes(hash, &stats_lag_warn, sizeof(stats_lag_warn));
+	hash = hash_bytes(hash, &max_conns, sizeof(max_conns));
+	hash = hash_bytes(hash, &max_handshakes, sizeof(max_handshakes));
+	hash = hash_bytes(hash, &max_buffered, sizeof(max_buffered));
+	hash = hash_bytes(hash, &queue_time, sizeof(queue_time));
+	hash = hash_bytes(hash, &tunnel_addr, sizeof(tunnel_addr));
+	hash = hash_path(hash, tunnel_key_path);
+	return hash;
+}
+
+/* Ask a shared relay already running on shared_port for a listener.
+ * Returns the port of the listener, or 0 if no shared relay is running.
+ * The relay options of this launch are not used then; if they differ
+ * from those of the shared relay, the user is told.
+ */
+static uint16_t
+request_shared_listener (const struct sockaddr_in *proxy_addr, const struct sockaddr_in *connect_addr, struct in_addr *listen_addr)
+{
+  struct sockaddr_in addr;
+  char proxy_name[16];
+  char listen_name[16];
+  char reply[128];
+  char *request;
+  SOCKET sock;
+  int len = 0;
+  unsigned port;
+  unsigned hash;
+
+  sock = net->socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET)
+    die("Cannot create socket: %s\n", wsa_errstr());
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = shared_port;
+  if (net->connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    if (net->last_error() != WSAECONNREFUSED)
+      die("Cannot connect to shared relay: %s\n", wsa_errstr());
+    net->closesocket(sock);
+    return 0;
+  }
+
+  load_control_key();
+  snprintf(proxy_name, sizeof(proxy_name), "%s", inet_ntoa(proxy_addr->sin_addr));
+  request = xasprintf("%s LISTEN %s %u %s %u\n", control_key, proxy_name, ntohs(proxy_addr->sin_port), inet_ntoa(connect_addr->sin_addr), ntohs(connect_addr->sin_port));
+  if (net->send(sock, request, strlen(request), 0) != strlen(request))
+    die("Cannot write to shared relay: %s\n", wsa_errstr());
+  free(request);
+
+  while (len < sizeof(reply) - 1 && memchr(reply, '\n', len) == NULL) {
+    int n = net->recv(sock, reply + len, sizeof(reply) - 1 - len, 0);
+    if (n == SOCKET_ERROR)
+      die("Cannot read from shared relay: %s\n", wsa_errstr());
+    if (n == 0)
+      break;
+    len += n;
+  }
+  reply[len] = '\0';
+  net->closesocket(sock); /* Ignore errors */
+
+  if (sscanf(reply, "OK %u", &port) != 1 || port == 0 || port > UINT16_MAX)
+    die("Shared relay refused request: %s\n", reply);
+  /* Relays without loopback aliases only reply with the port. */
+  listen_addr->s_addr = htonl(INADDR_LOOPBACK);
+  if (sscanf(reply, "OK %*u %15s", listen_name) == 1 && inet_addr(listen_name) != INADDR_NONE)
+    listen_addr->s_addr = inet_addr(listen_name);
+  if (sscanf(reply, "OK %*u %*15s %x", &hash) == 1 && hash != options_hash())
+    warn("The shared relay on port %d uses other relay options than this launch. Give takeover=1 to restart it with the options of this launch.\n", ntohs(shared_port));
+  return port;
+}
+
+/* Become the shared relay by listening on the control port. If another
+ * process got there first, this relay simply stays private.
+ */
+static void
+open_control_listener (void)
+{
+  struct sockaddr_in addr;
+  u_long nonblock = 1;
+
+  for (int c = 0; c < MAX_CONTROL_CLIENTS; c++)
+    control_clients[c].sock = INVALID_SOCKET;
+  control_sock = net->socket(AF_INET, SOCK_STREAM, 0);
+  if (control_sock == INVALID_SOCKET)
+    die("Cannot create socket: %s\n", wsa_errstr());
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = shared_port;
+  if (net->bind(control_sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    if (net->last_error() != WSAEADDRINUSE)
+      die("Cannot bind to address %ls port %d: %s\n", L"127.0.0.1", ntohs(shared_port), wsa_errstr());
+    net->closesocket(control_sock);
+    control_sock = INVALID_SOCKET;
+    return;
+  }
+  if (net->listen(control_sock, MAX_CONTROL_CLIENTS) != 0)
+    die("Cannot listen for connections: %s\n", wsa_errstr());
+  if (net->ioctlsocket(control_sock, FIONBIO, &nonblock) != 0)
+    die("Cannot make socket non-blocking: %s\n", wsa_errstr());
+  load_control_key();
+}
+
+/* A relay hands its sockets to a new process as a header, the
+ * listeners, the connections and the connections waiting for admission.
+ * Each connection is followed, upstream then downstream, by its queued
+ * chunks and the data they cover, starting with the part of the head
+ * chunk already sent. Times are relative to the handoff. Sockets are
+ * passed as protocol info from WSADuplicateSocket. The new process
+ * confirms with "OK\n" once it has taken everything over.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t listener_count;
+	uint32_t conn_count;
+	uint32_t pending_count;
+	uint32_t next_conn_id;
+	WSAPROTOCOL_INFOW control_sock;
+} handoff_header_t;
+
+typedef struct {
+	WSAPROTOCOL_INFOW sock;
+	uint16_t port;
+	struct sockaddr_in proxy_addr;
+	struct sockaddr_in connect_addr;
+} handoff_listener_t;
+
+typedef struct {
+	int32_t sent;				/* Bytes of the head chunk already sent */
+	int32_t len;				/* Bytes not yet sent */
+	int32_t ready;
+	int32_t chunk_count;
+	int32_t chunk_released;
+	int64_t link_free;
+	uint8_t eof;
+} handoff_stream_t;
+
+typedef struct {
+	WSAPROTOCOL_INFOW client_sock;
+	WSAPROTOCOL_INFOW proxy_sock;
+	uint32_t state;
+	uint32_t listener;
+	uint32_t id;
+	char request[64];
+	int32_t request_len;
+	int32_t request_sent;
+	char reply[8];
+	int32_t reply_len;
+	handoff_stream_t stream[2];	/* Upstream and downstream */
+} handoff_conn_t;
+
+typedef struct {
+	int32_t size;
+	int32_t len;
+	int64_t received;
+	int64_t due;
+} handoff_chunk_t;
+
+typedef struct {
+	WSAPROTOCOL_INFOW sock;
+	uint32_t listener;
+	int64_t accepted;
+} handoff_pending_t;
+
+static int
+full_recv (SOCKET fd, void *buf, int count)
+{
+  int total = 0;
+  char *ptr = (char *) buf;
+  
+  while (count > 0) {
+    int n_rw = net->recv(fd, ptr, count, 0);
+    if (n_rw == SOCKET_ERROR)
+      break;
+    if (n_rw == 0) {
+      net->set_last_error(0);
+      break;
+    }
+    total += n_rw;
+    ptr += n_rw;
+    count -= n_rw;
+  }
+
+  return total;
+}
+
+static int
+full_send (SOCKET fd, const void *buf, int count)
+{
+  int total = 0;
+  const char *ptr = (const char *) buf;
+  
+  while (count > 0) {
+    int n_rw = net->send(fd, ptr, count, 0);
+    if (n_rw == SOCKET_ERROR)
+      break;
+    if (n_rw == 0) {
+      net->set_last_error(WSAENOBUFS);
+      break;
+    }
+    total += n_rw;
+    ptr += n_rw;
+    count -= n_rw;
+  }
+
+  return total;
+}
+
+static bool
+handoff_send (SOCKET fd, const void *buf, int count)
+{
+	return full_send(fd, buf, count) == count;
+}
+
+static bool
+handoff_recv (SOCKET fd, void *buf, int count)
+{
+	return full_recv(fd, buf, count) == count;
+}
+
+static bool
+duplicate_socket (SOCKET sock, DWORD pid, WSAPROTOCOL_INFOW *info)
+{
+	return WSADuplicateSocketW(sock, pid, info) == 0;
+}
+
+/* Describe why a handoff failed, which may be that the other process
+ * closed the connection.
+ */
+static const char *
+handoff_errstr (void)
+{
+	if (net->last_error() == 0)
+		return "The other process closed the connection.";
+	return wsa_errstr();
+}
+
+/* Returns INVALID_SOCKET if the socket cannot be taken over. */
+static SOCKET
+restore_socket (WSAPROTOCOL_INFOW *info)
+{
+	u_long nonblock = 1;
+	SOCKET sock;
+
+	sock = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, info, 0, 0);
+	if (sock == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	if (net->ioctlsocket(sock, FIONBIO, &nonblock) != 0) {
+		int error = net->last_error();
+
+		net->closesocket(sock); /* Ignore errors */
+		net->set_last_error(error);
+		return INVALID_SOCKET;
+	}
+	return sock;
+}
+
+/* Describe a stream for a handoff, with times relative to now. */
+static void
+describe_stream (const stream_t *stream, int64_t now, handoff_stream_t *info)
+{
+	info->sent = stream->start - stream_head_pos(stream);
+	info->len = stream->len;
+	info->ready = stream->ready;
+	info->chunk_count = stream->chunk_count;
+	info->chunk_released = stream->chunk_released;
+	info->link_free = stream->link_free - now;
+	info->eof = stream->eof;
+}
+
+static bool
+send_stream (SOCKET fd, const stream_t *stream, int64_t now)
+{
+	int pos = stream_head_pos(stream);
+
+	for (int c = 0; c < stream->chunk_count; c++) {
+		const chunk_t *chunk = &stream->chunks[(stream->chunk_head + c) % MAX_CHUNKS];
+		handoff_chunk_t info;
+
+		info.size = chunk->size;
+		info.len = chunk->len;
+		info.received = chunk->received - now;
+		info.due = chunk->due - now;
+		if (!handoff_send(fd, &info, sizeof(info)))
+			return false;
+	}
+	return handoff_send(fd, stream->data + pos, stream->start - pos + stream->len);
+}
+
+/* Restore a stream described by info from a handoff, keeping the
+ * schedule of its chunks. Without link emulation in this process, the
+ * chunks still held back are released at once. Returns an error
+ * message if the stream cannot be restored.
+ */
+static const char *
+receive_stream (SOCKET fd, stream_t *stream, const handoff_stream_t *info, int64_t now)
+{
+	int total = 0;
+
+	if (info->sent < 0 || info->sent > STREAM_WINDOW || info->len < 0 || info->len > STREAM_WINDOW - info->sent
+			|| info->chunk_count < 0 || info->chunk_count > MAX_CHUNKS
+			|| info->chunk_released < 0 || info->chunk_released > info->chunk_count
+			|| info->ready < 0 || info->ready > info->len)
+		return "Invalid handoff from shared relay";
+	for (int c = 0; c < info->chunk_count; c++) {
+		chunk_t *chunk = &stream->chunks[c];
+		handoff_chunk_t chunk_info;
+
+		if (!handoff_recv(fd, &chunk_info, sizeof(chunk_info)))
+			return handoff_errstr();
+		if (chunk_info.size < 0 || chunk_info.size > STREAM_WINDOW || chunk_info.len < 0 || chunk_info.len > chunk_info.size
+				|| (c > 0 && chunk_info.len != chunk_info.size))
+			return "Invalid handoff from shared relay";
+		chunk->size = chunk_info.size;
+		chunk->len = chunk_info.len;
+		chunk->received = now + chunk_info.received;
+		chunk->due = now + chunk_info.due;
+		total += chunk->len;
+	}
+	if (total != info->len || (info->chunk_count > 0 ? stream->chunks[0].size - stream->chunks[0].len : 0) != info->sent)
+		return "Invalid handoff from shared relay";
+	if (!handoff_recv(fd, stream->data, info->sent + info->len))
+		return handoff_errstr();
+	stream->start = info->sent;
+	stream->len = info->len;
+	stream->ready = info->ready;
+	stream->chunk_head = 0;
+	stream->chunk_count = info->chunk_count;
+	stream->chunk_released = info->chunk_released;
+	stream->link_free = now + info->link_free;
+	stream->eof = info->eof;
+	if (stream->link == NULL) {
+		stream->ready = stream->len;
+		stream->chunk_released = stream->chunk_count;
+	}
+	return NULL;
+}
+
+/* Hand all sockets and buffered data over to process pid through the
+ * control connection fd. Nothing is read from the sockets in between,
+ * so no data is lost. The relay loop only stops once the new process
+ * has confirmed that it took everything over; if the handoff fails
+ * before that, this relay warns and keeps serving as if nothing had
+ * happened, and the new process refuses to take over. Closing the
+ * sockets after a handoff only closes this process's descriptors.
+ */
+static bool
+hand_off_relay (SOCKET fd, DWORD pid)
+{
+	handoff_header_t header;
+	u_long nonblock = 0;
+	DWORD timeout = HANDOFF_TIMEOUT;
+	int64_t now = now_us();
+	char ack[3];
+
+	if (net->ioctlsocket(fd, FIONBIO, &nonblock) != 0
+			|| net->setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) != 0)
+		goto failed;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = HANDOFF_MAGIC;
+	header.listener_count = listener_count;
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		if (conns[c].state != CONN_UNUSED)
+			header.conn_count++;
+	}
+	header.pending_count = pending_count;
+	header.next_conn_id = next_conn_id;
+	if (!duplicate_socket(control_sock, pid, &header.control_sock)
+			|| !handoff_send(fd, &header, sizeof(header)))
+		goto failed;
+
+	for (int c = 0; c < listener_count; c++) {
+		handoff_listener_t info;
+
+		memset(&info, 0, sizeof(info));
+		if (!duplicate_socket(listeners[c].sock, pid, &info.sock))
+			goto failed;
+		info.port = listeners[c].port;
+		info.proxy_addr = listeners[c].proxy_addr;
+		info.connect_addr = listeners[c].connect_addr;
+		if (!handoff_send(fd, &info, sizeof(info)))
+			goto failed;
+	}
+
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		conn_t *conn = &conns[c];
+		stream_t *streams[2] = { &conn->upstream, &conn->downstream };
+		handoff_conn_t info;
+
+		if (conn->state == CONN_UNUSED)
+			continue;
+		memset(&info, 0, sizeof(info));
+		if (!duplicate_socket(conn->client_sock, pid, &info.client_sock)
+				|| !duplicate_socket(conn->proxy_sock, pid, &info.proxy_sock))
+			goto failed;
+		info.state = conn->state;
+		info.listener = conn->listener - listeners;
+		info.id = conn->stats.id;
+		memcpy(info.request, conn->request, sizeof(info.request));
+		info.request_len = conn->request_len;
+		info.request_sent = conn->request_sent;
+		memcpy(info.reply, conn->reply, sizeof(info.reply));
+		info.reply_len = conn->reply_len;
+		for (int d = 0; d < 2; d++)
+			describe_stream(streams[d], now, &info.stream[d]);
+		if (!handoff_send(fd, &info, sizeof(info)))
+			goto failed;
+		for (int d = 0; d < 2; d++) {
+			if (!send_stream(fd, streams[d], now))
+				goto failed;
+		}
+	}
+
+	for (int c = 0; c < pending_count; c++) {
+		pending_t *entry = &pending[(pending_head + c) % MAX_PENDING];
+		handoff_pending_t info;
+
+		memset(&info, 0, sizeof(info));
+		if (!duplicate_socket(entry->sock, pid, &info.sock))
+			goto failed;
+		info.listener = entry->listener - listeners;
+		info.accepted = entry->accepted - now;
+		if (!handoff_send(fd, &info, sizeof(info)))
+			goto failed;
+	}
+
+	if (!handoff_recv(fd, ack, sizeof(ack)))
+		goto failed;
+	if (memcmp(ack, "OK\n", sizeof(ack)) != 0) {
+		net->set_last_error(0);
+		goto failed;
+	}
+	relay_handed_off = true;
+	return true;
+
+failed:
+	relay_stats.handoffs_failed++;
+	warn_in_background("Cannot hand off the shared relay to process %lu: %s\nThis relay keeps serving its connections.\n",
+		pid, handoff_errstr());
+	return false;
+}
+
+/* Undo a takeover that could not be completed: close every socket taken
+ * over so far and leave the tables empty, as they were before.
+ */
+static void
+abandon_takeover (void)
+{
+	if (control_sock != INVALID_SOCKET)
+		net->closesocket(control_sock); /* Ignore errors */
+	control_sock = INVALID_SOCKET;
+	for (int c = 0; c < listener_count; c++) {
+		if (listeners[c].sock != INVALID_SOCKET)
+			net->closesocket(listeners[c].sock); /* Ignore errors */
+	}
+	listener_count = 0;
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		conn_t *conn = &conns[c];
+
+		if (conn->state == CONN_UNUSED)
+			continue;
+		if (conn->client_sock != INVALID_SOCKET)
+			net->closesocket(conn->client_sock); /* Ignore errors */
+		if (conn->proxy_sock != INVALID_SOCKET)
+			net->closesocket(conn->proxy_sock); /* Ignore errors */
+		config_release(conn->config);
+		conn->state = CONN_UNUSED;
+	}
+	for (int c = 0; c < pending_count; c++)
+		net->closesocket(pending[c].sock); /* Ignore errors */
+	pending_head = 0;
+	pending_count = 0;
+	next_conn_id = 0;
+	relay_stats.connections = 0;
+	relay_stats.active = 0;
+	relay_stats.queued = 0;
+}
+
+/* Take over the shared relay on shared_port, including its control
+ * port, listeners and connections. Returns false if no shared relay
+ * is running, or if the takeover failed; then nothing is taken over,
+ * and the shared relay keeps serving since it was not told to stop.
+ */
+static bool
+take_over_relay (void)
+{
+	struct sockaddr_in addr;
+	struct sockaddr_in listen_addr;
+	int addr_len;
+	handoff_header_t header;
+	const char *error = NULL;
+	char *request;
+	SOCKET sock;
+	int64_t now;
+	int len;
+
+	sock = net->socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET)
+		die("Cannot create socket: %s\n", wsa_errstr());
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = shared_port;
+	if (net->connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		if (net->last_error() != WSAECONNREFUSED)
+			die("Cannot connect to shared relay: %s\n", wsa_errstr());
+		net->closesocket(sock);
+		return false;
+	}
+
+	load_control_key();
+	request = xasprintf("%s HANDOFF %lu\n", control_key, GetCurrentProcessId());
+	if (!handoff_send(sock, request, strlen(request)))
+		die("Cannot write to shared relay: %s\n", wsa_errstr());
+	free(request);
+
+	len = full_recv(sock, &header, sizeof(header));
+	for (int c = 0; c < MAX_CONTROL_CLIENTS; c++)
+		control_clients[c].sock = INVALID_SOCKET;
+	if (len >= 4 && memcmp(&header, "ERR ", 4) == 0) {
+		static char reason[sizeof(header)];
+
+		/* Such as while the relay has open tunnels. */
+		memcpy(reason, (char *) &header + 4, len - 4);
+		reason[len - 4] = '\0';
+		reason[strcspn(reason, "\n")] = '\0';
+		error = reason;
+		goto refused;
+	}
+	if (len != sizeof(header)) {
+		error = handoff_errstr();
+		goto refused;
+	}
+	if (header.magic != HANDOFF_MAGIC || header.listener_count > MAX_LISTENERS
+			|| header.conn_count > MAX_CONNECTIONS || header.pending_count > MAX_PENDING) {
+		error = "Invalid handoff from shared relay";
+		goto refused;
+	}
+	if ((control_sock = restore_socket(&header.control_sock)) == INVALID_SOCKET) {
+		error = handoff_errstr();
+		goto refused;
+	}
+	next_conn_id = header.next_conn_id;
+
+	for (int c = 0; c < header.listener_count; c++) {
+		listener_t *listener = &listeners[c];
+		handoff_listener_t info;
+
+		if (!handoff_recv(sock, &info, sizeof(info)) || (listener->sock = restore_socket(&info.sock)) == INVALID_SOCKET) {
+			error = handoff_errstr();
+			goto refused;
+		}
+		listener_count++;
+		listener->addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr_len = sizeof(listen_addr);
+		if (net->getsockname(listener->sock, (struct sockaddr *) &listen_addr, &addr_len) == 0)
+			listener->addr = listen_addr.sin_addr;
+		listener->port = info.port;
+		listener->proxy_addr = info.proxy_addr;
+		listener->connect_addr = info.connect_addr;
+		snprintf(listener->target_name, sizeof(listener->target_name), "%s:%u", inet_ntoa(info.connect_addr.sin_addr), ntohs(info.connect_addr.sin_port));
+	}
+
+	now = now_us();
+	for (int c = 0; c < header.conn_count; c++) {
+		conn_t *conn = &conns[c];
+		stream_t *streams[2] = { &conn->upstream, &conn->downstream };
+		handoff_conn_t info;
+
+		if (!handoff_recv(sock, &info, sizeof(info))) {
+			error = handoff_errstr();
+			goto refused;
+		}
+		if (info.listener >= listener_count || info.request_len > sizeof(conn->request)
+				|| info.reply_len > sizeof(conn->reply)
+				|| (info.state != CONN_CONNECTING && info.state != CONN_HANDSHAKE && info.state != CONN_RELAYING)) {
+			error = "Invalid handoff from shared relay";
+			goto refused;
+		}
+		memset(conn, 0, sizeof(*conn));
+		conn->state = info.state;
+		conn->config = config_acquire();
+		conn->client_sock = restore_socket(&info.client_sock);
+		conn->proxy_sock = conn->client_sock != INVALID_SOCKET ? restore_socket(&info.proxy_sock) : INVALID_SOCKET;
+		if (conn->proxy_sock == INVALID_SOCKET) {
+			error = handoff_errstr();
+			goto refused;
+		}
+		conn->listener = &listeners[info.listener];
+		memcpy(conn->request, info.request, sizeof(conn->request));
+		conn->request_len = info.request_len;
+		conn->request_sent = info.request_sent;
+		memcpy(conn->reply, info.reply, sizeof(conn->reply));
+		conn->reply_len = info.reply_len;
+		conn->stats.id = info.id;
+		conn->stats.target = conn->listener->target_name;
+		conn->stats.phase_time[PHASE_ACCEPT] = now;
+		conn->stats.event_written = true;
+		for (int d = 0; d < 2; d++) {
+			streams[d]->conn_id = info.id;
+			streams[d]->direction = d;
+			streams[d]->stats = &conn->stats;
+			if (conn->config->link_emulation)
+				streams[d]->link = &conn->config->links[d];
+			if ((error = receive_stream(sock, streams[d], &info.stream[d], now)) != NULL)
+				goto refused;
+		}
+		relay_stats.connections++;
+		relay_stats.active++;
+	}
+
+	for (int c = 0; c < header.pending_count; c++) {
+		handoff_pending_t info;
+
+		if (!handoff_recv(sock, &info, sizeof(info))) {
+			error = handoff_errstr();
+			goto refused;
+		}
+		if (info.listener >= listener_count) {
+			error = "Invalid handoff from shared relay";
+			goto refused;
+		}
+		if ((pending[c].sock = restore_socket(&info.sock)) == INVALID_SOCKET) {
+			error = handoff_errstr();
+			goto refused;
+		}
+		pending[c].listener = &listeners[info.listener];
+		pending[c].accepted = now + info.accepted;
+		pending_count++;
+	}
+	pending_head = 0;
+	relay_stats.queued = pending_count;
+
+	/* The shared relay stops serving once it has this. */
+	if (!handoff_send(sock, "OK\n", 3)) {
+		error = handoff_errstr();
+		goto refused;
+	}
+	net->closesocket(sock); /* Ignore errors */
+	return true;
+
+refused:
+	warn("Cannot take over the shared relay: %s\nUsing it as it is instead.\n", error);
+	abandon_takeover();
+	net->closesocket(sock); /* Ignore errors */
+	return false;
+}
+
+static wchar_t *
+format_addr (struct in_addr addr)
+{
+  uint32_t value = ntohl(addr.s_addr);
+
+  return xaswprintf(L"%u.%u.%u.%u", value >> 24, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF);
+}
+
+/* prepare_proxy:
+ * Set up a local listener relaying to connect_host through the SOCKS
+ * proxy, and return its port. The loopback address of the listener is
+ * stored in listen_host. With a shared relay, the listener may live in
+ * another process, in which case handle_proxy does nothing.
+ */
+uint16_t
+prepare_proxy (const wchar_t *proxy_host, const wchar_t *proxy_port, const wchar_t *connect_host, const wchar_t *connect_port, wchar_t **listen_host)
+{
+  struct in_addr listen_addr;
+  struct sockaddr_in proxy_addr;
+  struct sockaddr_in connect_addr;
+  listener_t *listener;
+  WSADATA wsadata;
+  uint16_t port;
+
+  if (WSAStartup(MAKEWORD(2,2), &wsadata) != 0)
+    die("Cannot initialize socket library: %s\n", wsa_errstr());
+
+  memset(&proxy_addr, 0, sizeof(proxy_addr));
+  memset(&connect_addr, 0, sizeof(connect_addr));
+  if (!parse_addr(proxy_host, &proxy_addr.sin_addr))
+    die("Invalid IP address `%ls'\n", proxy_host);
+  if (!parse_port(proxy_port, &proxy_addr.sin_port))
+    die("Invalid port `%ls'\n", proxy_port);
+  proxy_addr.sin_family = AF_INET;
+  if (!parse_addr(connect_host, &connect_addr.sin_addr))
+    die("Invalid IP address `%ls'\n", connect_host);
+  if (!parse_port(connect_port, &connect_addr.sin_port))
+    die("Invalid port `%ls'\n", connect_port);
+  connect_addr.sin_family = AF_INET;
+
+  /*warn("proxy=%ls:%ls connect=%ls:%ls\n", proxy_host, proxy_port, connect_host, connect_port);*/
+
+  if (config == NULL) {
+    char *error;
+
+    config = load_config(&error);
+    if (config == NULL)
+      die("%s\n", error);
+  }
+  if (tunnel_addr.sin_family != 0 && tunnel_key[0] == '\0')
+    load_tunnel_key();
+
+  /* Connect directly if an earlier probe from this network found the
+   * target faster to reach without the proxy.
+   */
+  if (probe_timeout != 0 && shared_port == 0 && path_cache_key(&connect_addr, path_key, sizeof(path_key))) {
+    relay_stats.path = lookup_path();
+    if (relay_stats.path == PATH_DIRECT) {
+      relay_bypassed = true;
+      *listen_host = xwcsdup(connect_host);
+      return ntohs(connect_addr.sin_port);
+    }
+    relay_stats.path_cached = relay_stats.path == PATH_PROXY;
+    if (!relay_stats.path_cached) {
+      relay_stats.direct_rtt = 0;
+      relay_stats.proxy_rtt = 0;
+    }
+  }
+
+  /* If a takeover fails, the shared relay is used as it is. */
+  if (shared_port != 0 && !(takeover && take_over_relay())) {
+    if ((port = request_shared_listener(&proxy_addr, &connect_addr, &listen_addr)) != 0) {
+      relay_remote = true;
+      *listen_host = format_addr(listen_addr);
+      return port;
+    }
+    open_control_listener();
+  }
+
+  listener = add_listener(&proxy_addr, &connect_addr);
+  *listen_host = format_addr(listener->addr);
+  return listener->port;
+}
+
+/* prepare_tunnel_peer:
+ * Make this process a peer endpoint: accept tunnels from relays on
+ * listen_host and listen_port, and connect the streams they carry to
+ * their targets. handle_proxy then serves until the process is ended.
+ */
+void
+prepare_tunnel_peer (const wchar_t *listen_host, const wchar_t *listen_port)
+{
+	struct sockaddr_in addr;
+	u_long nonblock = 1;
+	WSADATA wsadata;
+
+	if (WSAStartup(MAKEWORD(2,2), &wsadata) != 0)
+		die("Cannot initialize socket library: %s\n", wsa_errstr());
+	memset(&addr, 0, sizeof(addr));
+	if (!parse_addr(listen_host, &addr.sin_addr))
+		die("Invalid IP address `%ls'\n", listen_host);
+	if (!parse_port(listen_port, &addr.sin_port))
+		die("Invalid port `%ls'\n", listen_port);
+	addr.sin_family = AF_INET;
+
+	if (config == NULL) {
+		char *error;
+
+		config = load_config(&error);
+		if (config == NULL)
+			die("%s\n", error);
+	}
+	load_tunnel_key();
+	if (!CryptAcquireContext(&tunnel_prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+		die("Cannot acquire cryptographic context: %s\n", system_errstr());
+
+	tunnel_listen_sock = net->socket(AF_INET, SOCK_STREAM, 0);
+	if (tunnel_listen_sock == INVALID_SOCKET)
+		die("Cannot create socket: %s\n", wsa_errstr());
+	if (net->bind(tunnel_listen_sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		die("Cannot bind to address %ls port %ls: %s\n", listen_host, listen_port, wsa_errstr());
+	if (net->listen(tunnel_listen_sock, SOMAXCONN) != 0)
+		die("Cannot listen for connections: %s\n", wsa_errstr());
+	if (net->ioctlsocket(tunnel_listen_sock, FIONBIO, &nonblock) != 0)
+		die("Cannot make socket non-blocking: %s\n", wsa_errstr());
+}
+
+/* Handle a control request from another launcher. Each request starts
+ * with the control key and a space, followed by one of:
+ *   LISTEN PROXY-ADDR PROXY-PORT TARGET-ADDR TARGET-PORT
+ * The reply is "OK PORT ADDR OPTIONS-HASH" or "ERR MESSAGE".
+ *   HANDOFF PID
+ * The reply is the state of the relay, see hand_off_relay, to be
+ * confirmed by the other launcher.
+ *   RELOAD
+ * The reply is "OK" or "ERR MESSAGE".
+ */
+static void
+handle_control_request (control_client_t *client)
+{
+	struct sockaddr_in proxy_addr;
+	struct sockaddr_in connect_addr;
+	listener_t *listener = NULL;
+	char proxy_name[16];
+	char connect_name[16];
+	unsigned proxy_port;
+	unsigned connect_port;
+	unsigned long pid;
+	const char *request;
+	char *reply;
+
+	if (!check_control_key(client->line)) {
+		reply = xasprintf("ERR Not authorized\n");
+		net->send(client->sock, reply, strlen(reply), 0); /* Ignore errors */
+		free(reply);
+		return;
+	}
+	request = client->line + sizeof(control_key);
+
+	if (sscanf(request, "HANDOFF %lu", &pid) == 1) {
+		/* Only the requesting launcher itself may take the sockets. */
+		if (pid != client->pid || !launcher_process(pid)) {
+			reply = xasprintf("ERR Not authorized\n");
+			net->send(client->sock, reply, strlen(reply), 0); /* Ignore errors */
+			free(reply);
+			return;
+		}
+		/* A tunnel's streams cannot be handed over like sockets. */
+		for (int c = 0; c < MAX_TUNNELS; c++) {
+			if (tunnels[c].state != TUNNEL_UNUSED) {
+				reply = xasprintf("ERR The relay has open tunnels\n");
+				net->send(client->sock, reply, strlen(reply), 0); /* Ignore errors */
+				free(reply);
+				return;
+			}
+		}
+		hand_off_relay(client->sock, pid);
+		return;
+	}
+	if (strncmp(request, "RELOAD\n", 7) == 0 || strncmp(request, "RELOAD\r\n", 8) == 0) {
+		char *error = reload_config();
+
+		if (error != NULL) {
+			reply = xasprintf("ERR %s\n", error);
+			free(error);
+		} else {
+			reply = xasprintf("OK\n");
+		}
+		net->send(client->sock, reply, strlen(reply), 0); /* Ignore errors */
+		free(reply);
+		return;
+	}
+
+	memset(&proxy_addr, 0, sizeof(proxy_addr));
+	memset(&connect_addr, 0, sizeof(connect_addr));
+	if (sscanf(request, "LISTEN %15s %u %15s %u", proxy_name, &proxy_port, connect_name, &connect_port) == 4
+			&& proxy_port <= UINT16_MAX && connect_port <= UINT16_MAX
+			&& (proxy_addr.sin_addr.s_addr = inet_addr(proxy_name)) != INADDR_NONE
+			&& (connect_addr.sin_addr.s_addr = inet_addr(connect_name)) != INADDR_NONE) {
+		proxy_addr.sin_family = AF_INET;
+		proxy_addr.sin_port = htons(proxy_port);
+		connect_addr.sin_family = AF_INET;
+		connect_addr.sin_port = htons(connect_port);
+		listener = add_listener(&proxy_addr, &connect_addr);
+		if (listener != NULL)
+			reply = xasprintf("OK %u %s %08x\n", listener->port, inet_ntoa(listener->addr), options_hash());
+		else
+			reply = xasprintf("ERR No free listener\n");
+	} else {
+		reply = xasprintf("ERR Invalid request\n");
+	}
+	net->send(client->sock, reply, strlen(reply), 0); /* Ignore errors */
+	free(reply);
+}
+
+static void
+handle_control_clients (fd_set *read_fds)
+{
+	for (int c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+		control_client_t *client = &control_clients[c];
+		int len;
+
+		if (client->sock == INVALID_SOCKET || !fd_isset(client->sock, read_fds))
+			continue;
+		len = net->recv(client->sock, client->line + client->len, sizeof(client->line) - 1 - client->len, 0);
+		if (len == SOCKET_ERROR && net->last_error() == WSAEWOULDBLOCK)
+			continue;
+		if (len > 0) {
+			client->len += len;
+			client->line[client->len] = '\0';
+			if (strchr(client->line, '\n') != NULL)
+				handle_control_request(client);
+			else if (client->len < sizeof(client->line) - 1)
+				continue;
+		}
+		net->closesocket(client->sock); /* Ignore errors */
+		client->sock = INVALID_SOCKET;
+	}
+
+	if (!relay_handed_off && fd_isset(control_sock, read_fds)) {
+		for (int c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+			if (control_clients[c].sock == INVALID_SOCKET) {
+				control_clients[c].sock = net->accept(control_sock, NULL, NULL);
+				control_clients[c].len = 0;
+				if (control_clients[c].sock == INVALID_SOCKET)
+					break;
+				/* Other users may reach the port but not the relay. */
+				control_clients[c].pid = control_peer_pid(control_clients[c].sock);
+				if (control_clients[c].pid == 0 || !same_user_process(control_clients[c].pid)) {
+					net->closesocket(control_clients[c].sock); /* Ignore errors */
+					control_clients[c].sock = INVALID_SOCKET;
+				}
+				break;
+			}
+		}
+	}
+}
+
+static void
+put32 (unsigned char *buf, uint32_t value)
+{
+	buf[0] = value >> 24;
+	buf[1] = (value >> 16) & 0xFF;
+	buf[2] = (value >> 8) & 0xFF;
+	buf[3] = value & 0xFF;
+}
+
+static uint32_t
+get32 (const unsigned char *buf)
+{
+	return (uint32_t) buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+/* Queue a frame to be sent on the tunnel. The buffer grows as needed,
+ * but data is only framed while less than TUNNEL_BUFSIZE is queued.
+ */
+static void
+tunnel_queue (tunnel_t *tunnel, frame_type_t type, uint32_t stream_id, const void *payload, int len)
+{
+	unsigned char *frame;
+
+	if (tunnel->out_start + tunnel->out_len + TUNNEL_HEADER_SIZE + len > tunnel->out_size) {
+		memmove(tunnel->out, tunnel->out + tunnel->out_start, tunnel->out_len);
+		tunnel->out_start = 0;
+		if (tunnel->out_len + TUNNEL_HEADER_SIZE + len > tunnel->out_size) {
+			tunnel->out_size = (tunnel->out_len + TUNNEL_HEADER_SIZE + len) * 2;
+			tunnel->out = xrealloc(tunnel->out, tunnel->out_size);
+		}
+	}
+	frame = (unsigned char *) tunnel->out + tunnel->out_start + tunnel->out_len;
+	frame[0] = type;
+	frame[1] = 0;
+	frame[2] = len >> 8;
+	frame[3] = len & 0xFF;
+	put32(frame + 4, stream_id);
+	if (len > 0)
+		memcpy(frame + TUNNEL_HEADER_SIZE, payload, len);
+	tunnel->out_len += TUNNEL_HEADER_SIZE + len;
+}
+
+static void
+close_connection (conn_t *conn)
+{
+	/* Tell the other end of the tunnel, unless it closed the stream
+	 * first or never heard of it. The peer endpoint tells the relay why
+	 * the target could not be reached.
+	 */
+	if (conn->tunnel != NULL && !conn->remote_closed && (conn->tunnel->peer || conn->state != CONN_CONNECTING)) {
+		if (conn->tunnel->peer && conn->stats.failure != NULL) {
+			unsigned char error[4];
+
+			put32(error, conn->stats.error);
+			tunnel_queue(conn->tunnel, FRAME_RESET, conn->stream_id, error, sizeof(error));
+		} else {
+			tunnel_queue(conn->tunnel, FRAME_CLOSE, conn->stream_id, NULL, 0);
+		}
+	}
+	if (conn->client_sock != INVALID_SOCKET)
+		net->closesocket(conn->client_sock); /* Ignore errors */
+	if (conn->proxy_sock != INVALID_SOCKET)
+		net->closesocket(conn->proxy_sock); /* Ignore errors */
+	conn->state = CONN_UNUSED;
+	relay_stats.active--;
+	stats_write_event(&conn->stats);
+	config_release(conn->config);
+}
+
+/* Return the next number of an xorshift64 generator for link emulation.
+ * rand() has too few bits for jitter in microseconds.
+ */
+static uint64_t
+link_random (void)
+{
+	link_random_state ^= link_random_state << 13;
+	link_random_state ^= link_random_state >> 7;
+	link_random_state ^= link_random_state << 17;
+	return link_random_state;
+}
+
+/* Queue a chunk just read into the stream. With link emulation the chunk
+ * becomes due after the emulated delay. Chunks are released in order, so
+ * a stalled chunk holds back the ones behind it just as a TCP
+ * retransmission would. Without link emulation it is due immediately.
+ */
+static void
+stream_queue (stream_t *stream, int len, int64_t now)
+{
+	const link_t *link = stream->link;
+	int64_t due = now;
+	chunk_t *chunk;
+
+	/* Only data from a tunnel can arrive with every chunk slot taken,
+	 * since the window its sender keeps to is in bytes. It joins the
+	 * last chunk then.
+	 */
+	if (stream->chunk_count == MAX_CHUNKS) {
+		chunk = &stream->chunks[(stream->chunk_head + stream->chunk_count - 1) % MAX_CHUNKS];
+		chunk->size += len;
+		chunk->len += len;
+		if (stream->chunk_released == stream->chunk_count)
+			stream->ready += len;
+		return;
+	}
+
+	if (link != NULL) {
+		if (stream->link_free < now)
+			stream->link_free = now;
+		if (link->rate > 0)
+			stream->link_free += (int64_t) len * 8000 / link->rate;
+		due = stream->link_free + link->delay * 1000;
+		if (link->jitter > 0)
+			due += link_random() % (link->jitter * 1000 + 1);
+		if (link->stall > 0 && link_random() % 100 < link->stall)
+			due += link->stall_time * 1000;
+		if (stream->chunk_count > 0) {
+			chunk_t *last = &stream->chunks[(stream->chunk_head + stream->chunk_count - 1) % MAX_CHUNKS];
+			if (due < last->due)
+				due = last->due;
+		}
+	}
+
+	chunk = &stream->chunks[(stream->chunk_head + stream->chunk_count) % MAX_CHUNKS];
+	chunk->size = len;
+	chunk->len = len;
+	chunk->received = now;
+	chunk->due = due;
+	stream->chunk_count++;
+	if (link == NULL) {
+		stream->ready += len;
+		stream->chunk_released++;
+	}
+}
+
+/* Move chunks whose time has come to the ready part of the stream.
+ * Returns the time when the next chunk is due, or 0 if none is waiting.
+ */
+static int64_t
+stream_release (stream_t *stream, int64_t now)
+{
+	while (stream->chunk_released < stream->chunk_count) {
+		chunk_t *chunk = &stream->chunks[(stream->chunk_head + stream->chunk_released) % MAX_CHUNKS];
+		if (chunk->due > now)
+			return chunk->due;
+		stream->ready += chunk->len;
+		stream->chunk_released++;
+	}
+	return 0;
+}
+
+/* Account for len bytes sent from the head of the stream, and retire
+ * the chunks that are now completely sent. pos is the offset in the
+ * stream window of the first byte of the head chunk.
+ */
+static void
+stream_consume (stream_t *stream, int len, int pos, int64_t now)
+{
+	while (len > 0) {
+		chunk_t *chunk = &stream->chunks[stream->chunk_head];
+		int part = len < chunk->len ? len : chunk->len;
+
+		chunk->len -= part;
+		len -= part;
+		if (chunk->len > 0)
+			break;
+		stream->retired += chunk->size;
+		stats_chunk(stream->stats, stream->direction, chunk->size, now - chunk->received);
+		if (capture_enabled)
+			capture_record(stream->conn_id, stream->direction, chunk->size, now - chunk->received, stream->data + pos, now);
+		pos += chunk->size;
+		stream->chunk_head = (stream->chunk_head + 1) % MAX_CHUNKS;
+		stream->chunk_count--;
+		stream->chunk_released--;
+	}
+}
+
+/* A stream may be read into while it has window space and chunk slots left. */
+static bool
+stream_has_room (const stream_t *stream)
+{
+	return !stream->eof && stream->len < STREAM_WINDOW && stream->chunk_count < MAX_CHUNKS;
+}
+
+/* Offset in the stream window of the first byte of the head chunk.
+ * The already sent part of that chunk is kept so that it can be
+ * captured in one piece.
+ */
+static int
+stream_head_pos (const stream_t *stream)
+{
+	if (stream->chunk_count == 0)
+		return stream->start;
+	return stream->start - (stream->chunks[stream->chunk_head].size - stream->chunks[stream->chunk_head].len);
+}
+
+/* Move the unretired part of the stream to the start of the window. */
+static void
+stream_compact (stream_t *stream)
+{
+	int pos = stream_head_pos(stream);
+
+	if (pos > 0) {
+		memmove(stream->data, stream->data + pos, stream->start - pos + stream->len);
+		stream->start -= pos;
+	}
+}
+
+/* Account for len bytes just added at the end of the stream. */
+static void
+stream_received (stream_t *stream, int len)
+{
+	int64_t now;
+
+	stream->len += len;
+	now = now_us();
+	stats_recv(stream->stats, stream->direction, len, stream->len);
+	stats_lag(stream->stats, stream->direction, len, now);
+	if (stream->direction == STATS_UP) {
+		stats_phase(stream->stats, PHASE_FIRST_CLIENT_BYTE, now);
+	} else if (stream->stats->phase_time[PHASE_FIRST_SERVER_BYTE] == 0) {
+		/* Setup is complete once the server has responded. */
+		stats_phase(stream->stats, PHASE_FIRST_SERVER_BYTE, now);
+		stats_write_event(stream->stats);
+	}
+	stream_queue(stream, len, now);
+}
+
+/* Read at most PROXY_BUFSIZE bytes into the free part of the stream window.
+ * Returns false if the connection failed.
+ */
+static bool
+stream_fill (stream_t *stream, SOCKET fd)
+{
+	int space;
+	int len;
+
+	if (stream->start + stream->len == STREAM_WINDOW)
+		stream_compact(stream);
+	space = STREAM_WINDOW - stream->start - stream->len;
+	if (space > PROXY_BUFSIZE)
+		space = PROXY_BUFSIZE;
+	if (space == 0)
+		return true;
+
+	len = net->recv(fd, stream->data + stream->start + stream->len, space, 0);
+	if (len == SOCKET_ERROR)
+		return net->last_error() == WSAEWOULDBLOCK;
+	if (len == 0) {
+		stream->eof = true;
+		return true;
+	}
+	stream_received(stream, len);
+	return true;
+}
+
+/* Add data that arrived over a tunnel. Returns false if it does not fit
+ * the window, which the sender must keep to.
+ */
+static bool
+stream_put (stream_t *stream, const char *data, int len)
+{
+	if (stream->start - stream_head_pos(stream) + stream->len + len > STREAM_WINDOW)
+		return false;
+	if (stream->start + stream->len + len > STREAM_WINDOW)
+		stream_compact(stream);
+	memcpy(stream->data + stream->start + stream->len, data, len);
+	stream_received(stream, len);
+	return true;
+}
+
+/* Account for len bytes sent from the start of the stream. */
+static void
+stream_sent (stream_t *stream, int len)
+{
+	int pos = stream_head_pos(stream);
+
+	stream->start += len;
+	stream->len -= len;
+	stream->ready -= len;
+	stats_send(stream->stats, stream->direction);
+	stream_consume(stream, len, pos, now_us());
+	if (stream->len == 0)
+		stream->start = 0;
+}
+
+/* Send as much buffered data as the socket accepts.
+ * Returns false if the connection failed.
+ */
+static bool
+stream_flush (stream_t *stream, SOCKET fd)
+{
+	int len;
+
+	len = net->send(fd, stream->data + stream->start, stream->ready, 0);
+	if (len == SOCKET_ERROR)
+		return net->last_error() == WSAEWOULDBLOCK;
+	stream_sent(stream, len);
+	return true;
+}
+
+/* Build a SOCKS4 request to connect to addr, and return its length. */
+static int
+socks_request (char *request, const struct sockaddr_in *addr)
+{
+	request[0] = 0x04;
+	request[1] = 0x01;
+	request[2] = addr->sin_port & 0xFF;
+	request[3] = addr->sin_port >> 8;
+	request[4] = addr->sin_addr.s_addr & 0xFF;
+	request[5] = (addr->sin_addr.s_addr >> 8) & 0xFF;
+	request[6] = (addr->sin_addr.s_addr >> 16) & 0xFF;
+	request[7] = addr->sin_addr.s_addr >> 24;
+	memcpy(request + 8, program_name, strlen(program_name) + 1);
+	return 8 + strlen(program_name) + 1;
+}
+
+/* Take a free connection and set up its streams and statistics.
+ * admission_open must have returned true.
+ */
+static conn_t *
+new_connection (SOCKET client_sock)
+{
+	conn_t *conn = NULL;
+
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		if (conns[c].state == CONN_UNUSED) {
+			conn = &conns[c];
+			break;
+		}
+	}
+
+	memset(conn, 0, sizeof(*conn));
+	conn->client_sock = client_sock;
+	conn->proxy_sock = INVALID_SOCKET;
+	conn->upstream.conn_id = next_conn_id;
+	conn->upstream.direction = CAPTURE_UP;
+	conn->downstream.conn_id = next_conn_id;
+	conn->downstream.direction = CAPTURE_DOWN;
+	conn->stats.id = next_conn_id;
+	conn->upstream.stats = &conn->stats;
+	conn->downstream.stats = &conn->stats;
+	relay_stats.connections++;
+	relay_stats.active++;
+	stats_phase(&conn->stats, PHASE_ACCEPT, now_us());
+	next_conn_id++;
+	conn->config = config_acquire();
+	if (conn->config->link_emulation) {
+		conn->upstream.link = &conn->config->links[0];
+		conn->downstream.link = &conn->config->links[1];
+	}
+	return conn;
+}
+
+/* Initialize a tunnel on sock, connecting or accepted. */
+static void
+init_tunnel (tunnel_t *tunnel, SOCKET sock, bool peer)
+{
+	BOOL keepalive = TRUE;
+
+	/* An idle tunnel is kept open, so a dead peer has to be noticed. */
+	net->setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (char *) &keepalive, sizeof(keepalive)); /* Ignore errors */
+	tunnel->sock = sock;
+	tunnel->peer = peer;
+	tunnel->request_sent = 0;
+	tunnel->reply_len = 0;
+	tunnel->started = now_us();
+	tunnel->in_len = 0;
+	tunnel->out_start = 0;
+	tunnel->out_len = 0;
+	tunnel->next_stream = 1;
+	tunnel->next_conn = 0;
+	if (tunnel->out == NULL) {
+		tunnel->out_size = TUNNEL_BUFSIZE + TUNNEL_HEADER_SIZE + PROXY_BUFSIZE;
+		tunnel->out = xmalloc(tunnel->out_size);
+	}
+	relay_stats.tunnels++;
+}
+
+/* Return the tunnel to the peer endpoint through proxy_addr, opening
+ * one if there is none. The tunnel stays open when it carries no
+ * streams, so that later connections, and later launches served by a
+ * shared relay, skip the connect and the SOCKS handshake. Returns NULL
+ * with *error set if no tunnel can be opened.
+ */
+static tunnel_t *
+get_tunnel (const struct sockaddr_in *proxy_addr, int *error)
+{
+	tunnel_t *tunnel = NULL;
+	u_long nonblock = 1;
+	SOCKET sock;
+
+	for (int c = 0; c < MAX_TUNNELS; c++) {
+		tunnel_t *other = &tunnels[c];
+
+		if (other->state == TUNNEL_UNUSED) {
+			if (tunnel == NULL)
+				tunnel = other;
+		} else if (!other->peer && other->proxy_addr.sin_addr.s_addr == proxy_addr->sin_addr.s_addr
+				&& other->proxy_addr.sin_port == proxy_addr->sin_port) {
+			return other;
+		}
+	}
+	if (tunnel == NULL) {
+		*error = WSAENOBUFS;
+		return NULL;
+	}
+
+	sock = net->socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET) {
+		*error = net->last_error();
+		return NULL;
+	}
+	if (net->ioctlsocket(sock, FIONBIO, &nonblock) != 0) {
+		*error = net->last_error();
+		net->closesocket(sock); /* Ignore errors */
+		return NULL;
+	}
+	if (net->connect(sock, (struct sockaddr *) proxy_addr, sizeof(*proxy_addr)) != 0) {
+		if (net->last_error() != WSAEWOULDBLOCK) {
+			*error = net->last_error();
+			net->closesocket(sock); /* Ignore errors */
+			return NULL;
+		}
+		tunnel->state = TUNNEL_CONNECTING;
+	} else {
+		tunnel->state = TUNNEL_HANDSHAKE;
+	}
+	init_tunnel(tunnel, sock, false);
+	tunnel->proxy_addr = *proxy_addr;
+	tunnel->request_len = socks_request(tunnel->request, &tunnel_addr);
+	return tunnel;
+}
+
+/* Open the stream of a connection on its tunnel. Data may follow the
+ * OPEN frame at once, so the stream costs no round trip of its own.
+ */
+static void
+open_stream (conn_t *conn)
+{
+	unsigned char target[6];
+
+	memcpy(target, &conn->listener->connect_addr.sin_addr, 4);
+	memcpy(target + 4, &conn->listener->connect_addr.sin_port, 2);
+	tunnel_queue(conn->tunnel, FRAME_OPEN, conn->stream_id, target, sizeof(target));
+	conn->state = CONN_RELAYING;
+	stats_phase(&conn->stats, PHASE_CONNECT_DONE, now_us());
+}
+
+/* Start relaying a connection that waited wait microseconds for
+ * admission. admission_open must have returned true.
+ */
+static void
+start_connection (listener_t *listener, SOCKET client_sock, int64_t wait)
+{
+	conn_t *conn;
+	u_long nonblock = 1;
+	int error;
+
+	histogram_add(&relay_stats.queue_wait, wait);
+	conn = new_connection(client_sock);
+	conn->listener = listener;
+	conn->stats.target = listener->target_name;
+
+	/* Over a tunnel, the connection waits in CONN_CONNECTING only until
+	 * the tunnel is open.
+	 */
+	if (tunnel_addr.sin_family != 0) {
+		conn->state = CONN_CONNECTING;
+		stats_phase(&conn->stats, PHASE_CONNECT_START, now_us());
+		conn->tunnel = get_tunnel(&listener->proxy_addr, &error);
+		if (conn->tunnel == NULL) {
+			stats_fail(&conn->stats, "tunnel", error);
+			close_connection(conn);
+			return;
+		}
+		conn->stream_id = conn->tunnel->next_stream++;
+		conn->credit = STREAM_WINDOW;
+		if (conn->tunnel->state == TUNNEL_OPEN)
+			open_stream(conn);
+		return;
+	}
+
+	conn->proxy_sock = net->socket(AF_INET, SOCK_STREAM, 0);
+	if (conn->proxy_sock == INVALID_SOCKET || net->ioctlsocket(conn->proxy_sock, FIONBIO, &nonblock) != 0) {
+		stats_fail(&conn->stats, "socket", net->last_error());
+		close_connection(conn);
+		return;
+	}
+	conn->request_len = socks_request(conn->request, &listener->connect_addr);
+
+	conn->state = CONN_CONNECTING;
+	stats_phase(&conn->stats, PHASE_CONNECT_START, now_us());
+	if (net->connect(conn->proxy_sock, (struct sockaddr *) &listener->proxy_addr, sizeof(listener->proxy_addr)) != 0) {
+		if (net->last_error() != WSAEWOULDBLOCK) {
+			stats_fail(&conn->stats, "connect", net->last_error());
+			close_connection(conn);
+		}
+	} else {
+		conn->state = CONN_HANDSHAKE;
+		stats_phase(&conn->stats, PHASE_CONNECT_DONE, now_us());
+	}
+}
+
+/* Return whether a new connection can be started within the limits
+ * on connections, handshakes in progress and buffered data.
+ */
+static bool
+admission_open (void)
+{
+	uint32_t active = 0;
+	uint32_t handshakes = 0;
+	uint64_t buffered = 0;
+
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		conn_t *conn = &conns[c];
+
+		if (conn->state == CONN_UNUSED)
+			continue;
+		active++;
+		if (conn->state != CONN_RELAYING)
+			handshakes++;
+		buffered += conn->upstream.len + conn->downstream.len;
+	}
+	return active < max_conns && handshakes < max_handshakes
+		&& (max_buffered == 0 || buffered < max_buffered * (uint64_t) 1024);
+}
+
+/* Close a connection the relay has no capacity for. The viewer sees
+ * the connection closed at once instead of waiting for a timeout.
+ */
+static void
+reject_connection (SOCKET sock)
+{
+	net->closesocket(sock); /* Ignore errors */
+	relay_stats.rejected++;
+}
+
+/* admit_pending:
+ * Start waiting connections, oldest first, while there is capacity.
+ * Connections that have waited longer than queue_time are rejected.
+ */
+static void
+admit_pending (int64_t now)
+{
+	while (pending_count > 0) {
+		pending_t *entry = &pending[pending_head];
+
+		if (admission_open())
+			start_connection(entry->listener, entry->sock, now - entry->accepted);
+		else if (queue_time >= 0 && now - entry->accepted >= queue_time)
+			reject_connection(entry->sock);
+		else
+			break;
+		pending_head = (pending_head + 1) % MAX_PENDING;
+		pending_count--;
+	}
+	relay_stats.queued = pending_count;
+}
+
+/* accept_connection:
+ * Accept a connection and start it, or queue it if the relay is at
+ * its limits. It is rejected if the queue is full or disabled.
+ * Returns false if there was no connection to accept or accepting
+ * failed, so that a burst of connections can be taken in one round.
+ */
+static bool
+accept_connection (listener_t *listener, int64_t now)
+{
+	SOCKET client_sock;
+	u_long nonblock = 1;
+
+	/* A failed accept costs the relay only that connection. A viewer
+	 * that resets before it is accepted leaves nothing behind, but if
+	 * the relay ran out of sockets or buffers the connection is still in
+	 * the backlog, so the listener rests instead of spinning on it.
+	 */
+	client_sock = net->accept(listener->sock, NULL, NULL);
+	if (client_sock == INVALID_SOCKET) {
+		int error = net->last_error();
+
+		if (error == WSAEWOULDBLOCK)
+			return false;
+		stats_accept_failed("accept", error);
+		if (error == WSAECONNRESET)
+			return true;
+		listener->paused_until = now + ACCEPT_BACKOFF * 1000;
+		return false;
+	}
+	if (net->ioctlsocket(client_sock, FIONBIO, &nonblock) != 0) {
+		stats_accept_failed("nonblock", net->last_error());
+		net->closesocket(client_sock); /* Ignore errors */
+		return false;
+	}
+
+	if (pending_count == 0 && admission_open()) {
+		start_connection(listener, client_sock, 0);
+	} else if (queue_time == 0 || pending_count >= MAX_PENDING) {
+		reject_connection(client_sock);
+	} else {
+		pending_t *entry = &pending[(pending_head + pending_count) % MAX_PENDING];
+
+		entry->sock = client_sock;
+		entry->listener = listener;
+		entry->accepted = now;
+		pending_count++;
+		relay_stats.queued = pending_count;
+	}
+	return true;
+}
+
+/* Returns false if the connection should be closed. */
+static bool
+handle_handshake (conn_t *conn, fd_set *read_fds, fd_set *write_fds)
+{
+	int len;
+
+	if (fd_isset(conn->proxy_sock, write_fds)) {
+		len = net->send(conn->proxy_sock, conn->request + conn->request_sent, conn->request_len - conn->request_sent, 0);
+		if (len == SOCKET_ERROR && net->last_error() != WSAEWOULDBLOCK) {
+			stats_fail(&conn->stats, "write", net->last_error());
+			return false;
+		}
+		if (len > 0)
+			conn->request_sent += len;
+		if (conn->request_sent == conn->request_len)
+			stats_phase(&conn->stats, PHASE_REQUEST_SENT, now_us());
+	}
+	if (fd_isset(conn->proxy_sock, read_fds)) {
+		len = net->recv(conn->proxy_sock, conn->reply + conn->reply_len, sizeof(conn->reply) - conn->reply_len, 0);
+		if (len == SOCKET_ERROR) {
+			if (net->last_error() == WSAEWOULDBLOCK)
+				return true;
+			stats_fail(&conn->stats, "read", net->last_error());
+			return false;
+		}
+		if (len == 0) {
+			stats_fail(&conn->stats, "closed", 0);
+			return false;
+		}
+		conn->reply_len += len;
+		if (conn->reply_len == sizeof(conn->reply)) {
+			if (conn->reply[0] != 0) {
+				stats_fail(&conn->stats, "invalid reply", 0);
+				return false;
+			}
+			if (conn->reply[1] != 0x5A) {
+				stats_fail(&conn->stats, "denied", 0);
+				return false;
+			}
+			conn->state = CONN_RELAYING;
+			stats_phase(&conn->stats, PHASE_REPLY_RECEIVED, now_us());
+			if (path_key[0] != '\0' && relay_stats.proxy_rtt == 0)
+				relay_stats.proxy_rtt = conn->stats.phase_time[PHASE_REPLY_RECEIVED] - conn->stats.phase_time[PHASE_CONNECT_START];
+		}
+	}
+	return true;
+}
+
+/* Returns false if the connection should be closed. */
+static bool
+handle_relaying (conn_t *conn, fd_set *read_fds, fd_set *write_fds)
+{
+	if (fd_isset(conn->proxy_sock, write_fds) && !stream_flush(&conn->upstream, conn->proxy_sock))
+		return false;
+	if (fd_isset(conn->client_sock, write_fds) && !stream_flush(&conn->downstream, conn->client_sock))
+		return false;
+	if (fd_isset(conn->proxy_sock, read_fds) && !stream_fill(&conn->downstream, conn->proxy_sock))
+		return false;
+
+	/* Close once either side has closed and everything it sent is delivered. */
+	if (conn->upstream.eof && conn->upstream.len == 0)
+		return false;
+	if (conn->downstream.eof && conn->downstream.len == 0)
+		return false;
+	return true;
+}
+
+/* The stream a connection sends over its tunnel. */
+static stream_t *
+tunnel_send_stream (conn_t *conn)
+{
+	return conn->tunnel->peer ? &conn->downstream : &conn->upstream;
+}
+
+/* The stream a connection receives from its tunnel. */
+static stream_t *
+tunnel_recv_stream (conn_t *conn)
+{
+	return conn->tunnel->peer ? &conn->upstream : &conn->downstream;
+}
+
+static conn_t *
+find_stream (tunnel_t *tunnel, uint32_t stream_id)
+{
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		conn_t *conn = &conns[c];
+
+		if (conn->state != CONN_UNUSED && conn->tunnel == tunnel && conn->stream_id == stream_id)
+			return conn;
+	}
+	return NULL;
+}
+
+/* Close a tunnel and the connections it carries. Those still waiting
+ * for it fail, with failure if not NULL.
+ */
+static void
+close_tunnel (tunnel_t *tunnel, const char *failure, int error)
+{
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		conn_t *conn = &conns[c];
+
+		if (conn->state == CONN_UNUSED || conn->tunnel != tunnel)
+			continue;
+		if (failure != NULL && conn->state == CONN_CONNECTING && conn->stats.failure == NULL)
+			stats_fail(&conn->stats, failure, error);
+		conn->remote_closed = true;
+		close_connection(conn);
+	}
+	net->closesocket(tunnel->sock); /* Ignore errors */
+	tunnel->state = TUNNEL_UNUSED;
+	if (failure != NULL)
+		relay_stats.tunnels_failed++;
+}
+
+/* At the peer endpoint, connect a stream the relay opened to its
+ * target. The relay is told with RESET if the target cannot be reached,
+ * or if this endpoint is at its limits; streams are not queued here.
+ */
+static void
+accept_stream (tunnel_t *tunnel, uint32_t stream_id, const unsigned char *target)
+{
+	struct sockaddr_in addr;
+	u_long nonblock = 1;
+	conn_t *conn;
+
+	if (!admission_open()) {
+		unsigned char error[4];
+
+		put32(error, WSAECONNREFUSED);
+		tunnel_queue(tunnel, FRAME_RESET, stream_id, error, sizeof(error));
+		relay_stats.rejected++;
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	memcpy(&addr.sin_addr, target, 4);
+	memcpy(&addr.sin_port, target + 4, 2);
+
+	conn = new_connection(INVALID_SOCKET);
+	snprintf(conn->target_name, sizeof(conn->target_name), "%s:%u", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	conn->stats.target = conn->target_name;
+	conn->tunnel = tunnel;
+	conn->stream_id = stream_id;
+	conn->credit = STREAM_WINDOW;
+	conn->proxy_sock = net->socket(AF_INET, SOCK_STREAM, 0);
+	if (conn->proxy_sock == INVALID_SOCKET || net->ioctlsocket(conn->proxy_sock, FIONBIO, &nonblock) != 0) {
+		stats_fail(&conn->stats, "socket", net->last_error());
+		close_connection(conn);
+		return;
+	}
+
+	conn->state = CONN_CONNECTING;
+	stats_phase(&conn->stats, PHASE_CONNECT_START, now_us());
+	if (net->connect(conn->proxy_sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		if (net->last_error() != WSAEWOULDBLOCK) {
+			stats_fail(&conn->stats, "connect", net->last_error());
+			close_connection(conn);
+		}
+	} else {
+		conn->state = CONN_RELAYING;
+		stats_phase(&conn->stats, PHASE_CONNECT_DONE, now_us());
+	}
+}
+
+/* Act on a frame received on a tunnel. Returns why the tunnel must be
+ * closed, or NULL. Frames for a stream this end has closed are ignored,
+ * as the other end may have sent them before it learned of the close.
+ */
+static const char *
+tunnel_frame (tunnel_t *tunnel, int type, uint32_t stream_id, const unsigned char *payload, int len)
+{
+	unsigned char digest[TUNNEL_DIGEST_BYTES];
+	stream_t *stream;
+	conn_t *conn;
+
+	if (tunnel->state == TUNNEL_AUTH) {
+		if (!tunnel->peer && type == FRAME_HELLO && len == TUNNEL_NONCE_BYTES) {
+			if (!tunnel_digest(payload, digest))
+				return "digest";
+			tunnel_queue(tunnel, FRAME_AUTH, 0, digest, sizeof(digest));
+			tunnel->state = TUNNEL_OPEN;
+			for (int c = 0; c < MAX_CONNECTIONS; c++) {
+				if (conns[c].state == CONN_CONNECTING && conns[c].tunnel == tunnel)
+					open_stream(&conns[c]);
+			}
+			return NULL;
+		}
+		if (tunnel->peer && type == FRAME_AUTH && len == TUNNEL_DIGEST_BYTES) {
+			unsigned char diff = 0;
+
+			/* All of the digest is compared so that the time taken reveals nothing. */
+			if (!tunnel_digest(tunnel->nonce, digest))
+				return "digest";
+			for (int c = 0; c < TUNNEL_DIGEST_BYTES; c++)
+				diff |= payload[c] ^ digest[c];
+			if (diff != 0)
+				return "not authorized";
+			tunnel->state = TUNNEL_OPEN;
+			return NULL;
+		}
+		return "invalid frame";
+	}
+
+	if (type == FRAME_OPEN) {
+		if (!tunnel->peer || len != 6 || find_stream(tunnel, stream_id) != NULL)
+			return "invalid frame";
+		accept_stream(tunnel, stream_id, payload);
+		return NULL;
+	}
+	conn = find_stream(tunnel, stream_id);
+	switch (type) {
+	case FRAME_DATA:
+		if (conn == NULL)
+			return NULL;
+		stream = tunnel_recv_stream(conn);
+		if (stream->eof || !stream_put(stream, (const char *) payload, len))
+			return "window exceeded";
+		return NULL;
+	case FRAME_WINDOW:
+		if (len != 4)
+			return "invalid frame";
+		if (conn == NULL)
+			return NULL;
+		if (get32(payload) > STREAM_WINDOW - conn->credit)
+			return "window exceeded";
+		conn->credit += get32(payload);
+		return NULL;
+	case FRAME_CLOSE:
+		if (len != 0)
+			return "invalid frame";
+		if (conn == NULL)
+			return NULL;
+		conn->remote_closed = true;
+		stream = tunnel_recv_stream(conn);
+		stream->eof = true;
+		/* With nothing left to deliver, nothing would wake the connection. */
+		if (stream->len == 0)
+			close_connection(conn);
+		return NULL;
+	case FRAME_RESET:
+		if (tunnel->peer || len != 4)
+			return "invalid frame";
+		if (conn == NULL)
+			return NULL;
+		conn->remote_closed = true;
+		stats_fail(&conn->stats, "reset", get32(payload));
+		close_connection(conn);
+		return NULL;
+	default:
+		return "invalid frame";
+	}
+}
+
+/* Connect a tunnel through the proxy, and receive its frames once it
+ * is set up. Returns why the tunnel must be closed, or NULL; *error is
+ * the Winsock error behind it, if any.
+ */
+static const char *
+handle_tunnel (tunnel_t *tunnel, fd_set *read_fds, fd_set *write_fds, fd_set *except_fds, int *error)
+{
+	const char *failure;
+	int pos = 0;
+	int len;
+
+	switch (tunnel->state) {
+	case TUNNEL_CONNECTING:
+		if (fd_isset(tunnel->sock, except_fds)) {
+			int error_len = sizeof(*error);
+
+			net->getsockopt(tunnel->sock, SOL_SOCKET, SO_ERROR, (char *) error, &error_len);
+			return "connect";
+		}
+		if (fd_isset(tunnel->sock, write_fds))
+			tunnel->state = TUNNEL_HANDSHAKE;
+		return NULL;
+	case TUNNEL_HANDSHAKE:
+		if (fd_isset(tunnel->sock, write_fds)) {
+			len = net->send(tunnel->sock, tunnel->request + tunnel->request_sent, tunnel->request_len - tunnel->request_sent, 0);
+			if (len == SOCKET_ERROR && net->last_error() != WSAEWOULDBLOCK) {
+				*error = net->last_error();
+				return "write";
+			}
+			if (len > 0)
+				tunnel->request_sent += len;
+		}
+		if (fd_isset(tunnel->sock, read_fds)) {
+			len = net->recv(tunnel->sock, tunnel->reply + tunnel->reply_len, sizeof(tunnel->reply) - tunnel->reply_len, 0);
+			if (len == SOCKET_ERROR) {
+				if (net->last_error() == WSAEWOULDBLOCK)
+					return NULL;
+				*error = net->last_error();
+				return "read";
+			}
+			if (len == 0)
+				return "closed";
+			tunnel->reply_len += len;
+			if (tunnel->reply_len == sizeof(tunnel->reply)) {
+				if (tunnel->reply[0] != 0)
+					return "invalid reply";
+				if (tunnel->reply[1] != 0x5A)
+					return "denied";
+				tunnel->state = TUNNEL_AUTH;
+			}
+		}
+		return NULL;
+	default:
+		break;
+	}
+
+	if (!fd_isset(tunnel->sock, read_fds))
+		return NULL;
+	len = net->recv(tunnel->sock, tunnel->in + tunnel->in_len, sizeof(tunnel->in) - tunnel->in_len, 0);
+	if (len == SOCKET_ERROR) {
+		if (net->last_error() == WSAEWOULDBLOCK)
+			return NULL;
+		*error = net->last_error();
+		return "read";
+	}
+	if (len == 0)
+		return "closed";
+	tunnel->in_len += len;
+	while (tunnel->in_len - pos >= TUNNEL_HEADER_SIZE) {
+		const unsigned char *frame = (const unsigned char *) tunnel->in + pos;
+		int size = frame[2] << 8 | frame[3];
+
+		if (frame[1] != 0 || size > PROXY_BUFSIZE)
+			return "invalid frame";
+		if (tunnel->in_len - pos < TUNNEL_HEADER_SIZE + size)
+			break;
+		if ((failure = tunnel_frame(tunnel, frame[0], get32(frame + 4), frame + TUNNEL_HEADER_SIZE, size)) != NULL)
+			return failure;
+		pos += TUNNEL_HEADER_SIZE + size;
+	}
+	memmove(tunnel->in, tunnel->in + pos, tunnel->in_len - pos);
+	tunnel->in_len -= pos;
+	return NULL;
+}
+
+/* Frame the data that the streams of a tunnel may send, at most
+ * PROXY_BUFSIZE bytes per stream and round, starting after the stream
+ * served last so that each gets its turn. A stream sends only as much
+ * as the other end has granted, so a stream whose receiver is slow
+ * cannot fill the tunnel and hold up the others.
+ */
+static void
+fill_tunnel (tunnel_t *tunnel)
+{
+	int first = tunnel->next_conn;
+
+	for (int c = 0; c < MAX_CONNECTIONS && tunnel->out_len < TUNNEL_BUFSIZE; c++) {
+		conn_t *conn = &conns[(first + c) % MAX_CONNECTIONS];
+		stream_t *stream;
+		int len;
+
+		if (conn->state != CONN_RELAYING || conn->tunnel != tunnel)
+			continue;
+		stream = tunnel_send_stream(conn);
+		len = stream->ready;
+		if (len > conn->credit)
+			len = conn->credit;
+		if (len > PROXY_BUFSIZE)
+			len = PROXY_BUFSIZE;
+		if (len > 0) {
+			tunnel_queue(tunnel, FRAME_DATA, conn->stream_id, stream->data + stream->start, len);
+			conn->credit -= len;
+			stream_sent(stream, len);
+			tunnel->next_conn = (first + c + 1) % MAX_CONNECTIONS;
+		}
+		/* Close once the source has closed and everything it sent is framed. */
+		if (stream->eof && stream->len == 0)
+			close_connection(conn);
+	}
+}
+
+/* Grant the other end of the tunnel the window retired since the last
+ * grant. Small grants wait until a quarter of the window has been
+ * retired, unless the stream has run empty.
+ */
+static void
+tunnel_grant (conn_t *conn)
+{
+	stream_t *stream = tunnel_recv_stream(conn);
+	uint32_t grant = stream->retired - conn->granted;
+	unsigned char payload[4];
+
+	if (grant == 0 || (grant < STREAM_WINDOW / 4 && stream->len > 0))
+		return;
+	put32(payload, grant);
+	tunnel_queue(conn->tunnel, FRAME_WINDOW, conn->stream_id, payload, sizeof(payload));
+	conn->granted = stream->retired;
+}
+
+/* Send as many queued frames as the socket accepts.
+ * Returns false if the tunnel failed.
+ */
+static bool
+flush_tunnel (tunnel_t *tunnel, int *error)
+{
+	int len;
+
+	if (tunnel->out_len == 0)
+		return true;
+	len = net->send(tunnel->sock, tunnel->out + tunnel->out_start, tunnel->out_len, 0);
+	if (len == SOCKET_ERROR) {
+		if (net->last_error() == WSAEWOULDBLOCK)
+			return true;
+		*error = net->last_error();
+		return false;
+	}
+	tunnel->out_start += len;
+	tunnel->out_len -= len;
+	if (tunnel->out_len == 0)
+		tunnel->out_start = 0;
+	return true;
+}
+
+/* At the peer endpoint, accept a tunnel from a relay and challenge it
+ * to prove that it has the key.
+ */
+static void
+accept_tunnel (void)
+{
+	tunnel_t *tunnel = NULL;
+	u_long nonblock = 1;
+	SOCKET sock;
+
+	sock = net->accept(tunnel_listen_sock, NULL, NULL);
+	if (sock == INVALID_SOCKET) {
+		if (net->last_error() != WSAEWOULDBLOCK)
+			stats_accept_failed("tunnel", net->last_error());
+		return;
+	}
+	for (int c = 0; c < MAX_TUNNELS; c++) {
+		if (tunnels[c].state == TUNNEL_UNUSED) {
+			tunnel = &tunnels[c];
+			break;
+		}
+	}
+	if (tunnel == NULL || net->ioctlsocket(sock, FIONBIO, &nonblock) != 0) {
+		stats_accept_failed("tunnel", tunnel == NULL ? WSAENOBUFS : net->last_error());
+		net->closesocket(sock); /* Ignore errors */
+		return;
+	}
+	if (!CryptGenRandom(tunnel_prov, sizeof(tunnel->nonce), tunnel->nonce)) {
+		stats_accept_failed("nonce", 0);
+		net->closesocket(sock); /* Ignore errors */
+		return;
+	}
+	init_tunnel(tunnel, sock, true);
+	tunnel->state = TUNNEL_AUTH;
+	tunnel_queue(tunnel, FRAME_HELLO, 0, tunnel->nonce, sizeof(tunnel->nonce));
+}
+
+/* Return the earlier of two times, where 0 means no time. */
+static int64_t
+earliest (int64_t a, int64_t b)
+{
+	if (a == 0 || (b != 0 && b < a))
+		return b;
+	return a;
+}
+
+static int
+collect_stats (conn_stats_t **list)
+{
+	int count = 0;
+
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		if (conns[c].state != CONN_UNUSED)
+			list[count++] = &conns[c].stats;
+	}
+	return count;
+}
+
+/* Sample the kernel's view of the upstream connection: round trip
+ * time, congestion window and retransmissions. Requires SIO_TCP_INFO,
+ * which is available since Windows 10 version 1703.
+ */
+static void
+sample_tcp_info (conn_t *conn)
+{
+#ifdef SIO_TCP_INFO
+	DWORD version = 0;
+	DWORD len;
+	TCP_INFO_v0 info;
+
+	if (WSAIoctl(conn->proxy_sock, SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &len, NULL, NULL) != 0) {
+		conn->stats.tcp.valid = false;
+		return;
+	}
+	conn->stats.tcp.valid = true;
+	conn->stats.tcp.rtt_us = info.RttUs;
+	conn->stats.tcp.min_rtt_us = info.MinRttUs;
+	conn->stats.tcp.cwnd = info.Cwnd;
+	conn->stats.tcp.bytes_in_flight = info.BytesInFlight;
+	conn->stats.tcp.bytes_retrans = info.BytesRetrans;
+	conn->stats.tcp.timeouts = info.TimeoutEpisodes;
+#endif
+}
+
+static void
+update_stats (int64_t now)
+{
+	conn_stats_t *list[MAX_CONNECTIONS];
+	int count;
+
+	for (int c = 0; c < MAX_CONNECTIONS; c++) {
+		if (conns[c].state == CONN_RELAYING)
+			sample_tcp_info(&conns[c]);
+	}
+	if (stats_path != NULL) {
+		count = collect_stats(list);
+		stats_write_file(stats_path, list, count, now);
+	}
+}
+
+/* The statistics endpoint only listens on the loopback interface. */
+static void
+open_stats_listener (void)
+{
+	struct sockaddr_in addr;
+	u_long nonblock = 1;
+
+	for (int c = 0; c < MAX_HTTP_CLIENTS; c++)
+		http_socks[c] = INVALID_SOCKET;
+	stats_sock = net->socket(AF_INET, SOCK_STREAM, 0);
+	if (stats_sock == INVALID_SOCKET)
+		die("Cannot create socket: %s\n", wsa_errstr());
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = stats_port;
+	if (net->bind(stats_sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		die("Cannot bind to address %ls port %d: %s\n", L"127.0.0.1", ntohs(stats_port), wsa_errstr());
+	if (net->listen(stats_sock, MAX_HTTP_CLIENTS) != 0)
+		die("Cannot listen for connections: %s\n", wsa_errstr());
+	if (net->ioctlsocket(stats_sock, FIONBIO, &nonblock) != 0)
+		die("Cannot make socket non-blocking: %s\n", wsa_errstr());
+}
+
+/* Answer HTTP requests for statistics. The request itself is not
+ * parsed beyond the path: "/json" returns JSON, anything else the
+ * Prometheus text format. Responses are sent without blocking, and
+ * a client that cannot take the whole response gets a truncated one.
+ */
+static void
+handle_stats_requests (fd_set *read_fds)
+{
+	for (int c = 0; c < MAX_HTTP_CLIENTS; c++) {
+		conn_stats_t *list[MAX_CONNECTIONS];
+		char request[512];
+		char *body;
+		char *response;
+		int count;
+		int len;
+
+		if (http_socks[c] == INVALID_SOCKET || !fd_isset(http_socks[c], read_fds))
+			continue;
+		len = net->recv(http_socks[c], request, sizeof(request) - 1, 0);
+		if (len == SOCKET_ERROR && net->last_error() == WSAEWOULDBLOCK)
+			continue;
+		if (len > 0) {
+			request[len] = '\0';
+			count = collect_stats(list);
+			if (strncmp(request, "GET /json", 9) == 0) {
+				body = stats_format_json(list, count, now_us());
+				response = xasprintf("HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: %u\r\n\r\n%s", (unsigned) strlen(body), body);
+			} else {
+				body = stats_format_prometheus(list, count);
+				response = xasprintf("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\n\r\n%s", (unsigned) strlen(body), body);
+			}
+			net->send(http_socks[c], response, strlen(response), 0); /* Ignore errors */
+			free(response);
+			free(body);
+		}
+		net->closesocket(http_socks[c]); /* Ignore errors */
+		http_socks[c] = INVALID_SOCKET;
+	}
+
+	if (fd_isset(stats_sock, read_fds)) {
+		for (int c = 0; c < MAX_HTTP_CLIENTS; c++) {
+			if (http_socks[c] == INVALID_SOCKET) {
+				http_socks[c] = net->accept(stats_sock, NULL, NULL);
+				break;
+			}
+		}
+	}
+}
+
+/* start_probe:
+ * Start a direct connect to the target, run alongside the proxied
+ * connection of the viewer.
+ */
+static void
+start_probe (int64_t now)
+{
+	u_long nonblock = 1;
+
+	probe_sock = net->socket(AF_INET, SOCK_STREAM, 0);
+	if (probe_sock == INVALID_SOCKET)
+		die("Cannot create socket: %s\n", wsa_errstr());
+	if (net->ioctlsocket(probe_sock, FIONBIO, &nonblock) != 0)
+		die("Cannot make socket non-blocking: %s\n", wsa_errstr());
+	probe_start = now;
+	if (net->connect(probe_sock, (struct sockaddr *) &listeners[0].connect_addr, sizeof(listeners[0].connect_addr)) == 0) {
+		relay_stats.direct_rtt = now_us() - probe_start;
+	} else if (net->last_error() != WSAEWOULDBLOCK) {
+		relay_stats.direct_rtt = -1;
+	} else {
+		return;
+	}
+	net->closesocket(probe_sock); /* Ignore errors */
+	probe_sock = INVALID_SOCKET;
+}
+
+/* check_probe:
+ * Record the outcome of the direct connect, and once both paths have
+ * been timed, store the faster one for later launches.
+ */
+static void
+check_probe (fd_set *write_fds, fd_set *except_fds, int64_t now)
+{
+	if (probe_sock != INVALID_SOCKET) {
+		if (fd_isset(probe_sock, write_fds))
+			relay_stats.direct_rtt = now - probe_start;
+		else if (fd_isset(probe_sock, except_fds) || now >= probe_start + probe_timeout * (int64_t) 1000)
+			relay_stats.direct_rtt = -1;
+		else
+			return;
+		net->closesocket(probe_sock); /* Ignore errors */
+		probe_sock = INVALID_SOCKET;
+	}
+	if (relay_stats.path != PATH_UNKNOWN || relay_stats.direct_rtt == 0)
+		return;
+	if (relay_stats.direct_rtt < 0)
+		relay_stats.path = PATH_PROXY;
+	else if (relay_stats.proxy_rtt == 0)
+		return;
+	else
+		relay_stats.path = relay_stats.direct_rtt <= relay_stats.proxy_rtt ? PATH_DIRECT : PATH_PROXY;
+	store_path();
+	stats_write_path_event(listeners[0].target_name);
+}
+
+void
+handle_proxy (void)
+{
+	int64_t next_stats;
+	int rc;
+	int c;
+
+	if (relay_remote || relay_bypassed)
+		return;
+
+	relay_stats.start = now_us();
+	link_random_state = relay_stats.start | 1;
+	next_stats = relay_stats.start + stats_interval * (int64_t) 1000000;
+	if (capture_path != NULL)
+		capture_open(capture_path, capture_size * 1024, capture_payload, listeners[0].connect_addr.sin_addr.s_addr, listeners[0].connect_addr.sin_port, relay_stats.start);
+	if (stats_port != 0)
+		open_stats_listener();
+	if (events_path != NULL)
+		stats_open_events(events_path);
+
+	/* Make select timeouts accurate to the millisecond for link emulation. */
+	if (link_emulation || config_path != NULL)
+		timeBeginPeriod(1);
+
+	/* Each connection is a pair of streams with a fixed window. A socket is
+	 * only polled for reading while the window in that direction has room,
+	 * and each select round moves at most PROXY_BUFSIZE bytes per stream,
+	 * so a bulk transfer cannot starve the other sessions.
+	 * The listen socket is shut down when there are no connections and
+	 * no new connections have been made in PROXY_LIFETIME_SECONDS seconds.
+	 * A shared relay waits SHARED_LIFETIME_SECONDS instead, since later
+	 * launches count on its control port and warm listeners; control
+	 * requests restart the wait.
+	 */
+	for (;;) {
+		struct timeval lifetime = { control_sock != INVALID_SOCKET ? SHARED_LIFETIME_SECONDS : PROXY_LIFETIME_SECONDS, 0 };
+		struct timeval timer;
+		struct timeval *timeout;
+		fd_set read_fds;
+		fd_set write_fds;
+		fd_set except_fds;
+		int64_t now = now_us();
+		int64_t next_due = 0;
+		int active = 0;
+
+		admit_pending(now);
+		if (pending_count > 0 && queue_time >= 0)
+			next_due = pending[pending_head].accepted + queue_time;
+
+		FD_ZERO(&read_fds);
+		FD_ZERO(&write_fds);
+		FD_ZERO(&except_fds);
+		for (c = 0; c < MAX_CONNECTIONS; c++) {
+			conn_t *conn = &conns[c];
+
+			if (conn->state == CONN_UNUSED)
+				continue;
+			active++;
+			if (conn->config->link_emulation) {
+				next_due = earliest(next_due, stream_release(&conn->upstream, now));
+				next_due = earliest(next_due, stream_release(&conn->downstream, now));
+			}
+			/* A tunnel takes the place of the proxy socket at the relay,
+			 * and of the client socket at the peer endpoint.
+			 */
+			if (stream_has_room(&conn->upstream) && conn->client_sock != INVALID_SOCKET)
+				fd_add(conn->client_sock, &read_fds);
+			switch (conn->state) {
+			case CONN_CONNECTING:
+				if (conn->proxy_sock != INVALID_SOCKET) {
+					fd_add(conn->proxy_sock, &write_fds);
+					fd_add(conn->proxy_sock, &except_fds);
+				}
+				break;
+			case CONN_HANDSHAKE:
+				if (conn->request_sent < conn->request_len)
+					fd_add(conn->proxy_sock, &write_fds);
+				else
+					fd_add(conn->proxy_sock, &read_fds);
+				break;
+			case CONN_RELAYING:
+				if (conn->proxy_sock != INVALID_SOCKET) {
+					if (stream_has_room(&conn->downstream))
+						fd_add(conn->proxy_sock, &read_fds);
+					if (conn->upstream.ready > 0)
+						fd_add(conn->proxy_sock, &write_fds);
+				}
+				if (conn->downstream.ready > 0 && conn->client_sock != INVALID_SOCKET)
+					fd_add(conn->client_sock, &write_fds);
+				break;
+			default:
+				break;
+			}
+		}
+		/* Tunnels are always read, since their streams keep within the
+		 * windows granted. One that is not up in time is given up on.
+		 */
+		for (c = 0; c < MAX_TUNNELS; c++) {
+			tunnel_t *tunnel = &tunnels[c];
+
+			switch (tunnel->state) {
+			case TUNNEL_UNUSED:
+				continue;
+			case TUNNEL_CONNECTING:
+				fd_add(tunnel->sock, &write_fds);
+				fd_add(tunnel->sock, &except_fds);
+				break;
+			case TUNNEL_HANDSHAKE:
+				if (tunnel->request_sent < tunnel->request_len)
+					fd_add(tunnel->sock, &write_fds);
+				else
+					fd_add(tunnel->sock, &read_fds);
+				break;
+			default:
+				fd_add(tunnel->sock, &read_fds);
+				if (tunnel->out_len > 0)
+					fd_add(tunnel->sock, &write_fds);
+				break;
+			}
+			if (tunnel->state != TUNNEL_OPEN)
+				next_due = earliest(next_due, tunnel->started + TUNNEL_AUTH_TIMEOUT * (int64_t) 1000);
+		}
+		if (tunnel_listen_sock != INVALID_SOCKET)
+			fd_add(tunnel_listen_sock, &read_fds);
+		/* Listeners are always polled, so that connections beyond the
+		 * limits are queued or rejected instead of left in the backlog.
+		 */
+		for (c = 0; c < listener_count; c++) {
+			if (listeners[c].paused_until > now)
+				next_due = earliest(next_due, listeners[c].paused_until);
+			else
+				fd_add(listeners[c].sock, &read_fds);
+		}
+		if (control_sock != INVALID_SOCKET) {
+			bool control_room = false;
+			for (c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+				if (control_clients[c].sock != INVALID_SOCKET)
+					fd_add(control_clients[c].sock, &read_fds);
+				else
+					control_room = true;
+			}
+			if (control_room)
+				fd_add(control_sock, &read_fds);
+		}
+		if (stats_sock != INVALID_SOCKET) {
+			bool http_room = false;
+			for (c = 0; c < MAX_HTTP_CLIENTS; c++) {
+				if (http_socks[c] != INVALID_SOCKET)
+					fd_add(http_socks[c], &read_fds);
+				else
+					http_room = true;
+			}
+			if (http_room)
+				fd_add(stats_sock, &read_fds);
+		}
+		if (stats_path != NULL || stats_sock != INVALID_SOCKET) {
+			if (now >= next_stats) {
+				update_stats(now);
+				next_stats = now + stats_interval * (int64_t) 1000000;
+			}
+			if (active > 0)
+				next_due = earliest(next_due, next_stats);
+		}
+
+		if (path_key[0] != '\0' && relay_stats.path == PATH_UNKNOWN && probe_start == 0 && active > 0)
+			start_probe(now);
+		if (probe_sock != INVALID_SOCKET) {
+			fd_add(probe_sock, &write_fds);
+			fd_add(probe_sock, &except_fds);
+			next_due = earliest(next_due, probe_start + probe_timeout * (int64_t) 1000);
+		}
+
+		/* The peer endpoint serves until it is ended. */
+		if (active == 0 && tunnel_listen_sock == INVALID_SOCKET) {
+			timeout = &lifetime;
+		} else if (next_due != 0) {
+			/* Round up to whole milliseconds, the resolution of select. */
+			int64_t wait = (next_due - now + 999) / 1000 * 1000;
+			timer.tv_sec = wait / 1000000;
+			timer.tv_usec = wait % 1000000;
+			timeout = &timer;
+		} else {
+			timeout = NULL;
+		}
+		if ((rc = net->select(FD_SETSIZE, &read_fds, &write_fds, &except_fds, timeout)) == SOCKET_ERROR)
+			die ("Cannot wait for input: %s\n", wsa_errstr());
+		fd_sort(&read_fds);
+		fd_sort(&write_fds);
+		fd_sort(&except_fds);
+		if (rc == 0 && active == 0 && tunnel_listen_sock == INVALID_SOCKET)
+			break;
+
+		for (c = 0; c < MAX_CONNECTIONS; c++) {
+			conn_t *conn = &conns[c];
+			bool ok = true;
+
+			if (conn->state == CONN_UNUSED)
+				continue;
+			if (fd_isset(conn->client_sock, &read_fds))
+				ok = stream_fill(&conn->upstream, conn->client_sock);
+
+			switch (conn->state) {
+			case CONN_CONNECTING:
+				if (fd_isset(conn->proxy_sock, &except_fds)) {
+					int error = 0;
+					int error_len = sizeof(error);
+
+					net->getsockopt(conn->proxy_sock, SOL_SOCKET, SO_ERROR, (char *) &error, &error_len);
+					stats_fail(&conn->stats, "connect", error);
+					ok = false;
+				} else if (fd_isset(conn->proxy_sock, &write_fds)) {
+					/* The peer endpoint connects to the target itself. */
+					conn->state = conn->tunnel != NULL ? CONN_RELAYING : CONN_HANDSHAKE;
+					stats_phase(&conn->stats, PHASE_CONNECT_DONE, now_us());
+				}
+				break;
+			case CONN_HANDSHAKE:
+				if (ok)
+					ok = handle_handshake(conn, &read_fds, &write_fds);
+				break;
+			case CONN_RELAYING:
+				if (ok)
+					ok = handle_relaying(conn, &read_fds, &write_fds);
+				break;
+			default:
+				break;
+			}
+			if (ok && conn->tunnel != NULL && conn->state == CONN_RELAYING)
+				tunnel_grant(conn);
+			if (!ok)
+				close_connection(conn);
+		}
+
+		for (c = 0; c < MAX_TUNNELS; c++) {
+			tunnel_t *tunnel = &tunnels[c];
+			const char *failure;
+			int error = 0;
+
+			if (tunnel->state == TUNNEL_UNUSED)
+				continue;
+			failure = handle_tunnel(tunnel, &read_fds, &write_fds, &except_fds, &error);
+			if (failure == NULL && tunnel->state != TUNNEL_OPEN && now_us() >= tunnel->started + TUNNEL_AUTH_TIMEOUT * (int64_t) 1000)
+				failure = "timeout";
+			if (failure == NULL && tunnel->state == TUNNEL_OPEN)
+				fill_tunnel(tunnel);
+			if (failure == NULL && tunnel->state >= TUNNEL_AUTH && !flush_tunnel(tunnel, &error))
+				failure = "write";
+			if (failure != NULL)
+				close_tunnel(tunnel, failure, error);
+		}
+		if (tunnel_listen_sock != INVALID_SOCKET && fd_isset(tunnel_listen_sock, &read_fds))
+			accept_tunnel();
+
+		for (c = 0; c < listener_count; c++) {
+			if (fd_isset(listeners[c].sock, &read_fds)) {
+				for (int a = 0; a < ACCEPT_BATCH && accept_connection(&listeners[c], now_us()); a++)
+					;
+			}
+		}
+		if (path_key[0] != '\0' && relay_stats.path == PATH_UNKNOWN && probe_start != 0)
+			check_probe(&write_fds, &except_fds, now_us());
+		if (control_sock != INVALID_SOCKET)
+			handle_control_clients(&read_fds);
+		if (relay_handed_off)
+			break;
+		if (stats_sock != INVALID_SOCKET)
+			handle_stats_requests(&read_fds);
+	}
+
+	if (link_emulation || config_path != NULL)
+		timeEndPeriod(1);
+	capture_close();
+	stats_close_events();
+	if (stats_path != NULL)
+		update_stats(now_us());
+	if (stats_sock != INVALID_SOCKET) {
+		for (c = 0; c < MAX_HTTP_CLIENTS; c++) {
+			if (http_socks[c] != INVALID_SOCKET)
+				net->closesocket(http_socks[c]); /* Ignore errors */
+		}
+		net->closesocket(stats_sock); /* Ignore errors */
+	}
+	if (control_sock != INVALID_SOCKET) {
+		for (c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+			if (control_clients[c].sock != INVALID_SOCKET)
+				net->closesocket(control_clients[c].sock); /* Ignore errors */
+		}
+		net->closesocket(control_sock); /* Ignore errors */
+	}
+	if (probe_sock != INVALID_SOCKET)
+		net->closesocket(probe_sock); /* Ignore errors */
+	for (c = 0; c < MAX_TUNNELS; c++) {
+		if (tunnels[c].state != TUNNEL_UNUSED)
+			close_tunnel(&tunnels[c], NULL, 0);
+	}
+	for (c = 0; c < pending_count; c++)
+		net->closesocket(pending[(pending_head + c) % MAX_PENDING].sock); /* Ignore errors */
+	/* Only left after a handoff; the sockets stay open in the new relay. */
+	for (c = 0; c < MAX_CONNECTIONS; c++) {
+		if (conns[c].state != CONN_UNUSED) {
+			net->closesocket(conns[c].client_sock); /* Ignore errors */
+			net->closesocket(conns[c].proxy_sock); /* Ignore errors */
+		}
+	}
+	for (c = 0; c < listener_count; c++) {
+		if (net->closesocket(listeners[c].sock) != 0)
+			die("Cannot close client connection: %s\n", wsa_errstr());
+	}
 }
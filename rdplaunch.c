@@ -26,6 +26,9 @@
 #include "rdpvnclaunch.h"
 
 #define DEFAULT_TMPFILE_TEMPLATE L"rdplaunch-XXXXXX.rdp"
+#define TMPFILE_DIRECTIVE L"tmpfile template:s:"
+#define COMMAND_DIRECTIVE L"command line:s:"
+#define ENCODING_DIRECTIVE L"output encoding:s:"
 #define DEFAULT_RDP_TEMPLATE_FILE  L"template.rdp"
 #define DEFAULT_MSTSC_COMMAND  L"mstsc.exe \"@TMPFILE@\" /w:@WIDTH@ /h:@CLIENTHEIGHT@"
 #define DEFAULT_PORT_STR L"3389"
@@ -36,6 +39,8 @@ const char *program_name = "rdplaunch";
 const wchar_t *program_name_w = L"rdplaunch";
 const char version_etc_copyright[] = "Copyright (C) 2012 Oskar Liljeblad";
 
+static const template_syntax_t template_syntax = { TMPFILE_DIRECTIVE, COMMAND_DIRECTIVE, ENCODING_DIRECTIVE };
+
 static wchar_t *encrypt_password_for_rdp_connection(const wchar_t *password)
 {
 	wchar_t *hash;
@@ -59,6 +64,55 @@ static wchar_t *encrypt_password_for_rdp_connection(const wchar_t *password)
 	return hash;
 }
 
+/* Providers of the variables that take system calls to compute. They
+ * only run if the template or command line uses the variable.
+ */
+static wchar_t *provide_password(vartable_t *vars, void *password)
+{
+	return encrypt_password_for_rdp_connection(password);
+}
+
+static wchar_t *provide_width(vartable_t *vars, void *data)
+{
+	RECT workarea;
+
+	if (!SystemParametersInfo(SPI_GETWORKAREA, 0, &workarea, 0))
+		die("Cannot get screen size: %s", system_errstr());
+	return xaswprintf(L"%lu", workarea.right - workarea.left);
+}
+
+static wchar_t *provide_inner_width(vartable_t *vars, void *data)
+{
+	LONG width = wcstol(get_replacement(vars, L"WIDTH"), NULL, 10);
+	LONG framewidth;
+
+	if ((framewidth = GetSystemMetrics(SM_CXSIZEFRAME)) == 0)
+		die("Cannot get window frame width: no error message provided");
+	return xaswprintf(L"%lu", width - framewidth*2);
+}
+
+static wchar_t *provide_client_height(vartable_t *vars, void *data)
+{
+	LONG height;
+
+	if ((height = GetSystemMetrics(SM_CYFULLSCREEN)) == 0)
+		die("Cannot get screen height: no error message provided");
+	return xaswprintf(L"%lu", height);
+}
+
+static wchar_t *provide_inner_height(vartable_t *vars, void *data)
+{
+	LONG height = wcstol(get_replacement(vars, L"CLIENTHEIGHT"), NULL, 10);
+	LONG frameheight;
+	LONG captionheight;
+
+	if ((frameheight = GetSystemMetrics(SM_CYSIZEFRAME)) == 0)
+		die("Cannot get window frame height: no error message provided");
+	if ((captionheight = GetSystemMetrics(SM_CYCAPTION)) == 0)
+		die("Cannot get window caption height: no error message provided");
+	return xaswprintf(L"%lu", height - frameheight - captionheight);
+}
+
 static void prepare_registry_for_rdp_connection (const wchar_t *hostname)
 {
 	wchar_t *key_name;
@@ -99,27 +153,27 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
 {
 	BOOL admin_mode = FALSE;
 	BOOL credssp_support = FALSE;
-	wchar_t *template_file;
+	wchar_t *template_file = NULL;
     wchar_t *proxy_host = NULL;
     wchar_t *proxy_port;
-	wchar_t *search_replace[] = {
-		L"USERNAME", NULL,
-		L"PASSWORD", NULL,
-		L"HOSTNAME", NULL,
-		L"PORT", NULL,
-		L"WIDTH", NULL,
-		L"INNERWIDTH", NULL,
-		L"CLIENTHEIGHT", NULL,		/* Height of screen excluding task bar */
-		L"INNERHEIGHT", NULL,		/* Height of screen excluding task bar and top and bottom window frames */
-		L"TMPFILE", NULL,
-		L"ADMINMODE", NULL,			/* "1" if admin_mode, otherwise "0" */
-		L"TITLE", NULL,
-		L"CREDSSP", NULL,			/* "1" if credssp_support, otherwise "0" */
-		NULL
-	};
+	vartable_t *vars = vartable_new();
+	bool import_env = false;
+
+	/* Variables set by the program, in addition to those given with -D. */
+	define_variable(vars, L"USERNAME");
+	define_variable(vars, L"PASSWORD");
+	define_variable(vars, L"HOSTNAME");
+	define_variable(vars, L"PORT");
+	define_variable(vars, L"WIDTH");
+	define_variable(vars, L"INNERWIDTH");
+	define_variable(vars, L"CLIENTHEIGHT");	/* Height of screen excluding task bar */
+	define_variable(vars, L"INNERHEIGHT");	/* Height of screen excluding task bar and top and bottom window frames */
+	define_variable(vars, L"TMPFILE");
+	define_variable(vars, L"ADMINMODE");		/* "1" if admin_mode, otherwise "0" */
+	define_variable(vars, L"TITLE");
+	define_variable(vars, L"CREDSSP");		/* "1" if credssp_support, otherwise "0" */
 
 	srand(time(NULL));
-	template_file = xwcsdup(DEFAULT_RDP_TEMPLATE_FILE);
     proxy_port = xwcsdup(DEFAULT_PROXY_PORT);
 
 	int argc;
@@ -139,27 +193,36 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
 				case 'h':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"HOSTNAME", xwcsdup(argv[++c]));
+					set_replacement(vars, L"HOSTNAME", xwcsdup(argv[++c]));
 					break;
 				case 'u':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"USERNAME", xwcsdup(argv[++c]));
+					set_replacement(vars, L"USERNAME", xwcsdup(argv[++c]));
 					break;
 				case 'p':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"PASSWORD", xwcsdup(argv[++c]));
+					set_replacement(vars, L"PASSWORD", xwcsdup(argv[++c]));
 					break;
 				case 'P':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"PORT", xwcsdup(argv[++c]));
+					set_replacement(vars, L"PORT", xwcsdup(argv[++c]));
 					break;
 				case 't':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"TITLE", xwcsdup(argv[++c]));
+					set_replacement(vars, L"TITLE", xwcsdup(argv[++c]));
+					break;
+				case 'D':
+					if (c+1 >= argc)
+						die("Missing required parameter for option -%c.", argv[c][1]);
+					if (!set_variable_assignment(vars, argv[++c]))
+						die("Invalid variable assignment `%ls', expected KEY=VALUE.", argv[c]);
+					break;
+				case 'E':
+					import_env = true;
 					break;
 				case 'T':
 					if (c+1 >= argc)
@@ -179,6 +242,11 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
                     free(proxy_port);
                     proxy_port = xwcsdup(argv[++c]);
                     break;
+				case 'O':
+					if (c+1 >= argc)
+						die("Missing required parameter for option -%c.", argv[c][1]);
+					set_proxy_option(argv[++c]);
+					break;
                 case 'H':
                     inform(
                             "Usage: %s [OPTION]...\n"
@@ -196,11 +264,18 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
                             "  -t TITLE\n"
                             "    Title of Remote Desktop window.\n"
                             "  -T FILE\n"
-                            "    Path of an alternate template file. Default is %ls.\n"
+                            "    Path of an alternate template file. Default is the built-in\n"
+                            "    template, compiled from %ls.\n"
+                            "  -D KEY=VALUE\n"
+                            "    Set a template variable, used as @KEY@ in the template.\n"
+                            "  -E\n"
+                            "    Make environment variables available as template variables.\n"
                             "  -s HOST\n"
                             "    Name or address of a SOCKS4 proxy to connect through.\n"
                             "  -S PORT\n"
                             "    Port number of SOCKS4 proxy. Default is %ls.\n"
+                            "  -O NAME=VALUE\n"
+                            "    Set a relay option. See README for available options.\n"
                             "  -a\n"
                             "    Connect to administrative (console) session.\n"
 							"  -c\n"
@@ -231,101 +306,72 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
 	}
 	LocalFree(argv);
 
-    wchar_t *hostname = get_replacement(search_replace, L"HOSTNAME");
+    wchar_t *hostname = get_replacement(vars, L"HOSTNAME");
     if (hostname == NULL)
 		die("Missing hostname.");
-    wchar_t *port = get_replacement(search_replace, L"PORT");
+    wchar_t *port = get_replacement(vars, L"PORT");
 	if (port == NULL)
-		port = set_replacement(search_replace, L"PORT", xwcsdup(DEFAULT_PORT_STR));
+		port = set_replacement(vars, L"PORT", xwcsdup(DEFAULT_PORT_STR));
 
-	if (get_replacement(search_replace, L"USERNAME") == NULL)
+	if (get_replacement(vars, L"USERNAME") == NULL)
 		die("Missing username.");
-	wchar_t *password = get_replacement(search_replace, L"PASSWORD");
-	if (password == NULL)
+	if (get_replacement(vars, L"PASSWORD") == NULL)
 		die("Missing password.");
+	wchar_t *password = xwcsdup(get_replacement(vars, L"PASSWORD"));
 
-	RECT workarea;
-	if (!SystemParametersInfo(SPI_GETWORKAREA, 0, &workarea, 0))
-		die("Cannot get screen size: %s", system_errstr());
-	LONG width = workarea.right - workarea.left;
-	set_replacement(search_replace, L"WIDTH", xaswprintf(L"%lu", width));
+	set_provider(vars, L"WIDTH", provide_width, NULL);
+	set_provider(vars, L"INNERWIDTH", provide_inner_width, NULL);
+	set_provider(vars, L"CLIENTHEIGHT", provide_client_height, NULL);
+	set_provider(vars, L"INNERHEIGHT", provide_inner_height, NULL);
 
-	LONG framewidth;
-	if ((framewidth = GetSystemMetrics(SM_CXSIZEFRAME)) == 0)
-		die("Cannot get window frame width: no error message provided");
-	set_replacement(search_replace, L"INNERWIDTH", xaswprintf(L"%lu", width - framewidth*2));
+	set_replacement(vars, L"ADMINMODE", xwcsdup(admin_mode ? L"1" : L"0"));
+	set_replacement(vars, L"CREDSSP", xwcsdup(credssp_support ? L"1" : L"0"));
 
-	LONG height;
-	if ((height = GetSystemMetrics(SM_CYFULLSCREEN)) == 0)
-		die("Cannot get screen height: no error message provided");
-	set_replacement(search_replace, L"CLIENTHEIGHT", xaswprintf(L"%lu", height));
-	LONG frameheight;
-	if ((frameheight = GetSystemMetrics(SM_CYSIZEFRAME)) == 0)
-		die("Cannot get window frame height: no error message provided");
-	LONG captionheight;
-	if ((captionheight = GetSystemMetrics(SM_CYCAPTION)) == 0)
-		die("Cannot get window caption height: no error message provided");
-	set_replacement(search_replace, L"INNERHEIGHT", xaswprintf(L"%lu", height - frameheight - captionheight));
-
-	set_replacement(search_replace, L"ADMINMODE", xwcsdup(admin_mode ? L"1" : L"0"));
-	set_replacement(search_replace, L"CREDSSP", xwcsdup(credssp_support ? L"1" : L"0"));
-
-	if (get_replacement(search_replace, L"TITLE") == NULL)
-		set_replacement(search_replace, L"TITLE", xwcsdup(hostname));
+	if (get_replacement(vars, L"TITLE") == NULL)
+		set_replacement(vars, L"TITLE", xwcsdup(hostname));
 
     if (proxy_host != NULL) {
+        wchar_t *listen_host;
         int listen_port;
 
-        listen_port = prepare_proxy(proxy_host, proxy_port, hostname, get_replacement(search_replace, L"PORT"));
-        hostname = set_replacement(search_replace, L"HOSTNAME", xwcsdup(L"127.0.0.1"));
-        port = set_replacement(search_replace, L"PORT", xaswprintf(L"%d", listen_port));
+        listen_port = prepare_proxy(proxy_host, proxy_port, hostname, get_replacement(vars, L"PORT"), &listen_host);
+        hostname = set_replacement(vars, L"HOSTNAME", listen_host);
+        port = set_replacement(vars, L"PORT", xaswprintf(L"%d", listen_port));
     }
     prepare_registry_for_rdp_connection(hostname);
-	set_replacement(search_replace, L"PASSWORD", encrypt_password_for_rdp_connection(password));
+	set_provider(vars, L"PASSWORD", provide_password, password);
 
 	wchar_t *command = xwcsdup(DEFAULT_MSTSC_COMMAND);
 	wchar_t *tmpfile_template = xwcsdup(DEFAULT_TMPFILE_TEMPLATE);
 
-	FILE *in_fh;
+	if (import_env)
+		import_environment(vars);
+
 	wcsbuf_t *inbuf = wcsbuf_new();
-	wcsbuf_t *outbuf = wcsbuf_new();
-	if ((in_fh = _wfopen(template_file, L"r, ccs=UNICODE")) == NULL)
-		die("Cannot open file `%ls' for reading: %s", template_file, errno_errstr());
-	while ((inbuf->len = wgetline(&inbuf->data, &inbuf->size, in_fh)) >= 0) {
-		if (inbuf->data[0] != '#' && inbuf->data[0] != '\n' && !(inbuf->data[0] == '\r' && inbuf->data[1] == '\n')) {
-			if (wcsncmp(inbuf->data, L"tmpfile template:s:", 19) == 0) {
-				chomp_string(inbuf->data + 19);
-				free(tmpfile_template);
-				tmpfile_template = xwcsdup(inbuf->data + 19);
-			} else if (wcsncmp(inbuf->data, L"command line:s:", 15) == 0) {
-				chomp_string(inbuf->data+15);
-				free(command);
-				command = xwcsdup(inbuf->data+15);
-			} else {
-				expand_line(inbuf, search_replace);
-				wcsbuf_append_wcsbuf(outbuf, inbuf);
-			}
-		}
+	template_t *template;
+	if (template_file != NULL) {
+		template = template_load(template_file, &template_syntax, vars);
+		free(template_file);
+	} else {
+		template = template_embedded(&embedded_template, vars);
+	}
+	if (template->tmpfile_template != NULL) {
+		free(tmpfile_template);
+		tmpfile_template = xwcsdup(template->tmpfile_template);
 	}
-	if (ferror(in_fh))
-		die("Cannot read from file `%ls': %s", template_file, errno_errstr());
-	fclose(in_fh);
-	free(template_file);
-
-	FILE *out_fh;
-	wchar_t *tmpfile = get_temp_file_expanded(tmpfile_template, search_replace);
-	set_replacement(search_replace, L"TMPFILE", tmpfile);
-	if ((out_fh = _wfopen(tmpfile, L"wT, ccs=UTF-16LE")) == NULL)
-		die("Cannot open file `%ls' for writing: %s", tmpfile, errno_errstr());
-	if (fwrite(outbuf->data, outbuf->len * sizeof(wchar_t), 1, out_fh) < 0)
-		die("Cannot write to file `%ls': %s", tmpfile, errno_errstr());
-	if (fclose(out_fh) < 0)
-		die("Cannot close file `%ls': %s", tmpfile, errno_errstr());
-	wcsbuf_free(outbuf);
+	if (template->command != NULL) {
+		free(command);
+		command = xwcsdup(template->command);
+	}
+
+	wchar_t *tmpfile = get_temp_file_expanded(tmpfile_template, vars);
+	set_replacement(vars, L"TMPFILE", tmpfile);
+	template_write(template, vars, tmpfile, template->encoding);
+	template_free(template);
 
 	wcsbuf_set_wcs(inbuf, command);
 	free(command);
-	expand_line(inbuf, search_replace);
+	expand_line(inbuf, vars);
 
 	STARTUPINFOW startupinfo;
 	PROCESS_INFORMATION procinfo;
@@ -355,8 +401,8 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
 	if (!DeleteFileW(tmpfile))
 		die("Cannot delete temporary file `%ls': %s", tmpfile, system_errstr());
 
-	for (int c = 0; search_replace[c] != NULL; c += 2)
-		free(search_replace[c+1]);
+	vartable_free(vars);
 	wcsbuf_free(inbuf);
+	free(password);
 	return 0;
 }
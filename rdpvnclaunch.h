@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #define EOVERFLOW 2006
 #define NIBBLE_TO_UCHAR(x) ((x) < 10 ? '0'+(x) : 'A'+(x)-10)
@@ -39,21 +41,143 @@ typedef struct {
     ssize_t len;
 } wcsbuf_t;
 
+typedef enum {
+	ENCODING_UTF16LE,
+	ENCODING_UTF8,
+	ENCODING_UTF16BE,			/* Input only */
+	ENCODING_ANSI,				/* Input only */
+} encoding_t;
+
+/* Most bytes encode_utf8 writes for len UTF-16 units. */
+#define ENCODE_UTF8_MAX(len) (3 * (len) + 3)
+
+/* Vector code paths are built for x86 and chosen at run time. */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Positions asked of scan_chars at a time when finding placeholders.
+ * Must be even, as they come in pairs.
+ */
+#define SCAN_BATCH 64
+
+typedef struct {
+	const char *name;
+	size_t (*scan)(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max);
+	bool (*supported)(void);	/* NULL if always supported */
+} scanner_t;
+
+typedef struct {
+	const wchar_t *tmpfile;		/* Prefixes of the template directives */
+	const wchar_t *command;
+	const wchar_t *encoding;
+} template_syntax_t;
+
+struct vartable;
+
+/* Computes the value of a variable the first time it is used. */
+typedef wchar_t *(*provider_t)(struct vartable *vars, void *data);
+
+typedef struct {
+	wchar_t *key;
+	uint32_t hash;
+	wchar_t *value;				/* NULL if not set */
+	provider_t provider;		/* NULL if value is set or not provided */
+	void *provider_data;
+} variable_t;
+
+typedef struct vartable {
+	variable_t *vars;			/* Indexed by slot */
+	size_t count;
+	size_t size;
+	int *index;					/* Hash index of slots, -1 if free */
+	size_t index_size;			/* Power of two */
+} vartable_t;
+
+typedef struct {
+	size_t offset;				/* Start of literal text in pool */
+	size_t len;
+	int slot;					/* Variable index, or -1 for literal text */
+	bool placeholder;			/* "@NAME@", literal if NAME is not a variable */
+} template_token_t;
+
+typedef struct {
+	wchar_t *pool;				/* Template text */
+	size_t pool_len;
+	size_t pool_size;
+	template_token_t *tokens;
+	size_t token_count;
+	size_t token_size;
+	wchar_t *tmpfile_template;	/* From directives, NULL if not given */
+	wchar_t *command;
+	void *view;					/* Mapped file holding pool, or NULL */
+	encoding_t encoding;		/* Output encoding */
+} template_t;
+
+typedef struct {
+	uint32_t offset;
+	uint32_t len;
+	bool placeholder;
+} embedded_token_t;
+
+typedef struct {
+	const wchar_t *pool;
+	size_t pool_len;
+	const embedded_token_t *tokens;
+	size_t token_count;
+	const wchar_t *tmpfile_template;	/* NULL if not given */
+	const wchar_t *command;
+	encoding_t encoding;
+} embedded_template_t;
+
 /* rdplaunch.c / vnclaunch.c */
 extern const char *program_name;
 extern const wchar_t *program_name_w;
 
+/* rdptemplate.c / vnctemplate.c, generated by tplgen */
+extern const embedded_template_t embedded_template;
+
 /* proxy.c */
-extern uint16_t prepare_proxy (const wchar_t *proxy_host, const wchar_t *port, const wchar_t *connect_host, const wchar_t *connect_port);
+extern uint16_t prepare_proxy (const wchar_t *proxy_host, const wchar_t *port, const wchar_t *connect_host, const wchar_t *connect_port, wchar_t **listen_host);
 extern void handle_proxy (void);
+extern void set_proxy_option (const wchar_t *option);
+extern void prepare_tunnel_peer (const wchar_t *listen_host, const wchar_t *listen_port);
 
 /* cfggen.c */
-extern void expand_line(wcsbuf_t *buf, wchar_t **search_replace);
-extern wchar_t *set_replacement(wchar_t **search_replace, const wchar_t *key, wchar_t *value);
-extern wchar_t *get_replacement(wchar_t **search_replace, const wchar_t *key);
-extern wchar_t *get_temp_file_expanded(const wchar_t *template, wchar_t **search_replace);
+extern vartable_t *vartable_new(void);
+extern void vartable_free(vartable_t *vars);
+extern int variable_slot(const vartable_t *vars, const wchar_t *name, size_t len);
+extern int define_variable(vartable_t *vars, const wchar_t *key);
+extern bool set_variable_assignment(vartable_t *vars, const wchar_t *assignment);
+extern void import_environment(vartable_t *vars);
+extern template_t *template_new(void);
+extern void template_free(template_t *tpl);
+extern template_t *template_parse(const wchar_t *path, const template_syntax_t *syntax, vartable_t *vars);
+extern template_t *template_embedded(const embedded_template_t *embedded, vartable_t *vars);
+extern template_t *template_load(const wchar_t *path, const template_syntax_t *syntax, vartable_t *vars);
+extern void template_add(template_t *tpl, const wchar_t *text, size_t len, vartable_t *vars);
+extern void template_render(const template_t *tpl, vartable_t *vars, wcsbuf_t *out);
+extern void template_write(const template_t *tpl, vartable_t *vars, const wchar_t *path, encoding_t encoding);
+extern void expand_line(wcsbuf_t *buf, vartable_t *vars);
+extern wchar_t *set_replacement(vartable_t *vars, const wchar_t *key, wchar_t *value);
+extern void set_provider(vartable_t *vars, const wchar_t *key, provider_t provider, void *data);
+extern wchar_t *variable_value(vartable_t *vars, int slot);
+extern wchar_t *get_replacement(vartable_t *vars, const wchar_t *key);
+extern wchar_t *get_temp_file_expanded(const wchar_t *template, vartable_t *vars);
 extern void chomp_string(wchar_t *str);
 
+/* encoding.c */
+extern bool parse_encoding(const wchar_t *name, encoding_t *encoding);
+extern encoding_t detect_encoding(const char *data, size_t size, size_t *bom_len);
+extern wchar_t *decode_text(const char *data, size_t size, encoding_t encoding, size_t *len);
+extern size_t encode_utf8(const wchar_t *str, size_t len, char *out, wchar_t *high_surrogate);
+
+/* scan.c */
+extern bool cpu_has_sse2(void);
+extern bool cpu_has_avx2(void);
+extern size_t get_scanners(const scanner_t **scanners);
+extern size_t scan_chars(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max);
+
 /* wow64.c */
 extern BOOL is_running_in_wow64(void);
 
@@ -0,0 +1,1235 @@
+/* relaybench.c - Measure relay throughput and latency
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* The benchmark runs everything in one process: a SOCKS server stand-in,
+ * a target that answers each request with a reply of the requested size,
+ * the relay from proxy.c, and a load generator. Each traffic pattern is
+ * run once directly against the target and once through the SOCKS
+ * stand-in and the relay; the difference is what the relay adds.
+ * Instead of the built-in patterns, a chunk trace converted from a relay
+ * capture file by capread can be replayed.
+ *
+ * With -H the relay is a shared one, and partway through a pattern a
+ * second relaybench process started with -T takes it over. The load
+ * generator keeps running across the handoff and must not see any
+ * exchange fail.
+ *
+ * With -F the relay runs on socket operations that make some of its
+ * receives and sends short and fail some calls on non-blocking sockets
+ * with WSAEWOULDBLOCK, as a loaded network and kernel may. The relay
+ * must still carry every byte, so no exchange may fail either.
+ *
+ * With -C each pattern is run through the relay alternately with and
+ * without the capture given by -O capture=FILE, and the best throughput
+ * of each is compared. Capture must not cost more than
+ * CAPTURE_MAX_OVERHEAD percent of it.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include "rdpvnclaunch.h"
+#include "stats.h"
+#include "capture.h"
+#include "netops.h"
+
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_EXCHANGES 1000
+#define DEFAULT_TARGET_PORT 33890	/* Fixed so that the relay reuses one loopback alias */
+#define CONNECT_RATE_COUNT 200
+#define MAX_WORKERS 32			/* Connections the relay serves at once */
+#define REQUEST_HEADER_SIZE 8
+#define BENCH_BUFSIZE 65536
+#define REPLAY_START_DELAY 200000	/* Microseconds for connection setup before a replay */
+#define HANDOFF_SHARED_PORT 33891	/* Control port of the relay handed off with -H */
+#define HANDOFF_TIMEOUT 30000		/* Milliseconds for the new process to take over */
+#define MAX_RELAY_OPTIONS 64
+#define MAX_FAULT_SOCKETS 256		/* Non-blocking sockets tracked with -F */
+#define CAPTURE_ROUNDS 3			/* Runs with and without capture compared with -C */
+#define CAPTURE_MAX_OVERHEAD 5.0	/* Percent of relay throughput capture may cost */
+
+const char *program_name = "relaybench";
+const wchar_t *program_name_w = L"relaybench";
+
+/* One exchange is a request of request_size bytes from the viewer side,
+ * answered by reply_size bytes from the target. The first eight bytes
+ * of a request hold both sizes.
+ */
+typedef struct {
+	const char *name;
+	uint32_t request_size;
+	uint32_t reply_size;
+} pattern_t;
+
+typedef struct {
+	SOCKET sock;
+	LPTHREAD_START_ROUTINE func;	/* Run for each accepted connection */
+} server_t;
+
+typedef struct {
+	struct sockaddr_in addr;
+	const pattern_t *pattern;
+	int exchanges;
+	histogram_t latency;		/* Microseconds per exchange */
+	uint64_t bytes;
+} worker_t;
+
+typedef struct {
+	double mb_per_s;
+	double cpu_s_per_gb;
+	histogram_t latency;
+} result_t;
+
+/* One direction of a connection in a replayed trace. */
+typedef struct {
+	int count;
+	int64_t *time;				/* Microseconds from the start of the trace */
+	uint32_t *size;
+	volatile int64_t *sent;		/* Time when sending of each chunk started */
+	int64_t *latency;			/* Microseconds until each chunk was received */
+} replay_flow_t;
+
+typedef struct {
+	uint32_t id;				/* Connection number in the trace */
+	replay_flow_t flow[2];		/* Viewer to server, server to viewer */
+} replay_conn_t;
+
+/* A socket and the trace direction to send or receive on it. */
+typedef struct {
+	SOCKET sock;
+	replay_flow_t *flow;
+} replay_side_t;
+
+typedef struct {
+	histogram_t latency[2];
+	double jitter[2];			/* Mean difference in latency of consecutive chunks */
+} replay_result_t;
+
+static const pattern_t patterns[] = {
+	{ "interactive", 64, 64 },			/* Keystrokes and small screen updates */
+	{ "bulk", 64, 256 * 1024 },			/* Bitmap bursts from the server */
+	{ "upload", 256 * 1024, 64 },		/* Clipboard and file transfer to the server */
+};
+
+static int64_t clock_freq;
+static struct sockaddr_in target_addr;
+static worker_t workers[MAX_WORKERS];
+static replay_conn_t replay_conns[MAX_WORKERS];
+static int replay_conn_count;
+static int replay_skipped;		/* Chunks of connections beyond MAX_WORKERS */
+static double replay_speed = 1;
+static int64_t replay_start;
+static LONG replay_remaining;	/* Flows not yet fully received */
+static HANDLE replay_done;
+static struct sockaddr_in replay_addr;
+static volatile LONG exchanges_done;
+static wchar_t *relay_options[MAX_RELAY_OPTIONS];	/* Passed on to the process taking over */
+static int relay_option_count;
+static PROCESS_INFORMATION takeover_process;
+static net_ops_t fault_net_ops;
+static int fault_percent;
+static uint32_t fault_state = 1;
+static SOCKET nonblocking_socks[MAX_FAULT_SOCKETS];
+static int nonblocking_count;
+static uint64_t short_faults;
+static uint64_t would_block_faults;
+
+static void
+fatal (const char *fmt, ...)
+{
+	va_list argv;
+
+	fprintf(stderr, "%s: ", program_name);
+	va_start(argv, fmt);
+	vfprintf(stderr, fmt, argv);
+	va_end(argv);
+	exit(1);
+}
+
+static char *
+wsa_errstr (void)
+{
+	return system_errstr_error(WSAGetLastError());
+}
+
+static int64_t
+now_us (void)
+{
+	LARGE_INTEGER count;
+
+	if (clock_freq == 0) {
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		clock_freq = freq.QuadPart;
+	}
+	QueryPerformanceCounter(&count);
+	return count.QuadPart / clock_freq * 1000000 + count.QuadPart % clock_freq * 1000000 / clock_freq;
+}
+
+/* Return user and kernel time used by the process, in microseconds. */
+static int64_t
+cpu_us (void)
+{
+	FILETIME creation, exit, kernel, user;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		fatal("Cannot get process times: %s\n", system_errstr());
+	return ((((int64_t) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime)
+		+ (((int64_t) user.dwHighDateTime << 32) | user.dwLowDateTime)) / 10;
+}
+
+static bool
+full_recv (SOCKET sock, void *buf, int count)
+{
+	char *ptr = buf;
+
+	while (count > 0) {
+		int len = recv(sock, ptr, count, 0);
+		if (len == SOCKET_ERROR || len == 0)
+			return false;
+		ptr += len;
+		count -= len;
+	}
+	return true;
+}
+
+static bool
+full_send (SOCKET sock, const void *buf, int count)
+{
+	const char *ptr = buf;
+
+	while (count > 0) {
+		int len = send(sock, ptr, count, 0);
+		if (len == SOCKET_ERROR)
+			return false;
+		ptr += len;
+		count -= len;
+	}
+	return true;
+}
+
+/* Receive and discard count bytes. */
+static bool
+drain (SOCKET sock, uint32_t count)
+{
+	char buf[BENCH_BUFSIZE];
+
+	while (count > 0) {
+		int len = recv(sock, buf, count < sizeof(buf) ? count : sizeof(buf), 0);
+		if (len == SOCKET_ERROR || len == 0)
+			return false;
+		count -= len;
+	}
+	return true;
+}
+
+/* Send count bytes of filler. */
+static bool
+fill (SOCKET sock, uint32_t count)
+{
+	static const char buf[BENCH_BUFSIZE];
+
+	while (count > 0) {
+		int len = count < sizeof(buf) ? count : sizeof(buf);
+		if (!full_send(sock, buf, len))
+			return false;
+		count -= len;
+	}
+	return true;
+}
+
+static SOCKET
+open_listener (struct sockaddr_in *addr)
+{
+	int addr_len = sizeof(*addr);
+	SOCKET sock;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET)
+		fatal("Cannot create socket: %s\n", wsa_errstr());
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *) addr, sizeof(*addr)) != 0)
+		fatal("Cannot bind to port %u: %s\n", ntohs(addr->sin_port), wsa_errstr());
+	if (listen(sock, SOMAXCONN) != 0)
+		fatal("Cannot listen for connections: %s\n", wsa_errstr());
+	if (getsockname(sock, (struct sockaddr *) addr, &addr_len) != 0)
+		fatal("Cannot get socket address: %s\n", wsa_errstr());
+	return sock;
+}
+
+static SOCKET
+connect_to (const struct sockaddr_in *addr)
+{
+	BOOL nodelay = TRUE;
+	SOCKET sock;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET)
+		fatal("Cannot create socket: %s\n", wsa_errstr());
+	if (connect(sock, (const struct sockaddr *) addr, sizeof(*addr)) != 0)
+		fatal("Cannot connect to %s port %u: %s\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), wsa_errstr());
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &nodelay, sizeof(nodelay)); /* Ignore errors */
+	return sock;
+}
+
+static DWORD WINAPI
+accept_thread (void *arg)
+{
+	server_t *server = arg;
+
+	for (;;) {
+		SOCKET client = accept(server->sock, NULL, NULL);
+		HANDLE thread;
+
+		if (client == INVALID_SOCKET)
+			fatal("Cannot accept connection: %s\n", wsa_errstr());
+		thread = CreateThread(NULL, 0, server->func, (void *) client, 0, NULL);
+		if (thread == NULL)
+			fatal("Cannot create thread: %s\n", system_errstr());
+		CloseHandle(thread);
+	}
+	return 0;
+}
+
+/* Run func in a new thread for every connection accepted on sock. */
+static void
+start_server (server_t *server)
+{
+	HANDLE thread;
+
+	thread = CreateThread(NULL, 0, accept_thread, server, 0, NULL);
+	if (thread == NULL)
+		fatal("Cannot create thread: %s\n", system_errstr());
+	CloseHandle(thread);
+}
+
+static void replay_target (SOCKET sock, uint32_t index);
+
+/* target_connection:
+ * The echo/sink target: answer each request with a reply of the size
+ * given in its header, until the connection is closed. A header with a
+ * request size of 0 starts replaying the trace connection given by the
+ * second field instead.
+ */
+static DWORD WINAPI
+target_connection (void *arg)
+{
+	SOCKET sock = (SOCKET) arg;
+	BOOL nodelay = TRUE;
+	uint32_t header[2];
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &nodelay, sizeof(nodelay)); /* Ignore errors */
+	while (full_recv(sock, header, sizeof(header))) {
+		if (header[0] == 0) {
+			replay_target(sock, header[1]);
+			return 0;
+		}
+		if (!drain(sock, header[0] - REQUEST_HEADER_SIZE) || !fill(sock, header[1]))
+			break;
+	}
+	closesocket(sock); /* Ignore errors */
+	return 0;
+}
+
+/* socks_connection:
+ * The SOCKS server stand-in: accept a SOCKS4 or SOCKS5 CONNECT request
+ * without authentication, connect to the target and pass data both ways.
+ */
+static DWORD WINAPI
+socks_connection (void *arg)
+{
+	SOCKET client = (SOCKET) arg;
+	SOCKET server = INVALID_SOCKET;
+	struct sockaddr_in addr;
+	unsigned char buf[BENCH_BUFSIZE];
+	fd_set fds;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	if (!full_recv(client, buf, 1))
+		goto done;
+	if (buf[0] == 4) {
+		static const unsigned char reply[8] = { 0, 0x5A };
+
+		/* Command, port, address and a NUL-terminated user ID */
+		if (!full_recv(client, buf + 1, 7) || buf[1] != 1)
+			goto done;
+		do {
+			if (!full_recv(client, buf + 8, 1))
+				goto done;
+		} while (buf[8] != '\0');
+		memcpy(&addr.sin_port, buf + 2, 2);
+		memcpy(&addr.sin_addr, buf + 4, 4);
+		server = connect_to(&addr);
+		if (!full_send(client, reply, sizeof(reply)))
+			goto done;
+	} else if (buf[0] == 5) {
+		static const unsigned char method[2] = { 5, 0 };
+		static const unsigned char reply[10] = { 5, 0, 0, 1 };
+
+		/* Methods, then version, command, reserved, IPv4 address type */
+		if (!full_recv(client, buf + 1, 1) || !full_recv(client, buf + 2, buf[1])
+				|| !full_send(client, method, sizeof(method))
+				|| !full_recv(client, buf, 10) || buf[1] != 1 || buf[3] != 1)
+			goto done;
+		memcpy(&addr.sin_addr, buf + 4, 4);
+		memcpy(&addr.sin_port, buf + 8, 2);
+		server = connect_to(&addr);
+		if (!full_send(client, reply, sizeof(reply)))
+			goto done;
+	} else {
+		goto done;
+	}
+
+	for (;;) {
+		int len;
+
+		FD_ZERO(&fds);
+		FD_SET(client, &fds);
+		FD_SET(server, &fds);
+		if (select(0, &fds, NULL, NULL, NULL) == SOCKET_ERROR)
+			break;
+		if (FD_ISSET(client, &fds)) {
+			len = recv(client, (char *) buf, sizeof(buf), 0);
+			if (len == SOCKET_ERROR || len == 0 || !full_send(server, buf, len))
+				break;
+		}
+		if (FD_ISSET(server, &fds)) {
+			len = recv(server, (char *) buf, sizeof(buf), 0);
+			if (len == SOCKET_ERROR || len == 0 || !full_send(client, buf, len))
+				break;
+		}
+	}
+
+done:
+	if (server != INVALID_SOCKET)
+		closesocket(server); /* Ignore errors */
+	closesocket(client); /* Ignore errors */
+	return 0;
+}
+
+/* The fault-injecting socket operations are only called from the relay
+ * thread, so they need no locking.
+ */
+static uint32_t
+fault_random (void)
+{
+	fault_state ^= fault_state << 13;
+	fault_state ^= fault_state >> 17;
+	fault_state ^= fault_state << 5;
+	return fault_state;
+}
+
+static bool
+fault_hit (void)
+{
+	return fault_random() % 100 < fault_percent;
+}
+
+static int
+find_nonblocking (SOCKET sock)
+{
+	for (int c = 0; c < nonblocking_count; c++) {
+		if (nonblocking_socks[c] == sock)
+			return c;
+	}
+	return -1;
+}
+
+/* Only calls on non-blocking sockets may fail with WSAEWOULDBLOCK. */
+static void
+set_nonblocking (SOCKET sock, bool nonblocking)
+{
+	int c = find_nonblocking(sock);
+
+	if (nonblocking && c < 0) {
+		if (nonblocking_count >= MAX_FAULT_SOCKETS)
+			fatal("Too many sockets for fault injection\n");
+		nonblocking_socks[nonblocking_count++] = sock;
+	} else if (!nonblocking && c >= 0) {
+		nonblocking_socks[c] = nonblocking_socks[--nonblocking_count];
+	}
+}
+
+/* Return a length for a short transfer of len bytes, or fail it with
+ * WSAEWOULDBLOCK and return SOCKET_ERROR. Sends on blocking sockets
+ * are never short in Winsock, so they are left alone.
+ */
+static int
+fault_len (SOCKET sock, int len, bool sending)
+{
+	bool nonblocking = find_nonblocking(sock) >= 0;
+
+	if (nonblocking && (len <= 1 || fault_random() % 2 == 0)) {
+		would_block_faults++;
+		WSASetLastError(WSAEWOULDBLOCK);
+		return SOCKET_ERROR;
+	}
+	if (len > 1 && (nonblocking || !sending)) {
+		short_faults++;
+		len = 1 + fault_random() % (len - 1);
+	}
+	return len;
+}
+
+static SOCKET
+fault_accept (SOCKET sock, struct sockaddr *addr, int *addr_len)
+{
+	SOCKET client;
+
+	if (find_nonblocking(sock) >= 0 && fault_hit()) {
+		would_block_faults++;
+		WSASetLastError(WSAEWOULDBLOCK);
+		return INVALID_SOCKET;
+	}
+	client = accept(sock, addr, addr_len);
+	/* Accepted sockets inherit the mode of the listener. */
+	if (client != INVALID_SOCKET && find_nonblocking(sock) >= 0)
+		set_nonblocking(client, true);
+	return client;
+}
+
+static int
+fault_recv (SOCKET sock, char *buf, int len, int flags)
+{
+	if (fault_hit() && (len = fault_len(sock, len, false)) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	return recv(sock, buf, len, flags);
+}
+
+static int
+fault_send (SOCKET sock, const char *buf, int len, int flags)
+{
+	if (fault_hit() && (len = fault_len(sock, len, true)) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	return send(sock, buf, len, flags);
+}
+
+static int
+fault_ioctlsocket (SOCKET sock, long cmd, u_long *arg)
+{
+	if (ioctlsocket(sock, cmd, arg) != 0)
+		return SOCKET_ERROR;
+	if (cmd == FIONBIO)
+		set_nonblocking(sock, *arg != 0);
+	return 0;
+}
+
+static int
+fault_closesocket (SOCKET sock)
+{
+	set_nonblocking(sock, false);
+	return closesocket(sock);
+}
+
+/* Run the relay on the fault-injecting operations. */
+static void
+install_faults (void)
+{
+	fault_net_ops = winsock_net_ops;
+	fault_net_ops.accept = fault_accept;
+	fault_net_ops.recv = fault_recv;
+	fault_net_ops.send = fault_send;
+	fault_net_ops.ioctlsocket = fault_ioctlsocket;
+	fault_net_ops.closesocket = fault_closesocket;
+	set_proxy_net_ops(&fault_net_ops);
+}
+
+static void
+print_faults (void)
+{
+	if (fault_percent > 0) {
+		printf(",\"faults\":{\"percent\":%d,\"short\":%" PRIu64 ",\"would_block\":%" PRIu64 "}",
+			fault_percent, short_faults, would_block_faults);
+	}
+}
+
+static DWORD WINAPI
+relay_thread (void *arg)
+{
+	handle_proxy();
+	return 0;
+}
+
+/* Run one connection of the load generator. */
+static DWORD WINAPI
+worker_thread (void *arg)
+{
+	worker_t *worker = arg;
+	uint32_t header[2] = { worker->pattern->request_size, worker->pattern->reply_size };
+	SOCKET sock;
+
+	sock = connect_to(&worker->addr);
+	for (int c = 0; c < worker->exchanges; c++) {
+		int64_t start = now_us();
+
+		if (!full_send(sock, header, sizeof(header))
+				|| !fill(sock, header[0] - REQUEST_HEADER_SIZE)
+				|| !drain(sock, header[1]))
+			fatal("Connection closed during %s exchange: %s\n", worker->pattern->name, wsa_errstr());
+		histogram_add(&worker->latency, now_us() - start);
+		worker->bytes += header[0] + header[1];
+		InterlockedIncrement(&exchanges_done);
+	}
+	closesocket(sock); /* Ignore errors */
+	return 0;
+}
+
+static void
+histogram_merge (histogram_t *dest, const histogram_t *src)
+{
+	for (int c = 0; c < HISTOGRAM_BUCKETS; c++)
+		dest->counts[c] += src->counts[c];
+	dest->count += src->count;
+	dest->sum += src->sum;
+	if (src->max > dest->max)
+		dest->max = src->max;
+}
+
+static void
+start_workers (HANDLE *threads, const pattern_t *pattern, const struct sockaddr_in *addr, int connections, int exchanges)
+{
+	exchanges_done = 0;
+	for (int c = 0; c < connections; c++) {
+		memset(&workers[c], 0, sizeof(workers[c]));
+		workers[c].addr = *addr;
+		workers[c].pattern = pattern;
+		workers[c].exchanges = exchanges;
+		threads[c] = CreateThread(NULL, 0, worker_thread, &workers[c], 0, NULL);
+		if (threads[c] == NULL)
+			fatal("Cannot create thread: %s\n", system_errstr());
+	}
+}
+
+/* Wait for the workers and sum up their results, from start and
+ * cpu_start when they were started.
+ */
+static void
+finish_workers (HANDLE *threads, int connections, int64_t start, int64_t cpu_start, result_t *result)
+{
+	uint64_t bytes = 0;
+	int64_t elapsed;
+
+	WaitForMultipleObjects(connections, threads, TRUE, INFINITE);
+	elapsed = now_us() - start;
+	for (int c = 0; c < connections; c++) {
+		CloseHandle(threads[c]);
+		histogram_merge(&result->latency, &workers[c].latency);
+		bytes += workers[c].bytes;
+	}
+	result->mb_per_s = elapsed > 0 ? bytes / (double) elapsed : 0;
+	result->cpu_s_per_gb = bytes > 0 ? (cpu_us() - cpu_start) / 1e6 / (bytes / 1e9) : 0;
+}
+
+static void
+run_pattern (const pattern_t *pattern, const struct sockaddr_in *addr, int connections, int exchanges, result_t *result)
+{
+	HANDLE threads[MAX_WORKERS];
+	int64_t start;
+	int64_t cpu_start;
+
+	memset(result, 0, sizeof(*result));
+	start = now_us();
+	cpu_start = cpu_us();
+	start_workers(threads, pattern, addr, connections, exchanges);
+	finish_workers(threads, connections, start, cpu_start, result);
+}
+
+/* Run a pattern through the relay, and a quarter of the way through
+ * start command to take the relay over. Returns the time until the
+ * relay in this process had handed off.
+ */
+static int64_t
+run_handoff (const pattern_t *pattern, const struct sockaddr_in *addr, int connections, int exchanges, HANDLE relay, wchar_t *command, result_t *result)
+{
+	STARTUPINFOW startupinfo;
+	HANDLE threads[MAX_WORKERS];
+	int64_t handoff_start;
+	int64_t handoff_us;
+	int64_t start;
+	int64_t cpu_start;
+
+	memset(result, 0, sizeof(*result));
+	start = now_us();
+	cpu_start = cpu_us();
+	start_workers(threads, pattern, addr, connections, exchanges);
+	while (exchanges_done < connections * exchanges / 4)
+		Sleep(1);
+
+	memset(&startupinfo, 0, sizeof(startupinfo));
+	startupinfo.cb = sizeof(startupinfo);
+	handoff_start = now_us();
+	if (!CreateProcessW(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &startupinfo, &takeover_process))
+		fatal("Cannot start `%ls': %s\n", command, system_errstr());
+	CloseHandle(takeover_process.hThread);
+	/* The relay loop returns once it has handed off. */
+	if (WaitForSingleObject(relay, HANDOFF_TIMEOUT) != WAIT_OBJECT_0)
+		fatal("Relay was not handed off within %d ms\n", HANDOFF_TIMEOUT);
+	handoff_us = now_us() - handoff_start;
+
+	finish_workers(threads, connections, start, cpu_start, result);
+	return handoff_us;
+}
+
+/* Return connections per second through addr, each doing one small
+ * exchange before it is closed.
+ */
+static double
+connect_rate (const struct sockaddr_in *addr)
+{
+	uint32_t header[2] = { REQUEST_HEADER_SIZE, 1 };
+	int64_t start = now_us();
+
+	for (int c = 0; c < CONNECT_RATE_COUNT; c++) {
+		SOCKET sock = connect_to(addr);
+
+		if (!full_send(sock, header, sizeof(header)) || !drain(sock, header[1]))
+			fatal("Connection closed during connect test: %s\n", wsa_errstr());
+		closesocket(sock); /* Ignore errors */
+	}
+	return CONNECT_RATE_COUNT / ((now_us() - start) / 1e6);
+}
+
+static int64_t
+added (const histogram_t *relay, const histogram_t *direct, double percentile)
+{
+	int64_t diff = histogram_percentile(relay, percentile) - histogram_percentile(direct, percentile);
+	return diff > 0 ? diff : 0;
+}
+
+static void
+add_chunk (replay_flow_t *flow, int64_t time, uint32_t size)
+{
+	if ((flow->count & (flow->count - 1)) == 0) {
+		int alloc = flow->count == 0 ? 1 : flow->count * 2;
+		flow->time = xrealloc(flow->time, alloc * sizeof(*flow->time));
+		flow->size = xrealloc(flow->size, alloc * sizeof(*flow->size));
+	}
+	flow->time[flow->count] = time;
+	flow->size[flow->count] = size;
+	flow->count++;
+}
+
+/* load_trace:
+ * Read a chunk trace in the CSV format written by capread. Chunk times
+ * are made relative to the first chunk. Returns the number of chunks.
+ */
+static int
+load_trace (const char *path)
+{
+	char line[128];
+	int64_t first = INT64_MAX;
+	int chunks = 0;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		fatal("Cannot open file `%s' for reading: %s\n", path, errno_errstr());
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		long long time;
+		unsigned conn;
+		char direction[8];
+		unsigned size;
+		int c;
+
+		if (sscanf(line, "%lld,%u,%7[^,],%u", &time, &conn, direction, &size) != 4)
+			continue;			/* Header line */
+		if (size == 0)
+			continue;
+		for (c = 0; c < replay_conn_count; c++) {
+			if (replay_conns[c].id == conn)
+				break;
+		}
+		if (c == replay_conn_count) {
+			if (replay_conn_count >= MAX_WORKERS) {
+				replay_skipped++;
+				continue;
+			}
+			replay_conns[c].id = conn;
+			replay_conn_count++;
+		}
+		add_chunk(&replay_conns[c].flow[strcmp(direction, "up") == 0 ? STATS_UP : STATS_DOWN], time, size);
+		if (time < first)
+			first = time;
+		chunks++;
+	}
+	if (ferror(fp))
+		fatal("Cannot read from file `%s': %s\n", path, errno_errstr());
+	fclose(fp);
+	if (chunks == 0)
+		fatal("No chunks in trace `%s'\n", path);
+
+	for (int c = 0; c < replay_conn_count; c++) {
+		for (int d = 0; d < 2; d++) {
+			replay_flow_t *flow = &replay_conns[c].flow[d];
+
+			for (int n = 0; n < flow->count; n++)
+				flow->time[n] -= first;
+			flow->sent = xmalloc((flow->count + 1) * sizeof(*flow->sent));
+			flow->latency = xmalloc((flow->count + 1) * sizeof(*flow->latency));
+		}
+	}
+	return chunks;
+}
+
+/* Send the chunks of flow at their time in the trace, scaled by the
+ * replay speed.
+ */
+static void
+replay_send (SOCKET sock, replay_flow_t *flow)
+{
+	for (int n = 0; n < flow->count; n++) {
+		int64_t due = replay_start + (int64_t) (flow->time[n] / replay_speed);
+		int64_t now;
+
+		while ((now = now_us()) < due)
+			Sleep(due - now >= 2000 ? (due - now) / 1000 - 1 : 0);
+		flow->sent[n] = now;
+		if (!fill(sock, flow->size[n]))
+			fatal("Connection closed during replay: %s\n", wsa_errstr());
+	}
+}
+
+/* Receive the chunks of flow and record when each was complete. */
+static void
+replay_receive (SOCKET sock, replay_flow_t *flow)
+{
+	char buf[BENCH_BUFSIZE];
+	uint64_t received = 0;
+	uint64_t end = 0;
+	int n = 0;
+
+	if (flow->count > 0)
+		end = flow->size[0];
+	while (n < flow->count) {
+		int len = recv(sock, buf, sizeof(buf), 0);
+		int64_t now = now_us();
+
+		if (len == SOCKET_ERROR || len == 0)
+			fatal("Connection closed during replay: %s\n", wsa_errstr());
+		received += len;
+		while (n < flow->count && received >= end) {
+			flow->latency[n] = now - flow->sent[n];
+			if (++n < flow->count)
+				end += flow->size[n];
+		}
+	}
+	if (InterlockedDecrement(&replay_remaining) == 0)
+		SetEvent(replay_done);
+}
+
+static DWORD WINAPI
+replay_send_thread (void *arg)
+{
+	replay_side_t *side = arg;
+
+	replay_send(side->sock, side->flow);
+	return 0;
+}
+
+static DWORD WINAPI
+replay_receive_thread (void *arg)
+{
+	replay_side_t *side = arg;
+
+	replay_receive(side->sock, side->flow);
+	return 0;
+}
+
+/* The server side of a replayed connection. */
+static void
+replay_target (SOCKET sock, uint32_t index)
+{
+	replay_side_t side;
+	HANDLE thread;
+
+	if (index >= replay_conn_count)
+		fatal("Invalid replay connection %u\n", index);
+	side.sock = sock;
+	side.flow = &replay_conns[index].flow[STATS_DOWN];
+	thread = CreateThread(NULL, 0, replay_send_thread, &side, 0, NULL);
+	if (thread == NULL)
+		fatal("Cannot create thread: %s\n", system_errstr());
+	replay_receive(sock, &replay_conns[index].flow[STATS_UP]);
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	closesocket(sock); /* Ignore errors */
+}
+
+/* The viewer side of a replayed connection. */
+static DWORD WINAPI
+replay_client (void *arg)
+{
+	uint32_t index = (uintptr_t) arg;
+	uint32_t header[2] = { 0, index };
+	replay_side_t side;
+	HANDLE thread;
+
+	side.sock = connect_to(&replay_addr);
+	side.flow = &replay_conns[index].flow[STATS_DOWN];
+	if (!full_send(side.sock, header, sizeof(header)))
+		fatal("Cannot start replay: %s\n", wsa_errstr());
+	thread = CreateThread(NULL, 0, replay_receive_thread, &side, 0, NULL);
+	if (thread == NULL)
+		fatal("Cannot create thread: %s\n", system_errstr());
+	replay_send(side.sock, &replay_conns[index].flow[STATS_UP]);
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	closesocket(side.sock); /* Ignore errors */
+	return 0;
+}
+
+static void
+run_replay (const struct sockaddr_in *addr, replay_result_t *result)
+{
+	HANDLE threads[MAX_WORKERS];
+
+	memset(result, 0, sizeof(*result));
+	replay_addr = *addr;
+	replay_remaining = replay_conn_count * 2;
+	ResetEvent(replay_done);
+	replay_start = now_us() + REPLAY_START_DELAY;
+	for (uintptr_t c = 0; c < replay_conn_count; c++) {
+		threads[c] = CreateThread(NULL, 0, replay_client, (void *) c, 0, NULL);
+		if (threads[c] == NULL)
+			fatal("Cannot create thread: %s\n", system_errstr());
+	}
+	WaitForSingleObject(replay_done, INFINITE);
+	WaitForMultipleObjects(replay_conn_count, threads, TRUE, INFINITE);
+
+	for (int d = 0; d < 2; d++) {
+		double jitter_sum = 0;
+		int jitter_count = 0;
+
+		for (int c = 0; c < replay_conn_count; c++) {
+			const replay_flow_t *flow = &replay_conns[c].flow[d];
+
+			for (int n = 0; n < flow->count; n++) {
+				histogram_add(&result->latency[d], flow->latency[n]);
+				if (n > 0) {
+					jitter_sum += llabs(flow->latency[n] - flow->latency[n - 1]);
+					jitter_count++;
+				}
+			}
+		}
+		result->jitter[d] = jitter_count > 0 ? jitter_sum / jitter_count : 0;
+	}
+	for (int c = 0; c < replay_conn_count; c++)
+		CloseHandle(threads[c]);
+}
+
+static void
+print_replay_result (const char *name, const replay_result_t *result)
+{
+	printf("\"%s\":{", name);
+	for (int d = 0; d < 2; d++) {
+		printf("%s\"%s\":{\"p50_us\":%" PRIu64 ",\"p99_us\":%" PRIu64 ",\"p999_us\":%" PRIu64 ",\"jitter_us\":%.0f}",
+			d > 0 ? "," : "", d == STATS_UP ? "up" : "down",
+			histogram_percentile(&result->latency[d], 50), histogram_percentile(&result->latency[d], 99),
+			histogram_percentile(&result->latency[d], 99.9), result->jitter[d]);
+	}
+	printf("}");
+}
+
+static void
+print_result (const char *name, const result_t *result)
+{
+	printf("\"%s\":{\"mb_s\":%.1f,\"cpu_s_per_gb\":%.2f,\"p50_us\":%" PRIu64 ",\"p99_us\":%" PRIu64 ",\"p999_us\":%" PRIu64 "}",
+		name, result->mb_per_s, result->cpu_s_per_gb,
+		histogram_percentile(&result->latency, 50), histogram_percentile(&result->latency, 99),
+		histogram_percentile(&result->latency, 99.9));
+}
+
+int
+main (int argc, char **argv)
+{
+	static server_t target_server = { INVALID_SOCKET, target_connection };
+	static server_t socks_server = { INVALID_SOCKET, socks_connection };
+	static result_t direct[sizeof(patterns)/sizeof(*patterns)];
+	static result_t relay[sizeof(patterns)/sizeof(*patterns)];
+	struct sockaddr_in socks_addr;
+	struct sockaddr_in relay_addr;
+	int connections = DEFAULT_CONNECTIONS;
+	int exchanges = DEFAULT_EXCHANGES;
+	const char *only_pattern = NULL;
+	const char *trace = NULL;
+	const char *takeover_port = NULL;
+	bool handoff = false;
+	bool compare_capture = false;
+	int trace_chunks = 0;
+	wchar_t *socks_port;
+	wchar_t *target_port;
+	wchar_t *listen_host;
+	char listen_name[16];
+	double direct_rate;
+	double relay_rate;
+	WSADATA wsadata;
+	HANDLE thread;
+	int first = 1;
+	int c;
+
+	for (c = 1; c < argc && argv[c][0] == '-'; c++) {
+		if (strcmp(argv[c], "-c") == 0 && c + 1 < argc) {
+			connections = atoi(argv[++c]);
+		} else if (strcmp(argv[c], "-n") == 0 && c + 1 < argc) {
+			exchanges = atoi(argv[++c]);
+		} else if (strcmp(argv[c], "-p") == 0 && c + 1 < argc) {
+			only_pattern = argv[++c];
+		} else if (strcmp(argv[c], "-r") == 0 && c + 1 < argc) {
+			trace = argv[++c];
+		} else if (strcmp(argv[c], "-s") == 0 && c + 1 < argc) {
+			replay_speed = atof(argv[++c]);
+		} else if (strcmp(argv[c], "-O") == 0 && c + 1 < argc) {
+			wchar_t option[256];
+			if (mbstowcs(option, argv[++c], sizeof(option)/sizeof(*option)) >= sizeof(option)/sizeof(*option))
+				fatal("Relay option too long\n");
+			set_proxy_option(option);
+			if (relay_option_count >= MAX_RELAY_OPTIONS)
+				fatal("Too many relay options\n");
+			relay_options[relay_option_count++] = xwcsdup(option);
+		} else if (strcmp(argv[c], "-H") == 0) {
+			handoff = true;
+		} else if (strcmp(argv[c], "-T") == 0 && c + 1 < argc) {
+			takeover_port = argv[++c];
+		} else if (strcmp(argv[c], "-F") == 0 && c + 1 < argc) {
+			fault_percent = atoi(argv[++c]);
+		} else if (strcmp(argv[c], "-C") == 0) {
+			compare_capture = true;
+		} else {
+			break;
+		}
+	}
+	if (c != argc || connections < 1 || connections > MAX_WORKERS || exchanges < 1 || replay_speed <= 0
+			|| fault_percent < 0 || fault_percent > 100 || (handoff && trace != NULL)
+			|| (compare_capture && (handoff || trace != NULL))) {
+		fprintf(stderr,
+			"Usage: %s [-c CONNECTIONS] [-n EXCHANGES] [-p PATTERN] [-F PERCENT] [-O NAME=VALUE]...\n"
+			"       %s -r TRACE [-s SPEED] [-F PERCENT] [-O NAME=VALUE]...\n"
+			"       %s -H [-c CONNECTIONS] [-n EXCHANGES] [-p PATTERN] [-F PERCENT] [-O NAME=VALUE]...\n"
+			"       %s -C -O capture=FILE [-c CONNECTIONS] [-n EXCHANGES] [-p PATTERN] [-O NAME=VALUE]...\n"
+			"Measure relay throughput and latency against local endpoints.\n"
+			"Patterns are interactive, bulk and upload; all are run by default.\n"
+			"CONNECTIONS is at most %d. With -r, replay a CSV trace from capread\n"
+			"instead, SPEED times as fast as recorded. With -H, run one pattern\n"
+			"(interactive by default) and hand the relay off to a new process\n"
+			"partway through; any failed exchange is an error. With -F, make\n"
+			"PERCENT of the relay's socket receives and sends short or fail\n"
+			"with WSAEWOULDBLOCK. With -C, compare relay throughput with and\n"
+			"without capture; capture costing over %g%% is an error. Results\n"
+			"are written as JSON.\n",
+			program_name, program_name, program_name, program_name, MAX_WORKERS, CAPTURE_MAX_OVERHEAD);
+		exit(1);
+	}
+	if (trace != NULL) {
+		trace_chunks = load_trace(trace);
+		if ((replay_done = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+			fatal("Cannot create event: %s\n", system_errstr());
+		timeBeginPeriod(1);
+	}
+
+	if (WSAStartup(MAKEWORD(2,2), &wsadata) != 0)
+		fatal("Cannot initialize socket library: %s\n", wsa_errstr());
+	if (fault_percent > 0)
+		install_faults();
+
+	/* Started by -H to take over the relay, which this process then
+	 * serves until it has been idle for a while.
+	 */
+	if (takeover_port != NULL) {
+		wchar_t port[8];
+
+		if (mbstowcs(port, takeover_port, sizeof(port)/sizeof(*port)) >= sizeof(port)/sizeof(*port))
+			fatal("Invalid port `%s'\n", takeover_port);
+		target_port = xaswprintf(L"%u", DEFAULT_TARGET_PORT);
+		prepare_proxy(L"127.0.0.1", port, L"127.0.0.1", target_port, &listen_host);
+		free(listen_host);
+		handle_proxy();
+		exit(0);
+	}
+	if (handoff) {
+		wchar_t *option = xaswprintf(L"shared=%u", HANDOFF_SHARED_PORT);
+		set_proxy_option(option);
+		free(option);
+	}
+
+	memset(&target_addr, 0, sizeof(target_addr));
+	target_addr.sin_port = htons(DEFAULT_TARGET_PORT);
+	target_server.sock = open_listener(&target_addr);
+	start_server(&target_server);
+	memset(&socks_addr, 0, sizeof(socks_addr));
+	socks_server.sock = open_listener(&socks_addr);
+	start_server(&socks_server);
+
+	socks_port = xaswprintf(L"%u", ntohs(socks_addr.sin_port));
+	target_port = xaswprintf(L"%u", ntohs(target_addr.sin_port));
+	memset(&relay_addr, 0, sizeof(relay_addr));
+	relay_addr.sin_family = AF_INET;
+	relay_addr.sin_port = htons(prepare_proxy(L"127.0.0.1", socks_port, L"127.0.0.1", target_port, &listen_host));
+	if (wcstombs(listen_name, listen_host, sizeof(listen_name)) >= sizeof(listen_name))
+		fatal("Invalid relay address `%ls'\n", listen_host);
+	relay_addr.sin_addr.s_addr = inet_addr(listen_name);
+	free(listen_host);
+	thread = CreateThread(NULL, 0, relay_thread, NULL, 0, NULL);
+	if (thread == NULL)
+		fatal("Cannot create thread: %s\n", system_errstr());
+
+	if (handoff) {
+		const pattern_t *pattern = &patterns[0];
+		wchar_t path[MAX_PATH];
+		wchar_t *command;
+		result_t result;
+		int64_t handoff_us;
+
+		for (int p = 0; only_pattern != NULL && p < sizeof(patterns)/sizeof(*patterns); p++) {
+			if (strcmp(only_pattern, patterns[p].name) == 0)
+				pattern = &patterns[p];
+		}
+		if (GetModuleFileNameW(NULL, path, MAX_PATH) == 0)
+			fatal("Cannot get program path: %s\n", system_errstr());
+		command = xaswprintf(L"\"%ls\" -T %ls -F %d -O shared=%u -O takeover=1", path, socks_port, fault_percent, HANDOFF_SHARED_PORT);
+		for (int o = 0; o < relay_option_count; o++) {
+			wchar_t *longer = xaswprintf(L"%ls -O \"%ls\"", command, relay_options[o]);
+			free(command);
+			command = longer;
+		}
+
+		handoff_us = run_handoff(pattern, &relay_addr, connections, exchanges, thread, command, &result);
+		TerminateProcess(takeover_process.hProcess, 0); /* Ignore errors */
+		CloseHandle(takeover_process.hProcess);
+		printf("{\"connections\":%d,\"exchanges\":%d,\"pattern\":\"%s\",\"handoff_us\":%" PRId64 ",",
+			connections, exchanges, pattern->name, handoff_us);
+		print_result("relay", &result);
+		print_faults();
+		printf("}\n");
+		exit(0);
+	}
+	CloseHandle(thread);
+
+	/* Capture is switched on and off between runs, while the relay is
+	 * idle. The first run is left as the relay started, which tells
+	 * whether capture was configured at all.
+	 */
+	if (compare_capture) {
+		bool started = false;
+		bool ok = true;
+
+		printf("{\"connections\":%d,\"exchanges\":%d,\"rounds\":%d,\"limit_percent\":%g,\"patterns\":{",
+			connections, exchanges, CAPTURE_ROUNDS, CAPTURE_MAX_OVERHEAD);
+		for (int p = 0; p < sizeof(patterns)/sizeof(*patterns); p++) {
+			result_t best[2];		/* Without and with capture */
+			double overhead;
+
+			if (only_pattern != NULL && strcmp(only_pattern, patterns[p].name) != 0)
+				continue;
+			memset(best, 0, sizeof(best));
+			for (int r = 0; r < CAPTURE_ROUNDS; r++) {
+				for (int on = 1; on >= 0; on--) {
+					result_t result;
+
+					if (started)
+						capture_enabled = on;
+					run_pattern(&patterns[p], &relay_addr, connections, exchanges, &result);
+					if (!started && !capture_enabled)
+						fatal("Relay option capture=FILE is needed with -C\n");
+					started = true;
+					if (result.mb_per_s > best[on].mb_per_s)
+						best[on] = result;
+				}
+			}
+			overhead = best[0].mb_per_s > 0 ? (best[0].mb_per_s - best[1].mb_per_s) / best[0].mb_per_s * 100 : 0;
+			if (overhead > CAPTURE_MAX_OVERHEAD)
+				ok = false;
+			printf("%s\"%s\":{", first ? "" : ",", patterns[p].name);
+			print_result("relay", &best[0]);
+			printf(",");
+			print_result("capture", &best[1]);
+			printf(",\"overhead_percent\":%.1f}", overhead);
+			first = 0;
+		}
+		printf("}}\n");
+		if (!ok)
+			fatal("Capture costs more than %g%% of relay throughput\n", CAPTURE_MAX_OVERHEAD);
+		exit(0);
+	}
+
+	/* The relay exits after a minute without connections, so the relayed
+	 * runs come first and back to back.
+	 */
+	if (trace != NULL) {
+		replay_result_t relay_replay;
+		replay_result_t direct_replay;
+
+		run_replay(&relay_addr, &relay_replay);
+		run_replay(&target_addr, &direct_replay);
+		printf("{\"trace\":\"%s\",\"speed\":%g,\"connections\":%d,\"chunks\":%d,\"skipped_chunks\":%d,",
+			trace, replay_speed, replay_conn_count, trace_chunks, replay_skipped);
+		print_replay_result("direct", &direct_replay);
+		printf(",");
+		print_replay_result("relay", &relay_replay);
+		printf(",\"added_latency_us\":{");
+		for (int d = 0; d < 2; d++) {
+			printf("%s\"%s\":{\"p50\":%" PRId64 ",\"p99\":%" PRId64 ",\"p999\":%" PRId64 "}",
+				d > 0 ? "," : "", d == STATS_UP ? "up" : "down",
+				added(&relay_replay.latency[d], &direct_replay.latency[d], 50),
+				added(&relay_replay.latency[d], &direct_replay.latency[d], 99),
+				added(&relay_replay.latency[d], &direct_replay.latency[d], 99.9));
+		}
+		printf("}");
+		print_faults();
+		printf("}\n");
+		timeEndPeriod(1);
+		exit(0);
+	}
+
+	for (int p = 0; p < sizeof(patterns)/sizeof(*patterns); p++) {
+		if (only_pattern == NULL || strcmp(only_pattern, patterns[p].name) == 0)
+			run_pattern(&patterns[p], &relay_addr, connections, exchanges, &relay[p]);
+	}
+	relay_rate = connect_rate(&relay_addr);
+	for (int p = 0; p < sizeof(patterns)/sizeof(*patterns); p++) {
+		if (only_pattern == NULL || strcmp(only_pattern, patterns[p].name) == 0)
+			run_pattern(&patterns[p], &target_addr, connections, exchanges, &direct[p]);
+	}
+	direct_rate = connect_rate(&target_addr);
+
+	printf("{\"connections\":%d,\"exchanges\":%d,\"patterns\":{", connections, exchanges);
+	for (int p = 0; p < sizeof(patterns)/sizeof(*patterns); p++) {
+		if (only_pattern != NULL && strcmp(only_pattern, patterns[p].name) != 0)
+			continue;
+		printf("%s\"%s\":{", first ? "" : ",", patterns[p].name);
+		print_result("direct", &direct[p]);
+		printf(",");
+		print_result("relay", &relay[p]);
+		printf(",\"added_latency_us\":{\"p50\":%" PRId64 ",\"p99\":%" PRId64 ",\"p999\":%" PRId64 "}}",
+			added(&relay[p].latency, &direct[p].latency, 50), added(&relay[p].latency, &direct[p].latency, 99),
+			added(&relay[p].latency, &direct[p].latency, 99.9));
+		first = 0;
+	}
+	printf("},\"connect_rate\":{\"direct_per_s\":%.0f,\"relay_per_s\":%.0f}", direct_rate, relay_rate);
+	print_faults();
+	printf("}\n");
+
+	exit(0);
+}
@@ -0,0 +1,74 @@
+/* relaypeer.c - Peer endpoint for relay tunnels
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* The peer endpoint runs on a host that the SOCKS proxy reaches, next
+ * to the targets. Relays started with the tunnel relay option connect
+ * to it through the proxy once, and then carry every viewer connection
+ * as a stream over that tunnel; the peer endpoint connects each stream
+ * to its target. It is the relay of proxy.c in another role, so the
+ * link emulation, capture and statistics options apply here too.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "rdpvnclaunch.h"
+
+const char *program_name = "relaypeer";
+const wchar_t *program_name_w = L"relaypeer";
+
+int
+main (int argc, char **argv)
+{
+	wchar_t host[16];
+	wchar_t port[8];
+	int c;
+
+	for (c = 1; c < argc && argv[c][0] == '-'; c++) {
+		if (strcmp(argv[c], "-O") == 0 && c + 1 < argc) {
+			wchar_t option[256];
+			if (mbstowcs(option, argv[++c], sizeof(option)/sizeof(*option)) >= sizeof(option)/sizeof(*option))
+				die("Relay option too long\n");
+			set_proxy_option(option);
+		} else {
+			break;
+		}
+	}
+	if (argc - c != 2) {
+		fprintf(stderr,
+			"Usage: %s -O tunnel-key=FILE [-O NAME=VALUE]... ADDRESS PORT\n"
+			"Accept relay tunnels on ADDRESS and PORT, and connect the viewer\n"
+			"connections they carry to their targets. Relays must be started\n"
+			"with the same key file. Runs until ended.\n",
+			program_name);
+		exit(1);
+	}
+	if (mbstowcs(host, argv[c], sizeof(host)/sizeof(*host)) >= sizeof(host)/sizeof(*host))
+		die("Invalid IP address `%s'\n", argv[c]);
+	if (mbstowcs(port, argv[c + 1], sizeof(port)/sizeof(*port)) >= sizeof(port)/sizeof(*port))
+		die("Invalid port `%s'\n", argv[c + 1]);
+
+	prepare_tunnel_peer(host, port);
+	handle_proxy();
+	exit(0);
+}
@@ -0,0 +1,1644 @@
+/* relaysim.c - Run the relay on a simulated network
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* The simulator runs the relay from proxy.c on in-memory sockets and a
+ * virtual clock, all in one thread. The clock only moves while the
+ * relay waits in select, and then straight to the next time something
+ * happens, so a scenario with thousands of connections and minutes of
+ * traffic runs in seconds and the same way every time.
+ *
+ * Each direction of a connection delivers data after the latency of
+ * its link and no faster than its rate, and holds at most SIM_BUFFER
+ * bytes sent but not yet read. Beyond that a send fails with
+ * WSAEWOULDBLOCK, as it would with a full TCP window.
+ *
+ * The other ends of the relay's connections are scripted. Viewers
+ * connect to the relay and run exchanges: a request starting with a
+ * header that gives the request and reply sizes, answered by a reply
+ * of that size. The SOCKS proxy answers each connection from the relay
+ * as the scenario's script says for it, by arrival, and then serves
+ * the exchanges as the target. A request for the peer endpoint of a
+ * tunnel is forwarded to it instead, and the peer endpoint, served by
+ * the same relay, connects the streams to a scripted target on its
+ * side. Requests and replies are filled with a
+ * pattern that depends on the viewer and the offset, and are checked
+ * at the other end.
+ *
+ * Each scenario is run in a process of its own, since the relay cannot
+ * be reset, and written as JSON. A failed check is reported and makes
+ * the exit status nonzero.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include "rdpvnclaunch.h"
+#include "stats.h"
+#include "netops.h"
+
+#define SIM_START 1000000		/* Virtual time at start, as the relay takes 0 for no time */
+#define SIM_BUFFER 65536		/* Bytes a direction holds sent but not yet read */
+#define SIM_MAX_SPIN 100000		/* Select calls at one time before the relay is taken to spin */
+#define MAX_BOUND 16			/* Bound sockets */
+#define MAX_SEND 16384			/* Largest send by a scripted endpoint */
+#define MAX_READ 65536			/* Largest read by a scripted endpoint */
+#define HEADER_SIZE 12			/* Request size, reply size and viewer of an exchange */
+#define PROXY_ADDR "10.0.0.1"
+#define PROXY_PORT "1080"
+#define TARGET_ADDR "10.0.0.2"
+#define TARGET_PORT "5900"
+#define TUNNEL_ADDR "10.0.0.3"
+#define TUNNEL_PORT "7000"
+#define TUNNEL_KEY_FILE "relaysim.key"
+
+/* From proxy.c, for the checks. */
+#define RELAY_LIFETIME (60 * (int64_t) 1000000)	/* PROXY_LIFETIME_SECONDS */
+#define RELAY_WINDOW 16384		/* STREAM_WINDOW */
+
+#define SCALE_VIEWERS 10000
+#define SCALE_WAVE 100			/* Viewers connecting at once */
+#define TIMEOUT_HELD 4			/* Viewers holding the relay at max-conns */
+#define TIMEOUT_QUEUED 6		/* Viewers waiting for admission until queue-time */
+#define TIMEOUT_QUEUE_TIME 500	/* Milliseconds */
+#define BULK_SIZE (4 * 1024 * 1024)
+#define BULK_READ 4096			/* Bytes read by the slow viewer every BULK_READ_INTERVAL */
+#define BULK_READ_INTERVAL 16000
+#define INTERACTIVE_VIEWERS 8
+#define INTERACTIVE_EXCHANGES 200
+#define INTERACTIVE_SLACK 1000	/* Microseconds allowed over the round trip */
+#define TUNNEL_LATER 20			/* Viewers connecting after the tunnel has been idle */
+#define TUNNEL_LATER_START (30 * (int64_t) 1000000)
+
+typedef struct {
+	int64_t latency;			/* Microseconds one way */
+	int64_t rate;				/* Bytes per second, 0 for no limit */
+} sim_link_t;
+
+typedef struct segment {
+	struct segment *next;
+	int64_t due;				/* Arrival time */
+	int len;
+	int pos;					/* Bytes already read */
+	char data[];
+} segment_t;
+
+typedef struct actor actor_t;
+
+/* A scripted endpoint. wake is called for events on its sockets, with
+ * the socket, and when a timer it set is due, with the socket given to
+ * schedule.
+ */
+struct actor {
+	void (*wake) (actor_t *actor, SOCKET sock);
+};
+
+typedef enum {
+	SIM_OPEN,					/* Created or bound */
+	SIM_LISTENING,
+	SIM_CONNECTED,				/* Established from ready on */
+	SIM_REFUSED,				/* Connect fails at ready */
+	SIM_CLOSED,
+} sim_state_t;
+
+typedef struct {
+	sim_state_t state;
+	actor_t *actor;				/* Scripted endpoint owning the socket, NULL for the relay */
+	void *data;					/* The actor's state for the socket */
+	struct sockaddr_in addr;	/* Bound address */
+	sim_link_t link;			/* Of the connection, or of connections to a listener */
+	SOCKET peer;				/* Other end of the connection, 0 if none */
+	int64_t ready;
+	int error;					/* For SO_ERROR */
+	segment_t *head;			/* Data on its way to this end */
+	segment_t *tail;
+	int buffered;				/* Bytes sent to this end and not yet read */
+	int64_t link_free;			/* Time the link towards this end is idle */
+	int64_t fin_due;			/* Arrival of the other end's close, 0 if none */
+	SOCKET backlog_head;		/* Connections to a listener, not yet accepted */
+	SOCKET backlog_tail;
+	SOCKET backlog_next;
+} sim_socket_t;
+
+typedef struct {
+	int64_t time;
+	uint64_t seq;				/* Keeps events of one time in order */
+	actor_t *actor;				/* Actor to wake, NULL for the owner of sock */
+	SOCKET sock;
+} event_t;
+
+typedef enum {
+	VIEWER_WAITING,				/* Not connected yet */
+	VIEWER_CONNECTING,
+	VIEWER_SENDING,				/* Sending a request */
+	VIEWER_RECEIVING,			/* Reading the reply */
+	VIEWER_THINKING,			/* Pausing between exchanges */
+	VIEWER_HOLDING,				/* Staying connected after the last exchange */
+	VIEWER_DONE,
+} viewer_state_t;
+
+typedef struct {
+	actor_t actor;
+	uint32_t id;
+	viewer_state_t state;
+	SOCKET sock;
+	int64_t start;				/* Time to connect */
+	int exchanges;
+	uint32_t request_size;		/* Bytes, header included */
+	uint32_t reply_size;
+	int64_t think;				/* Pause between exchanges */
+	int64_t hold_until;			/* Time to close after the last exchange, 0 for at once */
+	uint32_t read_size;			/* Bytes read each read_interval, 0 to read all that arrives */
+	int64_t read_interval;
+	histogram_t *latency;		/* Microseconds per exchange, or NULL */
+	int64_t timer;				/* Time of the wakeup set last, 0 if none */
+	int done;					/* Exchanges completed */
+	uint32_t sent;				/* Bytes of the request sent */
+	uint32_t received;			/* Bytes of the reply received */
+	uint64_t up_pos;			/* Payload bytes of all requests sent */
+	uint64_t down_pos;			/* Bytes of all replies received */
+	uint64_t peer_sent;			/* Bytes of all replies sent by the target */
+	uint64_t max_in_flight;		/* Most reply bytes sent by the target and not yet received */
+	int64_t exchange_start;
+	int64_t next_exchange;
+	int64_t next_read;
+	int64_t first_latency;		/* Time of the first exchange, 0 if none completed */
+	int64_t ended;				/* Time the connection was closed */
+	const char *failure;		/* Why the connection ended early, NULL if it did not */
+} viewer_t;
+
+typedef enum {
+	SOCKS_ACCEPT,
+	SOCKS_DENY,					/* Reply with request rejected */
+	SOCKS_CLOSE,				/* Close without a reply */
+	SOCKS_DELAY,				/* Accept after delay */
+} socks_action_t;
+
+typedef struct {
+	socks_action_t action;
+	int64_t delay;
+} socks_step_t;
+
+typedef enum {
+	PEER_REQUEST,				/* Reading the SOCKS request */
+	PEER_REPLYING,				/* Waiting to reply */
+	PEER_SERVING,				/* Serving exchanges as the target */
+	PEER_CONNECTING,			/* Connecting to the peer endpoint of a tunnel */
+	PEER_FORWARDING,			/* Passing data to and from the peer endpoint */
+	PEER_DONE,
+} peer_state_t;
+
+/* Data on its way through the proxy, for a forwarded connection. */
+typedef struct {
+	SOCKET from;
+	SOCKET to;
+	char buf[MAX_SEND];
+	int pos;
+	int len;
+} pipe_t;
+
+typedef struct {
+	peer_state_t state;
+	SOCKET sock;
+	socks_step_t step;
+	int64_t reply_at;
+	char request[64];
+	int request_len;
+	uint32_t header[HEADER_SIZE / sizeof(uint32_t)];
+	int header_len;
+	viewer_t *viewer;
+	uint32_t request_left;		/* Payload bytes of the request not yet read */
+	uint32_t reply_left;		/* Bytes of the reply not yet sent */
+	uint64_t up_pos;
+	uint64_t down_pos;
+	SOCKET forward;				/* To the peer endpoint, 0 if not forwarding */
+	pipe_t *pipes;				/* Both directions, when forwarding */
+} peer_conn_t;
+
+typedef struct {
+	const char *name;
+	const char *description;
+	void (*setup) (void);
+	void (*check) (void);
+	bool serves;				/* The relay is a peer endpoint too, and does not exit */
+} scenario_t;
+
+const char *program_name = "relaysim";
+const wchar_t *program_name_w = L"relaysim";
+
+static int64_t sim_now = SIM_START;
+static int sim_error;
+static sim_socket_t *sim_sockets;	/* Socket s is sim_sockets[s - 1] */
+static SOCKET sim_socket_count;
+static SOCKET sim_socket_space;
+static SOCKET bound[MAX_BOUND];
+static int bound_count;
+static event_t *events;
+static size_t event_count;
+static size_t event_space;
+static uint64_t event_seq;
+static uint64_t events_run;
+static uint64_t select_calls;
+static int64_t last_select;
+static int spin_count;
+static uint32_t peak_active;
+static int64_t last_relay_close;	/* Time the relay last closed a connection */
+static sim_link_t viewer_link;		/* Between viewers and the relay */
+static sim_link_t proxy_link;		/* Between the relay and the SOCKS proxy */
+static struct sockaddr_in relay_addr;
+static viewer_t *viewers;
+static uint32_t viewer_count;
+static actor_t socks_actor;
+static SOCKET socks_listener;
+static SOCKET target_listener;		/* At the peer endpoint, 0 if not tunneling */
+static socks_step_t socks_script[16];
+static int socks_script_len;
+static int socks_arrivals;
+static histogram_t interactive_latency;
+static const scenario_t *scenario;
+static bool checks_ok = true;
+
+static void
+fatal (const char *fmt, ...)
+{
+	va_list argv;
+
+	fprintf(stderr, "%s: ", program_name);
+	va_start(argv, fmt);
+	vfprintf(stderr, fmt, argv);
+	va_end(argv);
+	exit(1);
+}
+
+static void
+check (bool ok, const char *fmt, ...)
+{
+	va_list argv;
+
+	if (ok)
+		return;
+	fprintf(stderr, "%s: check failed: ", program_name);
+	va_start(argv, fmt);
+	vfprintf(stderr, fmt, argv);
+	va_end(argv);
+	checks_ok = false;
+}
+
+static double
+seconds (int64_t us)
+{
+	return us / 1e6;
+}
+
+/* Schedule a wakeup of actor, or of the owner of sock, at time. */
+static void
+schedule (int64_t time, actor_t *actor, SOCKET sock)
+{
+	size_t c;
+
+	if (event_count == event_space) {
+		event_space = event_space == 0 ? 1024 : event_space * 2;
+		events = xrealloc(events, event_space * sizeof(*events));
+	}
+	for (c = event_count++; c > 0; c = (c - 1) / 2) {
+		event_t *parent = &events[(c - 1) / 2];
+		if (parent->time < time || (parent->time == time && parent->seq < event_seq))
+			break;
+		events[c] = *parent;
+	}
+	events[c].time = time;
+	events[c].seq = event_seq++;
+	events[c].actor = actor;
+	events[c].sock = sock;
+}
+
+static event_t
+pop_event (void)
+{
+	event_t top = events[0];
+	event_t last = events[--event_count];
+	size_t c = 0;
+
+	for (;;) {
+		size_t child = 2 * c + 1;
+
+		if (child >= event_count)
+			break;
+		if (child + 1 < event_count && (events[child + 1].time < events[child].time
+				|| (events[child + 1].time == events[child].time && events[child + 1].seq < events[child].seq)))
+			child++;
+		if (last.time < events[child].time || (last.time == events[child].time && last.seq < events[child].seq))
+			break;
+		events[c] = events[child];
+		c = child;
+	}
+	events[c] = last;
+	return top;
+}
+
+/* Wake the actors whose events are due. */
+static void
+run_events (void)
+{
+	while (event_count > 0 && events[0].time <= sim_now) {
+		event_t event = pop_event();
+		actor_t *actor = event.actor;
+
+		events_run++;
+		if (actor == NULL && sim_sockets[event.sock - 1].state != SIM_CLOSED)
+			actor = sim_sockets[event.sock - 1].actor;
+		if (actor != NULL)
+			actor->wake(actor, event.sock);
+	}
+}
+
+static sim_socket_t *
+sim_get (SOCKET sock)
+{
+	if (sock == 0 || sock > sim_socket_count || sim_sockets[sock - 1].state == SIM_CLOSED) {
+		sim_error = WSAENOTSOCK;
+		return NULL;
+	}
+	return &sim_sockets[sock - 1];
+}
+
+/* Sockets are never reused, so that a stale socket is caught. Adding one
+ * moves the table, so pointers into it must be fetched again.
+ */
+static SOCKET
+new_socket (actor_t *actor)
+{
+	sim_socket_t *s;
+
+	if (sim_socket_count == sim_socket_space) {
+		sim_socket_space = sim_socket_space == 0 ? 1024 : sim_socket_space * 2;
+		sim_sockets = xrealloc(sim_sockets, sim_socket_space * sizeof(*sim_sockets));
+	}
+	s = &sim_sockets[sim_socket_count++];
+	memset(s, 0, sizeof(*s));
+	s->state = SIM_OPEN;
+	s->actor = actor;
+	return sim_socket_count;
+}
+
+static SOCKET
+find_listener (const struct sockaddr_in *addr)
+{
+	for (int c = 0; c < bound_count; c++) {
+		sim_socket_t *s = &sim_sockets[bound[c] - 1];
+		if (s->state == SIM_LISTENING && s->addr.sin_addr.s_addr == addr->sin_addr.s_addr && s->addr.sin_port == addr->sin_port)
+			return bound[c];
+	}
+	return 0;
+}
+
+static bool
+sim_readable (const sim_socket_t *s)
+{
+	if (s->state == SIM_LISTENING)
+		return s->backlog_head != 0 && sim_sockets[s->backlog_head - 1].ready <= sim_now;
+	if (s->state != SIM_CONNECTED || s->ready > sim_now)
+		return false;
+	if (s->head != NULL)
+		return s->head->due <= sim_now;
+	return s->fin_due != 0 && s->fin_due <= sim_now;
+}
+
+static bool
+sim_writable (const sim_socket_t *s)
+{
+	const sim_socket_t *peer;
+
+	if (s->state != SIM_CONNECTED || s->ready > sim_now)
+		return false;
+	peer = &sim_sockets[s->peer - 1];
+	return peer->state == SIM_CLOSED || peer->buffered < SIM_BUFFER;
+}
+
+static bool
+sim_failed (const sim_socket_t *s)
+{
+	return s->state == SIM_REFUSED && s->ready <= sim_now;
+}
+
+static SOCKET
+sim_socket (int af, int type, int protocol)
+{
+	if (af != AF_INET || type != SOCK_STREAM) {
+		sim_error = WSAEAFNOSUPPORT;
+		return INVALID_SOCKET;
+	}
+	return new_socket(NULL);
+}
+
+static int
+sim_bind (SOCKET sock, const struct sockaddr *addr, int addr_len)
+{
+	const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+	sim_socket_t *s;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	if (s->state != SIM_OPEN || s->addr.sin_family != 0 || bound_count == MAX_BOUND) {
+		sim_error = WSAEINVAL;
+		return SOCKET_ERROR;
+	}
+	for (int c = 0; c < bound_count; c++) {
+		const sim_socket_t *other = &sim_sockets[bound[c] - 1];
+		if (other->addr.sin_addr.s_addr == in->sin_addr.s_addr && other->addr.sin_port == in->sin_port) {
+			sim_error = WSAEADDRINUSE;
+			return SOCKET_ERROR;
+		}
+	}
+	s->addr = *in;
+	bound[bound_count++] = sock;
+	return 0;
+}
+
+static int
+sim_listen (SOCKET sock, int backlog)
+{
+	sim_socket_t *s;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	if (s->state != SIM_OPEN || s->addr.sin_family == 0) {
+		sim_error = WSAEINVAL;
+		return SOCKET_ERROR;
+	}
+	s->state = SIM_LISTENING;
+	if (s->actor == NULL)
+		s->link = viewer_link;
+	return 0;
+}
+
+static SOCKET
+sim_accept (SOCKET sock, struct sockaddr *addr, int *addr_len)
+{
+	sim_socket_t *s;
+	SOCKET conn;
+
+	if ((s = sim_get(sock)) == NULL)
+		return INVALID_SOCKET;
+	if (s->state != SIM_LISTENING) {
+		sim_error = WSAEINVAL;
+		return INVALID_SOCKET;
+	}
+	if (!sim_readable(s)) {
+		sim_error = WSAEWOULDBLOCK;
+		return INVALID_SOCKET;
+	}
+	conn = s->backlog_head;
+	s->backlog_head = sim_sockets[conn - 1].backlog_next;
+	if (s->backlog_head == 0)
+		s->backlog_tail = 0;
+	if (addr != NULL) {
+		memset(addr, 0, *addr_len);
+		((struct sockaddr_in *) addr)->sin_family = AF_INET;
+	}
+	return conn;
+}
+
+/* The connection is established after a round trip, or refused after
+ * one if nothing listens at addr. Either way it is in progress first.
+ */
+static int
+sim_connect (SOCKET sock, const struct sockaddr *addr, int addr_len)
+{
+	SOCKET listener_sock = find_listener((const struct sockaddr_in *) addr);
+	SOCKET server_sock;
+	sim_socket_t *listener;
+	sim_socket_t *server;
+	sim_socket_t *s;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	if (s->state != SIM_OPEN) {
+		sim_error = WSAEINVAL;
+		return SOCKET_ERROR;
+	}
+	if (listener_sock == 0) {
+		s->state = SIM_REFUSED;
+		s->ready = sim_now + 2 * proxy_link.latency;
+		s->error = WSAECONNREFUSED;
+		schedule(s->ready, NULL, sock);
+		sim_error = WSAEWOULDBLOCK;
+		return SOCKET_ERROR;
+	}
+
+	server_sock = new_socket(sim_sockets[listener_sock - 1].actor);
+	s = &sim_sockets[sock - 1];
+	listener = &sim_sockets[listener_sock - 1];
+	server = &sim_sockets[server_sock - 1];
+	server->state = SIM_CONNECTED;
+	server->addr = listener->addr;
+	server->link = listener->link;
+	server->peer = sock;
+	server->ready = sim_now + listener->link.latency;
+	s->state = SIM_CONNECTED;
+	s->link = listener->link;
+	s->peer = server_sock;
+	s->ready = sim_now + 2 * listener->link.latency;
+	if (listener->backlog_tail != 0)
+		sim_sockets[listener->backlog_tail - 1].backlog_next = server_sock;
+	else
+		listener->backlog_head = server_sock;
+	listener->backlog_tail = server_sock;
+	schedule(server->ready, NULL, listener_sock);
+	schedule(s->ready, NULL, sock);
+	sim_error = WSAEWOULDBLOCK;
+	return SOCKET_ERROR;
+}
+
+static int
+sim_recv (SOCKET sock, char *buf, int len, int flags)
+{
+	sim_socket_t *s;
+	int was_full;
+	int n = 0;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	if (s->state != SIM_CONNECTED || s->ready > sim_now) {
+		sim_error = WSAENOTCONN;
+		return SOCKET_ERROR;
+	}
+	was_full = s->buffered >= SIM_BUFFER;
+	while (n < len && s->head != NULL && s->head->due <= sim_now) {
+		segment_t *seg = s->head;
+		int part = seg->len - seg->pos < len - n ? seg->len - seg->pos : len - n;
+
+		memcpy(buf + n, seg->data + seg->pos, part);
+		seg->pos += part;
+		n += part;
+		if (seg->pos == seg->len) {
+			s->head = seg->next;
+			if (s->head == NULL)
+				s->tail = NULL;
+			free(seg);
+		}
+	}
+	if (n > 0) {
+		s->buffered -= n;
+		/* A scripted sender waits to be told that there is room again. */
+		if (was_full && sim_sockets[s->peer - 1].state != SIM_CLOSED && sim_sockets[s->peer - 1].actor != NULL)
+			schedule(sim_now, NULL, s->peer);
+		return n;
+	}
+	if (s->head == NULL && s->fin_due != 0 && s->fin_due <= sim_now)
+		return 0;
+	sim_error = WSAEWOULDBLOCK;
+	return SOCKET_ERROR;
+}
+
+static int
+sim_send (SOCKET sock, const char *buf, int len, int flags)
+{
+	sim_socket_t *peer;
+	sim_socket_t *s;
+	segment_t *seg;
+	int64_t start;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	if (s->state != SIM_CONNECTED || s->ready > sim_now) {
+		sim_error = WSAENOTCONN;
+		return SOCKET_ERROR;
+	}
+	peer = &sim_sockets[s->peer - 1];
+	if (peer->state == SIM_CLOSED) {
+		sim_error = WSAECONNRESET;
+		return SOCKET_ERROR;
+	}
+	if (peer->buffered >= SIM_BUFFER) {
+		sim_error = WSAEWOULDBLOCK;
+		return SOCKET_ERROR;
+	}
+	if (len > SIM_BUFFER - peer->buffered)
+		len = SIM_BUFFER - peer->buffered;
+
+	seg = xmalloc(sizeof(*seg) + len);
+	memcpy(seg->data, buf, len);
+	seg->next = NULL;
+	seg->len = len;
+	seg->pos = 0;
+	start = peer->link_free > sim_now ? peer->link_free : sim_now;
+	peer->link_free = start + (s->link.rate > 0 ? len * (int64_t) 1000000 / s->link.rate : 0);
+	seg->due = peer->link_free + s->link.latency;
+	if (peer->tail != NULL)
+		peer->tail->next = seg;
+	else
+		peer->head = seg;
+	peer->tail = seg;
+	peer->buffered += len;
+	schedule(seg->due, NULL, s->peer);
+	return len;
+}
+
+static int
+sim_closesocket (SOCKET sock)
+{
+	sim_socket_t *s;
+	segment_t *seg;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	for (int c = 0; c < bound_count; c++) {
+		if (bound[c] == sock) {
+			bound[c] = bound[--bound_count];
+			break;
+		}
+	}
+	if (s->state == SIM_LISTENING) {
+		while (s->backlog_head != 0) {
+			SOCKET conn = s->backlog_head;
+			s->backlog_head = sim_sockets[conn - 1].backlog_next;
+			sim_closesocket(conn);
+		}
+	}
+	if (s->state == SIM_CONNECTED) {
+		sim_socket_t *peer = &sim_sockets[s->peer - 1];
+
+		if (peer->state != SIM_CLOSED) {
+			peer->fin_due = (peer->link_free > sim_now ? peer->link_free : sim_now) + s->link.latency;
+			schedule(peer->fin_due, NULL, s->peer);
+		}
+		if (s->actor == NULL)
+			last_relay_close = sim_now;
+	}
+	while ((seg = s->head) != NULL) {
+		s->head = seg->next;
+		free(seg);
+	}
+	s->tail = NULL;
+	s->buffered = 0;
+	s->state = SIM_CLOSED;
+	return 0;
+}
+
+static int
+sim_ioctlsocket (SOCKET sock, long cmd, u_long *arg)
+{
+	if (sim_get(sock) == NULL)
+		return SOCKET_ERROR;
+	if (cmd != FIONBIO || *arg == 0) {
+		sim_error = WSAEINVAL;
+		return SOCKET_ERROR;
+	}
+	return 0;
+}
+
+static int
+sim_getsockopt (SOCKET sock, int level, int name, char *value, int *value_len)
+{
+	sim_socket_t *s;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	memset(value, 0, *value_len);
+	if (level == SOL_SOCKET && name == SO_ERROR && *value_len >= (int) sizeof(int))
+		memcpy(value, &s->error, sizeof(int));
+	return 0;
+}
+
+static int
+sim_setsockopt (SOCKET sock, int level, int name, const char *value, int value_len)
+{
+	return sim_get(sock) == NULL ? SOCKET_ERROR : 0;
+}
+
+static int
+sim_getsockname (SOCKET sock, struct sockaddr *addr, int *addr_len)
+{
+	sim_socket_t *s;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	memcpy(addr, &s->addr, sizeof(s->addr));
+	*addr_len = sizeof(s->addr);
+	return 0;
+}
+
+static int
+sim_getpeername (SOCKET sock, struct sockaddr *addr, int *addr_len)
+{
+	sim_socket_t *s;
+
+	if ((s = sim_get(sock)) == NULL)
+		return SOCKET_ERROR;
+	if (s->state != SIM_CONNECTED) {
+		sim_error = WSAENOTCONN;
+		return SOCKET_ERROR;
+	}
+	memcpy(addr, &sim_sockets[s->peer - 1].addr, sizeof(s->addr));
+	*addr_len = sizeof(s->addr);
+	return 0;
+}
+
+/* Count the sockets of set that are ready, and with keep, drop the rest
+ * from it. Returns -1 if the set holds a socket that is not open.
+ */
+static int
+select_ready (fd_set *set, bool (*ready) (const sim_socket_t *s), bool keep)
+{
+	u_int count = 0;
+
+	if (set == NULL)
+		return 0;
+	for (u_int c = 0; c < set->fd_count; c++) {
+		sim_socket_t *s = sim_get(set->fd_array[c]);
+
+		if (s == NULL)
+			return -1;
+		if (ready(s)) {
+			if (keep)
+				set->fd_array[count] = set->fd_array[c];
+			count++;
+		}
+	}
+	if (keep)
+		set->fd_count = count;
+	return count;
+}
+
+/* Run the scripted endpoints until a socket in the sets is ready or the
+ * timeout has passed, moving the clock to each event in turn.
+ */
+static int
+sim_select (int nfds, fd_set *read_fds, fd_set *write_fds, fd_set *except_fds, const struct timeval *timeout)
+{
+	int64_t deadline = 0;
+
+	select_calls++;
+	if (relay_stats.active > peak_active)
+		peak_active = relay_stats.active;
+	if (sim_now != last_select)
+		spin_count = 0;
+	else if (++spin_count > SIM_MAX_SPIN)
+		fatal("The relay is spinning at %.6f s\n", seconds(sim_now));
+	if (timeout != NULL)
+		deadline = sim_now + timeout->tv_sec * (int64_t) 1000000 + timeout->tv_usec;
+
+	for (;;) {
+		int readable;
+		int writable;
+		int failed;
+
+		run_events();
+		readable = select_ready(read_fds, sim_readable, false);
+		writable = select_ready(write_fds, sim_writable, false);
+		failed = select_ready(except_fds, sim_failed, false);
+		if (readable < 0 || writable < 0 || failed < 0)
+			return SOCKET_ERROR;
+		if (readable + writable + failed > 0 || (timeout != NULL && sim_now >= deadline)) {
+			select_ready(read_fds, sim_readable, true);
+			select_ready(write_fds, sim_writable, true);
+			select_ready(except_fds, sim_failed, true);
+			last_select = sim_now;
+			return readable + writable + failed;
+		}
+		if (event_count == 0 && timeout == NULL) {
+			/* A peer endpoint waits for tunnels until it is ended. */
+			if (scenario->serves) {
+				scenario->check();
+				exit(checks_ok ? 0 : 1);
+			}
+			fatal("The relay waits at %.6f s for sockets that nothing will make ready\n", seconds(sim_now));
+		}
+		if (event_count > 0 && (timeout == NULL || events[0].time < deadline))
+			sim_now = events[0].time;
+		else
+			sim_now = deadline;
+	}
+}
+
+static int sim_last_error (void) { return sim_error; }
+static void sim_set_last_error (int error) { sim_error = error; }
+static int64_t sim_now_us (void) { return sim_now; }
+
+static const net_ops_t sim_net_ops = {
+	sim_socket, sim_bind, sim_listen, sim_accept, sim_connect, sim_recv, sim_send,
+	sim_closesocket, sim_ioctlsocket, sim_getsockopt, sim_setsockopt, sim_getsockname, sim_getpeername,
+	sim_select, sim_last_error, sim_set_last_error, sim_now_us,
+};
+
+/* Byte pos of the pattern for seed. Each viewer has a seed for each
+ * direction, so that misrouted data is caught too.
+ */
+static uint8_t
+pattern_byte (uint32_t seed, uint64_t pos)
+{
+	uint64_t x = pos + seed * 0x9E3779B97F4A7C15ULL;
+
+	x ^= x >> 29;
+	return (x * 0xBF58476D1CE4E5B9ULL) >> 56;
+}
+
+static void
+pattern_fill (char *buf, uint32_t seed, uint64_t pos, uint32_t len)
+{
+	for (uint32_t c = 0; c < len; c++)
+		buf[c] = pattern_byte(seed, pos + c);
+}
+
+static bool
+pattern_check (const char *buf, uint32_t seed, uint64_t pos, uint32_t len)
+{
+	for (uint32_t c = 0; c < len; c++) {
+		if ((uint8_t) buf[c] != pattern_byte(seed, pos + c))
+			return false;
+	}
+	return true;
+}
+
+static void
+viewer_set_timer (viewer_t *viewer, int64_t time)
+{
+	if (viewer->timer == 0 || time < viewer->timer) {
+		viewer->timer = time;
+		schedule(time, &viewer->actor, viewer->sock);
+	}
+}
+
+/* Close the connection, early if failure is not NULL. */
+static void
+viewer_end (viewer_t *viewer, const char *failure)
+{
+	if (viewer->sock != 0)
+		sim_closesocket(viewer->sock);
+	viewer->failure = failure;
+	viewer->ended = sim_now;
+	viewer->state = VIEWER_DONE;
+}
+
+static void
+viewer_send (viewer_t *viewer)
+{
+	uint32_t header[HEADER_SIZE / sizeof(uint32_t)] = { viewer->request_size, viewer->reply_size, viewer->id };
+	char buf[MAX_SEND];
+
+	while (viewer->sent < viewer->request_size) {
+		uint32_t len = viewer->request_size - viewer->sent;
+		uint32_t header_len = 0;
+		int n;
+
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		if (viewer->sent < HEADER_SIZE) {
+			header_len = HEADER_SIZE - viewer->sent;
+			memcpy(buf, (char *) header + viewer->sent, header_len);
+		}
+		pattern_fill(buf + header_len, viewer->id * 2, viewer->up_pos, len - header_len);
+		n = sim_send(viewer->sock, buf, len, 0);
+		if (n == SOCKET_ERROR) {
+			if (sim_error != WSAEWOULDBLOCK)
+				viewer_end(viewer, "send failed");
+			return;
+		}
+		viewer->up_pos += n > header_len ? n - header_len : 0;
+		viewer->sent += n;
+	}
+	viewer->state = VIEWER_RECEIVING;
+}
+
+static void
+viewer_receive (viewer_t *viewer)
+{
+	static char buf[MAX_READ];
+
+	while (viewer->received < viewer->reply_size) {
+		uint32_t len = viewer->reply_size - viewer->received;
+		int n;
+
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		if (viewer->read_size != 0) {
+			if (sim_now < viewer->next_read) {
+				viewer_set_timer(viewer, viewer->next_read);
+				return;
+			}
+			if (len > viewer->read_size)
+				len = viewer->read_size;
+		}
+		n = sim_recv(viewer->sock, buf, len, 0);
+		if (n == SOCKET_ERROR) {
+			if (sim_error != WSAEWOULDBLOCK)
+				viewer_end(viewer, "receive failed");
+			return;
+		}
+		if (n == 0) {
+			viewer_end(viewer, "closed");
+			return;
+		}
+		if (!pattern_check(buf, viewer->id * 2 + 1, viewer->down_pos, n)) {
+			viewer_end(viewer, "corrupt reply");
+			return;
+		}
+		viewer->down_pos += n;
+		viewer->received += n;
+		viewer->next_read = sim_now + viewer->read_interval;
+	}
+
+	/* The first exchange includes connecting to the target. */
+	if (viewer->latency != NULL && viewer->done > 0)
+		histogram_add(viewer->latency, sim_now - viewer->exchange_start);
+	if (viewer->done++ == 0)
+		viewer->first_latency = sim_now - viewer->exchange_start;
+	if (viewer->done < viewer->exchanges) {
+		viewer->state = VIEWER_THINKING;
+		viewer->next_exchange = sim_now + viewer->think;
+	} else if (viewer->hold_until > sim_now) {
+		viewer->state = VIEWER_HOLDING;
+	} else {
+		viewer_end(viewer, NULL);
+	}
+}
+
+/* Between exchanges the relay must not send anything, but may close. */
+static void
+viewer_check_closed (viewer_t *viewer)
+{
+	char c;
+	int n = sim_recv(viewer->sock, &c, 1, 0);
+
+	if (n == 0)
+		viewer_end(viewer, "closed");
+	else if (n > 0)
+		viewer_end(viewer, "unexpected data");
+	else if (sim_error != WSAEWOULDBLOCK)
+		viewer_end(viewer, "receive failed");
+}
+
+static void
+viewer_wake (actor_t *actor, SOCKET sock)
+{
+	viewer_t *viewer = (viewer_t *) actor;
+	viewer_state_t state;
+
+	if (viewer->timer != 0 && viewer->timer <= sim_now)
+		viewer->timer = 0;
+	if (viewer->state == VIEWER_WAITING) {
+		if (sim_now < viewer->start) {
+			viewer_set_timer(viewer, viewer->start);
+			return;
+		}
+		viewer->sock = new_socket(&viewer->actor);
+		if (sim_connect(viewer->sock, (struct sockaddr *) &relay_addr, sizeof(relay_addr)) != 0 && sim_error != WSAEWOULDBLOCK)
+			viewer_end(viewer, "connect failed");
+		else
+			viewer->state = VIEWER_CONNECTING;
+		return;
+	}
+	if (viewer->state == VIEWER_CONNECTING) {
+		sim_socket_t *s = &sim_sockets[viewer->sock - 1];
+
+		if (sim_now < s->ready)
+			return;
+		if (s->state != SIM_CONNECTED) {
+			viewer_end(viewer, "refused");
+			return;
+		}
+		viewer->state = VIEWER_SENDING;
+		viewer->exchange_start = sim_now;
+	}
+
+	do {
+		state = viewer->state;
+		switch (viewer->state) {
+		case VIEWER_SENDING:
+			viewer_send(viewer);
+			break;
+		case VIEWER_RECEIVING:
+			viewer_receive(viewer);
+			break;
+		case VIEWER_THINKING:
+			if (sim_now >= viewer->next_exchange) {
+				viewer->state = VIEWER_SENDING;
+				viewer->sent = 0;
+				viewer->received = 0;
+				viewer->exchange_start = sim_now;
+			} else {
+				viewer_check_closed(viewer);
+				if (viewer->state == VIEWER_THINKING)
+					viewer_set_timer(viewer, viewer->next_exchange);
+			}
+			break;
+		case VIEWER_HOLDING:
+			if (sim_now >= viewer->hold_until) {
+				viewer_end(viewer, NULL);
+			} else {
+				viewer_check_closed(viewer);
+				if (viewer->state == VIEWER_HOLDING)
+					viewer_set_timer(viewer, viewer->hold_until);
+			}
+			break;
+		default:
+			break;
+		}
+	} while (viewer->state != state);
+}
+
+static viewer_t *
+add_viewer (int64_t start, int exchanges, uint32_t request_size, uint32_t reply_size)
+{
+	viewer_t *viewer = &viewers[viewer_count];
+
+	memset(viewer, 0, sizeof(*viewer));
+	viewer->actor.wake = viewer_wake;
+	viewer->id = viewer_count++;
+	viewer->start = start;
+	viewer->exchanges = exchanges;
+	viewer->request_size = request_size;
+	viewer->reply_size = reply_size;
+	return viewer;
+}
+
+static void
+peer_close (peer_conn_t *conn)
+{
+	sim_closesocket(conn->sock);
+	if (conn->forward != 0)
+		sim_closesocket(conn->forward);
+	conn->state = PEER_DONE;
+}
+
+static void
+peer_reply (peer_conn_t *conn, char status)
+{
+	char reply[8] = { 0x00, status };
+
+	if (sim_send(conn->sock, reply, sizeof(reply), 0) != sizeof(reply))
+		fatal("Cannot send SOCKS reply\n");
+}
+
+/* Read the SOCKS4 request, eight bytes and a user ID ending in NUL, and
+ * act on it as the script says.
+ */
+static void
+peer_read_request (peer_conn_t *conn)
+{
+	struct in_addr target_addr = { .s_addr = inet_addr(TARGET_ADDR) };
+	uint16_t target_port = htons(atoi(TARGET_PORT));
+	struct sockaddr_in tunnel_addr;
+	int n;
+
+	n = sim_recv(conn->sock, conn->request + conn->request_len, sizeof(conn->request) - conn->request_len, 0);
+	if (n == SOCKET_ERROR) {
+		if (sim_error != WSAEWOULDBLOCK)
+			peer_close(conn);
+		return;
+	}
+	if (n == 0) {
+		peer_close(conn);
+		return;
+	}
+	conn->request_len += n;
+	if (conn->request_len <= 8 || memchr(conn->request + 8, '\0', conn->request_len - 8) == NULL) {
+		if (conn->request_len == sizeof(conn->request))
+			fatal("SOCKS request too long\n");
+		return;
+	}
+	memset(&tunnel_addr, 0, sizeof(tunnel_addr));
+	tunnel_addr.sin_family = AF_INET;
+	tunnel_addr.sin_addr.s_addr = inet_addr(TUNNEL_ADDR);
+	tunnel_addr.sin_port = htons(atoi(TUNNEL_PORT));
+	if (conn->request[0] == 0x04 && conn->request[1] == 0x01 && target_listener != 0
+			&& memcmp(conn->request + 2, &tunnel_addr.sin_port, 2) == 0 && memcmp(conn->request + 4, &tunnel_addr.sin_addr, 4) == 0) {
+		conn->forward = new_socket(&socks_actor);
+		sim_sockets[conn->forward - 1].data = conn;
+		if (sim_connect(conn->forward, (struct sockaddr *) &tunnel_addr, sizeof(tunnel_addr)) != 0 && sim_error != WSAEWOULDBLOCK)
+			fatal("Cannot connect to the peer endpoint\n");
+		conn->state = PEER_CONNECTING;
+		return;
+	}
+	if (conn->request[0] != 0x04 || conn->request[1] != 0x01
+			|| memcmp(conn->request + 2, &target_port, 2) != 0 || memcmp(conn->request + 4, &target_addr, 4) != 0)
+		fatal("Invalid SOCKS request\n");
+
+	switch (conn->step.action) {
+	case SOCKS_ACCEPT:
+		peer_reply(conn, 0x5A);
+		conn->state = PEER_SERVING;
+		break;
+	case SOCKS_DENY:
+		peer_reply(conn, 0x5B);
+		peer_close(conn);
+		break;
+	case SOCKS_CLOSE:
+		peer_close(conn);
+		break;
+	case SOCKS_DELAY:
+		conn->reply_at = sim_now + conn->step.delay;
+		conn->state = PEER_REPLYING;
+		schedule(conn->reply_at, NULL, conn->sock);
+		break;
+	}
+}
+
+/* Serve exchanges as the target: read a request, then send the reply,
+ * as much as the connection takes.
+ */
+static void
+peer_serve (peer_conn_t *conn)
+{
+	static char buf[MAX_READ];
+	bool progress;
+
+	do {
+		int n;
+
+		progress = false;
+		if (conn->reply_left > 0) {
+			uint32_t len = conn->reply_left < MAX_SEND ? conn->reply_left : MAX_SEND;
+			viewer_t *viewer = conn->viewer;
+
+			pattern_fill(buf, viewer->id * 2 + 1, conn->down_pos, len);
+			n = sim_send(conn->sock, buf, len, 0);
+			if (n == SOCKET_ERROR) {
+				if (sim_error != WSAEWOULDBLOCK)
+					peer_close(conn);
+				return;
+			}
+			conn->reply_left -= n;
+			conn->down_pos += n;
+			viewer->peer_sent += n;
+			if (viewer->peer_sent - viewer->down_pos > viewer->max_in_flight)
+				viewer->max_in_flight = viewer->peer_sent - viewer->down_pos;
+			progress = true;
+			continue;
+		}
+
+		if (conn->header_len < HEADER_SIZE) {
+			n = sim_recv(conn->sock, (char *) conn->header + conn->header_len, HEADER_SIZE - conn->header_len, 0);
+		} else {
+			uint32_t len = conn->request_left < sizeof(buf) ? conn->request_left : sizeof(buf);
+			n = sim_recv(conn->sock, buf, len, 0);
+		}
+		if (n == SOCKET_ERROR) {
+			if (sim_error != WSAEWOULDBLOCK)
+				peer_close(conn);
+			return;
+		}
+		if (n == 0) {
+			peer_close(conn);
+			return;
+		}
+		progress = true;
+		if (conn->header_len < HEADER_SIZE) {
+			conn->header_len += n;
+			if (conn->header_len < HEADER_SIZE)
+				continue;
+			if (conn->header[2] >= viewer_count || conn->header[0] < HEADER_SIZE)
+				fatal("Invalid exchange header\n");
+			if (conn->viewer == NULL)
+				conn->viewer = &viewers[conn->header[2]];
+			else if (conn->viewer != &viewers[conn->header[2]])
+				fatal("Exchange of viewer %u on the connection of viewer %u\n", conn->header[2], conn->viewer->id);
+			conn->request_left = conn->header[0] - HEADER_SIZE;
+		} else {
+			if (!pattern_check(buf, conn->viewer->id * 2, conn->up_pos, n))
+				fatal("Corrupt request from viewer %u\n", conn->viewer->id);
+			conn->up_pos += n;
+			conn->request_left -= n;
+		}
+		if (conn->request_left == 0) {
+			conn->reply_left = conn->header[1];
+			conn->header_len = 0;
+		}
+	} while (progress && conn->state == PEER_SERVING);
+}
+
+/* Pass on what has arrived in either direction, as much as the other
+ * side takes. A close in either direction closes both.
+ */
+static void
+peer_forward (peer_conn_t *conn)
+{
+	for (int d = 0; d < 2; d++) {
+		pipe_t *pipe = &conn->pipes[d];
+		int n;
+
+		for (;;) {
+			if (pipe->len == 0) {
+				n = sim_recv(pipe->from, pipe->buf, sizeof(pipe->buf), 0);
+				if (n == SOCKET_ERROR && sim_error == WSAEWOULDBLOCK)
+					break;
+				if (n <= 0) {
+					peer_close(conn);
+					return;
+				}
+				pipe->pos = 0;
+				pipe->len = n;
+			}
+			n = sim_send(pipe->to, pipe->buf + pipe->pos, pipe->len, 0);
+			if (n == SOCKET_ERROR && sim_error == WSAEWOULDBLOCK)
+				break;
+			if (n == SOCKET_ERROR) {
+				peer_close(conn);
+				return;
+			}
+			pipe->pos += n;
+			pipe->len -= n;
+		}
+	}
+}
+
+static void
+socks_wake (actor_t *actor, SOCKET sock)
+{
+	peer_conn_t *conn;
+
+	if (sock == target_listener) {
+		SOCKET conn_sock;
+
+		while ((conn_sock = sim_accept(target_listener, NULL, NULL)) != INVALID_SOCKET) {
+			conn = xmalloc(sizeof(*conn));
+			memset(conn, 0, sizeof(*conn));
+			conn->sock = conn_sock;
+			conn->state = PEER_SERVING;
+			sim_sockets[conn_sock - 1].data = conn;
+			socks_wake(actor, conn_sock);
+		}
+		return;
+	}
+
+	if (sock == socks_listener) {
+		SOCKET conn_sock;
+
+		while ((conn_sock = sim_accept(socks_listener, NULL, NULL)) != INVALID_SOCKET) {
+			conn = xmalloc(sizeof(*conn));
+			memset(conn, 0, sizeof(*conn));
+			conn->sock = conn_sock;
+			if (socks_arrivals < socks_script_len)
+				conn->step = socks_script[socks_arrivals];
+			socks_arrivals++;
+			sim_sockets[conn_sock - 1].data = conn;
+			socks_wake(actor, conn_sock);
+		}
+		return;
+	}
+
+	conn = sim_sockets[sock - 1].data;
+	if (conn->state == PEER_REQUEST)
+		peer_read_request(conn);
+	if (conn->state == PEER_REPLYING && sim_now >= conn->reply_at) {
+		peer_reply(conn, 0x5A);
+		conn->state = PEER_SERVING;
+	}
+	if (conn->state == PEER_SERVING)
+		peer_serve(conn);
+	if (conn->state == PEER_CONNECTING) {
+		const sim_socket_t *s = &sim_sockets[conn->forward - 1];
+
+		if (sim_now < s->ready)
+			return;
+		if (s->state != SIM_CONNECTED)
+			fatal("The peer endpoint refused the tunnel\n");
+		peer_reply(conn, 0x5A);
+		conn->pipes = xmalloc(2 * sizeof(*conn->pipes));
+		conn->pipes[0] = (pipe_t) { .from = conn->sock, .to = conn->forward };
+		conn->pipes[1] = (pipe_t) { .from = conn->forward, .to = conn->sock };
+		conn->state = PEER_FORWARDING;
+	}
+	if (conn->state == PEER_FORWARDING)
+		peer_forward(conn);
+}
+
+static void
+open_socks_listener (void)
+{
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(PROXY_ADDR);
+	addr.sin_port = htons(atoi(PROXY_PORT));
+	socks_actor.wake = socks_wake;
+	socks_listener = new_socket(&socks_actor);
+	sim_sockets[socks_listener - 1].link = proxy_link;
+	if (sim_bind(socks_listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || sim_listen(socks_listener, SOMAXCONN) != 0)
+		fatal("Cannot open SOCKS listener\n");
+}
+
+static void
+print_result (const char *name, const char *fmt, ...)
+{
+	va_list argv;
+
+	printf("{\"scenario\":\"%s\",", name);
+	va_start(argv, fmt);
+	vprintf(fmt, argv);
+	va_end(argv);
+	printf(",\"virtual_s\":%.6f,\"select_calls\":%" PRIu64 ",\"events\":%" PRIu64 ",\"ok\":%s}\n",
+		seconds(sim_now - SIM_START), select_calls, events_run, checks_ok ? "true" : "false");
+}
+
+/* Viewers connect in waves until all are connected at once, run a few
+ * exchanges each and then wait for the others before closing.
+ */
+static void
+setup_scale (void)
+{
+	viewer_link = (sim_link_t) { 200, 0 };
+	proxy_link = (sim_link_t) { 20000, 10000000 / 8 };
+	viewers = xmalloc(SCALE_VIEWERS * sizeof(*viewers));
+	for (int c = 0; c < SCALE_VIEWERS; c++) {
+		viewer_t *viewer = add_viewer(SIM_START + c / SCALE_WAVE * 10000, 4, 64, 1024);
+		viewer->think = 250000;
+		viewer->hold_until = SIM_START + 4000000;
+	}
+}
+
+static void
+check_scale (void)
+{
+	uint32_t completed = 0;
+
+	for (uint32_t c = 0; c < viewer_count; c++) {
+		if (viewers[c].failure == NULL && viewers[c].done == viewers[c].exchanges)
+			completed++;
+	}
+	check(completed == viewer_count, "%u of %u viewers completed their exchanges\n", completed, viewer_count);
+	check(peak_active == viewer_count, "at most %u connections were active at once, not %u\n", peak_active, viewer_count);
+	check(relay_stats.connections == viewer_count && relay_stats.rejected == 0 && relay_stats.failed == 0,
+		"%" PRIu64 " connections, %" PRIu64 " rejected and %" PRIu64 " failed\n",
+		relay_stats.connections, relay_stats.rejected, relay_stats.failed);
+	print_result("scale", "\"viewers\":%u,\"completed\":%u,\"peak_active\":%u,\"connections\":%" PRIu64,
+		viewer_count, completed, peak_active, relay_stats.connections);
+}
+
+/* Four viewers hold the relay at max-conns while six more wait for
+ * admission until queue-time and are closed. Then the proxy denies one
+ * connection, closes one and answers one late. Last, the idle relay
+ * must exit after its lifetime.
+ */
+static void
+setup_timeout (void)
+{
+	viewer_link = (sim_link_t) { 200, 0 };
+	proxy_link = (sim_link_t) { 20000, 0 };
+	set_proxy_option(L"max-conns=4");
+	set_proxy_option(L"queue-time=500");
+	viewers = xmalloc((TIMEOUT_HELD + TIMEOUT_QUEUED + 3) * sizeof(*viewers));
+	for (int c = 0; c < TIMEOUT_HELD; c++) {
+		viewer_t *viewer = add_viewer(SIM_START, 2, 64, 64);
+		viewer->think = 100000;
+		viewer->hold_until = SIM_START + 3000000;
+		socks_script[socks_script_len++] = (socks_step_t) { SOCKS_ACCEPT };
+	}
+	for (int c = 0; c < TIMEOUT_QUEUED; c++)
+		add_viewer(SIM_START + 100000, 1, 64, 64);
+	add_viewer(SIM_START + 4000000, 1, 64, 64);
+	socks_script[socks_script_len++] = (socks_step_t) { SOCKS_DENY };
+	add_viewer(SIM_START + 4010000, 1, 64, 64);
+	socks_script[socks_script_len++] = (socks_step_t) { SOCKS_CLOSE };
+	add_viewer(SIM_START + 4020000, 2, 64, 64);
+	socks_script[socks_script_len++] = (socks_step_t) { SOCKS_DELAY, 2000000 };
+}
+
+static void
+check_timeout (void)
+{
+	const viewer_t *denied = &viewers[TIMEOUT_HELD + TIMEOUT_QUEUED];
+	const viewer_t *closed = denied + 1;
+	const viewer_t *delayed = denied + 2;
+	int64_t idle = sim_now - last_relay_close;
+	int64_t max_wait = 0;
+
+	for (int c = 0; c < TIMEOUT_HELD; c++) {
+		const viewer_t *viewer = &viewers[c];
+		check(viewer->failure == NULL && viewer->done == viewer->exchanges,
+			"held viewer %d: %s after %d exchanges\n", c, viewer->failure, viewer->done);
+	}
+	/* The relay waits in whole milliseconds, so the close may be late by
+	 * up to one, plus a round trip to the viewer.
+	 */
+	for (int c = 0; c < TIMEOUT_QUEUED; c++) {
+		const viewer_t *viewer = &viewers[TIMEOUT_HELD + c];
+		int64_t wait = viewer->ended - viewer->start - 2 * viewer_link.latency;
+
+		check(viewer->failure != NULL && strcmp(viewer->failure, "closed") == 0 && viewer->done == 0,
+			"queued viewer %d: %s after %d exchanges\n", c, viewer->failure, viewer->done);
+		check(wait >= TIMEOUT_QUEUE_TIME * 1000 && wait < (TIMEOUT_QUEUE_TIME + 1) * 1000,
+			"queued viewer %d closed after %.6f s\n", c, seconds(wait));
+		if (wait > max_wait)
+			max_wait = wait;
+	}
+	check(denied->failure != NULL && strcmp(denied->failure, "closed") == 0 && denied->done == 0,
+		"denied viewer: %s after %d exchanges\n", denied->failure, denied->done);
+	check(closed->failure != NULL && strcmp(closed->failure, "closed") == 0 && closed->done == 0,
+		"viewer with closed proxy: %s after %d exchanges\n", closed->failure, closed->done);
+	check(delayed->failure == NULL && delayed->done == delayed->exchanges,
+		"delayed viewer: %s after %d exchanges\n", delayed->failure, delayed->done);
+	check(delayed->first_latency >= 2000000 && delayed->first_latency < 2200000,
+		"delayed viewer's first exchange took %.6f s\n", seconds(delayed->first_latency));
+	check(relay_stats.connections == TIMEOUT_HELD + 3 && relay_stats.rejected == TIMEOUT_QUEUED && relay_stats.failed == 2,
+		"%" PRIu64 " connections, %" PRIu64 " rejected and %" PRIu64 " failed\n",
+		relay_stats.connections, relay_stats.rejected, relay_stats.failed);
+	check(idle == RELAY_LIFETIME, "relay exited %.6f s after the last connection\n", seconds(idle));
+	print_result("timeout", "\"rejected\":%" PRIu64 ",\"failed\":%" PRIu64 ",\"max_queue_wait_s\":%.6f,"
+		"\"delayed_first_exchange_s\":%.6f,\"idle_exit_s\":%.6f",
+		relay_stats.rejected, relay_stats.failed, seconds(max_wait), seconds(delayed->first_latency), seconds(idle));
+}
+
+/* A viewer reads a large reply far slower than the proxy link carries
+ * it, next to interactive viewers. The relay must hold only its window
+ * of the bulk reply, and the interactive exchanges must not wait for it.
+ */
+static void
+setup_backpressure (void)
+{
+	viewer_t *bulk;
+
+	viewer_link = (sim_link_t) { 100, 0 };
+	proxy_link = (sim_link_t) { 20000, 100000000 / 8 };
+	viewers = xmalloc((1 + INTERACTIVE_VIEWERS) * sizeof(*viewers));
+	bulk = add_viewer(SIM_START, 1, 64, BULK_SIZE);
+	bulk->read_size = BULK_READ;
+	bulk->read_interval = BULK_READ_INTERVAL;
+	for (int c = 0; c < INTERACTIVE_VIEWERS; c++) {
+		viewer_t *viewer = add_viewer(SIM_START + 100000, INTERACTIVE_EXCHANGES, 64, 64);
+		viewer->think = 50000;
+		viewer->latency = &interactive_latency;
+	}
+}
+
+static void
+check_backpressure (void)
+{
+	const viewer_t *bulk = &viewers[0];
+	uint64_t max_in_flight = 2 * SIM_BUFFER + RELAY_WINDOW;
+	int64_t round_trip = 2 * (viewer_link.latency + proxy_link.latency);
+	uint64_t p99 = histogram_percentile(&interactive_latency, 99);
+
+	check(bulk->failure == NULL && bulk->done == 1, "bulk viewer: %s after %u bytes\n", bulk->failure, bulk->received);
+	check(bulk->max_in_flight <= max_in_flight, "%" PRIu64 " bytes of the bulk reply in flight, over %" PRIu64 "\n",
+		bulk->max_in_flight, max_in_flight);
+	for (int c = 1; c <= INTERACTIVE_VIEWERS; c++) {
+		const viewer_t *viewer = &viewers[c];
+		check(viewer->failure == NULL && viewer->done == viewer->exchanges,
+			"interactive viewer %d: %s after %d exchanges\n", c, viewer->failure, viewer->done);
+	}
+	check(p99 <= round_trip + INTERACTIVE_SLACK, "interactive p99 %" PRIu64 " us, round trip %" PRId64 " us\n", p99, round_trip);
+	print_result("backpressure", "\"bulk_bytes\":%" PRIu64 ",\"bulk_s\":%.6f,\"bulk_max_in_flight\":%" PRIu64 ","
+		"\"round_trip_us\":%" PRId64 ",\"interactive_p50_us\":%" PRIu64 ",\"interactive_p99_us\":%" PRIu64 ",\"interactive_max_us\":%" PRIu64,
+		bulk->down_pos, seconds(bulk->first_latency), bulk->max_in_flight, round_trip,
+		histogram_percentile(&interactive_latency, 50), p99, interactive_latency.max);
+}
+
+/* The relay carries the viewers as streams over a tunnel to a peer
+ * endpoint, served by the same relay behind the proxy: a slow bulk
+ * reader next to interactive viewers, and later a second wave on the
+ * tunnel left open. The credit windows must keep the bulk stream from
+ * delaying the others, and the second wave must not wait for a connect
+ * or a SOCKS handshake.
+ */
+static void
+setup_tunnel (void)
+{
+	struct sockaddr_in addr;
+	viewer_t *bulk;
+	FILE *fp;
+
+	viewer_link = (sim_link_t) { 100, 0 };
+	proxy_link = (sim_link_t) { 20000, 100000000 / 8 };
+	fp = fopen(TUNNEL_KEY_FILE, "w");
+	if (fp == NULL || fputs("relaysim\n", fp) == EOF || fclose(fp) != 0)
+		fatal("Cannot write `%s'\n", TUNNEL_KEY_FILE);
+	set_proxy_option(L"tunnel=" TUNNEL_ADDR ":" TUNNEL_PORT);
+	set_proxy_option(L"tunnel-key=" TUNNEL_KEY_FILE);
+	prepare_tunnel_peer(L"" TUNNEL_ADDR, L"" TUNNEL_PORT);
+	remove(TUNNEL_KEY_FILE); /* Ignore errors */
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(TARGET_ADDR);
+	addr.sin_port = htons(atoi(TARGET_PORT));
+	socks_actor.wake = socks_wake;
+	target_listener = new_socket(&socks_actor);
+	sim_sockets[target_listener - 1].link = viewer_link;
+	if (sim_bind(target_listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || sim_listen(target_listener, SOMAXCONN) != 0)
+		fatal("Cannot open target listener\n");
+
+	viewers = xmalloc((1 + INTERACTIVE_VIEWERS + TUNNEL_LATER) * sizeof(*viewers));
+	bulk = add_viewer(SIM_START, 1, 64, BULK_SIZE);
+	bulk->read_size = BULK_READ;
+	bulk->read_interval = BULK_READ_INTERVAL;
+	for (int c = 0; c < INTERACTIVE_VIEWERS; c++) {
+		viewer_t *viewer = add_viewer(SIM_START + 100000, INTERACTIVE_EXCHANGES, 64, 64);
+		viewer->think = 50000;
+		viewer->latency = &interactive_latency;
+	}
+	for (int c = 0; c < TUNNEL_LATER; c++)
+		add_viewer(SIM_START + TUNNEL_LATER_START + c * 1000, 2, 64, 1024);
+}
+
+static void
+check_tunnel (void)
+{
+	const viewer_t *bulk = &viewers[0];
+	uint64_t max_in_flight = 2 * SIM_BUFFER + 2 * RELAY_WINDOW;
+	/* Viewer to relay, relay to proxy, proxy to peer endpoint and peer endpoint to target. */
+	int64_t round_trip = 2 * (3 * viewer_link.latency + proxy_link.latency);
+	uint64_t p99 = histogram_percentile(&interactive_latency, 99);
+	int64_t max_first = 0;
+
+	check(bulk->failure == NULL && bulk->done == 1, "bulk viewer: %s after %u bytes\n", bulk->failure, bulk->received);
+	check(bulk->max_in_flight <= max_in_flight, "%" PRIu64 " bytes of the bulk reply in flight, over %" PRIu64 "\n",
+		bulk->max_in_flight, max_in_flight);
+	for (int c = 1; c <= INTERACTIVE_VIEWERS; c++) {
+		const viewer_t *viewer = &viewers[c];
+		check(viewer->failure == NULL && viewer->done == viewer->exchanges,
+			"interactive viewer %d: %s after %d exchanges\n", c, viewer->failure, viewer->done);
+	}
+	check(p99 <= round_trip + INTERACTIVE_SLACK, "interactive p99 %" PRIu64 " us, round trip %" PRId64 " us\n", p99, round_trip);
+	/* The first exchange includes only the connect from the peer
+	 * endpoint to the target, a round trip on the viewer link.
+	 */
+	for (int c = 0; c < TUNNEL_LATER; c++) {
+		const viewer_t *viewer = &viewers[1 + INTERACTIVE_VIEWERS + c];
+
+		check(viewer->failure == NULL && viewer->done == viewer->exchanges,
+			"later viewer %d: %s after %d exchanges\n", c, viewer->failure, viewer->done);
+		if (viewer->first_latency > max_first)
+			max_first = viewer->first_latency;
+	}
+	check(max_first <= round_trip + 2 * viewer_link.latency + INTERACTIVE_SLACK,
+		"later viewer's first exchange took %" PRId64 " us, round trip %" PRId64 " us\n", max_first, round_trip);
+	check(socks_arrivals == 1, "%d connections through the proxy, not 1\n", socks_arrivals);
+	check(relay_stats.tunnels == 2 && relay_stats.tunnels_failed == 0 && relay_stats.failed == 0,
+		"%" PRIu64 " tunnels, %" PRIu64 " failed, and %" PRIu64 " connections failed\n",
+		relay_stats.tunnels, relay_stats.tunnels_failed, relay_stats.failed);
+	print_result("tunnel", "\"bulk_bytes\":%" PRIu64 ",\"bulk_s\":%.6f,\"bulk_max_in_flight\":%" PRIu64 ","
+		"\"round_trip_us\":%" PRId64 ",\"interactive_p50_us\":%" PRIu64 ",\"interactive_p99_us\":%" PRIu64 ","
+		"\"later_first_exchange_max_us\":%" PRId64 ",\"proxy_connections\":%d",
+		bulk->down_pos, seconds(bulk->first_latency), bulk->max_in_flight, round_trip,
+		histogram_percentile(&interactive_latency, 50), p99, max_first, socks_arrivals);
+}
+
+static const scenario_t scenarios[] = {
+	{ "scale", "10,000 viewers connected at once", setup_scale, check_scale },
+	{ "timeout", "admission queue timeouts, proxy failures and the relay lifetime", setup_timeout, check_timeout },
+	{ "backpressure", "a slow bulk reader next to interactive viewers", setup_backpressure, check_backpressure },
+	{ "tunnel", "viewers carried over one tunnel to a peer endpoint", setup_tunnel, check_tunnel, true },
+};
+
+int
+main (int argc, char **argv)
+{
+	wchar_t *listen_host;
+	char listen_name[16];
+	int c;
+
+	for (c = 0; argc == 2 && c < sizeof(scenarios)/sizeof(*scenarios); c++) {
+		if (strcmp(argv[1], scenarios[c].name) == 0)
+			scenario = &scenarios[c];
+	}
+	if (scenario == NULL) {
+		fprintf(stderr, "Usage: %s SCENARIO\n"
+			"Run the relay on a simulated network with virtual time.\n"
+			"Scenarios:\n", program_name);
+		for (c = 0; c < sizeof(scenarios)/sizeof(*scenarios); c++)
+			fprintf(stderr, "  %-14s%s\n", scenarios[c].name, scenarios[c].description);
+		fprintf(stderr, "Results are written as JSON.\n");
+		exit(1);
+	}
+
+	set_proxy_net_ops(&sim_net_ops);
+	scenario->setup();
+	open_socks_listener();
+	memset(&relay_addr, 0, sizeof(relay_addr));
+	relay_addr.sin_family = AF_INET;
+	relay_addr.sin_port = htons(prepare_proxy(L"" PROXY_ADDR, L"" PROXY_PORT, L"" TARGET_ADDR, L"" TARGET_PORT, &listen_host));
+	if (wcstombs(listen_name, listen_host, sizeof(listen_name)) >= sizeof(listen_name))
+		fatal("Invalid relay address `%ls'\n", listen_host);
+	relay_addr.sin_addr.s_addr = inet_addr(listen_name);
+	free(listen_host);
+
+	for (uint32_t v = 0; v < viewer_count; v++)
+		schedule(viewers[v].start, &viewers[v].actor, 0);
+	handle_proxy();
+	scenario->check();
+	exit(checks_ok ? 0 : 1);
+}
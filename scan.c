@@ -0,0 +1,205 @@
+/* scan.c - Find characters in text with vector instructions
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* The vector code is compiled with target attributes rather than
+ * compiler flags, so the programs still run on any x86 processor. The
+ * best scanner the processor supports is chosen the first time
+ * scan_chars is called.
+ *
+ * On 64-bit Windows the stack is only 16-byte aligned, but GCC spills
+ * 256-bit values with aligned moves. The Makefile therefore has the
+ * assembler turn those into unaligned moves for 64-bit builds.
+ */
+
+#include <wchar.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "rdpvnclaunch.h"
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static size_t scan_scalar(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max);
+#ifdef HAVE_X86_SIMD
+static size_t scan_sse2(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max);
+static size_t scan_avx2(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max);
+#endif
+
+/* Best first. */
+static const scanner_t all_scanners[] = {
+#ifdef HAVE_X86_SIMD
+	{ "avx2", scan_avx2, cpu_has_avx2 },
+	{ "sse2", scan_sse2, cpu_has_sse2 },
+#endif
+	{ "scalar", scan_scalar, NULL },
+};
+
+static const scanner_t *usable_scanners;
+static size_t usable_count;
+
+#ifdef HAVE_X86_SIMD
+
+/* The processor is asked with CPUID once; the answers are kept. */
+static int sse2_supported = -1;
+static int avx2_supported = -1;
+
+bool
+cpu_has_sse2(void)
+{
+	if (sse2_supported < 0) {
+		__builtin_cpu_init();
+		sse2_supported = __builtin_cpu_supports("sse2") != 0;
+	}
+	return sse2_supported;
+}
+
+/* This also requires the operating system to save the AVX registers. */
+bool
+cpu_has_avx2(void)
+{
+	if (avx2_supported < 0) {
+		__builtin_cpu_init();
+		avx2_supported = __builtin_cpu_supports("avx2") != 0;
+	}
+	return avx2_supported;
+}
+
+#else
+
+bool
+cpu_has_sse2(void)
+{
+	return false;
+}
+
+bool
+cpu_has_avx2(void)
+{
+	return false;
+}
+
+#endif
+
+static size_t
+scan_scalar(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max)
+{
+	size_t count = 0;
+
+	for (size_t c = 0; c < len && count < max; c++) {
+		if (text[c] == ch)
+			positions[count++] = c;
+	}
+	return count;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Add the positions of the characters matched in mask, which has two
+ * bits per character, the first for position base.
+ */
+static inline size_t
+scan_mask(uint32_t mask, size_t base, size_t *positions, size_t count, size_t max)
+{
+	mask &= 0x55555555;
+	while (mask != 0 && count < max) {
+		positions[count++] = base + __builtin_ctz(mask) / 2;
+		mask &= mask - 1;
+	}
+	return count;
+}
+
+__attribute__((target("sse2")))
+static size_t
+scan_sse2(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max)
+{
+	const __m128i needle = _mm_set1_epi16((short) ch);
+	size_t count = 0;
+	size_t c;
+
+	for (c = 0; c + 8 <= len && count < max; c += 8) {
+		__m128i chars = _mm_loadu_si128((const __m128i *) (text + c));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chars, needle));
+
+		if (mask != 0)
+			count = scan_mask(mask, c, positions, count, max);
+	}
+	for (; c < len && count < max; c++) {
+		if (text[c] == ch)
+			positions[count++] = c;
+	}
+	return count;
+}
+
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max)
+{
+	const __m256i needle = _mm256_set1_epi16((short) ch);
+	size_t count = 0;
+	size_t c;
+
+	for (c = 0; c + 16 <= len && count < max; c += 16) {
+		__m256i chars = _mm256_loadu_si256((const __m256i *) (text + c));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(chars, needle));
+
+		if (mask != 0)
+			count = scan_mask(mask, c, positions, count, max);
+	}
+	for (; c < len && count < max; c++) {
+		if (text[c] == ch)
+			positions[count++] = c;
+	}
+	return count;
+}
+
+#endif
+
+/* get_scanners:
+ * Set *scanners to the scanners this processor can run, best first and
+ * ending with the scalar one. Returns how many there are.
+ */
+size_t
+get_scanners(const scanner_t **scanners)
+{
+	if (usable_scanners == NULL) {
+		size_t c;
+
+		for (c = 0; all_scanners[c].supported != NULL && !all_scanners[c].supported(); c++)
+			;
+		usable_count = sizeof(all_scanners)/sizeof(*all_scanners) - c;
+		usable_scanners = all_scanners + c;
+	}
+	*scanners = usable_scanners;
+	return usable_count;
+}
+
+/* scan_chars:
+ * Store the positions of the first max occurrences of ch in the len
+ * characters of text in positions, in order. Returns how many were
+ * found; if that is max, the search can continue after the last one.
+ */
+size_t
+scan_chars(const wchar_t *text, size_t len, wchar_t ch, size_t *positions, size_t max)
+{
+	const scanner_t *scanners;
+
+	get_scanners(&scanners);
+	return scanners[0].scan(text, len, ch, positions, max);
+}
@@ -0,0 +1,575 @@
+/* stats.c - Relay statistics
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <windows.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "rdpvnclaunch.h"
+#include "stats.h"
+
+/* The relay is single-threaded, so counters are plain integers
+ * updated in place; no locking or atomic operations are needed.
+ */
+relay_stats_t relay_stats;
+uint32_t stats_lag_warn;		/* Microseconds, 0 to disable lag warnings */
+
+static const char *direction_names[2] = { "up", "down" };
+static const char *phase_names[PHASE_COUNT] = {
+	"accept", "connect_start", "connect_done", "request_sent",
+	"reply_received", "first_client_byte", "first_server_byte"
+};
+static const char *path_names[] = { "unknown", "proxy", "direct" };
+static FILE *events_fh;
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} strbuf_t;
+
+static void
+strbuf_printf (strbuf_t *buf, const char *fmt, ...)
+{
+	va_list argv;
+	int len;
+
+	for (;;) {
+		va_start(argv, fmt);
+		len = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, argv);
+		va_end(argv);
+		if (len >= 0 && buf->len + len < buf->size)
+			break;
+		buf->size = buf->size * 2 + (len > 0 ? len : 0) + 256;
+		buf->data = xrealloc(buf->data, buf->size);
+	}
+	buf->len += len;
+}
+
+static int
+histogram_bucket (uint64_t value)
+{
+	int exp;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+	for (exp = 4; exp < 63 && value >> (exp + 1) != 0; exp++)
+		;
+	return HISTOGRAM_SUB_BUCKETS + (exp - 4) * (HISTOGRAM_SUB_BUCKETS / 2) + (value >> (exp - 3)) - 8;
+}
+
+/* Largest value that falls in the bucket. */
+static uint64_t
+histogram_bucket_value (int bucket)
+{
+	int exp;
+	uint64_t sub;
+
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+	exp = (bucket - HISTOGRAM_SUB_BUCKETS) / (HISTOGRAM_SUB_BUCKETS / 2) + 4;
+	sub = (bucket - HISTOGRAM_SUB_BUCKETS) % (HISTOGRAM_SUB_BUCKETS / 2) + 8;
+	return ((sub + 1) << (exp - 3)) - 1;
+}
+
+void
+histogram_add (histogram_t *hist, uint64_t value)
+{
+	hist->counts[histogram_bucket(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/* histogram_percentile:
+ * Return the value below which the given percentage (0-100) of
+ * recorded values fall, rounded up to the bucket boundary.
+ */
+uint64_t
+histogram_percentile (const histogram_t *hist, double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+
+	if (hist->count == 0)
+		return 0;
+	target = (uint64_t) (hist->count * percentile / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+	for (int c = 0; c < HISTOGRAM_BUCKETS; c++) {
+		seen += hist->counts[c];
+		if (seen >= target) {
+			uint64_t value = histogram_bucket_value(c);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+void
+stats_recv (conn_stats_t *conn, int direction, uint32_t len, uint32_t queued)
+{
+	flow_stats_t *flows[2] = { &conn->flow[direction], &relay_stats.flow[direction] };
+
+	for (int c = 0; c < 2; c++) {
+		flows[c]->bytes += len;
+		flows[c]->recv_calls++;
+		if (queued > flows[c]->queue_max)
+			flows[c]->queue_max = queued;
+	}
+}
+
+void
+stats_send (conn_stats_t *conn, int direction)
+{
+	conn->flow[direction].send_calls++;
+	relay_stats.flow[direction].send_calls++;
+}
+
+void
+stats_chunk (conn_stats_t *conn, int direction, uint32_t len, int64_t delay)
+{
+	conn->flow[direction].chunks++;
+	relay_stats.flow[direction].chunks++;
+	histogram_add(&relay_stats.latency[direction], delay);
+	histogram_add(&relay_stats.chunk_size[direction], len);
+}
+
+/* stats_phase:
+ * Record the first time a connection reaches a setup phase.
+ */
+void
+stats_phase (conn_stats_t *conn, phase_t phase, int64_t now)
+{
+	if (conn->phase_time[phase] != 0)
+		return;
+	conn->phase_time[phase] = now;
+	if (phase != PHASE_ACCEPT)
+		histogram_add(&relay_stats.phase[phase], now - conn->phase_time[PHASE_ACCEPT]);
+}
+
+/* stats_lag:
+ * Estimate input-to-update latency. A small read from the viewer is
+ * taken as input, such as a key press or mouse movement, and the next
+ * read from the server as the screen update answering it. The time in
+ * between is the lag the user sees, less the short viewer-relay leg.
+ */
+void
+stats_lag (conn_stats_t *conn, int direction, uint32_t len, int64_t now)
+{
+	int64_t lag;
+
+	if (direction == STATS_UP) {
+		if (len <= LAG_INPUT_SIZE && conn->input_time == 0)
+			conn->input_time = now;
+		return;
+	}
+	if (conn->input_time == 0)
+		return;
+	lag = now - conn->input_time;
+	conn->input_time = 0;
+	conn->lag[conn->lag_count % LAG_WINDOW] = lag < UINT32_MAX ? lag : UINT32_MAX;
+	conn->lag_count++;
+	histogram_add(&relay_stats.lag, lag);
+
+	if (stats_lag_warn != 0 && conn->lag_count >= LAG_MIN_SAMPLES) {
+		uint32_t p90 = stats_lag_percentile(conn, 90);
+
+		if (p90 > stats_lag_warn && !conn->lag_warned) {
+			conn->lag_warned = true;
+			relay_stats.lag_warnings++;
+			if (events_fh != NULL) {
+				fprintf(events_fh, "{\"event\":\"lag\",\"session\":%" PRIu32 ",\"target\":\"%s\",\"p50_us\":%" PRIu32 ",\"p90_us\":%" PRIu32 "}\n",
+					conn->id, conn->target, stats_lag_percentile(conn, 50), p90);
+				fflush(events_fh);
+			}
+		} else if (p90 <= stats_lag_warn) {
+			conn->lag_warned = false;
+		}
+	}
+}
+
+/* stats_fail:
+ * Record why the setup of a connection failed. The reason goes into
+ * the setup event written when the connection is closed.
+ */
+void
+stats_fail (conn_stats_t *conn, const char *failure, int error)
+{
+	conn->failure = failure;
+	conn->error = error;
+	relay_stats.failed++;
+}
+
+/* stats_accept_failed:
+ * Count a connection that could not be accepted, and note it in the
+ * events file. There is no session for it, so no setup event follows.
+ */
+void
+stats_accept_failed (const char *failure, int error)
+{
+	relay_stats.accept_failed++;
+	if (events_fh != NULL) {
+		fprintf(events_fh, "{\"event\":\"accept\",\"failure\":\"%s\",\"error\":%d}\n", failure, error);
+		fflush(events_fh);
+	}
+}
+
+/* stats_lag_percentile:
+ * Return a percentile of the recent lag samples of a connection.
+ */
+uint32_t
+stats_lag_percentile (const conn_stats_t *conn, double percentile)
+{
+	uint32_t sorted[LAG_WINDOW];
+	int count = conn->lag_count < LAG_WINDOW ? conn->lag_count : LAG_WINDOW;
+	int index;
+
+	if (count == 0)
+		return 0;
+	for (int c = 0; c < count; c++) {
+		uint32_t value = conn->lag[c];
+		int pos;
+
+		for (pos = c; pos > 0 && sorted[pos - 1] > value; pos--)
+			sorted[pos] = sorted[pos - 1];
+		sorted[pos] = value;
+	}
+	index = (int) (count * percentile / 100.0 + 0.5) - 1;
+	if (index < 0)
+		index = 0;
+	return sorted[index < count ? index : count - 1];
+}
+
+/* Statistics are an aid, so the relay goes on without them if a file
+ * cannot be written. The events file is opened before the relay serves
+ * anything; without it no events are written.
+ */
+void
+stats_open_events (const wchar_t *path)
+{
+	if ((events_fh = _wfopen(path, L"ab")) == NULL)
+		warn("Cannot open file `%ls' for writing: %s\nNo connection events will be written.", path, errno_errstr());
+}
+
+/* stats_write_event:
+ * Append the setup timeline of a connection to the events file as a
+ * line of JSON. Phases that were never reached are null.
+ */
+void
+stats_write_event (conn_stats_t *conn)
+{
+	if (events_fh == NULL || conn->event_written)
+		return;
+	conn->event_written = true;
+	fprintf(events_fh, "{\"event\":\"setup\",\"session\":%" PRIu32 ",\"target\":\"%s\"", conn->id, conn->target);
+	for (int c = PHASE_CONNECT_START; c < PHASE_COUNT; c++) {
+		if (conn->phase_time[c] != 0)
+			fprintf(events_fh, ",\"%s_us\":%" PRId64, phase_names[c], conn->phase_time[c] - conn->phase_time[PHASE_ACCEPT]);
+		else
+			fprintf(events_fh, ",\"%s_us\":null", phase_names[c]);
+	}
+	if (conn->failure != NULL)
+		fprintf(events_fh, ",\"failure\":\"%s\",\"error\":%d", conn->failure, conn->error);
+	fprintf(events_fh, "}\n");
+	fflush(events_fh);
+}
+
+/* Append the outcome of a direct connect probe to the events file. */
+void
+stats_write_path_event (const char *target)
+{
+	if (events_fh == NULL)
+		return;
+	fprintf(events_fh, "{\"event\":\"path\",\"target\":\"%s\",\"decision\":\"%s\",\"direct_rtt_us\":%" PRId64 ",\"proxy_rtt_us\":%" PRId64 "}\n",
+		target, path_names[relay_stats.path], relay_stats.direct_rtt, relay_stats.proxy_rtt);
+	fflush(events_fh);
+}
+
+void
+stats_close_events (void)
+{
+	if (events_fh != NULL)
+		fclose(events_fh);
+	events_fh = NULL;
+}
+
+static void
+format_flow_json (strbuf_t *buf, const flow_stats_t *flow)
+{
+	strbuf_printf(buf, "{\"bytes\":%" PRIu64 ",\"chunks\":%" PRIu64 ",\"recv_calls\":%" PRIu64
+		",\"send_calls\":%" PRIu64 ",\"avg_chunk\":%" PRIu64 ",\"queue_max\":%" PRIu32,
+		flow->bytes, flow->chunks, flow->recv_calls, flow->send_calls,
+		flow->chunks > 0 ? flow->bytes / flow->chunks : 0, flow->queue_max);
+}
+
+static void
+format_histogram_json (strbuf_t *buf, const histogram_t *hist)
+{
+	strbuf_printf(buf, "{\"count\":%" PRIu64 ",\"mean\":%" PRIu64 ",\"p50\":%" PRIu64
+		",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+		hist->count, hist->count > 0 ? hist->sum / hist->count : 0,
+		histogram_percentile(hist, 50), histogram_percentile(hist, 90),
+		histogram_percentile(hist, 99), histogram_percentile(hist, 99.9), hist->max);
+}
+
+/* stats_format_json:
+ * Return relay-wide and per-connection statistics as a JSON object.
+ */
+char *
+stats_format_json (conn_stats_t **conns, int count, int64_t now)
+{
+	strbuf_t buf = { NULL, 0, 0 };
+
+	strbuf_printf(&buf, "{\"uptime_us\":%" PRId64 ",\"connections\":%" PRIu64 ",\"active\":%" PRIu32 ",\"failed\":%" PRIu64 ",\"accept_failed\":%" PRIu64 ",\"stats_failed\":%" PRIu64 ",\"handoffs_failed\":%" PRIu64
+		",\"tunnels\":%" PRIu64 ",\"tunnels_failed\":%" PRIu64,
+		now - relay_stats.start, relay_stats.connections, relay_stats.active, relay_stats.failed, relay_stats.accept_failed,
+		relay_stats.stats_failed, relay_stats.handoffs_failed, relay_stats.tunnels, relay_stats.tunnels_failed);
+	for (int d = 0; d < 2; d++) {
+		strbuf_printf(&buf, ",\"%s\":", direction_names[d]);
+		format_flow_json(&buf, &relay_stats.flow[d]);
+		strbuf_printf(&buf, ",\"latency_us\":");
+		format_histogram_json(&buf, &relay_stats.latency[d]);
+		strbuf_printf(&buf, ",\"chunk_size\":");
+		format_histogram_json(&buf, &relay_stats.chunk_size[d]);
+		strbuf_printf(&buf, "}");
+	}
+	strbuf_printf(&buf, ",\"config\":{\"reloads\":%" PRIu64 ",\"reload_us\":%" PRId64 ",\"pinned\":%" PRIu32 "}",
+		relay_stats.reloads, relay_stats.reload_time, relay_stats.configs_pinned);
+	strbuf_printf(&buf, ",\"admission\":{\"queued\":%" PRIu32 ",\"rejected\":%" PRIu64 ",\"wait_us\":",
+		relay_stats.queued, relay_stats.rejected);
+	format_histogram_json(&buf, &relay_stats.queue_wait);
+	strbuf_printf(&buf, "}");
+	strbuf_printf(&buf, ",\"path\":{\"decision\":\"%s\",\"cached\":%s,\"direct_rtt_us\":%" PRId64 ",\"proxy_rtt_us\":%" PRId64 "}",
+		path_names[relay_stats.path], relay_stats.path_cached ? "true" : "false", relay_stats.direct_rtt, relay_stats.proxy_rtt);
+	strbuf_printf(&buf, ",\"lag_us\":");
+	format_histogram_json(&buf, &relay_stats.lag);
+	strbuf_printf(&buf, ",\"lag_warnings\":%" PRIu64, relay_stats.lag_warnings);
+	strbuf_printf(&buf, ",\"setup_us\":{");
+	for (int c = PHASE_CONNECT_START; c < PHASE_COUNT; c++) {
+		strbuf_printf(&buf, "%s\"%s\":", c > PHASE_CONNECT_START ? "," : "", phase_names[c]);
+		format_histogram_json(&buf, &relay_stats.phase[c]);
+	}
+	strbuf_printf(&buf, "}");
+	strbuf_printf(&buf, ",\"sessions\":[");
+	for (int c = 0; c < count; c++) {
+		const conn_stats_t *conn = conns[c];
+
+		strbuf_printf(&buf, "%s{\"id\":%" PRIu32, c > 0 ? "," : "", conn->id);
+		for (int d = 0; d < 2; d++) {
+			strbuf_printf(&buf, ",\"%s\":", direction_names[d]);
+			format_flow_json(&buf, &conn->flow[d]);
+			strbuf_printf(&buf, "}");
+		}
+		if (conn->tcp.valid) {
+			strbuf_printf(&buf, ",\"tcp\":{\"rtt_us\":%" PRIu32 ",\"min_rtt_us\":%" PRIu32 ",\"cwnd\":%" PRIu32
+				",\"bytes_in_flight\":%" PRIu32 ",\"bytes_retrans\":%" PRIu32 ",\"timeouts\":%" PRIu32 "}",
+				conn->tcp.rtt_us, conn->tcp.min_rtt_us, conn->tcp.cwnd,
+				conn->tcp.bytes_in_flight, conn->tcp.bytes_retrans, conn->tcp.timeouts);
+		}
+		if (conn->lag_count > 0) {
+			strbuf_printf(&buf, ",\"lag_us\":{\"samples\":%" PRIu32 ",\"p50\":%" PRIu32 ",\"p90\":%" PRIu32 ",\"p99\":%" PRIu32 ",\"warning\":%s}",
+				conn->lag_count, stats_lag_percentile(conn, 50), stats_lag_percentile(conn, 90),
+				stats_lag_percentile(conn, 99), conn->lag_warned ? "true" : "false");
+		}
+		strbuf_printf(&buf, "}");
+	}
+	strbuf_printf(&buf, "]}\n");
+	return buf.data;
+}
+
+static void
+format_histogram_prometheus (strbuf_t *buf, const char *name, const char *label, const char *value, const histogram_t *hist)
+{
+	static const double quantiles[] = { 50, 90, 99, 99.9 };
+
+	char labels[64] = "";
+
+	/* The histogram is labelled if label is not NULL. */
+	if (label != NULL)
+		snprintf(labels, sizeof(labels), "%s=\"%s\",", label, value);
+	for (int c = 0; c < sizeof(quantiles)/sizeof(*quantiles); c++) {
+		strbuf_printf(buf, "%s{%squantile=\"%g\"} %" PRIu64 "\n",
+			name, labels, quantiles[c] / 100, histogram_percentile(hist, quantiles[c]));
+	}
+	labels[strlen(labels) - (label != NULL)] = '\0';
+	strbuf_printf(buf, "%s_sum{%s} %" PRIu64 "\n", name, labels, hist->sum);
+	strbuf_printf(buf, "%s_count{%s} %" PRIu64 "\n", name, labels, hist->count);
+}
+
+/* stats_format_prometheus:
+ * Return statistics in the Prometheus text exposition format.
+ */
+char *
+stats_format_prometheus (conn_stats_t **conns, int count)
+{
+	strbuf_t buf = { NULL, 0, 0 };
+
+	strbuf_printf(&buf, "# TYPE relay_connections_total counter\nrelay_connections_total %" PRIu64 "\n", relay_stats.connections);
+	strbuf_printf(&buf, "# TYPE relay_connections_active gauge\nrelay_connections_active %" PRIu32 "\n", relay_stats.active);
+	strbuf_printf(&buf, "# TYPE relay_connections_failed_total counter\nrelay_connections_failed_total %" PRIu64 "\n", relay_stats.failed);
+	strbuf_printf(&buf, "# TYPE relay_accept_failed_total counter\nrelay_accept_failed_total %" PRIu64 "\n", relay_stats.accept_failed);
+	strbuf_printf(&buf, "# TYPE relay_stats_write_failed_total counter\nrelay_stats_write_failed_total %" PRIu64 "\n", relay_stats.stats_failed);
+	strbuf_printf(&buf, "# TYPE relay_handoffs_failed_total counter\nrelay_handoffs_failed_total %" PRIu64 "\n", relay_stats.handoffs_failed);
+	strbuf_printf(&buf, "# TYPE relay_tunnels_total counter\nrelay_tunnels_total %" PRIu64 "\n", relay_stats.tunnels);
+	strbuf_printf(&buf, "# TYPE relay_tunnels_failed_total counter\nrelay_tunnels_failed_total %" PRIu64 "\n", relay_stats.tunnels_failed);
+	strbuf_printf(&buf, "# TYPE relay_config_reloads_total counter\nrelay_config_reloads_total %" PRIu64 "\n", relay_stats.reloads);
+	strbuf_printf(&buf, "# TYPE relay_config_reload_us gauge\nrelay_config_reload_us %" PRId64 "\n", relay_stats.reload_time);
+	strbuf_printf(&buf, "# TYPE relay_config_pinned gauge\nrelay_config_pinned %" PRIu32 "\n", relay_stats.configs_pinned);
+	strbuf_printf(&buf, "# TYPE relay_bytes_total counter\n");
+	for (int d = 0; d < 2; d++)
+		strbuf_printf(&buf, "relay_bytes_total{direction=\"%s\"} %" PRIu64 "\n", direction_names[d], relay_stats.flow[d].bytes);
+	strbuf_printf(&buf, "# TYPE relay_recv_calls_total counter\n");
+	for (int d = 0; d < 2; d++)
+		strbuf_printf(&buf, "relay_recv_calls_total{direction=\"%s\"} %" PRIu64 "\n", direction_names[d], relay_stats.flow[d].recv_calls);
+	strbuf_printf(&buf, "# TYPE relay_send_calls_total counter\n");
+	for (int d = 0; d < 2; d++)
+		strbuf_printf(&buf, "relay_send_calls_total{direction=\"%s\"} %" PRIu64 "\n", direction_names[d], relay_stats.flow[d].send_calls);
+	strbuf_printf(&buf, "# TYPE relay_queue_max_bytes gauge\n");
+	for (int d = 0; d < 2; d++)
+		strbuf_printf(&buf, "relay_queue_max_bytes{direction=\"%s\"} %" PRIu32 "\n", direction_names[d], relay_stats.flow[d].queue_max);
+	strbuf_printf(&buf, "# TYPE relay_latency_us summary\n");
+	for (int d = 0; d < 2; d++)
+		format_histogram_prometheus(&buf, "relay_latency_us", "direction", direction_names[d], &relay_stats.latency[d]);
+	strbuf_printf(&buf, "# TYPE relay_chunk_bytes summary\n");
+	for (int d = 0; d < 2; d++)
+		format_histogram_prometheus(&buf, "relay_chunk_bytes", "direction", direction_names[d], &relay_stats.chunk_size[d]);
+	strbuf_printf(&buf, "# TYPE relay_setup_us summary\n");
+	for (int c = PHASE_CONNECT_START; c < PHASE_COUNT; c++)
+		format_histogram_prometheus(&buf, "relay_setup_us", "phase", phase_names[c], &relay_stats.phase[c]);
+	strbuf_printf(&buf, "# TYPE relay_admission_queued gauge\nrelay_admission_queued %" PRIu32 "\n", relay_stats.queued);
+	strbuf_printf(&buf, "# TYPE relay_admission_rejected_total counter\nrelay_admission_rejected_total %" PRIu64 "\n", relay_stats.rejected);
+	strbuf_printf(&buf, "# TYPE relay_admission_wait_us summary\n");
+	format_histogram_prometheus(&buf, "relay_admission_wait_us", NULL, NULL, &relay_stats.queue_wait);
+	if (relay_stats.path != PATH_UNKNOWN)
+		strbuf_printf(&buf, "# TYPE relay_path_direct gauge\nrelay_path_direct %d\n", relay_stats.path == PATH_DIRECT);
+	strbuf_printf(&buf, "# TYPE relay_path_rtt_us gauge\n");
+	if (relay_stats.direct_rtt > 0)
+		strbuf_printf(&buf, "relay_path_rtt_us{path=\"direct\"} %" PRId64 "\n", relay_stats.direct_rtt);
+	if (relay_stats.proxy_rtt > 0)
+		strbuf_printf(&buf, "relay_path_rtt_us{path=\"proxy\"} %" PRId64 "\n", relay_stats.proxy_rtt);
+	strbuf_printf(&buf, "# TYPE relay_lag_us summary\n");
+	format_histogram_prometheus(&buf, "relay_lag_us", NULL, NULL, &relay_stats.lag);
+	strbuf_printf(&buf, "# TYPE relay_lag_warnings_total counter\nrelay_lag_warnings_total %" PRIu64 "\n", relay_stats.lag_warnings);
+
+	strbuf_printf(&buf, "# TYPE relay_session_bytes_total counter\n");
+	for (int c = 0; c < count; c++) {
+		for (int d = 0; d < 2; d++)
+			strbuf_printf(&buf, "relay_session_bytes_total{session=\"%" PRIu32 "\",direction=\"%s\"} %" PRIu64 "\n", conns[c]->id, direction_names[d], conns[c]->flow[d].bytes);
+	}
+	strbuf_printf(&buf, "# TYPE relay_session_lag_us gauge\n");
+	for (int c = 0; c < count; c++) {
+		if (conns[c]->lag_count > 0) {
+			strbuf_printf(&buf, "relay_session_lag_us{session=\"%" PRIu32 "\",quantile=\"0.5\"} %" PRIu32 "\n", conns[c]->id, stats_lag_percentile(conns[c], 50));
+			strbuf_printf(&buf, "relay_session_lag_us{session=\"%" PRIu32 "\",quantile=\"0.9\"} %" PRIu32 "\n", conns[c]->id, stats_lag_percentile(conns[c], 90));
+		}
+	}
+	strbuf_printf(&buf, "# TYPE relay_session_rtt_us gauge\n");
+	for (int c = 0; c < count; c++) {
+		if (conns[c]->tcp.valid)
+			strbuf_printf(&buf, "relay_session_rtt_us{session=\"%" PRIu32 "\"} %" PRIu32 "\n", conns[c]->id, conns[c]->tcp.rtt_us);
+	}
+	strbuf_printf(&buf, "# TYPE relay_session_cwnd_bytes gauge\n");
+	for (int c = 0; c < count; c++) {
+		if (conns[c]->tcp.valid)
+			strbuf_printf(&buf, "relay_session_cwnd_bytes{session=\"%" PRIu32 "\"} %" PRIu32 "\n", conns[c]->id, conns[c]->tcp.cwnd);
+	}
+	strbuf_printf(&buf, "# TYPE relay_session_retrans_bytes_total counter\n");
+	for (int c = 0; c < count; c++) {
+		if (conns[c]->tcp.valid)
+			strbuf_printf(&buf, "relay_session_retrans_bytes_total{session=\"%" PRIu32 "\"} %" PRIu32 "\n", conns[c]->id, conns[c]->tcp.bytes_retrans);
+	}
+	return buf.data;
+}
+
+static DWORD WINAPI
+warning_thread (LPVOID param)
+{
+	char *msg = param;
+
+	warn("%s", msg);
+	free(msg);
+	return 0;
+}
+
+/* warn_in_background:
+ * Show a warning without holding up the relay loop, since warn() may
+ * wait for the user to close a message box.
+ */
+void
+warn_in_background (char *fmt, ...)
+{
+	va_list argv;
+	HANDLE thread;
+	char *msg;
+
+	va_start(argv, fmt);
+	msg = xvasprintf(fmt, argv);
+	va_end(argv);
+	thread = CreateThread(NULL, 0, warning_thread, msg, 0, NULL);
+	if (thread == NULL)
+		free(msg);
+	else
+		CloseHandle(thread);
+}
+
+/* stats_write_file:
+ * Replace the statistics file with current statistics in JSON.
+ * The file is written under a temporary name and then renamed, so
+ * readers never see a partially written file. If that fails (the disk
+ * is full or a reader holds the file locked) the temporary file is
+ * removed and the failure counted; the user is warned the first time.
+ */
+void
+stats_write_file (const wchar_t *path, conn_stats_t **conns, int count, int64_t now)
+{
+	static bool warned;
+
+	wchar_t *tmp_path;
+	char *json;
+	char *error = NULL;
+	FILE *fh;
+
+	json = stats_format_json(conns, count, now);
+	tmp_path = xaswprintf(L"%ls.tmp", path);
+	if ((fh = _wfopen(tmp_path, L"wb")) == NULL) {
+		error = xasprintf("Cannot open file `%ls' for writing: %s", tmp_path, errno_errstr());
+	} else {
+		if (fwrite(json, strlen(json), 1, fh) != 1)
+			error = xasprintf("Cannot write to file `%ls': %s", tmp_path, errno_errstr());
+		if (fclose(fh) != 0 && error == NULL)
+			error = xasprintf("Cannot close file `%ls': %s", tmp_path, errno_errstr());
+		if (error == NULL && !MoveFileExW(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+			error = xasprintf("Cannot rename `%ls' to `%ls': %s", tmp_path, path, system_errstr());
+		if (error != NULL)
+			DeleteFileW(tmp_path); /* Ignore errors */
+	}
+	if (error != NULL) {
+		relay_stats.stats_failed++;
+		if (!warned) {
+			warned = true;
+			warn_in_background("%s\nStatistics will not be updated until this is resolved.", error);
+		}
+		free(error);
+	}
+	free(tmp_path);
+	free(json);
+}
@@ -0,0 +1,153 @@
+/* stats.h - Relay statistics
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+/* Histograms are log-linear: values below HISTOGRAM_SUB_BUCKETS have a
+ * bucket each, larger values are split into HISTOGRAM_SUB_BUCKETS/2
+ * buckets per power of two, giving a relative error below 1/8.
+ */
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + 60 * HISTOGRAM_SUB_BUCKETS / 2)
+
+#define LAG_WINDOW 64			/* Input-to-update samples kept per connection */
+#define LAG_INPUT_SIZE 256		/* Largest read from the viewer taken as input */
+#define LAG_MIN_SAMPLES 8		/* Samples needed before warning about lag */
+
+#define STATS_UP 0				/* Viewer to server */
+#define STATS_DOWN 1			/* Server to viewer */
+
+/* Points in the setup of a proxied connection, in the order they
+ * normally occur. Times are recorded relative to PHASE_ACCEPT.
+ */
+typedef enum {
+	PHASE_ACCEPT,
+	PHASE_CONNECT_START,		/* Upstream TCP connect started */
+	PHASE_CONNECT_DONE,			/* Upstream TCP connect finished */
+	PHASE_REQUEST_SENT,			/* SOCKS request sent */
+	PHASE_REPLY_RECEIVED,		/* SOCKS reply received */
+	PHASE_FIRST_CLIENT_BYTE,
+	PHASE_FIRST_SERVER_BYTE,
+	PHASE_COUNT
+} phase_t;
+
+/* How viewers reach the target, decided by probing a direct connect. */
+typedef enum {
+	PATH_UNKNOWN,
+	PATH_PROXY,
+	PATH_DIRECT,
+} path_t;
+
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+} histogram_t;
+
+/* Counters for one direction of a connection, or of the whole relay. */
+typedef struct {
+	uint64_t bytes;
+	uint64_t chunks;
+	uint64_t recv_calls;
+	uint64_t send_calls;
+	uint32_t queue_max;			/* High-water mark of buffered bytes */
+} flow_stats_t;
+
+typedef struct {
+	bool valid;
+	uint32_t rtt_us;
+	uint32_t min_rtt_us;
+	uint32_t cwnd;
+	uint32_t bytes_in_flight;
+	uint32_t bytes_retrans;
+	uint32_t timeouts;
+} tcp_sample_t;
+
+typedef struct {
+	uint32_t id;
+	flow_stats_t flow[2];
+	tcp_sample_t tcp;			/* Last sample of the upstream socket */
+	const char *target;			/* Address and port relayed to */
+	int64_t phase_time[PHASE_COUNT];	/* 0 if not reached */
+	bool event_written;
+	int64_t input_time;			/* Arrival of unanswered input, 0 if none */
+	uint32_t lag[LAG_WINDOW];	/* Recent input-to-update times in microseconds */
+	uint32_t lag_count;			/* Samples taken; the last LAG_WINDOW are kept */
+	bool lag_warned;			/* Lag is above stats_lag_warn */
+	const char *failure;		/* Why setup failed, NULL if it did not */
+	int error;					/* Winsock error behind failure, 0 if none */
+} conn_stats_t;
+
+typedef struct {
+	int64_t start;
+	uint64_t connections;		/* Connections accepted */
+	uint32_t active;			/* Connections open */
+	flow_stats_t flow[2];
+	histogram_t latency[2];		/* Microseconds spent in the relay per chunk */
+	histogram_t chunk_size[2];	/* Bytes per chunk */
+	histogram_t phase[PHASE_COUNT];	/* Microseconds from accept */
+	uint64_t reloads;			/* Configuration reloads */
+	int64_t reload_time;		/* Microseconds spent in the last reload */
+	uint32_t configs_pinned;	/* Replaced configurations still in use */
+	histogram_t lag;			/* Microseconds from input to server response */
+	uint64_t lag_warnings;
+	uint32_t queued;			/* Connections waiting for admission */
+	uint64_t rejected;			/* Connections refused at the limits */
+	uint64_t failed;			/* Connections that could not reach the target */
+	uint64_t accept_failed;		/* Connections that could not be accepted */
+	uint64_t stats_failed;		/* Statistics file updates that failed */
+	uint64_t handoffs_failed;	/* Takeovers by another process that failed */
+	uint64_t tunnels;			/* Tunnels opened or accepted */
+	uint64_t tunnels_failed;	/* Tunnels closed by an error */
+	histogram_t queue_wait;		/* Microseconds waited for admission */
+	path_t path;
+	bool path_cached;			/* Path was decided on an earlier launch */
+	int64_t direct_rtt;			/* Direct connect time, 0 if unknown, -1 if unreachable */
+	int64_t proxy_rtt;			/* Connect and SOCKS handshake time, 0 if unknown */
+} relay_stats_t;
+
+/* stats.c */
+extern relay_stats_t relay_stats;
+extern uint32_t stats_lag_warn;
+extern void histogram_add (histogram_t *hist, uint64_t value);
+extern uint64_t histogram_percentile (const histogram_t *hist, double percentile);
+extern void stats_recv (conn_stats_t *conn, int direction, uint32_t len, uint32_t queued);
+extern void stats_send (conn_stats_t *conn, int direction);
+extern void stats_chunk (conn_stats_t *conn, int direction, uint32_t len, int64_t delay);
+extern void stats_phase (conn_stats_t *conn, phase_t phase, int64_t now);
+extern void stats_lag (conn_stats_t *conn, int direction, uint32_t len, int64_t now);
+extern void stats_fail (conn_stats_t *conn, const char *failure, int error);
+extern void stats_accept_failed (const char *failure, int error);
+extern uint32_t stats_lag_percentile (const conn_stats_t *conn, double percentile);
+extern void stats_open_events (const wchar_t *path);
+extern void stats_write_event (conn_stats_t *conn);
+extern void stats_write_path_event (const char *target);
+extern void stats_close_events (void);
+extern char *stats_format_json (conn_stats_t **conns, int count, int64_t now);
+extern char *stats_format_prometheus (conn_stats_t **conns, int count);
+extern void stats_write_file (const wchar_t *path, conn_stats_t **conns, int count, int64_t now);
+extern void warn_in_background (char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+#endif
@@ -0,0 +1,310 @@
+/* tplbench.c - Measure template reading and writing
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* The benchmark generates a template in each input encoding and turns
+ * it into a file in each output encoding, once the way the launchers
+ * did before templates were compiled (the C runtime reading lines with
+ * ccs= conversion, expand_line on each and an fwrite through ccs=), and
+ * once with template_parse and template_write.
+ *
+ * Each vector scanner the processor supports is first checked against
+ * the scalar one on random text, then timed on the template text.
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <wchar.h>
+#include "rdpvnclaunch.h"
+
+#define DEFAULT_LINES 100000
+#define DEFAULT_ROUNDS 10
+#define CHECK_ROUNDS 100000
+#define CHECK_MAX_LEN 300
+
+const char *program_name = "tplbench";
+const wchar_t *program_name_w = L"tplbench";
+
+static const template_syntax_t syntax = { L"tmpfile template:s:", L"command line:s:", L"output encoding:s:" };
+
+static const struct {
+	const char *name;
+	const wchar_t *mode;		/* For _wfopen */
+	encoding_t encoding;
+} output_encodings[] = {
+	{ "utf16le", L"wb, ccs=UTF-16LE", ENCODING_UTF16LE },
+	{ "utf8", L"wb, ccs=UTF-8", ENCODING_UTF8 },
+};
+
+static const struct {
+	const char *name;
+	const wchar_t *mode;		/* For _wfopen */
+} input_encodings[] = {
+	{ "utf16le", L"wb, ccs=UTF-16LE" },
+	{ "utf8", L"wb, ccs=UTF-8" },
+};
+
+static int64_t clock_freq;
+
+static void
+fatal (const char *fmt, ...)
+{
+	va_list argv;
+
+	fprintf(stderr, "%s: ", program_name);
+	va_start(argv, fmt);
+	vfprintf(stderr, fmt, argv);
+	va_end(argv);
+	exit(1);
+}
+
+static int64_t
+now_us (void)
+{
+	LARGE_INTEGER count;
+
+	if (clock_freq == 0) {
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		clock_freq = freq.QuadPart;
+	}
+	QueryPerformanceCounter(&count);
+	return count.QuadPart / clock_freq * 1000000 + count.QuadPart % clock_freq * 1000000 / clock_freq;
+}
+
+/* Write a template of lines lines resembling template.rdp, with a
+ * placeholder on every other line and some text outside ASCII.
+ */
+static void
+generate_template (const wchar_t *path, const wchar_t *mode, int lines)
+{
+	FILE *fh;
+
+	if ((fh = _wfopen(path, mode)) == NULL)
+		fatal("Cannot open `%ls' for writing: %s\n", path, errno_errstr());
+	fputws(L"# Generated by tplbench\n", fh);
+	for (int c = 0; c < lines; c++) {
+		if (c % 2 == 0)
+			fwprintf(fh, L"full address %d:s:@HOSTNAME@:@PORT@\n", c);
+		else
+			fwprintf(fh, L"description %d:s:K\x00f6rning p\x00e5 skrivbord \x2013 f\x00f6nster %d\n", c, c);
+	}
+	if (ferror(fh) || fclose(fh) != 0)
+		fatal("Cannot write to `%ls': %s\n", path, errno_errstr());
+}
+
+/* Compare every scanner with the scalar one, which is last, on random
+ * text with varying length, alignment, density of `@' and limit.
+ * Other characters share the low or high byte with `@'.
+ */
+static void
+check_scanners (void)
+{
+	static const wchar_t others[] = { 'a', 0x0140, 0x4000, 0x4040 };
+	static wchar_t text[CHECK_MAX_LEN + 16];
+	static size_t expected[CHECK_MAX_LEN];
+	static size_t found[CHECK_MAX_LEN];
+	const scanner_t *scanners;
+	size_t scanner_count = get_scanners(&scanners);
+
+	srand(1);
+	for (int r = 0; r < CHECK_ROUNDS; r++) {
+		size_t len = rand() % CHECK_MAX_LEN;
+		size_t offset = rand() % 16;
+		size_t max = rand() % 2 == 0 ? CHECK_MAX_LEN : rand() % 10 + 1;
+		int density = rand() % 8 + 1;
+		size_t expected_count;
+
+		for (size_t c = 0; c < len + offset; c++)
+			text[c] = rand() % density == 0 ? '@' : others[rand() % 4];
+		expected_count = scanners[scanner_count - 1].scan(text + offset, len, '@', expected, max);
+		for (size_t c = 0; c + 1 < scanner_count; c++) {
+			size_t count = scanners[c].scan(text + offset, len, '@', found, max);
+
+			if (count != expected_count || memcmp(found, expected, count * sizeof(*found)) != 0)
+				fatal("Scanner %s differs from %s (length %u, offset %u, limit %u)\n",
+					scanners[c].name, scanners[scanner_count - 1].name, (unsigned) len, (unsigned) offset, (unsigned) max);
+		}
+	}
+}
+
+/* Return the time in microseconds to find every `@' in text. */
+static int64_t
+time_scanner (const scanner_t *scanner, const wchar_t *text, size_t len, int rounds)
+{
+	size_t at[SCAN_BATCH];
+	int64_t start = now_us();
+	size_t total = 0;
+
+	for (int r = 0; r < rounds; r++) {
+		size_t pos = 0;
+		size_t count;
+
+		do {
+			count = scanner->scan(text + pos, len - pos, '@', at, SCAN_BATCH);
+			if (count > 0)
+				pos += at[count - 1] + 1;
+			total += count;
+		} while (count == SCAN_BATCH);
+	}
+	if (total == 0)
+		fatal("No placeholders found\n");
+	return now_us() - start;
+}
+
+static void
+run_crt (const wchar_t *in_path, const wchar_t *out_path, const wchar_t *mode, vartable_t *vars)
+{
+	wcsbuf_t *inbuf = wcsbuf_new();
+	wcsbuf_t *outbuf = wcsbuf_new();
+	FILE *fh;
+
+	if ((fh = _wfopen(in_path, L"r, ccs=UNICODE")) == NULL)
+		fatal("Cannot open `%ls' for reading: %s\n", in_path, errno_errstr());
+	while ((inbuf->len = wgetline(&inbuf->data, &inbuf->size, fh)) >= 0) {
+		if (inbuf->len == 0 || inbuf->data[0] == '#')
+			continue;
+		expand_line(inbuf, vars);
+		wcsbuf_append_wcsbuf(outbuf, inbuf);
+	}
+	fclose(fh); /* Ignore errors */
+
+	if ((fh = _wfopen(out_path, mode)) == NULL)
+		fatal("Cannot open `%ls' for writing: %s\n", out_path, errno_errstr());
+	fwrite(outbuf->data, outbuf->len * sizeof(wchar_t), 1, fh);
+	if (ferror(fh) || fclose(fh) != 0)
+		fatal("Cannot write to `%ls': %s\n", out_path, errno_errstr());
+	wcsbuf_free(inbuf);
+	wcsbuf_free(outbuf);
+}
+
+static void
+run_template (const wchar_t *in_path, const wchar_t *out_path, encoding_t encoding, vartable_t *vars)
+{
+	template_t *tpl = template_parse(in_path, &syntax, vars);
+
+	template_write(tpl, vars, out_path, encoding);
+	template_free(tpl);
+}
+
+static double
+megabytes_per_s (int64_t bytes, int64_t us)
+{
+	return us > 0 ? (double) bytes / us : 0;
+}
+
+int
+main (int argc, char **argv)
+{
+	int lines = DEFAULT_LINES;
+	int rounds = DEFAULT_ROUNDS;
+	wchar_t temp_dir[MAX_PATH];
+	wchar_t *in_path;
+	wchar_t *out_path;
+	vartable_t *vars;
+	const scanner_t *scanners;
+	size_t scanner_count;
+	template_t *tpl;
+	int c;
+
+	for (c = 1; c < argc && argv[c][0] == '-'; c++) {
+		if (strcmp(argv[c], "-l") == 0 && c + 1 < argc) {
+			lines = atoi(argv[++c]);
+		} else if (strcmp(argv[c], "-n") == 0 && c + 1 < argc) {
+			rounds = atoi(argv[++c]);
+		} else {
+			break;
+		}
+	}
+	if (c != argc || lines < 1 || rounds < 1) {
+		fprintf(stderr,
+			"Usage: %s [-l LINES] [-n ROUNDS]\n"
+			"Measure reading, expanding and writing a template of LINES lines, with\n"
+			"the C runtime and with compiled templates. Results are written as JSON.\n",
+			program_name);
+		exit(1);
+	}
+
+	if (GetTempPathW(MAX_PATH, temp_dir) == 0)
+		fatal("Cannot get temporary directory: %s\n", system_errstr());
+	in_path = xaswprintf(L"%lstplbench-in.rdp", temp_dir);
+	out_path = xaswprintf(L"%lstplbench-out.rdp", temp_dir);
+
+	scanner_count = get_scanners(&scanners);
+	check_scanners();
+
+	vars = vartable_new();
+	set_replacement(vars, L"HOSTNAME", xwcsdup(L"terminal.example.com"));
+	set_replacement(vars, L"PORT", xwcsdup(L"3389"));
+
+	printf("{\"lines\":%d,\"rounds\":%d,\"scanner\":\"%s\",\"inputs\":{", lines, rounds, scanners[0].name);
+	for (int i = 0; i < sizeof(input_encodings)/sizeof(*input_encodings); i++) {
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		int64_t size;
+
+		generate_template(in_path, input_encodings[i].mode, lines);
+		if (!GetFileAttributesExW(in_path, GetFileExInfoStandard, &attr))
+			fatal("Cannot get size of `%ls': %s\n", in_path, system_errstr());
+		size = ((int64_t) attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+
+		printf("%s\"%s\":{\"bytes\":%" PRId64, i == 0 ? "" : ",", input_encodings[i].name, size);
+		for (int o = 0; o < sizeof(output_encodings)/sizeof(*output_encodings); o++) {
+			int64_t crt_us = 0;
+			int64_t template_us = 0;
+
+			/* Alternate the two so that neither gets a warmer cache. */
+			for (int r = 0; r < rounds; r++) {
+				int64_t start = now_us();
+				run_crt(in_path, out_path, output_encodings[o].mode, vars);
+				crt_us += now_us() - start;
+				start = now_us();
+				run_template(in_path, out_path, output_encodings[o].encoding, vars);
+				template_us += now_us() - start;
+			}
+			printf(",\"%s\":{\"crt_us\":%" PRId64 ",\"template_us\":%" PRId64 ",\"crt_mb_s\":%.1f,\"template_mb_s\":%.1f}",
+				output_encodings[o].name, crt_us / rounds, template_us / rounds,
+				megabytes_per_s(size * rounds, crt_us), megabytes_per_s(size * rounds, template_us));
+		}
+		printf("}");
+	}
+
+	/* The template is still in the last input encoding. */
+	tpl = template_parse(in_path, &syntax, vars);
+	printf("},\"scanners\":{");
+	for (size_t s = 0; s < scanner_count; s++) {
+		int64_t us = time_scanner(&scanners[s], tpl->pool, tpl->pool_len, rounds);
+
+		printf("%s\"%s\":{\"us\":%" PRId64 ",\"mb_s\":%.1f}", s == 0 ? "" : ",", scanners[s].name,
+			us / rounds, megabytes_per_s((int64_t) tpl->pool_len * sizeof(wchar_t) * rounds, us));
+	}
+	printf("}}\n");
+	template_free(tpl);
+
+	DeleteFileW(in_path); /* Ignore errors */
+	DeleteFileW(out_path); /* Ignore errors */
+	vartable_free(vars);
+	free(in_path);
+	free(out_path);
+	return 0;
+}
@@ -0,0 +1,201 @@
+/* tplgen.c - Compile a template into C tables for embedding
+ *
+ * Copyright (C) 2012 Oskar Liljeblad
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <wchar.h>
+#include "rdpvnclaunch.h"
+
+/* The template is compiled with template_parse, so the tables are the
+ * same as those of a template read at run time. Placeholder slots are
+ * resolved when the program starts, since -D may define more names.
+ * tplgen is linked with conerror.o, so errors from template_parse go
+ * to stderr and fail the build instead of waiting in a message box.
+ */
+
+#define GENERATED_MARK L"Generated by tplgen"
+
+const char *program_name = "tplgen";
+const wchar_t *program_name_w = L"tplgen";
+
+static void
+fatal (const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", program_name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+/* Write str as the contents of a wide string literal, starting a new
+ * line after each newline in it.
+ */
+static void
+write_literal (FILE *fh, const wchar_t *str, size_t len)
+{
+	bool hex = false;
+
+	fputs("L\"", fh);
+	for (size_t c = 0; c < len; c++) {
+		wchar_t ch = str[c];
+
+		if (ch == '\\' || ch == '"') {
+			fprintf(fh, "\\%c", (char) ch);
+		} else if (ch == '\n') {
+			fputs("\\n", fh);
+			if (c + 1 < len)
+				fputs("\"\n\tL\"", fh);
+		} else if (ch == '\r') {
+			fputs("\\r", fh);
+		} else if (ch == '\t') {
+			fputs("\\t", fh);
+		} else if (ch >= 0x20 && ch < 0x7F) {
+			/* A hex escape would take a following hex digit as its own. */
+			if (hex && isxdigit(ch))
+				fputs("\" L\"", fh);
+			fputc(ch, fh);
+			hex = false;
+			continue;
+		} else {
+			fprintf(fh, "\\x%04x", (unsigned) (uint16_t) ch);
+			hex = true;
+			continue;
+		}
+		hex = false;
+	}
+	fputc('"', fh);
+}
+
+/* Return true if str occurs in the len characters of text, which need
+ * not be null-terminated.
+ */
+static bool
+contains (const wchar_t *text, size_t len, const wchar_t *str)
+{
+	size_t str_len = wcslen(str);
+
+	for (size_t c = 0; c + str_len <= len; c++) {
+		if (wmemcmp(text + c, str, str_len) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void
+write_optional_literal (FILE *fh, const wchar_t *str)
+{
+	if (str == NULL)
+		fputs("NULL", fh);
+	else
+		write_literal(fh, str, wcslen(str));
+}
+
+int
+main (int argc, char **argv)
+{
+	template_t *tpl;
+	vartable_t *vars;
+	template_syntax_t syntax;
+	wchar_t *tmpfile_prefix;
+	wchar_t *command_prefix;
+	wchar_t *encoding_prefix;
+	wchar_t *path;
+	wchar_t *pool;
+	size_t pool_len;
+	FILE *fh;
+
+	if (argc != 6) {
+		fprintf(stderr,
+			"Usage: %s TMPFILE-DIRECTIVE COMMAND-DIRECTIVE ENCODING-DIRECTIVE TEMPLATE OUTPUT\n"
+			"Compile TEMPLATE into C source defining embedded_template.\n",
+			program_name);
+		exit(1);
+	}
+	tmpfile_prefix = xaswprintf(L"%hs", argv[1]);
+	command_prefix = xaswprintf(L"%hs", argv[2]);
+	encoding_prefix = xaswprintf(L"%hs", argv[3]);
+	path = xaswprintf(L"%hs", argv[4]);
+	syntax.tmpfile = tmpfile_prefix;
+	syntax.command = command_prefix;
+	syntax.encoding = encoding_prefix;
+
+	/* No variables are defined, so every placeholder is left unresolved. */
+	vars = vartable_new();
+	if (strcmp(argv[4], argv[5]) == 0)
+		fatal("template and output are both `%s'", argv[4]);
+	tpl = template_parse(path, &syntax, vars);
+	/* Catches the arguments getting out of step with the Makefile. */
+	if (contains(tpl->pool, tpl->pool_len, GENERATED_MARK))
+		fatal("`%s' is tplgen output, not a template", argv[4]);
+	if (tpl->token_count == 0)
+		fatal("`%s' is empty", argv[4]);
+
+	/* The parsed pool is the whole template. Keep only the text covered
+	 * by tokens, leaving out comments and directives.
+	 */
+	pool_len = 0;
+	for (size_t c = 0; c < tpl->token_count; c++)
+		pool_len += tpl->tokens[c].len;
+	pool = xmalloc((pool_len + 1) * sizeof(wchar_t));
+	pool_len = 0;
+	for (size_t c = 0; c < tpl->token_count; c++) {
+		wmemcpy(pool + pool_len, tpl->pool + tpl->tokens[c].offset, tpl->tokens[c].len);
+		tpl->tokens[c].offset = pool_len;
+		pool_len += tpl->tokens[c].len;
+	}
+	pool[pool_len] = '\0';
+
+	fh = fopen(argv[5], "w");
+	if (fh == NULL)
+		fatal("cannot open `%s' for writing: %s", argv[5], errno_errstr());
+	fprintf(fh, "/* %s - %ls from %s. Do not edit. */\n\n", argv[5], GENERATED_MARK, argv[4]);
+	fprintf(fh, "#include \"rdpvnclaunch.h\"\n\n");
+	fprintf(fh, "static const wchar_t pool[] =\n\t");
+	write_literal(fh, pool, pool_len);
+	fprintf(fh, ";\n\nstatic const embedded_token_t tokens[] = {\n");
+	for (size_t c = 0; c < tpl->token_count; c++)
+		fprintf(fh, "\t{ %u, %u, %s },\n", (unsigned) tpl->tokens[c].offset, (unsigned) tpl->tokens[c].len, tpl->tokens[c].placeholder ? "true" : "false");
+	if (tpl->token_count == 0)
+		fprintf(fh, "\t{ 0, 0, false },\n");
+	fprintf(fh, "};\n\nconst embedded_template_t embedded_template = {\n");
+	fprintf(fh, "\tpool,\n\t%u,\n\ttokens,\n\t%u,\n\t", (unsigned) pool_len, (unsigned) tpl->token_count);
+	write_optional_literal(fh, tpl->tmpfile_template);
+	fprintf(fh, ",\n\t");
+	write_optional_literal(fh, tpl->command);
+	fprintf(fh, ",\n\t%s,\n};\n", tpl->encoding == ENCODING_UTF8 ? "ENCODING_UTF8" : "ENCODING_UTF16LE");
+	if (ferror(fh) || fclose(fh) != 0)
+		fatal("cannot write to `%s': %s", argv[5], errno_errstr());
+
+	free(pool);
+	template_free(tpl);
+	vartable_free(vars);
+	free(tmpfile_prefix);
+	free(command_prefix);
+	free(encoding_prefix);
+	free(path);
+	return 0;
+}
@@ -27,6 +27,9 @@
 #include "d3des.h"
 
 #define DEFAULT_TMPFILE_TEMPLATE L"vnclaunch-XXXXXX.vnc"
+#define TMPFILE_DIRECTIVE L"tmpfile_template="
+#define COMMAND_DIRECTIVE L"command_line="
+#define ENCODING_DIRECTIVE L"output_encoding="
 #define DEFAULT_VNC_TEMPLATE_FILE  L"template.vnc"
 #define DEFAULT_PORT_STR L"5900"
 #define VNC_MAX_PASSWORD_LEN 8
@@ -36,6 +39,8 @@ const char *program_name = "vnclaunch";
 const wchar_t *program_name_w = L"vnclaunch";
 const char version_etc_copyright[] = "Copyright (C) 2012 Oskar Liljeblad";
 
+static const template_syntax_t template_syntax = { TMPFILE_DIRECTIVE, COMMAND_DIRECTIVE, ENCODING_DIRECTIVE };
+
 #define XDIGIT_LCHAR(x) ((x) <= 9 ? '0'+(x) : 'a'+(x)-10)
 
 static wchar_t *get_default_vncviewer_command(void)
@@ -94,21 +99,27 @@ static wchar_t *encrypt_password_for_vnc_connection(const wchar_t *plain_passwd)
 	return hash;
 }
 
+/* Only run if the template or command line uses @PASSWORD@. */
+static wchar_t *provide_password(vartable_t *vars, void *password)
+{
+	return encrypt_password_for_vnc_connection(password);
+}
+
 int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int cmdShow)
 {
     	wchar_t *proxy_host = NULL;
         wchar_t *proxy_port;
-        wchar_t *template_file;
-	wchar_t *search_replace[] = {
-		L"PASSWORD", NULL,
-		L"HOSTNAME", NULL,
-		L"PORT", NULL,
-		L"TMPFILE", NULL,
-		NULL
-	};
+        wchar_t *template_file = NULL;
+	vartable_t *vars = vartable_new();
+	bool import_env = false;
+
+	/* Variables set by the program, in addition to those given with -D. */
+	define_variable(vars, L"PASSWORD");
+	define_variable(vars, L"HOSTNAME");
+	define_variable(vars, L"PORT");
+	define_variable(vars, L"TMPFILE");
 
 	srand(time(NULL));
-	template_file = xwcsdup(DEFAULT_VNC_TEMPLATE_FILE);
 	proxy_port = xwcsdup(DEFAULT_PROXY_PORT);
 
 	int argc;
@@ -122,17 +133,26 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
 				case 'h':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"HOSTNAME", xwcsdup(argv[++c]));
+					set_replacement(vars, L"HOSTNAME", xwcsdup(argv[++c]));
 					break;
 				case 'p':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"PASSWORD", xwcsdup(argv[++c]));
+					set_replacement(vars, L"PASSWORD", xwcsdup(argv[++c]));
 					break;
 				case 'P':
 					if (c+1 >= argc)
 						die("Missing required parameter for option -%c.", argv[c][1]);
-					set_replacement(search_replace, L"PORT", xwcsdup(argv[++c]));
+					set_replacement(vars, L"PORT", xwcsdup(argv[++c]));
+					break;
+				case 'D':
+					if (c+1 >= argc)
+						die("Missing required parameter for option -%c.", argv[c][1]);
+					if (!set_variable_assignment(vars, argv[++c]))
+						die("Invalid variable assignment `%ls', expected KEY=VALUE.", argv[c]);
+					break;
+				case 'E':
+					import_env = true;
 					break;
 				case 'T':
 					if (c+1 >= argc)
@@ -152,6 +172,11 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
                     free(proxy_port);
                     proxy_port = xwcsdup(argv[++c]);
                     break;
+				case 'O':
+					if (c+1 >= argc)
+						die("Missing required parameter for option -%c.", argv[c][1]);
+					set_proxy_option(argv[++c]);
+					break;
                 case 'H':
                     inform(
                             "Usage: %s [OPTION]...\n"
@@ -165,11 +190,18 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
                             "  -P PORT\n"
                             "    Port number to connect to. Default is %ls.\n"
                             "  -T FILE\n"
-                            "    Path of an alternate template file. Default is %ls.\n"
+                            "    Path of an alternate template file. Default is the built-in\n"
+                            "    template, compiled from %ls.\n"
+                            "  -D KEY=VALUE\n"
+                            "    Set a template variable, used as @KEY@ in the template.\n"
+                            "  -E\n"
+                            "    Make environment variables available as template variables.\n"
                             "  -s HOST\n"
                             "    Name or address of a SOCKS4 proxy to connect through.\n"
                             "  -S PORT\n"
                             "    Port number of SOCKS4 proxy. Default is %ls.\n"
+                            "  -O NAME=VALUE\n"
+                            "    Set a relay option. See README for available options.\n"
                             "  -H\n"
                             "    Display this help and exit.\n"
                             "  -V\n"
@@ -196,72 +228,61 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
 	}
 	LocalFree(argv);
 
-	wchar_t *hostname = get_replacement(search_replace, L"HOSTNAME");
+	wchar_t *hostname = get_replacement(vars, L"HOSTNAME");
 	if (hostname == NULL)
 		die("Missing hostname.");
-	wchar_t *port = get_replacement(search_replace, L"PORT");
+	wchar_t *port = get_replacement(vars, L"PORT");
 	if (port == NULL)
-		port = set_replacement(search_replace, L"PORT", xwcsdup(DEFAULT_PORT_STR));
+		port = set_replacement(vars, L"PORT", xwcsdup(DEFAULT_PORT_STR));
 
-	wchar_t *password = get_replacement(search_replace, L"PASSWORD");
-	if (password == NULL)
+	if (get_replacement(vars, L"PASSWORD") == NULL)
 		die("Missing password.");
+	wchar_t *password = xwcsdup(get_replacement(vars, L"PASSWORD"));
 
-	set_replacement(search_replace, L"PASSWORD", encrypt_password_for_vnc_connection(password));
+	set_provider(vars, L"PASSWORD", provide_password, password);
 
     if (proxy_host != NULL) {
+        wchar_t *listen_host;
         int listen_port;
 
-        listen_port = prepare_proxy(proxy_host, proxy_port, hostname, get_replacement(search_replace, L"PORT"));
-        hostname = set_replacement(search_replace, L"HOSTNAME", xwcsdup(L"127.0.0.1"));
-        port = set_replacement(search_replace, L"PORT", xaswprintf(L"%d", listen_port));
+        listen_port = prepare_proxy(proxy_host, proxy_port, hostname, get_replacement(vars, L"PORT"), &listen_host);
+        hostname = set_replacement(vars, L"HOSTNAME", listen_host);
+        port = set_replacement(vars, L"PORT", xaswprintf(L"%d", listen_port));
     }
 
 	wchar_t *command = NULL;
 	wchar_t *tmpfile_template = xwcsdup(DEFAULT_TMPFILE_TEMPLATE);
 
-	FILE *in_fh;
+	if (import_env)
+		import_environment(vars);
+
 	wcsbuf_t *inbuf = wcsbuf_new();
-	wcsbuf_t *outbuf = wcsbuf_new();
-	if ((in_fh = _wfopen(template_file, L"r, ccs=UNICODE")) == NULL)
-		die("Cannot open file `%ls' for reading: %s", template_file, errno_errstr());
-	while ((inbuf->len = wgetline(&inbuf->data, &inbuf->size, in_fh)) >= 0) {
-		if (inbuf->data[0] != '#' && inbuf->data[0] != '\n' && !(inbuf->data[0] == '\r' && inbuf->data[1] == '\n')) {
-			if (wcsncmp(inbuf->data, L"tmpfile_template=", 17) == 0) {
-				chomp_string(inbuf->data + 17);
-				free(tmpfile_template);
-				tmpfile_template = xwcsdup(inbuf->data + 17);
-			} else if (wcsncmp(inbuf->data, L"command_line=", 13) == 0) {
-				chomp_string(inbuf->data+13);
-				free(command); /* command may be NULL */
-				command = xwcsdup(inbuf->data+13);
-			} else {
-				expand_line(inbuf, search_replace);
-				wcsbuf_append_wcsbuf(outbuf, inbuf);
-			}
-		}
+	template_t *template;
+	if (template_file != NULL) {
+		template = template_load(template_file, &template_syntax, vars);
+		free(template_file);
+	} else {
+		template = template_embedded(&embedded_template, vars);
+	}
+	if (template->tmpfile_template != NULL) {
+		free(tmpfile_template);
+		tmpfile_template = xwcsdup(template->tmpfile_template);
+	}
+	if (template->command != NULL) {
+		free(command); /* command may be NULL */
+		command = xwcsdup(template->command);
 	}
-	if (ferror(in_fh))
-		die("Cannot read from file `%ls': %s", template_file, errno_errstr());
-	fclose(in_fh);
-	free(template_file);
 
-	FILE *out_fh;
-	wchar_t *tmpfile = get_temp_file_expanded(tmpfile_template, search_replace);
-	set_replacement(search_replace, L"TMPFILE", tmpfile);
-	if ((out_fh = _wfopen(tmpfile, L"wT, ccs=UNICODE")) == NULL)
-		die("Cannot open file `%ls' for writing: %s", tmpfile, errno_errstr());
-	if (fwrite(outbuf->data, outbuf->len * sizeof(wchar_t), 1, out_fh) < 0)
-		die("Cannot write to file `%ls': %s", tmpfile, errno_errstr());
-	if (fclose(out_fh) < 0)
-		die("Cannot close file `%ls': %s", tmpfile, errno_errstr());
-	wcsbuf_free(outbuf);
+	wchar_t *tmpfile = get_temp_file_expanded(tmpfile_template, vars);
+	set_replacement(vars, L"TMPFILE", tmpfile);
+	template_write(template, vars, tmpfile, template->encoding);
+	template_free(template);
 
 	if (command == NULL)
 		command = get_default_vncviewer_command();
 	wcsbuf_set_wcs(inbuf, command);
 	free(command);
-	expand_line(inbuf, search_replace);
+	expand_line(inbuf, vars);
 
 	STARTUPINFOW startupinfo;
 	PROCESS_INFORMATION procinfo;
@@ -291,8 +312,8 @@ int WINAPI WinMain (HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, i
 	if (!DeleteFileW(tmpfile))
 		die("Cannot delete temporary file `%ls': %s", tmpfile, system_errstr());
 
-	for (int c = 0; search_replace[c] != NULL; c += 2)
-		free(search_replace[c+1]);
+	vartable_free(vars);
 	wcsbuf_free(inbuf);
+	free(password);
 	return 0;
 }
@@ -32,10 +32,47 @@
 #define SSIZE_MAX LONG_MAX
 #endif
 
+/* Make room for at least len+1 characters, doubling the buffer.  */
+static int
+wgetdelim_reserve (wchar_t **lineptr, size_t *n, size_t len)
+{
+  size_t needed_max =
+    SSIZE_MAX < SIZE_MAX ? (size_t) SSIZE_MAX + 1 : SIZE_MAX;
+  size_t needed = *n;
+  wchar_t *new_lineptr;
+
+  if (len + 1 <= *n)
+    return 0;
+  while (needed < len + 1 && needed < needed_max / 2)
+    needed = 2 * needed + 1;    /* Be generous. */
+  if (needed_max / sizeof(wchar_t) < needed)
+    needed = needed_max / sizeof(wchar_t);
+  if (len + 1 > needed)
+    {
+      errno = EOVERFLOW;
+      return -1;
+    }
+
+  new_lineptr = (wchar_t *) realloc (*lineptr, needed * sizeof(wchar_t));
+  if (new_lineptr == NULL)
+    return -1;
+  *lineptr = new_lineptr;
+  *n = needed;
+  return 0;
+}
+
+/* Lines are read with fgetws, which scans the stream's own buffer for
+   the newline under one stream lock per call, instead of one getwc
+   (and one lock) per character.  Each call reads directly into the
+   free end of the line buffer, so long lines spanning several calls
+   or several stream buffer fills are copied only once.  fgetws cannot
+   report NUL characters, so text after a NUL on a line is dropped,
+   up to and including the newline.
+   Other delimiters are still read a character at a time.  */
 ssize_t
 wgetdelim (wchar_t **lineptr, size_t *n, int delimiter, FILE *fp)
 {
-  ssize_t result;
+  ssize_t result = 0;
   size_t cur_len = 0;
 
   if (lineptr == NULL || n == NULL || fp == NULL)
@@ -54,46 +91,76 @@ wgetdelim (wchar_t **lineptr, size_t *n, int delimiter, FILE *fp)
       *lineptr = new_lineptr;
     }
 
-  for (;;)
+  if (delimiter == '\n')
     {
-      wint_t i;
-
-      i = getwc (fp);
-      if (i == WEOF)
+      for (;;)
         {
-          result = -1;
-          break;
-        }
+          size_t room;
+          size_t len;
 
-      /* Make enough space for len+1 (for final NUL) bytes.  */
-      if (cur_len + 1 >= *n)
-        {
-          size_t needed_max =
-            SSIZE_MAX < SIZE_MAX ? (size_t) SSIZE_MAX + 1 : SIZE_MAX;
-          size_t needed = 2 * *n + 1;   /* Be generous. */
-          wchar_t *new_lineptr;
-
-          if (needed_max < needed)
-            needed = needed_max;
-          if (cur_len + 1 >= needed)
+          /* Keep room for at least one character besides the NUL.  */
+          if (wgetdelim_reserve (lineptr, n, cur_len + 1) < 0)
+            return -1;
+          room = *n - cur_len;
+          if (room > INT_MAX)
+            room = INT_MAX;
+          /* fgetws puts its terminating NUL here only if it filled
+             the buffer.  */
+          (*lineptr)[cur_len + room - 1] = '\n';
+          if (fgetws (*lineptr + cur_len, room, fp) == NULL)
             {
-              errno = EOVERFLOW;
-              return -1;
+              result = -1;
+              break;
             }
+          len = wcslen (*lineptr + cur_len);
+          /* A short read without a newline is end of file or a NUL.
+             If the call that read the NUL filled the buffer without
+             reaching the newline, the rest of the line is still in
+             the stream and must not be taken for the next line.  */
+          if (len + 1 < room)
+            {
+              if ((*lineptr)[cur_len + room - 1] == '\0'
+                  && (*lineptr)[cur_len + room - 2] != '\n')
+                {
+                  wint_t i;
 
-          new_lineptr = (wchar_t *) realloc (*lineptr, needed * sizeof(wchar_t));
-          if (new_lineptr == NULL)
-			return -1;
-
-          *lineptr = new_lineptr;
-          *n = needed;
+                  do
+                    i = getwc (fp);
+                  while (i != WEOF && i != '\n');
+                }
+              cur_len += len;
+              break;
+            }
+          cur_len += len;
+          if (cur_len > 0 && (*lineptr)[cur_len - 1] == '\n')
+            break;
+          if (wgetdelim_reserve (lineptr, n, 2 * *n) < 0)
+            return -1;
         }
+    }
+  else
+    {
+      for (;;)
+        {
+          wint_t i;
 
-      (*lineptr)[cur_len] = i;
-      cur_len++;
+          i = getwc (fp);
+          if (i == WEOF)
+            {
+              result = -1;
+              break;
+            }
+
+          /* Make enough space for len+1 (for final NUL) characters.  */
+          if (wgetdelim_reserve (lineptr, n, cur_len + 1) < 0)
+            return -1;
 
-      if (i == delimiter)
-        break;
+          (*lineptr)[cur_len] = i;
+          cur_len++;
+
+          if (i == delimiter)
+            break;
+        }
     }
   (*lineptr)[cur_len] = '\0';
   return cur_len ? cur_len : result;